@@ -8,53 +8,51 @@
 #include <pgtable.h>
 #include <cache.h>
 #include "hmem.h"
+#include "hchain.h"
+
+#define FP_TABLE_BATCH_NUM 0x40
+#define FP_TABLE_PAGES_NUM 0x10
+// pages of a chunk spanning more than this are flushed one by one
+#define FP_TABLE_FLUSH_PAGES 0x40
+
+// entries in transit.S, each passes the chain of the stub to its body below
+uint64_t _fp_transit0();
+uint64_t _fp_transit4();
+uint64_t _fp_transit8();
+uint64_t _fp_transit12();
 
 // transit0
 typedef uint64_t (*transit0_func_t)();
 
-uint64_t __attribute__((section(".fp.transit0.text"))) __attribute__((__noinline__)) _fp_transit0()
+uint64_t __attribute__((section(".fp.transit0.text"))) __attribute__((__noinline__)) _fp_transit0_body(void *chain)
 {
-    uint64_t this_va;
-    asm volatile("adr %0, ." : "=r"(this_va));
-    uint32_t *vptr = (uint32_t *)this_va;
-    while (*--vptr != ARM64_NOP) {
-    };
-    vptr--;
-    fp_hook_chain_t *hook_chain = local_container_of((uint64_t)vptr, fp_hook_chain_t, transit);
+    fp_hook_chain_t *hook_chain = (fp_hook_chain_t *)chain;
     hook_fargs0_t fargs;
     fargs.skip_origin = 0;
     fargs.chain = hook_chain;
-    for (int32_t i = 0; i < hook_chain->chain_items_max; i++) {
-        if (hook_chain->states[i] != CHAIN_ITEM_STATE_READY) continue;
-        hook_chain0_callback func = hook_chain->befores[i];
-        if (func) func(&fargs, hook_chain->udata[i]);
-    }
+    hook_chain_enter(hook_chain);
+    fargs.inflight_idx = __inflight_idx;
+    hook_chain_stats_begin(hook_chain);
+    hook_chain_call_befores(hook_chain, hook_chain0_callback, &fargs);
+    hook_chain_stats_befores_done();
     if (!fargs.skip_origin) {
         transit0_func_t origin_func = (transit0_func_t)hook_chain->hook.origin_fp;
         fargs.ret = origin_func();
     }
-    for (int32_t i = hook_chain->chain_items_max - 1; i >= 0; i--) {
-        if (hook_chain->states[i] != CHAIN_ITEM_STATE_READY) continue;
-        hook_chain0_callback func = hook_chain->afters[i];
-        if (func) func(&fargs, hook_chain->udata[i]);
-    }
+    hook_chain_stats_origin_done();
+    hook_chain_call_afters(hook_chain, hook_chain0_callback, &fargs);
+    hook_chain_stats_end(&fargs);
+    hook_chain_exit(hook_chain);
     return fargs.ret;
 }
-extern void _fp_transit0_end();
 
 // transit4
 typedef uint64_t (*transit4_func_t)(uint64_t, uint64_t, uint64_t, uint64_t);
 
 uint64_t __attribute__((section(".fp.transit4.text"))) __attribute__((__noinline__))
-_fp_transit4(uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3)
+_fp_transit4_body(uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3, void *chain)
 {
-    uint64_t this_va;
-    asm volatile("adr %0, ." : "=r"(this_va));
-    uint32_t *vptr = (uint32_t *)this_va;
-    while (*--vptr != ARM64_NOP) {
-    };
-    vptr--;
-    fp_hook_chain_t *hook_chain = local_container_of((uint64_t)vptr, fp_hook_chain_t, transit);
+    fp_hook_chain_t *hook_chain = (fp_hook_chain_t *)chain;
     hook_fargs4_t fargs;
     fargs.skip_origin = 0;
     fargs.arg0 = arg0;
@@ -62,39 +60,31 @@ _fp_transit4(uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3)
     fargs.arg2 = arg2;
     fargs.arg3 = arg3;
     fargs.chain = hook_chain;
-    for (int32_t i = 0; i < hook_chain->chain_items_max; i++) {
-        if (hook_chain->states[i] != CHAIN_ITEM_STATE_READY) continue;
-        hook_chain4_callback func = hook_chain->befores[i];
-        if (func) func(&fargs, hook_chain->udata[i]);
-    }
+    hook_chain_enter(hook_chain);
+    fargs.inflight_idx = __inflight_idx;
+    hook_chain_stats_begin(hook_chain);
+    hook_chain_call_befores(hook_chain, hook_chain4_callback, &fargs);
+    hook_chain_stats_befores_done();
     if (!fargs.skip_origin) {
         transit4_func_t origin_func = (transit4_func_t)hook_chain->hook.origin_fp;
         fargs.ret = origin_func(fargs.arg0, fargs.arg1, fargs.arg2, fargs.arg3);
     }
-    for (int32_t i = hook_chain->chain_items_max - 1; i >= 0; i--) {
-        if (hook_chain->states[i] != CHAIN_ITEM_STATE_READY) continue;
-        hook_chain4_callback func = hook_chain->afters[i];
-        if (func) func(&fargs, hook_chain->udata[i]);
-    }
+    hook_chain_stats_origin_done();
+    hook_chain_call_afters(hook_chain, hook_chain4_callback, &fargs);
+    hook_chain_stats_end(&fargs);
+    hook_chain_exit(hook_chain);
     return fargs.ret;
 }
 
-extern void _fp_transit4_end();
 
 // transit8:
 typedef uint64_t (*transit8_func_t)(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t);
 
 uint64_t __attribute__((section(".fp.transit8.text"))) __attribute__((__noinline__))
-_fp_transit8(uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5, uint64_t arg6,
-             uint64_t arg7)
+_fp_transit8_body(uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5,
+                  uint64_t arg6, uint64_t arg7, void *chain)
 {
-    uint64_t this_va;
-    asm volatile("adr %0, ." : "=r"(this_va));
-    uint32_t *vptr = (uint32_t *)this_va;
-    while (*--vptr != ARM64_NOP) {
-    };
-    vptr--;
-    fp_hook_chain_t *hook_chain = local_container_of((uint64_t)vptr, fp_hook_chain_t, transit);
+    fp_hook_chain_t *hook_chain = (fp_hook_chain_t *)chain;
     hook_fargs8_t fargs;
     fargs.skip_origin = 0;
     fargs.arg0 = arg0;
@@ -106,41 +96,34 @@ _fp_transit8(uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_
     fargs.arg6 = arg6;
     fargs.arg7 = arg7;
     fargs.chain = hook_chain;
-    for (int32_t i = 0; i < hook_chain->chain_items_max; i++) {
-        if (hook_chain->states[i] != CHAIN_ITEM_STATE_READY) continue;
-        hook_chain8_callback func = hook_chain->befores[i];
-        if (func) func(&fargs, hook_chain->udata[i]);
-    }
+    hook_chain_enter(hook_chain);
+    fargs.inflight_idx = __inflight_idx;
+    hook_chain_stats_begin(hook_chain);
+    hook_chain_call_befores(hook_chain, hook_chain8_callback, &fargs);
+    hook_chain_stats_befores_done();
     if (!fargs.skip_origin) {
         transit8_func_t origin_func = (transit8_func_t)hook_chain->hook.origin_fp;
         fargs.ret =
             origin_func(fargs.arg0, fargs.arg1, fargs.arg2, fargs.arg3, fargs.arg4, fargs.arg5, fargs.arg6, fargs.arg7);
     }
-    for (int32_t i = hook_chain->chain_items_max - 1; i >= 0; i--) {
-        if (hook_chain->states[i] != CHAIN_ITEM_STATE_READY) continue;
-        hook_chain8_callback func = hook_chain->afters[i];
-        if (func) func(&fargs, hook_chain->udata[i]);
-    }
+    hook_chain_stats_origin_done();
+    hook_chain_call_afters(hook_chain, hook_chain8_callback, &fargs);
+    hook_chain_stats_end(&fargs);
+    hook_chain_exit(hook_chain);
     return fargs.ret;
 }
 
-extern void _fp_transit8_end();
 
 // transit12:
 typedef uint64_t (*transit12_func_t)(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t,
                                      uint64_t, uint64_t, uint64_t, uint64_t);
 
 uint64_t __attribute__((section(".fp.transit12.text"))) __attribute__((__noinline__))
-_fp_transit12(uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5, uint64_t arg6,
-              uint64_t arg7, uint64_t arg8, uint64_t arg9, uint64_t arg10, uint64_t arg11)
+_fp_transit12_body(uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5,
+                   uint64_t arg6, uint64_t arg7, uint64_t arg8, uint64_t arg9, uint64_t arg10, uint64_t arg11,
+                   void *chain)
 {
-    uint64_t this_va;
-    asm volatile("adr %0, ." : "=r"(this_va));
-    uint32_t *vptr = (uint32_t *)this_va;
-    while (*--vptr != ARM64_NOP) {
-    };
-    vptr--;
-    fp_hook_chain_t *hook_chain = local_container_of((uint64_t)vptr, fp_hook_chain_t, transit);
+    fp_hook_chain_t *hook_chain = (fp_hook_chain_t *)chain;
     hook_fargs12_t fargs;
     fargs.skip_origin = 0;
     fargs.arg0 = arg0;
@@ -156,68 +139,44 @@ _fp_transit12(uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64
     fargs.arg10 = arg10;
     fargs.arg11 = arg11;
     fargs.chain = hook_chain;
-    for (int32_t i = 0; i < hook_chain->chain_items_max; i++) {
-        if (hook_chain->states[i] != CHAIN_ITEM_STATE_READY) continue;
-        hook_chain12_callback func = hook_chain->befores[i];
-        if (func) func(&fargs, hook_chain->udata[i]);
-    }
+    hook_chain_enter(hook_chain);
+    fargs.inflight_idx = __inflight_idx;
+    hook_chain_stats_begin(hook_chain);
+    hook_chain_call_befores(hook_chain, hook_chain12_callback, &fargs);
+    hook_chain_stats_befores_done();
     if (!fargs.skip_origin) {
         transit12_func_t origin_func = (transit12_func_t)hook_chain->hook.origin_fp;
         fargs.ret = origin_func(fargs.arg0, fargs.arg1, fargs.arg2, fargs.arg3, fargs.arg4, fargs.arg5, fargs.arg6,
                                 fargs.arg7, fargs.arg8, fargs.arg9, fargs.arg10, fargs.arg11);
     }
-    for (int32_t i = hook_chain->chain_items_max - 1; i >= 0; i--) {
-        if (hook_chain->states[i] != CHAIN_ITEM_STATE_READY) continue;
-        hook_chain12_callback func = hook_chain->afters[i];
-        if (func) func(&fargs, hook_chain->udata[i]);
-    }
+    hook_chain_stats_origin_done();
+    hook_chain_call_afters(hook_chain, hook_chain12_callback, &fargs);
+    hook_chain_stats_end(&fargs);
+    hook_chain_exit(hook_chain);
     return fargs.ret;
 }
 
-extern void _fp_transit12_end();
-
-static hook_err_t hook_chain_prepare(uint32_t *transit, int32_t argno)
+static uint64_t hook_chain_transit(int32_t argno)
 {
-    uint64_t transit_start, transit_end;
     switch (argno) {
     case 0:
-        transit_start = (uint64_t)_fp_transit0;
-        transit_end = (uint64_t)_fp_transit0_end;
-        break;
+        return (uint64_t)_fp_transit0;
     case 1:
     case 2:
     case 3:
     case 4:
-        transit_start = (uint64_t)_fp_transit4;
-        transit_end = (uint64_t)_fp_transit4_end;
-        break;
+        return (uint64_t)_fp_transit4;
     case 5:
     case 6:
     case 7:
     case 8:
-        transit_start = (uint64_t)_fp_transit8;
-        transit_end = (uint64_t)_fp_transit8_end;
-        break;
+        return (uint64_t)_fp_transit8;
     default:
-        transit_start = (uint64_t)_fp_transit12;
-        transit_end = (uint64_t)_fp_transit12_end;
-        break;
+        return (uint64_t)_fp_transit12;
     }
-
-    int32_t transit_num = (transit_end - transit_start) / 4;
-
-    // todo: assert
-    if (transit_num >= TRANSIT_INST_NUM) return -HOOK_TRANSIT_NO_MEM;
-
-    transit[0] = ARM64_BTI_JC;
-    transit[1] = ARM64_NOP;
-    for (int i = 0; i < transit_num; i++) {
-        transit[i + 2] = ((uint32_t *)transit_start)[i];
-    }
-    return HOOK_NO_ERR;
 }
 
-void fp_hook(uintptr_t fp_addr, void *replace, void **backup)
+static void __fp_hook(uintptr_t fp_addr, void *replace, void **backup)
 {
     uint64_t *entry = pgtable_entry_kernel(fp_addr);
     uint64_t ori_prot = *entry;
@@ -228,9 +187,16 @@ void fp_hook(uintptr_t fp_addr, void *replace, void **backup)
     dsb(ish);
     modify_entry_kernel(fp_addr, entry, ori_prot);
 }
+
+void fp_hook(uintptr_t fp_addr, void *replace, void **backup)
+{
+    if (hook_lock()) return;
+    __fp_hook(fp_addr, replace, backup);
+    hook_unlock();
+}
 KP_EXPORT_SYMBOL(fp_hook);
 
-void fp_unhook(uintptr_t fp_addr, void *backup)
+static void __fp_unhook(uintptr_t fp_addr, void *backup)
 {
     uint64_t *entry = pgtable_entry_kernel(fp_addr);
     uint64_t ori_prot = *entry;
@@ -238,77 +204,276 @@ void fp_unhook(uintptr_t fp_addr, void *backup)
     *(uintptr_t *)fp_addr = (uintptr_t)backup;
     dsb(ish);
     isb();
-    flush_icache_all();
     modify_entry_kernel(fp_addr, entry, ori_prot);
 }
+
+void fp_unhook(uintptr_t fp_addr, void *backup)
+{
+    if (hook_lock()) return;
+    __fp_unhook(fp_addr, backup);
+    hook_unlock();
+}
 KP_EXPORT_SYMBOL(fp_unhook);
 
-hook_err_t fp_hook_wrap(uintptr_t fp_addr, int32_t argno, void *before, void *after, void *udata)
+static hook_err_t __fp_hook_wrap_priority(uintptr_t fp_addr, int32_t argno, void *before, void *after, void *udata,
+                                          int32_t priority)
 {
     hook_err_t err = HOOK_NO_ERR;
     if (is_bad_address((void *)fp_addr)) return -HOOK_BAD_ADDRESS;
     fp_hook_chain_t *chain = hook_get_mem_from_origin(fp_addr);
-    if (!chain) {
-        chain = (fp_hook_chain_t *)hook_mem_zalloc(fp_addr, FUNCTION_POINTER_CHAIN);
+    int created = !chain;
+    if (created) {
+        chain = (fp_hook_chain_t *)hook_mem_zalloc_drain(fp_addr, FUNCTION_POINTER_CHAIN);
         if (!chain) return -HOOK_NO_MEM;
         chain->hook.fp_addr = fp_addr;
         chain->hook.replace_addr = (uint64_t)chain->transit;
-        err = hook_chain_prepare(chain->transit, argno);
-        if (err) return err;
-        flush_icache_all();
-        fp_hook(chain->hook.fp_addr, (void *)chain->hook.replace_addr, (void **)&chain->hook.origin_fp);
+        hook_stub_init(chain->transit, chain, hook_chain_transit(argno));
+        hook_chain_slots_init(hook_chain_slots(chain, FP_HOOK_CHAIN_NUM));
     }
 
-    for (int i = 0; i < FP_HOOK_CHAIN_NUM; i++) {
-        if ((before && chain->befores[i] == before) || (after && chain->afters[i] == after)) return -HOOK_DUPLICATED;
-
-        // todo: atomic or lock
-        if (chain->states[i] == CHAIN_ITEM_STATE_EMPTY) {
-            chain->states[i] = CHAIN_ITEM_STATE_BUSY;
-            dsb(ish);
-            chain->udata[i] = udata;
-            chain->befores[i] = before;
-            chain->afters[i] = after;
-            if (i + 1 > chain->chain_items_max) {
-                chain->chain_items_max = i + 1;
-            }
-            dsb(ish);
-            chain->states[i] = CHAIN_ITEM_STATE_READY;
-            logkv("Wrap func pointer add: %llx, %llx, %llx successed\n", chain->hook.fp_addr, before, after);
-            return HOOK_NO_ERR;
-        }
+    if (!err) err = hook_chain_slots_add(hook_chain_slots(chain, FP_HOOK_CHAIN_NUM), before, after, udata, priority);
+    logkv("Wrap func pointer add: %llx, %llx, %llx, priority: %d %s\n", fp_addr, before, after, priority,
+          err ? "failed" : "successed");
+    if (!created) return err;
+
+    // a new chain is only made reachable with its callbacks set, and never was on error
+    if (!err) {
+        fp_hook(chain->hook.fp_addr, (void *)chain->hook.replace_addr, (void **)&chain->hook.origin_fp);
+        return HOOK_NO_ERR;
     }
-    logkv("Wrap func pointer add: %llx, %llx, %llx failed\n", chain->hook.fp_addr, before, after);
-    return -HOOK_CHAIN_FULL;
+    hook_chain_slots_free(hook_chain_slots(chain, FP_HOOK_CHAIN_NUM));
+    hook_mem_free(chain);
+    return err;
+}
+
+hook_err_t fp_hook_wrap_priority(uintptr_t fp_addr, int32_t argno, void *before, void *after, void *udata,
+                                 int32_t priority)
+{
+    hook_err_t err = hook_lock();
+    if (err) return err;
+    err = __fp_hook_wrap_priority(fp_addr, argno, before, after, udata, priority);
+    hook_unlock();
+    return err;
+}
+KP_EXPORT_SYMBOL(fp_hook_wrap_priority);
+
+hook_err_t fp_hook_wrap(uintptr_t fp_addr, int32_t argno, void *before, void *after, void *udata)
+{
+    return fp_hook_wrap_priority(fp_addr, argno, before, after, udata, HOOK_PRIORITY_DEFAULT);
 }
 KP_EXPORT_SYMBOL(fp_hook_wrap);
 
-void fp_hook_unwrap(uintptr_t fp_addr, void *before, void *after)
+static void __fp_hook_unwrap(uintptr_t fp_addr, void *before, void *after)
 {
     if (is_bad_address((void *)fp_addr)) return;
     fp_hook_chain_t *chain = (fp_hook_chain_t *)hook_get_mem_from_origin(fp_addr);
     if (!chain) return;
-    for (int i = 0; i < FP_HOOK_CHAIN_NUM; i++) {
-        if (chain->states[i] == CHAIN_ITEM_STATE_READY)
-            if ((before && chain->befores[i] == before) || (after && chain->afters[i] == after)) {
-                chain->states[i] = CHAIN_ITEM_STATE_BUSY;
-                dsb(ish);
-                chain->udata[i] = 0;
-                chain->befores[i] = 0;
-                chain->afters[i] = 0;
-                dsb(ish);
-                chain->states[i] = CHAIN_ITEM_STATE_EMPTY;
-                break;
-            }
-    }
+    hook_chain_slots_remove(hook_chain_slots(chain, FP_HOOK_CHAIN_NUM), before, after);
+    chain->inflight_dirty = 1;
     logkv("Wrap func pointer remove: %llx, %llx, %llx\n", chain->hook.fp_addr, before, after);
 
-    for (int i = 0; i < FP_HOOK_CHAIN_NUM; i++) {
-        if (chain->states[i] != CHAIN_ITEM_STATE_EMPTY) return;
-    }
+    if (!hook_chain_slots_empty(hook_chain_slots(chain, FP_HOOK_CHAIN_NUM))) return;
     fp_unhook(chain->hook.fp_addr, (void *)chain->hook.origin_fp);
-    // todo: unsafe
-    hook_mem_free(chain);
+    // calls may still be inside, freed by hook_drain
+    hook_mem_retire(chain);
     logkv("Unwrap func pointer: %llx, %llx, %llx\n", fp_addr, before, after);
 }
-KP_EXPORT_SYMBOL(fp_hook_unwrap);
\ No newline at end of file
+
+void fp_hook_unwrap(uintptr_t fp_addr, void *before, void *after)
+{
+    if (hook_lock()) return;
+    __fp_hook_unwrap(fp_addr, before, after);
+    hook_unlock();
+}
+KP_EXPORT_SYMBOL(fp_hook_unwrap);
+
+// entries were changed without a flush, contiguous ranges are flushed whole
+static void fp_table_flush(uint64_t pages[], int32_t pages_num)
+{
+    uint64_t start = pages[0];
+    uint64_t end = pages[0];
+    for (int32_t i = 1; i < pages_num; i++) {
+        if (pages[i] < start) start = pages[i];
+        if (pages[i] > end) end = pages[i];
+    }
+    start &= CONT_PTE_MASK;
+    end = (end + CONT_PTE_SIZE) & CONT_PTE_MASK;
+    if ((end - start) / page_size <= FP_TABLE_FLUSH_PAGES) {
+        flush_tlb_kernel_range(start, end);
+        return;
+    }
+    for (int32_t i = 0; i < pages_num; i++) {
+        start = pages[i] & CONT_PTE_MASK;
+        flush_tlb_kernel_range(start, start + CONT_PTE_SIZE);
+    }
+}
+
+static void fp_table_write_chunk(fp_hook_chain_t *chains[], int32_t num, uint64_t pages[], int32_t pages_num,
+                                 int install)
+{
+    uint64_t *entries[FP_TABLE_PAGES_NUM];
+    uint64_t prots[FP_TABLE_PAGES_NUM];
+
+    // chains are set up before they are reachable
+    dsb(ishst);
+    for (int32_t i = 0; i < pages_num; i++) {
+        entries[i] = pgtable_entry_kernel(pages[i]);
+        prots[i] = *entries[i];
+        modify_entry_kernel_nosync(pages[i], entries[i], (prots[i] | PTE_DBM) & ~PTE_RDONLY);
+    }
+    fp_table_flush(pages, pages_num);
+    for (int32_t i = 0; i < num; i++) {
+        fp_hook_t *hook = &chains[i]->hook;
+        if (install) {
+            hook->origin_fp = *(uintptr_t *)hook->fp_addr;
+            *(uintptr_t *)hook->fp_addr = hook->replace_addr;
+        } else {
+            *(uintptr_t *)hook->fp_addr = hook->origin_fp;
+        }
+    }
+    dsb(ish);
+    isb();
+    // reverse order, pages sharing a contiguous range were saved already writable
+    for (int32_t i = pages_num - 1; i >= 0; i--) {
+        modify_entry_kernel_nosync(pages[i], entries[i], prots[i]);
+    }
+    fp_table_flush(pages, pages_num);
+}
+
+static void fp_table_write(fp_hook_chain_t *chains[], int32_t num, int install)
+{
+    uint64_t pages[FP_TABLE_PAGES_NUM];
+    uint64_t page_mask = ~((uint64_t)page_size - 1);
+    int32_t pages_num = 0;
+    int32_t start = 0;
+
+    for (int32_t i = 0; i < num; i++) {
+        uint64_t page = chains[i]->hook.fp_addr & page_mask;
+        int32_t j = 0;
+        for (; j < pages_num; j++) {
+            if (pages[j] == page) break;
+        }
+        if (j < pages_num) continue;
+        if (pages_num >= FP_TABLE_PAGES_NUM) {
+            fp_table_write_chunk(chains + start, i - start, pages, pages_num, install);
+            start = i;
+            pages_num = 0;
+        }
+        pages[pages_num++] = page;
+    }
+    if (num > start) fp_table_write_chunk(chains + start, num - start, pages, pages_num, install);
+}
+
+static int32_t __fp_hook_table(void **table, const uint32_t *indexes, int32_t n, int32_t argno, void *before,
+                               void *after, void *udata, hook_err_t *results)
+{
+    fp_hook_chain_t *chains[FP_TABLE_BATCH_NUM];
+    int32_t chains_num = 0;
+    int32_t wrapped = 0;
+
+    for (int32_t i = 0; i < n; i++) {
+        uintptr_t fp_addr = (uintptr_t)(table + indexes[i]);
+        hook_err_t err = HOOK_NO_ERR;
+        fp_hook_chain_t *chain = 0;
+
+        if (is_bad_address((void *)fp_addr)) {
+            err = -HOOK_BAD_ADDRESS;
+            goto out;
+        }
+        chain = hook_get_mem_from_origin(fp_addr);
+        if (chain) {
+            err = hook_chain_slots_add(hook_chain_slots(chain, FP_HOOK_CHAIN_NUM), before, after, udata,
+                                       HOOK_PRIORITY_DEFAULT);
+            goto out;
+        }
+
+        if (chains_num >= FP_TABLE_BATCH_NUM) {
+            fp_table_write(chains, chains_num, 1);
+            chains_num = 0;
+        }
+        chain = (fp_hook_chain_t *)hook_mem_zalloc_drain(fp_addr, FUNCTION_POINTER_CHAIN);
+        if (!chain) {
+            err = -HOOK_NO_MEM;
+            goto out;
+        }
+        chain->hook.fp_addr = fp_addr;
+        chain->hook.replace_addr = (uint64_t)chain->transit;
+        hook_stub_init(chain->transit, chain, hook_chain_transit(argno));
+        hook_chain_slots_init(hook_chain_slots(chain, FP_HOOK_CHAIN_NUM));
+        err = hook_chain_slots_add(hook_chain_slots(chain, FP_HOOK_CHAIN_NUM), before, after, udata,
+                                   HOOK_PRIORITY_DEFAULT);
+        if (err) {
+            // never reachable, no need to drain
+            hook_chain_slots_free(hook_chain_slots(chain, FP_HOOK_CHAIN_NUM));
+            hook_mem_free(chain);
+            goto out;
+        }
+        chains[chains_num++] = chain;
+
+    out:
+        if (results) results[i] = err;
+        if (!err) wrapped++;
+    }
+    fp_table_write(chains, chains_num, 1);
+
+    logkv("Wrap func pointer table: %llx, %d of %d, %llx, %llx\n", table, wrapped, n, before, after);
+    return wrapped;
+}
+
+int32_t fp_hook_table(void **table, const uint32_t *indexes, int32_t n, int32_t argno, void *before, void *after,
+                      void *udata, hook_err_t *results)
+{
+    hook_err_t err = hook_lock();
+    if (err) {
+        for (int32_t i = 0; results && i < n; i++) {
+            results[i] = err;
+        }
+        return 0;
+    }
+    int32_t wrapped = __fp_hook_table(table, indexes, n, argno, before, after, udata, results);
+    hook_unlock();
+    return wrapped;
+}
+KP_EXPORT_SYMBOL(fp_hook_table);
+
+static void __fp_unhook_table(void **table, const uint32_t *indexes, int32_t n, void *before, void *after)
+{
+    fp_hook_chain_t *chains[FP_TABLE_BATCH_NUM];
+    int32_t chains_num = 0;
+
+    for (int32_t i = 0; i <= n; i++) {
+        if (i == n || chains_num >= FP_TABLE_BATCH_NUM) {
+            fp_table_write(chains, chains_num, 0);
+            // calls may still be inside, freed by hook_drain
+            for (int32_t j = 0; j < chains_num; j++) {
+                hook_mem_retire(chains[j]);
+            }
+            chains_num = 0;
+        }
+        if (i == n) break;
+
+        uintptr_t fp_addr = (uintptr_t)(table + indexes[i]);
+        if (is_bad_address((void *)fp_addr)) continue;
+        fp_hook_chain_t *chain = (fp_hook_chain_t *)hook_get_mem_from_origin(fp_addr);
+        if (!chain) continue;
+        hook_chain_slots_remove(hook_chain_slots(chain, FP_HOOK_CHAIN_NUM), before, after);
+        chain->inflight_dirty = 1;
+        if (!hook_chain_slots_empty(hook_chain_slots(chain, FP_HOOK_CHAIN_NUM))) continue;
+
+        // a repeated index must not be queued twice
+        int32_t j = 0;
+        for (; j < chains_num; j++) {
+            if (chains[j] == chain) break;
+        }
+        if (j == chains_num) chains[chains_num++] = chain;
+    }
+    logkv("Unwrap func pointer table: %llx, %d, %llx, %llx\n", table, n, before, after);
+}
+
+void fp_unhook_table(void **table, const uint32_t *indexes, int32_t n, void *before, void *after)
+{
+    if (hook_lock()) return;
+    __fp_unhook_table(table, indexes, n, before, after);
+    hook_unlock();
+}
+KP_EXPORT_SYMBOL(fp_unhook_table);
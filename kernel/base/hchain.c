@@ -0,0 +1,430 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2024 bmax121. All Rights Reserved.
+ */
+
+#include "hchain.h"
+
+#include <kpslab.h>
+#include <baselib.h>
+#include <pgtable.h>
+#include <symbol.h>
+#include "hmem.h"
+
+#define ext_slots(e)                                                                                          \
+    ((hook_chain_slots_t){ HOOK_CHAIN_EXT_NUM, &(e)->chain_items_max, (e)->states, (e)->seqs, (e)->priorities,  \
+                           (e)->udata, (e)->befores, (e)->afters, 0, 0, 0, 0 })
+
+static int stats_enabled = 0;
+
+static kp_slab_t *ext_slab = 0;
+static kp_slab_t *stats_slab = 0;
+
+static int slots_find(hook_chain_slots_t *slots, void *before, void *after)
+{
+    for (int32_t i = 0; i < slots->num; i++) {
+        if ((before && slots->befores[i] == before) || (after && slots->afters[i] == after)) return i;
+    }
+    return -1;
+}
+
+// a position in the logical order of callbacks, the inline slots first, then each ext block
+typedef struct
+{
+    hook_chain_slots_t *head;
+    hook_chain_ext_t *ext;
+    hook_chain_slots_t view;
+    int32_t i;
+} slot_pos_t;
+
+static void pos_set(slot_pos_t *pos, hook_chain_ext_t *ext, int32_t i)
+{
+    pos->ext = ext;
+    pos->view = ext ? ext_slots(ext) : *pos->head;
+    pos->i = i;
+}
+
+static int pos_next(slot_pos_t *pos)
+{
+    if (pos->i + 1 < pos->view.num) {
+        pos->i++;
+        return 1;
+    }
+    hook_chain_ext_t *next = pos->ext ? pos->ext->next : *pos->head->ext;
+    if (!next) return 0;
+    pos_set(pos, next, 0);
+    return 1;
+}
+
+static void pos_prev(slot_pos_t *pos)
+{
+    if (pos->i > 0) {
+        pos->i--;
+        return;
+    }
+    hook_chain_ext_t *prev = pos->ext->prev;
+    pos_set(pos, prev, prev ? HOOK_CHAIN_EXT_NUM - 1 : pos->head->num - 1);
+}
+
+// writers hold the hook lock, transits read without it
+static void slot_seq_begin(hook_chain_slots_t *slots, int32_t i)
+{
+    *(volatile uint32_t *)&slots->seqs[i] = slots->seqs[i] + 1;
+    smp_wmb();
+}
+
+static void slot_seq_end(hook_chain_slots_t *slots, int32_t i)
+{
+    smp_store_release(&slots->seqs[i], slots->seqs[i] + 1);
+}
+
+static void slot_write(slot_pos_t *pos, void *before, void *after, void *udata, int32_t priority)
+{
+    hook_chain_slots_t *slots = &pos->view;
+    int32_t i = pos->i;
+    slot_seq_begin(slots, i);
+    slots->priorities[i] = priority;
+    slots->udata[i] = udata;
+    slots->befores[i] = before;
+    slots->afters[i] = after;
+    slots->states[i] = CHAIN_ITEM_STATE_READY;
+    slot_seq_end(slots, i);
+    if (i + 1 > *slots->items_max) {
+        *slots->items_max = i + 1;
+    }
+}
+
+static void slot_hide(hook_chain_slots_t *slots, int32_t i)
+{
+    slot_seq_begin(slots, i);
+    slots->states[i] = CHAIN_ITEM_STATE_BUSY;
+    slot_seq_end(slots, i);
+}
+
+/*
+ * Insert before the first callback with a lower priority, shifting the run of occupied slots up to the next
+ * empty one, from the end. A moved callback is hidden before its copy in the next slot is written, a transit
+ * may still miss it once, or read it in both slots, which the walk of befores skips, see hchain.h.
+ * Callers hold the hook lock, so there is one writer per chain.
+ */
+static hook_err_t slots_insert(hook_chain_slots_t *head, void *before, void *after, void *udata, int32_t priority)
+{
+    slot_pos_t pos = { head };
+    pos_set(&pos, 0, 0);
+
+    // the insert position is right after the last callback with an equal or higher priority
+    slot_pos_t at = pos;
+    int has_at = 1;
+    do {
+        if (pos.view.states[pos.i] == CHAIN_ITEM_STATE_EMPTY) continue;
+        if (pos.view.priorities[pos.i] < priority) continue;
+        at = pos;
+        has_at = pos_next(&at);
+    } while (pos_next(&pos));
+
+    // the first empty slot at or after it
+    slot_pos_t empty = at;
+    int has_empty = has_at && empty.view.states[empty.i] == CHAIN_ITEM_STATE_EMPTY;
+    while (has_at && !has_empty && pos_next(&empty)) {
+        has_empty = empty.view.states[empty.i] == CHAIN_ITEM_STATE_EMPTY;
+    }
+
+    if (!has_empty) {
+        hook_chain_ext_t *ext = (hook_chain_ext_t *)kp_slab_alloc(ext_slab);
+        if (!ext) return -HOOK_NO_MEM;
+        lib_memset(ext, 0, sizeof(hook_chain_ext_t));
+        ext->prev = *head->ext_last;
+        // publish only after the block is complete, transits may walk either direction
+        dsb(ish);
+        if (*head->ext_last) {
+            (*head->ext_last)->next = ext;
+        } else {
+            *head->ext = ext;
+        }
+        *head->ext_last = ext;
+        pos_set(&empty, ext, 0);
+        if (!has_at) at = empty;
+    }
+
+    while (empty.ext != at.ext || empty.i != at.i) {
+        slot_pos_t from = empty;
+        pos_prev(&from);
+        hook_chain_slots_t *fs = &from.view;
+        int32_t fi = from.i;
+        void *fbefore = fs->befores[fi];
+        void *fafter = fs->afters[fi];
+        void *fudata = fs->udata[fi];
+        int32_t fpriority = fs->priorities[fi];
+        slot_hide(fs, fi);
+        slot_write(&empty, fbefore, fafter, fudata, fpriority);
+        empty = from;
+    }
+
+    slot_write(&at, before, after, udata, priority);
+    return HOOK_NO_ERR;
+}
+
+static int slots_clear(hook_chain_slots_t *slots, void *before, void *after)
+{
+    for (int32_t i = 0; i < slots->num; i++) {
+        if (slots->states[i] != CHAIN_ITEM_STATE_READY) continue;
+        if ((before && slots->befores[i] == before) || (after && slots->afters[i] == after)) {
+            slot_seq_begin(slots, i);
+            slots->states[i] = CHAIN_ITEM_STATE_EMPTY;
+            slots->udata[i] = 0;
+            slots->befores[i] = 0;
+            slots->afters[i] = 0;
+            slot_seq_end(slots, i);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+hook_err_t hook_chain_slots_add(hook_chain_slots_t slots, void *before, void *after, void *udata, int32_t priority)
+{
+    if (slots_find(&slots, before, after) >= 0) return -HOOK_DUPLICATED;
+    for (hook_chain_ext_t *ext = *slots.ext; ext; ext = ext->next) {
+        hook_chain_slots_t es = ext_slots(ext);
+        if (slots_find(&es, before, after) >= 0) return -HOOK_DUPLICATED;
+    }
+    return slots_insert(&slots, before, after, udata, priority);
+}
+
+void hook_chain_slots_remove(hook_chain_slots_t slots, void *before, void *after)
+{
+    if (slots_clear(&slots, before, after)) return;
+    // emptied blocks are kept for reuse, a transit may still be walking them
+    for (hook_chain_ext_t *ext = *slots.ext; ext; ext = ext->next) {
+        hook_chain_slots_t es = ext_slots(ext);
+        if (slots_clear(&es, before, after)) return;
+    }
+}
+
+int hook_chain_slots_empty(hook_chain_slots_t slots)
+{
+    for (int32_t i = 0; i < slots.num; i++) {
+        if (slots.states[i] != CHAIN_ITEM_STATE_EMPTY) return 0;
+    }
+    for (hook_chain_ext_t *ext = *slots.ext; ext; ext = ext->next) {
+        for (int32_t i = 0; i < HOOK_CHAIN_EXT_NUM; i++) {
+            if (ext->states[i] != CHAIN_ITEM_STATE_EMPTY) return 0;
+        }
+    }
+    return 1;
+}
+
+int32_t hook_chain_slots_count(hook_chain_slots_t slots)
+{
+    int32_t count = 0;
+    for (int32_t i = 0; i < slots.num; i++) {
+        if (slots.states[i] == CHAIN_ITEM_STATE_READY) count++;
+    }
+    for (hook_chain_ext_t *ext = *slots.ext; ext; ext = ext->next) {
+        for (int32_t i = 0; i < HOOK_CHAIN_EXT_NUM; i++) {
+            if (ext->states[i] == CHAIN_ITEM_STATE_READY) count++;
+        }
+    }
+    return count;
+}
+
+int hook_chain_slots_first(hook_chain_slots_t slots, void **before, void **after, void **udata)
+{
+    slot_pos_t pos = { &slots };
+    pos_set(&pos, 0, 0);
+    do {
+        if (pos.view.states[pos.i] != CHAIN_ITEM_STATE_READY) continue;
+        *before = pos.view.befores[pos.i];
+        *after = pos.view.afters[pos.i];
+        *udata = pos.view.udata[pos.i];
+        return 1;
+    } while (pos_next(&pos));
+    return 0;
+}
+
+// cpus hashed to the same slot and tasks moving between cpus share counters, so adds must be atomic
+static __always_inline void hook_stats_add(uint64_t *counter, uint64_t val)
+{
+    uint64_t tmp;
+    uint32_t fail;
+    asm volatile("1: ldxr %0, %2\n"
+                 "   add %0, %0, %3\n"
+                 "   stxr %w1, %0, %2\n"
+                 "   cbnz %w1, 1b"
+                 : "=&r"(tmp), "=&r"(fail), "+Q"(*counter)
+                 : "r"(val));
+}
+
+static void hook_chain_stats_record(hook_chain_stats_t *stats, uint64_t t0, uint64_t t1, uint64_t t2, uint64_t t3,
+                                    int skip_origin)
+{
+    hook_stats_cpu_t *cpu = &stats->cpus[kp_cpu_slot(HOOK_STATS_CPU_NUM)];
+    uint64_t total = t3 - t0;
+    int32_t bucket = total ? 64 - __builtin_clzll(total) : 0;
+    if (bucket >= HOOK_STATS_HIST_NUM) bucket = HOOK_STATS_HIST_NUM - 1;
+    hook_stats_add(&cpu->calls, 1);
+    if (skip_origin) hook_stats_add(&cpu->skips, 1);
+    hook_stats_add(&cpu->before_ticks, t1 - t0);
+    hook_stats_add(&cpu->origin_ticks, t2 - t1);
+    hook_stats_add(&cpu->after_ticks, t3 - t2);
+    hook_stats_add(&cpu->hist[bucket], 1);
+}
+
+static void stats_attach(hook_chain_slots_t *slots)
+{
+    if (!*slots->stats_mem) {
+        hook_chain_stats_t *stats = (hook_chain_stats_t *)kp_slab_alloc(stats_slab);
+        if (!stats) return;
+        lib_memset(stats, 0, sizeof(hook_chain_stats_t));
+        stats->record = hook_chain_stats_record;
+        dsb(ish);
+        *slots->stats_mem = stats;
+    }
+    *slots->stats = *slots->stats_mem;
+}
+
+void hook_chain_slots_init(hook_chain_slots_t slots)
+{
+    if (stats_enabled) stats_attach(&slots);
+}
+
+void hook_chain_slots_free(hook_chain_slots_t slots)
+{
+    hook_chain_ext_t *ext = *slots.ext;
+    *slots.ext = 0;
+    *slots.ext_last = 0;
+    while (ext) {
+        hook_chain_ext_t *next = ext->next;
+        kp_slab_free(ext_slab, ext);
+        ext = next;
+    }
+    *slots.stats = 0;
+    kp_slab_free(stats_slab, *slots.stats_mem);
+    *slots.stats_mem = 0;
+}
+
+void hook_chain_init()
+{
+    ext_slab = kp_slab_create(sizeof(hook_chain_ext_t), 8);
+    stats_slab = kp_slab_create(sizeof(hook_chain_stats_t), 64);
+    log_boot("hook chain ext slab: %llx, stats slab: %llx\n", ext_slab, stats_slab);
+}
+
+static int slots_of(enum hook_type type, void *hook_mem, hook_chain_slots_t *slots, uint64_t *addr)
+{
+    if (type == INLINE_CHAIN) {
+        hook_chain_t *chain = (hook_chain_t *)hook_mem;
+        *slots = hook_chain_slots(chain, HOOK_CHAIN_NUM);
+        *addr = chain->hook.func_addr;
+        return 1;
+    }
+    if (type == FUNCTION_POINTER_CHAIN) {
+        fp_hook_chain_t *chain = (fp_hook_chain_t *)hook_mem;
+        *slots = hook_chain_slots(chain, FP_HOOK_CHAIN_NUM);
+        *addr = chain->hook.fp_addr;
+        return 1;
+    }
+    return 0;
+}
+
+static int stats_enable_cb(enum hook_type type, uintptr_t origin_addr, void *hook_mem, void *udata)
+{
+    hook_chain_slots_t slots;
+    uint64_t addr;
+    if (!slots_of(type, hook_mem, &slots, &addr)) return 0;
+    if (udata) {
+        stats_attach(&slots);
+    } else {
+        *slots.stats = 0;
+    }
+    return 0;
+}
+
+void hook_stats_enable(int enable)
+{
+    if (hook_lock()) return;
+    stats_enabled = !!enable;
+    hook_mem_for_each(stats_enable_cb, (void *)(uintptr_t)stats_enabled);
+    hook_unlock();
+    logkv("Hook stats %s\n", stats_enabled ? "enabled" : "disabled");
+}
+KP_EXPORT_SYMBOL(hook_stats_enable);
+
+int hook_stats_enabled()
+{
+    return stats_enabled;
+}
+KP_EXPORT_SYMBOL(hook_stats_enabled);
+
+static void stats_sum(hook_chain_stats_t *stats, hook_stats_cpu_t *sum)
+{
+    lib_memset(sum, 0, sizeof(*sum));
+    for (int32_t i = 0; stats && i < HOOK_STATS_CPU_NUM; i++) {
+        hook_stats_cpu_t *cpu = &stats->cpus[i];
+        sum->calls += *(volatile uint64_t *)&cpu->calls;
+        sum->skips += *(volatile uint64_t *)&cpu->skips;
+        sum->before_ticks += *(volatile uint64_t *)&cpu->before_ticks;
+        sum->origin_ticks += *(volatile uint64_t *)&cpu->origin_ticks;
+        sum->after_ticks += *(volatile uint64_t *)&cpu->after_ticks;
+        for (int32_t j = 0; j < HOOK_STATS_HIST_NUM; j++) {
+            sum->hist[j] += *(volatile uint64_t *)&cpu->hist[j];
+        }
+    }
+}
+
+// transits keep counting while this runs, so the counters are never cleared, the sums so far become the base
+static int stats_reset_cb(enum hook_type type, uintptr_t origin_addr, void *hook_mem, void *udata)
+{
+    hook_chain_slots_t slots;
+    uint64_t addr;
+    if (!slots_of(type, hook_mem, &slots, &addr) || !*slots.stats_mem) return 0;
+    stats_sum(*slots.stats_mem, &(*slots.stats_mem)->base);
+    return 0;
+}
+
+void hook_stats_reset()
+{
+    if (hook_lock()) return;
+    hook_mem_for_each(stats_reset_cb, 0);
+    hook_unlock();
+}
+KP_EXPORT_SYMBOL(hook_stats_reset);
+
+struct stats_for_each_ctx
+{
+    hook_stats_cb cb;
+    void *udata;
+    int num;
+};
+
+static int stats_for_each_cb(enum hook_type type, uintptr_t origin_addr, void *hook_mem, void *udata)
+{
+    struct stats_for_each_ctx *ctx = (struct stats_for_each_ctx *)udata;
+    hook_chain_slots_t slots;
+    uint64_t addr;
+    if (!slots_of(type, hook_mem, &slots, &addr)) return 0;
+
+    hook_stats_cpu_t sum;
+    hook_chain_stats_t *stats = *slots.stats_mem;
+    stats_sum(stats, &sum);
+    if (stats) {
+        // counters only grow, but the sum is read unordered against adds, clamp at the base
+        uint64_t *val = (uint64_t *)&sum;
+        uint64_t *base = (uint64_t *)&stats->base;
+        for (int32_t i = 0; i < sizeof(sum) / sizeof(uint64_t); i++) {
+            val[i] = val[i] > base[i] ? val[i] - base[i] : 0;
+        }
+    }
+    ctx->num++;
+    return ctx->cb(type, addr, hook_chain_slots_count(slots), &sum, ctx->udata);
+}
+
+int hook_stats_for_each(hook_stats_cb cb, void *udata)
+{
+    struct stats_for_each_ctx ctx = { cb, udata, 0 };
+    if (hook_lock()) return 0;
+    hook_mem_for_each(stats_for_each_cb, &ctx);
+    hook_unlock();
+    return ctx.num;
+}
+KP_EXPORT_SYMBOL(hook_stats_for_each);
@@ -0,0 +1,234 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2024 bmax121. All Rights Reserved.
+ */
+
+#ifndef _KP_HCHAIN_H_
+#define _KP_HCHAIN_H_
+
+#include <hook.h>
+#include <stdbool.h>
+#include <compiler.h>
+#include <barrier.h>
+#include <cache.h>
+#include "kplock.h"
+
+#define HOOK_STUB_LDR_X16 0x58000070 // LDR X16, stub[4]
+#define HOOK_STUB_LDR_X17 0x58000091 // LDR X17, stub[6]
+#define HOOK_STUB_BR_X17 0xD61F0220 // BR X17
+
+/*
+ * The trampoline of a chain branches to its stub, which loads the chain into x16 and branches to the
+ * transit in its literal. The transits are shared and run in place, a retarget only stores that literal,
+ * literals are read through the data side, so no text is patched. The transit entries in transit.S pass
+ * x16 on to the C bodies as an argument.
+ */
+static inline void hook_stub_init(uint32_t *stub, void *chain, uint64_t target)
+{
+    stub[0] = ARM64_BTI_JC;
+    stub[1] = HOOK_STUB_LDR_X16;
+    stub[2] = HOOK_STUB_LDR_X17;
+    stub[3] = HOOK_STUB_BR_X17;
+    *(uint64_t *)&stub[4] = (uint64_t)chain;
+    *(uint64_t *)&stub[6] = target;
+    flush_icache_range((uint64_t)stub, (uint64_t)(stub + HOOK_STUB_INST_NUM));
+}
+
+static inline uint64_t hook_stub_target(uint32_t *stub)
+{
+    return *(volatile uint64_t *)&stub[6];
+}
+
+// whatever the new transit reads is written before
+static inline void hook_stub_set_target(uint32_t *stub, uint64_t target)
+{
+    smp_store_release((uint64_t *)&stub[6], target);
+}
+
+// view of the inline callback slots of hook_chain_t or fp_hook_chain_t
+typedef struct
+{
+    int32_t num;
+    int32_t *items_max;
+    chain_item_state *states;
+    uint32_t *seqs;
+    int32_t *priorities;
+    void **udata;
+    void **befores;
+    void **afters;
+    hook_chain_ext_t **ext;
+    hook_chain_ext_t **ext_last;
+    hook_chain_stats_t **stats;
+    hook_chain_stats_t **stats_mem;
+} hook_chain_slots_t;
+
+#define hook_chain_slots(chain, n)                                                                              \
+    ((hook_chain_slots_t){ (n), &(chain)->chain_items_max, (chain)->states, (chain)->seqs, (chain)->priorities,     \
+                           (chain)->udata, (chain)->befores, (chain)->afters, &(chain)->ext, &(chain)->ext_last,   \
+                           &(chain)->stats, &(chain)->stats_mem })
+
+hook_err_t hook_chain_slots_add(hook_chain_slots_t slots, void *before, void *after, void *udata, int32_t priority);
+void hook_chain_slots_remove(hook_chain_slots_t slots, void *before, void *after);
+int hook_chain_slots_empty(hook_chain_slots_t slots);
+void hook_chain_slots_free(hook_chain_slots_t slots);
+int32_t hook_chain_slots_count(hook_chain_slots_t slots);
+int hook_chain_slots_first(hook_chain_slots_t slots, void **before, void **after, void **udata);
+void hook_chain_slots_init(hook_chain_slots_t slots);
+void hook_chain_init();
+
+/*
+ * 
+ * A slot is read like a seqcount, a callback is only called with the udata written together with it.
+ * A slot being written is skipped rather than waited for, the writer may be preempted.
+ * 
+ * A callback moved to the next slot by an insert may be read twice by a forward walk, in adjacent slots,
+ * so a before equal to the one just called is skipped, the same before is never added twice to a chain.
+ * The backward walk of afters can miss a moved callback once, but never reads it twice.
+ * 
+ * A before setting skip_origin to HOOK_SKIP_CHAIN cuts the chain, the position is kept in __cut_ext and __cut_i
+ * and afters only run from there back to the first callback.
+ * hook_chain_call_befores declares them, so it must be used once in the same scope as hook_chain_call_afters.
+ */
+#define __hook_chain_read_slot(items, i, fns, func, data)                                 \
+    ({                                                                                   \
+        uint32_t __seq = smp_load_acquire(&(items)->seqs[i]);                            \
+        int __ok = !(__seq & 1) && (items)->states[i] == CHAIN_ITEM_STATE_READY;         \
+        if (__ok) {                                                                      \
+            func = (items)->fns[i];                                                      \
+            data = (items)->udata[i];                                                    \
+            smp_rmb();                                                                   \
+            __ok = *(volatile uint32_t *)&(items)->seqs[i] == __seq;                     \
+        }                                                                                \
+        __ok;                                                                            \
+    })
+
+#define hook_chain_read_one(chain, before, after, data)                                   \
+    ({                                                                                   \
+        uint32_t __seq = smp_load_acquire(&(chain)->one_seq);                            \
+        int __ok = !(__seq & 1);                                                         \
+        if (__ok) {                                                                      \
+            before = (chain)->one_before;                                                \
+            after = (chain)->one_after;                                                  \
+            data = (chain)->one_udata;                                                   \
+            smp_rmb();                                                                   \
+            __ok = *(volatile uint32_t *)&(chain)->one_seq == __seq;                     \
+        }                                                                                \
+        __ok;                                                                            \
+    })
+
+#define __hook_chain_call_befores(items, callback_t, fargs)                    \
+    for (int32_t __i = 0; __i < (items)->chain_items_max; __i++) {             \
+        callback_t __func;                                                     \
+        void *__udata;                                                         \
+        if (!__hook_chain_read_slot(items, __i, befores, __func, __udata)) continue; \
+        if (!__func || (void *)__func == __last) continue;                     \
+        __last = (void *)__func;                                               \
+        __func(fargs, __udata);                                                \
+        if ((fargs)->skip_origin == HOOK_SKIP_CHAIN) {                         \
+            __cut_i = __i;                                                     \
+            break;                                                             \
+        }                                                                      \
+    }
+
+#define __hook_chain_call_afters(items, callback_t, fargs, start)              \
+    for (int32_t __i = (start); __i >= 0; __i--) {                             \
+        callback_t __func;                                                     \
+        void *__udata;                                                         \
+        if (!__hook_chain_read_slot(items, __i, afters, __func, __udata)) continue; \
+        if (__func) __func(fargs, __udata);                                    \
+    }
+
+#define hook_chain_call_befores(chain, callback_t, fargs)                                   \
+    hook_chain_ext_t *__cut_ext = 0;                                                        \
+    int32_t __cut_i = -1;                                                                   \
+    do {                                                                                    \
+        void *__last = 0;                                                                   \
+        __hook_chain_call_befores(chain, callback_t, fargs);                                \
+        if (__cut_i >= 0) break;                                                            \
+        for (hook_chain_ext_t *__ext = (chain)->ext; __ext; __ext = __ext->next) {          \
+            __hook_chain_call_befores(__ext, callback_t, fargs);                            \
+            if (__cut_i >= 0) {                                                             \
+                __cut_ext = __ext;                                                          \
+                break;                                                                      \
+            }                                                                               \
+        }                                                                                   \
+    } while (0)
+
+#define hook_chain_call_afters(chain, callback_t, fargs)                                    \
+    do {                                                                                    \
+        int __skip = __cut_i >= 0;                                                          \
+        for (hook_chain_ext_t *__ext = (chain)->ext_last; __ext; __ext = __ext->prev) {     \
+            if (__skip && __ext != __cut_ext) continue;                                     \
+            __hook_chain_call_afters(__ext, callback_t, fargs,                              \
+                                     __skip ? __cut_i : __ext->chain_items_max - 1);        \
+            __skip = 0;                                                                     \
+        }                                                                                   \
+        __hook_chain_call_afters(chain, callback_t, fargs,                                  \
+                                 __skip ? __cut_i : (chain)->chain_items_max - 1);          \
+    } while (0)
+
+// count before touching the chain, pairs with the barrier in hook_drain after callbacks are removed
+static __always_inline void hook_inflight_inc(int64_t *count)
+{
+    int64_t val;
+    uint32_t fail;
+    asm volatile("1: ldxr %0, %2\n"
+                 "   add %0, %0, #1\n"
+                 "   stxr %w1, %0, %2\n"
+                 "   cbnz %w1, 1b\n"
+                 "   dmb ish"
+                 : "=&r"(val), "=&r"(fail), "+Q"(*count)
+                 :
+                 : "memory");
+}
+
+static __always_inline void hook_inflight_dec(int64_t *count)
+{
+    int64_t val;
+    uint32_t fail;
+    asm volatile("   dmb ish\n"
+                 "1: ldxr %0, %2\n"
+                 "   sub %0, %0, #1\n"
+                 "   stxr %w1, %0, %2\n"
+                 "   cbnz %w1, 1b"
+                 : "=&r"(val), "=&r"(fail), "+Q"(*count)
+                 :
+                 : "memory");
+}
+
+// a task may leave on another cpu than it entered, only the sum over slots is meaningful
+#define hook_chain_enter(chain)                                                        \
+    int32_t __inflight_idx = *(volatile int32_t *)&(chain)->inflight_idx & 1;          \
+    hook_inflight_inc(&(chain)->inflight[kp_cpu_slot(HOOK_INFLIGHT_NUM)].count[__inflight_idx]);
+
+#define hook_chain_exit(chain) \
+    hook_inflight_dec(&(chain)->inflight[kp_cpu_slot(HOOK_INFLIGHT_NUM)].count[__inflight_idx]);
+
+#define hook_chain_call_rets(chain, ret, a0, a1, a2, a3)                        \
+    for (int32_t __r = 0; __r < HOOK_RET_NUM; __r++) {                          \
+        hook_ret_callback __rfunc = smp_load_acquire(&(chain)->ret_callbacks[__r]); \
+        if (__rfunc) __rfunc(ret, a0, a1, a2, a3, (chain)->ret_udata[__r]);     \
+    }
+
+static __always_inline uint64_t hook_stats_now()
+{
+    uint64_t val;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(val));
+    return val;
+}
+
+#define hook_chain_stats_begin(chain)               \
+    hook_chain_stats_t *__stats = (chain)->stats;   \
+    uint64_t __t0 = 0, __t1 = 0, __t2 = 0;          \
+    if (__stats) __t0 = hook_stats_now();
+
+#define hook_chain_stats_befores_done() \
+    if (__stats) __t1 = hook_stats_now();
+
+#define hook_chain_stats_origin_done() \
+    if (__stats) __t2 = hook_stats_now();
+
+#define hook_chain_stats_end(fargs) \
+    if (__stats) __stats->record(__stats, __t0, __t1, __t2, hook_stats_now(), (fargs)->skip_origin);
+
+#endif
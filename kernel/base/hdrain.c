@@ -0,0 +1,279 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2024 bmax121. All Rights Reserved.
+ */
+
+#include <hook.h>
+#include <ksyms.h>
+#include <pgtable.h>
+#include <barrier.h>
+#include <symbol.h>
+#include <asm/ptrace.h>
+#include <linux/rcupdate.h>
+#include "hmem.h"
+#include "hchain.h"
+
+#define HOOK_DRAIN_TIMEOUT_MS 2000
+
+static int drain_ready = 0;
+
+/*
+ * Callbacks and the origin are only reached between the in-flight count and its drop, so module text is
+ * drained by the counts alone. A call preempted in the stub of a chain, before it is counted, is only
+ * covered by a grace period that waits for preempted tasks. Without rcu tasks on a preemptible kernel
+ * there is none, so retired hook memory is kept instead of being reused.
+ */
+static int drain_keep_retired = 0;
+
+// kernel/rcu/tasks.h, waits until every task has voluntarily scheduled, i.e. left any preempted transit
+static void kfunc_def(synchronize_rcu_tasks)(void) = 0;
+static void kfunc_def(msleep)(unsigned int msecs) = 0;
+
+static int chain_inflight(enum hook_type type, void *hook_mem, hook_inflight_t **inflight, int32_t **idx,
+                          int32_t **dirty)
+{
+    if (type == INLINE_CHAIN) {
+        hook_chain_t *chain = (hook_chain_t *)hook_mem;
+        *inflight = chain->inflight;
+        *idx = &chain->inflight_idx;
+        *dirty = &chain->inflight_dirty;
+        return 1;
+    }
+    if (type == FUNCTION_POINTER_CHAIN) {
+        fp_hook_chain_t *chain = (fp_hook_chain_t *)hook_mem;
+        *inflight = chain->inflight;
+        *idx = &chain->inflight_idx;
+        *dirty = &chain->inflight_dirty;
+        return 1;
+    }
+    return 0;
+}
+
+static int64_t inflight_sum(hook_inflight_t *inflight, int32_t idx)
+{
+    int64_t sum = 0;
+    for (int32_t i = 0; i < HOOK_INFLIGHT_NUM; i++) {
+        sum += *(volatile int64_t *)&inflight[i].count[idx];
+    }
+    return sum;
+}
+
+static uint64_t drain_now()
+{
+    uint64_t val;
+    asm volatile("isb; mrs %0, cntvct_el0" : "=r"(val) : : "memory");
+    return val;
+}
+
+static uint64_t drain_deadline()
+{
+    uint64_t freq;
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(freq));
+    return drain_now() + freq / 1000 * HOOK_DRAIN_TIMEOUT_MS;
+}
+
+// returns 0 when the deadline passed
+static int drain_wait(uint64_t deadline)
+{
+    if ((int64_t)(drain_now() - deadline) >= 0) return 0;
+    if (drain_ready && kf_msleep) {
+        kf_msleep(1);
+    } else {
+        asm volatile("yield" ::: "memory");
+    }
+    return 1;
+}
+
+// once booted the hook api sleeps, on the hook lock, in a drain or in stop_machine
+hook_err_t hook_may_sleep()
+{
+    uint64_t daif;
+    if (!drain_ready) return HOOK_NO_ERR;
+    asm volatile("mrs %0, daif" : "=r"(daif));
+    // a caller holding a spinlock with irqs on can not be told apart
+    if (!(daif & PSR_I_BIT)) return HOOK_NO_ERR;
+    logkw("Hook api called with irqs masked\n");
+    return -HOOK_ATOMIC;
+}
+
+// waiting for the hook lock, whose holder may sleep
+void hook_relax()
+{
+    if (drain_ready && kf_msleep) {
+        kf_msleep(1);
+    } else {
+        asm volatile("yield" ::: "memory");
+    }
+}
+
+static void drain_grace_period()
+{
+    if (!drain_ready) return;
+    if (kf_synchronize_rcu_tasks) {
+        kf_synchronize_rcu_tasks();
+    } else if (kf_synchronize_rcu) {
+        // enough without preemption, see drain_keep_retired otherwise
+        kf_synchronize_rcu();
+    }
+}
+
+/*
+ * Callbacks are removed before the flip, calls entering after it count in the new index.
+ * Calls counted in the old index may still have loaded a removed callback, so wait for them only,
+ * which completes even if the chain is never idle.
+ */
+static int drain_flip_cb(enum hook_type type, uintptr_t origin_addr, void *hook_mem, void *udata)
+{
+    hook_inflight_t *inflight;
+    int32_t *idx, *dirty;
+    if (!chain_inflight(type, hook_mem, &inflight, &idx, &dirty) || !*dirty) return 0;
+    *(volatile int32_t *)idx = (*idx & 1) ^ 1;
+    return 0;
+}
+
+struct drain_ctx
+{
+    uint64_t deadline;
+    int waited;
+    int timeout;
+    // chain and counter of the call hook_drain_from is made from, it stays counted while it waits
+    void *self_chain;
+    int32_t self_idx;
+};
+
+static int drain_live_cb(enum hook_type type, uintptr_t origin_addr, void *hook_mem, void *udata)
+{
+    struct drain_ctx *ctx = (struct drain_ctx *)udata;
+    hook_inflight_t *inflight;
+    int32_t *idx, *dirty;
+    if (!chain_inflight(type, hook_mem, &inflight, &idx, &dirty) || !*dirty) return 0;
+    int32_t old = (*idx & 1) ^ 1;
+    int64_t self = hook_mem == ctx->self_chain && old == ctx->self_idx;
+    while (inflight_sum(inflight, old) > self) {
+        if (!drain_wait(ctx->deadline)) {
+            logkw("Hook drain: %llx busy\n", origin_addr);
+            return 1;
+        }
+    }
+    *dirty = 0;
+    return 0;
+}
+
+// retired chains are no longer reachable, wait for every call still inside
+static int drain_retired_cb(enum hook_type type, uintptr_t origin_addr, void *hook_mem, void *udata)
+{
+    struct drain_ctx *ctx = (struct drain_ctx *)udata;
+    hook_inflight_t *inflight;
+    int32_t *idx, *dirty;
+    if (!chain_inflight(type, hook_mem, &inflight, &idx, &dirty)) return 0;
+    if (hook_mem == ctx->self_chain) {
+        logkw("Hook drain: retired %llx is still running the caller\n", origin_addr);
+        ctx->timeout = 1;
+        return 1;
+    }
+    while (inflight_sum(inflight, 0) + inflight_sum(inflight, 1)) {
+        ctx->waited = 1;
+        if (!drain_wait(ctx->deadline)) {
+            logkw("Hook drain: retired %llx busy\n", origin_addr);
+            ctx->timeout = 1;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int drain_free_cb(enum hook_type type, uintptr_t origin_addr, void *hook_mem, void *udata)
+{
+    if (type == INLINE_CHAIN) {
+        hook_chain_slots_free(hook_chain_slots((hook_chain_t *)hook_mem, HOOK_CHAIN_NUM));
+    } else if (type == FUNCTION_POINTER_CHAIN) {
+        hook_chain_slots_free(hook_chain_slots((fp_hook_chain_t *)hook_mem, FP_HOOK_CHAIN_NUM));
+    }
+    hook_mem_free(hook_mem);
+    return 0;
+}
+
+static hook_err_t drain_retired(uint64_t deadline, void *self_chain)
+{
+    // uninstalls of the caller's own open batch are still queued, their text still branches into retired memory
+    if (hook_batch_depth() || drain_keep_retired) return HOOK_NO_ERR;
+    int32_t num = hook_mem_drain_begin();
+    if (!num) return HOOK_NO_ERR;
+
+    /*
+     * Calls that entered before the count was raised, or are returning after it was dropped, are only
+     * covered by the grace period. Calls counted meanwhile need another one after they leave.
+     */
+    struct drain_ctx ctx = { deadline, 1, 0, self_chain, 0 };
+    hook_mem_for_each_draining(drain_retired_cb, &ctx);
+    while (!ctx.timeout) {
+        drain_grace_period();
+        ctx.waited = 0;
+        hook_mem_for_each_draining(drain_retired_cb, &ctx);
+        if (!ctx.waited) break;
+    }
+    if (ctx.timeout) {
+        hook_mem_drain_abort();
+        return -HOOK_BUSY;
+    }
+    hook_mem_for_each_draining(drain_free_cb, 0);
+    logkv("Hook drain: %d freed\n", num);
+    return HOOK_NO_ERR;
+}
+
+static hook_err_t __hook_drain(hook_fargs0_t *fargs)
+{
+    // every fargs starts with the chain and the counter of the call
+    struct drain_ctx ctx = { drain_deadline(), 0, 0, 0, 0 };
+    if (fargs) {
+        ctx.self_chain = fargs->chain;
+        ctx.self_idx = fargs->inflight_idx;
+    }
+    smp_mb();
+    hook_mem_for_each(drain_flip_cb, 0);
+    smp_mb();
+    hook_mem_for_each(drain_live_cb, &ctx);
+    if ((int64_t)(drain_now() - ctx.deadline) >= 0) return -HOOK_BUSY;
+    return drain_retired(ctx.deadline, ctx.self_chain);
+}
+
+hook_err_t hook_drain_from(void *fargs)
+{
+    hook_err_t err = hook_lock();
+    if (err) return err;
+    err = __hook_drain((hook_fargs0_t *)fargs);
+    hook_unlock();
+    return err;
+}
+KP_EXPORT_SYMBOL(hook_drain_from);
+
+hook_err_t hook_drain()
+{
+    return hook_drain_from(0);
+}
+KP_EXPORT_SYMBOL(hook_drain);
+
+void *hook_mem_zalloc_drain(uintptr_t origin_addr, enum hook_type type)
+{
+    void *mem = hook_mem_zalloc(origin_addr, type);
+    if (mem) return mem;
+    // live chains are not waited for here, the caller may itself be running inside one
+    if (!drain_retired(drain_deadline(), 0)) {
+        mem = hook_mem_zalloc(origin_addr, type);
+        if (mem) return mem;
+    }
+    // once booted, hook api callers already sleep on the hook lock
+    if (hook_mem_grow(drain_ready)) return 0;
+    return hook_mem_zalloc(origin_addr, type);
+}
+
+void hook_drain_init()
+{
+    kfunc_lookup_name(synchronize_rcu_tasks);
+    kfunc_lookup_name(msleep);
+    // only built with CONFIG_PREEMPTION
+    drain_keep_retired = !kf_synchronize_rcu_tasks && kallsyms_lookup_name("preempt_schedule");
+    drain_ready = 1;
+    logkd("hook drain synchronize_rcu_tasks: %llx, msleep: %llx, keep retired: %d\n", kf_synchronize_rcu_tasks,
+          kf_msleep, drain_keep_retired);
+}
@@ -4,17 +4,32 @@
  */
 
 #include "hook.h"
+#include "hmem.h"
 
 #include <stdint.h>
+#include <log.h>
+#include <pgtable.h>
+#include <kpmalloc.h>
+#include <symbol.h>
 
-static uint64_t mem_region_start = 0;
-static uint64_t mem_region_end = 0;
+// retired memory may still be executed by callers that entered before the unhook, hook_drain frees it
+#define HOOK_MEM_FREE 0
+#define HOOK_MEM_USING 1
+#define HOOK_MEM_RETIRED 2
+#define HOOK_MEM_DRAINING 3
 
-typedef struct
+// size of each region chained once the preset one is full, taken from the rox pool, or from vmalloc once it is full
+#define HOOK_MEM_GROW_SIZE (1 << 18)
+
+// buckets of origin address to chain of hook memory in use, must be a power of 2
+#define HOOK_MEM_HASH_NUM 0x100
+
+typedef struct _hook_mem_warp_t
 {
     int using;
     enum hook_type type;
     uintptr_t addr;
+    struct _hook_mem_warp_t *hash_next;
     // must align 8
     union
     {
@@ -24,24 +39,118 @@ typedef struct
     } chain __attribute__((aligned(8)));
 } hook_mem_warp_t __attribute__((aligned(16)));
 
+// a bit is set while the slot is not free, the bitmap is kept at the head of the region
+typedef struct
+{
+    uint64_t start;
+    uint64_t end;
+    uint64_t *bitmap;
+    hook_mem_warp_t *slots;
+    int32_t num;
+    int32_t words;
+} hook_mem_region_t;
+
+static hook_mem_region_t mem_regions[HOOK_MEM_REGION_NUM];
+static int32_t mem_region_num = 0;
+
+static hook_mem_warp_t *mem_hash[HOOK_MEM_HASH_NUM];
+
+static int32_t mem_used = 0;
+static int32_t mem_peak = 0;
+
+static inline int32_t mem_hash_idx(uintptr_t origin_addr)
+{
+    return ((origin_addr >> 2) ^ (origin_addr >> 12)) & (HOOK_MEM_HASH_NUM - 1);
+}
+
+static void mem_hash_add(hook_mem_warp_t *warp)
+{
+    int32_t idx = mem_hash_idx(warp->addr);
+    warp->hash_next = mem_hash[idx];
+    mem_hash[idx] = warp;
+}
+
+static void mem_hash_del(hook_mem_warp_t *warp)
+{
+    hook_mem_warp_t **pos = &mem_hash[mem_hash_idx(warp->addr)];
+    for (; *pos; pos = &(*pos)->hash_next) {
+        if (*pos != warp) continue;
+        *pos = warp->hash_next;
+        break;
+    }
+    warp->hash_next = 0;
+}
+
+static hook_mem_region_t *mem_region_of(hook_mem_warp_t *warp)
+{
+    for (int32_t i = 0; i < mem_region_num; i++) {
+        hook_mem_region_t *region = &mem_regions[i];
+        if ((uint64_t)warp >= (uint64_t)region->slots && (uint64_t)warp < region->end) return region;
+    }
+    return 0;
+}
+
 int hook_mem_add(uint64_t start, int32_t size)
 {
+    if (mem_region_num >= HOOK_MEM_REGION_NUM) return -HOOK_NO_MEM;
+
     for (uint64_t i = start; i < start + size; i += 8) {
         *(uint64_t *)i = 0;
     }
-    mem_region_start = start;
-    mem_region_end = start + size;
+
+    // the bitmap is sized for the whole region, slightly more than what is left for slots
+    int32_t words = (size / sizeof(hook_mem_warp_t) + 63) / 64;
+    uint64_t slots = (start + words * sizeof(uint64_t) + 15) & ~15ull;
+    if (slots >= start + size) return -HOOK_NO_MEM;
+
+    hook_mem_region_t *region = &mem_regions[mem_region_num];
+    region->start = start;
+    region->end = start + size;
+    region->bitmap = (uint64_t *)start;
+    region->slots = (hook_mem_warp_t *)slots;
+    region->num = (region->end - slots) / sizeof(hook_mem_warp_t);
+    region->words = words;
+    region->end = (uint64_t)(region->slots + region->num);
+    mem_region_num++;
     return 0;
 }
 
-void *hook_mem_zalloc(uintptr_t origin_addr, enum hook_type type)
+// hook memory is only reached by absolute branches, it may be anywhere
+int hook_mem_grow(int can_sleep)
+{
+    if (mem_region_num >= HOOK_MEM_REGION_NUM) return -HOOK_NO_MEM;
+    // rox memory is left writable, see prot_myself
+    void *mem = kp_memalign_exec(page_size, HOOK_MEM_GROW_SIZE);
+    int region = 0;
+    if (!mem && can_sleep) {
+        mem = kp_exec_region_alloc(HOOK_MEM_GROW_SIZE);
+        region = 1;
+    }
+    if (!mem) return -HOOK_NO_MEM;
+    int rc = hook_mem_add((uint64_t)mem, HOOK_MEM_GROW_SIZE);
+    if (rc) {
+        if (region) {
+            kp_exec_region_free(mem);
+        } else {
+            kp_free_exec(mem);
+        }
+        return rc;
+    }
+    logkv("Hook memory region %d: %llx, %llx\n", mem_region_num - 1, mem, (uint64_t)mem + HOOK_MEM_GROW_SIZE);
+    return 0;
+}
+
+static void *mem_region_zalloc(hook_mem_region_t *region, uintptr_t origin_addr, enum hook_type type)
 {
-    uint64_t start = mem_region_start;
-    for (uint64_t addr = start; addr < mem_region_end; addr += sizeof(hook_mem_warp_t)) {
-        hook_mem_warp_t *wrap = (hook_mem_warp_t *)addr;
-        if (wrap->using) continue;
+    for (int32_t w = 0; w < region->words; w++) {
+        uint64_t free = ~region->bitmap[w];
+        if (!free) continue;
+        int32_t idx = w * 64 + __builtin_ctzll(free);
+        if (idx >= region->num) return 0;
 
-        wrap->using = 1;
+        hook_mem_warp_t *wrap = &region->slots[idx];
+        region->bitmap[w] |= 1ull << (idx & 63);
+        wrap->using = HOOK_MEM_USING;
         wrap->addr = origin_addr;
         wrap->type = type;
 
@@ -53,26 +162,167 @@ void *hook_mem_zalloc(uintptr_t origin_addr, enum hook_type type)
         if (((uintptr_t)&wrap->chain) & 0b111) {
             return 0;
         }
+        mem_hash_add(wrap);
+        if (++mem_used > mem_peak) mem_peak = mem_used;
         return &wrap->chain;
     }
     return 0;
 }
 
+void *hook_mem_zalloc(uintptr_t origin_addr, enum hook_type type)
+{
+    for (int32_t i = 0; i < mem_region_num; i++) {
+        void *mem = mem_region_zalloc(&mem_regions[i], origin_addr, type);
+        if (mem) return mem;
+    }
+    return 0;
+}
+
 void hook_mem_free(void *hook_mem)
 {
     hook_mem_warp_t *warp = local_container_of(hook_mem, hook_mem_warp_t, chain);
-    warp->using = 0;
+    if (warp->using == HOOK_MEM_USING) {
+        mem_hash_del(warp);
+        mem_used--;
+    }
+    warp->using = HOOK_MEM_FREE;
+    hook_mem_region_t *region = mem_region_of(warp);
+    if (!region) return;
+    int32_t idx = warp - region->slots;
+    region->bitmap[idx / 64] &= ~(1ull << (idx & 63));
 }
 
-void *hook_get_mem_from_origin(uint64_t origin_addr)
+void hook_mem_retire(void *hook_mem)
 {
-    uint64_t start = mem_region_start;
+    hook_mem_warp_t *warp = local_container_of(hook_mem, hook_mem_warp_t, chain);
+    if (warp->using == HOOK_MEM_USING) {
+        mem_hash_del(warp);
+        mem_used--;
+    }
+    warp->using = HOOK_MEM_RETIRED;
+}
 
-    for (uint64_t addr = start; addr < mem_region_end; addr += sizeof(hook_mem_warp_t)) {
-        hook_mem_warp_t *wrap = (hook_mem_warp_t *)addr;
-        if (wrap->using && wrap->addr == origin_addr) {
+// a queued uninstall failed and text still branches here, found by origin again unless it was hooked anew
+void hook_mem_unretire(void *hook_mem)
+{
+    hook_mem_warp_t *warp = local_container_of(hook_mem, hook_mem_warp_t, chain);
+    if (warp->using != HOOK_MEM_RETIRED) return;
+    warp->using = HOOK_MEM_USING;
+    if (!hook_get_mem_from_origin(warp->addr)) mem_hash_add(warp);
+    if (++mem_used > mem_peak) mem_peak = mem_used;
+}
+
+// calls fn on every slot not free, stops when fn returns nonzero
+static int mem_for_each_slot(int (*fn)(hook_mem_warp_t *wrap, void *udata), void *udata)
+{
+    for (int32_t i = 0; i < mem_region_num; i++) {
+        hook_mem_region_t *region = &mem_regions[i];
+        for (int32_t w = 0; w < region->words; w++) {
+            for (uint64_t bits = region->bitmap[w]; bits; bits &= bits - 1) {
+                int32_t idx = w * 64 + __builtin_ctzll(bits);
+                if (idx >= region->num) break;
+                if (fn(&region->slots[idx], udata)) return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+struct mem_move_ctx
+{
+    int from;
+    int to;
+    int32_t num;
+};
+
+static int mem_move_cb(hook_mem_warp_t *wrap, void *udata)
+{
+    struct mem_move_ctx *ctx = (struct mem_move_ctx *)udata;
+    if (wrap->using != ctx->from) return 0;
+    wrap->using = ctx->to;
+    ctx->num++;
+    return 0;
+}
+
+static int32_t hook_mem_move(int from, int to)
+{
+    struct mem_move_ctx ctx = { from, to, 0 };
+    mem_for_each_slot(mem_move_cb, &ctx);
+    return ctx.num;
+}
+
+int32_t hook_mem_drain_begin()
+{
+    return hook_mem_move(HOOK_MEM_RETIRED, HOOK_MEM_DRAINING);
+}
+
+void hook_mem_drain_abort()
+{
+    hook_mem_move(HOOK_MEM_DRAINING, HOOK_MEM_RETIRED);
+}
+
+void *hook_get_mem_from_origin(uint64_t origin_addr)
+{
+    for (hook_mem_warp_t *wrap = mem_hash[mem_hash_idx(origin_addr)]; wrap; wrap = wrap->hash_next) {
+        if (wrap->using == HOOK_MEM_USING && wrap->addr == origin_addr) {
             return &wrap->chain;
         }
     }
     return 0;
 }
+
+struct mem_each_ctx
+{
+    int using;
+    hook_mem_each_fn fn;
+    void *udata;
+};
+
+static int mem_each_cb(hook_mem_warp_t *wrap, void *udata)
+{
+    struct mem_each_ctx *ctx = (struct mem_each_ctx *)udata;
+    if (wrap->using != ctx->using) return 0;
+    return ctx->fn(wrap->type, wrap->addr, &wrap->chain, ctx->udata);
+}
+
+static void hook_mem_for_each_state(int using, hook_mem_each_fn fn, void *udata)
+{
+    struct mem_each_ctx ctx = { using, fn, udata };
+    mem_for_each_slot(mem_each_cb, &ctx);
+}
+
+void hook_mem_for_each(hook_mem_each_fn fn, void *udata)
+{
+    hook_mem_for_each_state(HOOK_MEM_USING, fn, udata);
+}
+
+void hook_mem_for_each_draining(hook_mem_each_fn fn, void *udata)
+{
+    hook_mem_for_each_state(HOOK_MEM_DRAINING, fn, udata);
+}
+
+static int mem_retired_cb(hook_mem_warp_t *wrap, void *udata)
+{
+    if (wrap->using != HOOK_MEM_USING) (*(int32_t *)udata)++;
+    return 0;
+}
+
+void hook_mem_stat(hook_mem_stat_t *stat)
+{
+    if (hook_lock()) {
+        *stat = (hook_mem_stat_t){ 0 };
+        return;
+    }
+    stat->regions = mem_region_num;
+    stat->slot_size = sizeof(hook_mem_warp_t);
+    stat->slots = 0;
+    for (int32_t i = 0; i < mem_region_num; i++) {
+        stat->slots += mem_regions[i].num;
+    }
+    stat->used = mem_used;
+    stat->peak = mem_peak;
+    stat->retired = 0;
+    mem_for_each_slot(mem_retired_cb, &stat->retired);
+    hook_unlock();
+}
+KP_EXPORT_SYMBOL(hook_mem_stat);
@@ -9,8 +9,27 @@
 #include <stdint.h>
 
 int hook_mem_add(uint64_t start, int32_t size);
+int hook_mem_grow(int can_sleep);
 void *hook_mem_zalloc(uintptr_t origin_addr, enum hook_type type);
 void hook_mem_free(void *hook_mem);
 void *hook_get_mem_from_origin(uint64_t origin_addr);
+typedef int (*hook_mem_each_fn)(enum hook_type type, uintptr_t origin_addr, void *hook_mem, void *udata);
+
+void hook_mem_for_each(hook_mem_each_fn fn, void *udata);
+
+void hook_mem_retire(void *hook_mem);
+void hook_mem_unretire(void *hook_mem);
+int32_t hook_mem_drain_begin();
+void hook_mem_drain_abort();
+void hook_mem_for_each_draining(hook_mem_each_fn fn, void *udata);
+
+// hook.c, serializes every writer of hook text, memory and callbacks, taken again by the same task
+hook_err_t hook_lock();
+void hook_unlock();
+
+// hdrain.c
+void *hook_mem_zalloc_drain(uintptr_t origin_addr, enum hook_type type);
+void hook_relax();
+hook_err_t hook_may_sleep();
 
 #endif
\ No newline at end of file
@@ -4,12 +4,16 @@
  */
 
 #include <hook.h>
+#include <hotpatch.h>
 #include <cache.h>
 #include <pgtable.h>
 #include <kpmalloc.h>
 #include <io.h>
 #include <symbol.h>
+#include <asm/current.h>
+#include <uapi/asm-generic/errno.h>
 #include "hmem.h"
+#include "hchain.h"
 
 #define bits32(n, high, low) ((uint32_t)((n) << (31u - (high))) >> (31u - (high) + (low)))
 #define bit(n, st) (((n) >> (st)) & 1)
@@ -58,19 +62,6 @@ typedef uint32_t inst_mask_t;
 #define MASK_HINT 0xFFFFF01F
 #define MASK_IGNORE 0x0
 
-static inst_mask_t masks[] = {
-    MASK_B,      MASK_BC,        MASK_BL,       MASK_ADR,         MASK_ADRP,        MASK_LDR_32,
-    MASK_LDR_64, MASK_LDRSW_LIT, MASK_PRFM_LIT, MASK_LDR_SIMD_32, MASK_LDR_SIMD_64, MASK_LDR_SIMD_128,
-    MASK_CBZ,    MASK_CBNZ,      MASK_TBZ,      MASK_TBNZ,        MASK_IGNORE,
-};
-static inst_type_t types[] = {
-    INST_B,      INST_BC,        INST_BL,       INST_ADR,         INST_ADRP,        INST_LDR_32,
-    INST_LDR_64, INST_LDRSW_LIT, INST_PRFM_LIT, INST_LDR_SIMD_32, INST_LDR_SIMD_64, INST_LDR_SIMD_128,
-    INST_CBZ,    INST_CBNZ,      INST_TBZ,      INST_TBNZ,        INST_IGNORE,
-};
-
-static int32_t relo_len[] = { 6, 8, 8, 4, 4, 6, 6, 6, 8, 8, 8, 8, 6, 6, 6, 6, 2 };
-
 // static uint64_t sign_extend(uint64_t x, uint32_t len)
 // {
 //     char sign_bit = bit(x, len - 1);
@@ -89,25 +80,6 @@ static int is_in_tramp(hook_t *hook, uint64_t addr)
     return 0;
 }
 
-static uint64_t relo_in_tramp(hook_t *hook, uint64_t addr)
-{
-    uint64_t tramp_start = hook->origin_addr;
-    uint64_t tramp_end = tramp_start + hook->tramp_insts_num * 4;
-    if (!(addr >= tramp_start && addr < tramp_end)) return addr;
-    uint32_t addr_inst_index = (addr - tramp_start) / 4;
-    uint64_t fix_addr = hook->relo_addr;
-    for (int i = 0; i < addr_inst_index; i++) {
-        inst_type_t inst = hook->origin_insts[i];
-        for (int j = 0; j < sizeof(relo_len) / sizeof(relo_len[0]); j++) {
-            if ((inst & masks[j]) == types[j]) {
-                fix_addr += relo_len[j] * 4;
-                break;
-            }
-        }
-    }
-    return fix_addr;
-}
-
 #ifdef HOOK_INTO_BRANCH_FUNC
 
 static uint64_t branch_func_addr_once(uint64_t addr)
@@ -138,153 +110,320 @@ uint64_t branch_func_addr(uint64_t addr)
 
 #endif
 
-static __noinline hook_err_t relo_b(hook_t *hook, uint64_t inst_addr, uint32_t inst, inst_type_t type)
+#define MASK_LDR_LIT 0x3B000000
+#define INST_LDR_LIT 0x18000000
+
+#define INST_LDR_X17 0x58000011
+#define INST_RET_X17 0xD65F0220
+#define INST_ADR_X30 0x1000001E
+#define INST_ADD_IMM 0x91000000
+#define INST_LDR_32_IMM 0xB9400000
+#define INST_LDR_64_IMM 0xF9400000
+#define INST_LDRSW_IMM 0xB9800000
+#define INST_STUR_X17_SP 0xF81F83F1 // STUR X17, [SP, #-0x8]
+#define INST_LDUR_X17_SP 0xF85F83F1 // LDUR X17, [SP, #-0x8]
+
+/*
+ * Decode tree over op0, bits 28:25, only the encoding groups holding pc-relative instructions are looked into,
+ * everything else is copied as is.
+ */
+static inst_type_t relo_classify(uint32_t inst)
 {
-    uint32_t *buf = hook->relo_insts + hook->relo_insts_num;
-    uint64_t imm64;
-    if (type == INST_BC) {
-        uint64_t imm19 = bits32(inst, 23, 5);
-        imm64 = sign64_extend(imm19 << 2u, 21u);
-    } else {
-        uint64_t imm26 = bits32(inst, 25, 0);
-        imm64 = sign64_extend(imm26 << 2u, 28u);
-    }
-    uint64_t addr = inst_addr + imm64;
-    addr = relo_in_tramp(hook, addr);
-
-    uint32_t idx = 0;
-    if (type == INST_BC) {
-        buf[idx++] = (inst & 0xFF00001F) | 0x40u; // B.<cond> #8
-        buf[idx++] = 0x14000006; // B #24
-    }
-    buf[idx++] = 0x58000051; // LDR X17, #8
-    buf[idx++] = 0x14000003; // B #12
-    buf[idx++] = addr & 0xFFFFFFFF;
-    buf[idx++] = addr >> 32u;
-    if (type == INST_BL) {
-        buf[idx++] = 0x1000001E; // ADR X30, .
-        buf[idx++] = 0x910033DE; // ADD X30, X30, #12
-        buf[idx++] = 0xD65F0220; // RET X17
-    } else {
-        buf[idx++] = 0xD65F0220; // RET X17
+    switch (bits32(inst, 28, 25)) {
+    case 0x8:
+    case 0x9:
+        // data processing, immediate
+        if ((inst & MASK_ADR) == INST_ADR) return INST_ADR;
+        if ((inst & MASK_ADRP) == INST_ADRP) return INST_ADRP;
+        break;
+    case 0xA:
+    case 0xB:
+        // branches, exception generating and system instructions
+        if ((inst & MASK_B) == INST_B) return INST_B;
+        if ((inst & MASK_BL) == INST_BL) return INST_BL;
+        if ((inst & MASK_BC) == INST_BC) return INST_BC;
+        if ((inst & MASK_CBZ) == INST_CBZ) return INST_CBZ;
+        if ((inst & MASK_CBNZ) == INST_CBNZ) return INST_CBNZ;
+        if ((inst & MASK_TBZ) == INST_TBZ) return INST_TBZ;
+        if ((inst & MASK_TBNZ) == INST_TBNZ) return INST_TBNZ;
+        break;
+    case 0xC:
+    case 0xE:
+        // loads and stores, load register (literal)
+        if ((inst & MASK_LDR_LIT) != INST_LDR_LIT) break;
+        switch (inst & MASK_LDR_64) {
+        case INST_LDR_32:
+        case INST_LDR_64:
+        case INST_LDRSW_LIT:
+        case INST_PRFM_LIT:
+        case INST_LDR_SIMD_32:
+        case INST_LDR_SIMD_64:
+        case INST_LDR_SIMD_128:
+            return inst & MASK_LDR_64;
+        }
+        break;
     }
-    buf[idx++] = ARM64_NOP;
-    return HOOK_NO_ERR;
+    return INST_IGNORE;
 }
 
-static __noinline hook_err_t relo_adr(hook_t *hook, uint64_t inst_addr, uint32_t inst, inst_type_t type)
+static uint64_t relo_target(uint64_t inst_addr, uint32_t inst, inst_type_t type)
 {
-    uint32_t *buf = hook->relo_insts + hook->relo_insts_num;
+    uint64_t imm;
+    switch (type) {
+    case INST_B:
+    case INST_BL:
+        imm = bits32(inst, 25, 0);
+        return inst_addr + sign64_extend(imm << 2u, 28u);
+    case INST_ADR:
+        imm = ((uint64_t)bits32(inst, 23, 5) << 2u) | bits32(inst, 30, 29);
+        return inst_addr + sign64_extend(imm, 21u);
+    case INST_ADRP:
+        imm = ((uint64_t)bits32(inst, 23, 5) << 14u) | ((uint64_t)bits32(inst, 30, 29) << 12u);
+        return (inst_addr + sign64_extend(imm, 33u)) & 0xFFFFFFFFFFFFF000;
+    case INST_TBZ:
+    case INST_TBNZ:
+        imm = bits32(inst, 18, 5);
+        return inst_addr + sign64_extend(imm << 2u, 16u);
+    case INST_IGNORE:
+        return 0;
+    default:
+        // B.<cond>, CB(N)Z and load literal
+        imm = bits32(inst, 23, 5);
+        return inst_addr + sign64_extend(imm << 2u, 21u);
+    }
+}
 
-    uint32_t xd = bits32(inst, 4, 0);
-    uint64_t immlo = bits32(inst, 30, 29);
-    uint64_t immhi = bits32(inst, 23, 5);
-    uint64_t addr;
+// branch offset to addr fits a signed word offset of bits
+static int relo_fits(uint64_t pc, uint64_t addr, int32_t bits)
+{
+    int64_t off = (int64_t)(addr - pc);
+    int64_t range = 1ll << (bits + 1);
+    return off >= -range && off < range;
+}
 
-    if (type == INST_ADR) {
-        addr = inst_addr + sign64_extend((immhi << 2u) | immlo, 21u);
-    } else {
-        addr = (inst_addr + sign64_extend((immhi << 14u) | (immlo << 12u), 33u)) & 0xFFFFFFFFFFFFF000;
-        if (is_in_tramp(hook, addr)) return -HOOK_BAD_RELO;
+static uint32_t relo_imm(uint64_t pc, uint64_t addr, int32_t bits)
+{
+    return (uint32_t)((addr - pc) >> 2u) & ((1u << bits) - 1);
+}
+
+static int relo_adr_fits(int64_t off)
+{
+    return off >= -(1ll << 20) && off < (1ll << 20);
+}
+
+static uint32_t relo_adr_imm(int64_t off)
+{
+    return ((uint32_t)(off & 0x3) << 29u) | (((uint32_t)(off >> 2u) & 0x7FFFF) << 5u);
+}
+
+static int64_t relo_page_off(uint64_t pc, uint64_t addr)
+{
+    return (int64_t)((addr >> 12u) - (pc >> 12u));
+}
+
+/*
+ * Emitters size and encode in the same pass, buf is null when only sizing.
+ * Literals are kept 8 byte aligned after the code that loads them, a nop is padded when needed.
+ */
+#define relo_put(x)                  \
+    do {                             \
+        if (buf) buf[n] = (x);       \
+        n++;                         \
+    } while (0)
+
+static int32_t relo_lit_index(uint64_t pc, int32_t n)
+{
+    return ((pc + n * 4) & 0x7) ? n + 1 : n;
+}
+
+static int32_t relo_put_lit(uint32_t *buf, int32_t n, int32_t lit, uint64_t addr)
+{
+    if (n < lit) relo_put(ARM64_NOP);
+    relo_put(addr & 0xFFFFFFFF);
+    relo_put(addr >> 32u);
+    return n;
+}
+
+static int32_t relo_branch(uint32_t *buf, uint64_t pc, uint64_t addr, int link)
+{
+    int32_t n = 0;
+    if (relo_fits(pc, addr, 26)) {
+        relo_put((link ? INST_BL : INST_B) | relo_imm(pc, addr, 26));
+        return n;
     }
-    buf[0] = 0x58000040u | xd; // LDR Xd, #8
-    buf[1] = 0x14000003; // B #12
-    buf[2] = addr & 0xFFFFFFFF;
-    buf[3] = addr >> 32u;
-    return HOOK_NO_ERR;
+    int32_t lit = relo_lit_index(pc, link ? 3 : 2);
+    relo_put(INST_LDR_X17 | (lit << 5u)); // LDR X17, lit
+    if (link) relo_put(INST_ADR_X30 | ((lit + 1) << 5u)); // ADR X30, after lit
+    relo_put(INST_RET_X17); // RET X17
+    return relo_put_lit(buf, n, lit, addr);
 }
 
-static __noinline hook_err_t relo_ldr(hook_t *hook, uint64_t inst_addr, uint32_t inst, inst_type_t type)
+static __noinline int32_t relo_b(uint32_t *buf, uint64_t pc, uint32_t inst, inst_type_t type, uint64_t addr,
+                                 int in_tramp)
 {
-    uint32_t *buf = hook->relo_insts + hook->relo_insts_num;
+    int32_t n = 0;
+    int link = type == INST_BL;
+    // relocated targets are within relo_insts, always in range
+    if (in_tramp) {
+        relo_put((link ? INST_BL : INST_B) | relo_imm(pc, addr, 26));
+        return n;
+    }
+    return relo_branch(buf, pc, addr, link);
+}
 
-    uint32_t rt = bits32(inst, 4, 0);
-    uint64_t imm19 = bits32(inst, 23, 5);
-    uint64_t offset = sign64_extend((imm19 << 2u), 21u);
-    uint64_t addr = inst_addr + offset;
+static __noinline int32_t relo_cond(uint32_t *buf, uint64_t pc, uint32_t inst, inst_type_t type, uint64_t addr,
+                                    int in_tramp)
+{
+    int32_t n = 0;
+    int32_t bits = 19;
+    uint32_t keep = 0xFF00001F;
+    if (type == INST_TBZ || type == INST_TBNZ) {
+        bits = 14;
+        keep = 0xFFF8001F;
+    }
+    if (in_tramp || relo_fits(pc, addr, bits)) {
+        relo_put((inst & keep) | (relo_imm(pc, addr, bits) << 5u));
+        return n;
+    }
+    relo_put((inst & keep) | (2u << 5u)); // B.<cond> / CB(N)Z / TB(N)Z #8
+    if (relo_fits(pc + 8, addr, 26)) {
+        relo_put(INST_B | 2u); // B #8
+        relo_put(INST_B | relo_imm(pc + 8, addr, 26));
+        return n;
+    }
+    int32_t lit = relo_lit_index(pc, 4);
+    relo_put(INST_B | (lit + 1)); // B after lit
+    relo_put(INST_LDR_X17 | ((lit - 2) << 5u)); // LDR X17, lit
+    relo_put(INST_RET_X17); // RET X17
+    return relo_put_lit(buf, n, lit, addr);
+}
 
-    if (is_in_tramp(hook, addr) && type != INST_PRFM_LIT) return -HOOK_BAD_RELO;
+static __noinline int32_t relo_adr(uint32_t *buf, uint64_t pc, uint32_t inst, inst_type_t type, uint64_t addr)
+{
+    int32_t n = 0;
+    uint32_t xd = bits32(inst, 4, 0);
+    if (type == INST_ADR && relo_adr_fits(addr - pc)) {
+        relo_put(INST_ADR | xd | relo_adr_imm(addr - pc));
+        return n;
+    }
+    if (relo_adr_fits(relo_page_off(pc, addr))) {
+        relo_put(INST_ADRP | xd | relo_adr_imm(relo_page_off(pc, addr)));
+        if (addr & 0xFFF) relo_put(INST_ADD_IMM | ((addr & 0xFFF) << 10u) | (xd << 5u) | xd); // ADD Xd, Xd, #lo12
+        return n;
+    }
+    int32_t lit = relo_lit_index(pc, 2);
+    relo_put(0x58000000u | (lit << 5u) | xd); // LDR Xd, lit
+    relo_put(INST_B | (lit + 1)); // B after lit
+    return relo_put_lit(buf, n, lit, addr);
+}
 
-    addr = relo_in_tramp(hook, addr);
+static __noinline int32_t relo_ldr(uint32_t *buf, uint64_t pc, uint32_t inst, inst_type_t type, uint64_t addr,
+                                   int in_tramp)
+{
+    int32_t n = 0;
+    uint32_t rt = bits32(inst, 4, 0);
+    int gpr = type == INST_LDR_32 || type == INST_LDR_64 || type == INST_LDRSW_LIT;
 
-    if (type == INST_LDR_32 || type == INST_LDR_64 || type == INST_LDRSW_LIT) {
-        buf[0] = 0x58000060u | rt; // LDR Xt, #12
-        if (type == INST_LDR_32) {
-            buf[1] = 0xB9400000 | rt | (rt << 5u); // LDR Wt, [Xt]
-        } else if (type == INST_LDR_64) {
-            buf[1] = 0xF9400000 | rt | (rt << 5u); // LDR Xt, [Xt]
-        } else {
-            // LDRSW_LIT
-            buf[1] = 0xB9800000 | rt | (rt << 5u); // LDRSW Xt, [Xt]
-        }
-        buf[2] = 0x14000004; // B #16
-        buf[3] = ARM64_NOP;
-        buf[4] = addr & 0xFFFFFFFF;
-        buf[5] = addr >> 32u;
+    if (in_tramp || relo_fits(pc, addr, 19)) {
+        relo_put((inst & 0xFF00001F) | (relo_imm(pc, addr, 19) << 5u));
+        return n;
+    }
+
+    uint32_t load; // load through [Xn], scaled offset fields are filled in below
+    int32_t scale;
+    if (type == INST_LDR_32) {
+        load = INST_LDR_32_IMM, scale = 4;
+    } else if (type == INST_LDR_64) {
+        load = INST_LDR_64_IMM, scale = 8;
+    } else if (type == INST_LDRSW_LIT) {
+        load = INST_LDRSW_IMM, scale = 4;
+    } else if (type == INST_PRFM_LIT) {
+        load = 0xF9800000, scale = 8; // PRFM
+    } else if (type == INST_LDR_SIMD_32) {
+        load = 0xBD400000, scale = 4; // LDR St
+    } else if (type == INST_LDR_SIMD_64) {
+        load = 0xFD400000, scale = 8; // LDR Dt
     } else {
-        buf[0] = 0xA93F47F0; // STP X16, X17, [SP, -0x10]
-        buf[1] = 0x58000091; // LDR X17, #16
-        if (type == INST_PRFM_LIT) {
-            buf[2] = 0xF9800220 | rt; // PRFM Rt, [X17]
-        } else if (type == INST_LDR_SIMD_32) {
-            buf[2] = 0xBD400220 | rt; // LDR St, [X17]
-        } else if (type == INST_LDR_SIMD_64) {
-            buf[2] = 0xFD400220 | rt; // LDR Dt, [X17]
+        load = 0x3DC00000u, scale = 16; // LDR Qt
+    }
+    // gprs load through their own destination, others borrow X17
+    uint32_t xn = gpr ? rt : 17;
+    int64_t page_off = relo_page_off(pc, addr);
+
+    if (!gpr) relo_put(INST_STUR_X17_SP);
+    if (relo_adr_fits(page_off)) {
+        uint32_t lo12 = addr & 0xFFF;
+        relo_put(INST_ADRP | xn | relo_adr_imm(page_off)); // ADRP Xn, addr
+        if (lo12 % scale) {
+            relo_put(INST_ADD_IMM | (lo12 << 10u) | (xn << 5u) | xn); // ADD Xn, Xn, #lo12
+            relo_put(load | (xn << 5u) | rt);
         } else {
-            // LDR_SIMD_128
-            buf[2] = 0x3DC00220u | rt; // LDR Qt, [X17]
+            relo_put(load | ((lo12 / scale) << 10u) | (xn << 5u) | rt);
         }
-        buf[3] = 0xF85F83F1; // LDR X17, [SP, -0x8]
-        buf[4] = 0x14000004; // B #16
-        buf[5] = ARM64_NOP;
-        buf[6] = addr & 0xFFFFFFFF;
-        buf[7] = addr >> 32u;
+        if (!gpr) relo_put(INST_LDUR_X17_SP);
+        return n;
     }
-    return HOOK_NO_ERR;
+    int32_t lit = relo_lit_index(pc, gpr ? 3 : 5);
+    relo_put(0x58000000u | ((lit - n) << 5u) | xn); // LDR Xn, lit
+    relo_put(load | (xn << 5u) | rt);
+    if (!gpr) relo_put(INST_LDUR_X17_SP);
+    relo_put(INST_B | (lit + 2 - n)); // B after lit
+    return relo_put_lit(buf, n, lit, addr);
 }
 
-static __noinline hook_err_t relo_cb(hook_t *hook, uint64_t inst_addr, uint32_t inst, inst_type_t type)
+static __noinline int32_t relo_ignore(uint32_t *buf, uint32_t inst)
 {
-    uint32_t *buf = hook->relo_insts + hook->relo_insts_num;
-
-    uint64_t imm19 = bits32(inst, 23, 5);
-    uint64_t offset = sign64_extend((imm19 << 2u), 21u);
-    uint64_t addr = inst_addr + offset;
-    addr = relo_in_tramp(hook, addr);
-
-    buf[0] = (inst & 0xFF00001F) | 0x40u; // CB(N)Z Rt, #8
-    buf[1] = 0x14000005; // B #20
-    buf[2] = 0x58000051; // LDR X17, #8
-    buf[3] = 0xD65F0220; // RET X17
-    buf[4] = addr & 0xFFFFFFFF;
-    buf[5] = addr >> 32u;
-    return HOOK_NO_ERR;
+    int32_t n = 0;
+    relo_put(inst);
+    return n;
 }
 
-static __noinline hook_err_t relo_tb(hook_t *hook, uint64_t inst_addr, uint32_t inst, inst_type_t type)
+static uint64_t relo_in_tramp(hook_t *hook, uint64_t addr);
+
+// returns the number of instructions emitted at pc, buf is null when only sizing
+static int32_t relo_inst(hook_t *hook, uint64_t inst_addr, uint32_t inst, uint64_t pc, uint32_t *buf)
 {
-    uint32_t *buf = hook->relo_insts + hook->relo_insts_num;
+    inst_type_t type = relo_classify(inst);
+    uint64_t addr = relo_target(inst_addr, inst, type);
+    int in_tramp = type != INST_IGNORE && is_in_tramp(hook, addr);
 
-    uint64_t imm14 = bits32(inst, 18, 5);
-    uint64_t offset = sign64_extend((imm14 << 2u), 16u);
-    uint64_t addr = inst_addr + offset;
-    addr = relo_in_tramp(hook, addr);
-
-    buf[0] = (inst & 0xFFF8001F) | 0x40u; // TB(N)Z Rt, #<imm>, #8
-    buf[1] = 0x14000005; // B #20
-    buf[2] = 0x58000051; // LDR X17, #8
-    buf[3] = 0xd61f0220; // RET X17
-    buf[4] = addr & 0xFFFFFFFF;
-    buf[5] = addr >> 32u;
-    return HOOK_NO_ERR;
+    switch (type) {
+    case INST_B:
+    case INST_BL:
+    case INST_BC:
+    case INST_CBZ:
+    case INST_CBNZ:
+    case INST_TBZ:
+    case INST_TBNZ:
+        if (in_tramp && buf) addr = relo_in_tramp(hook, addr);
+        if (type == INST_B || type == INST_BL) return relo_b(buf, pc, inst, type, addr, in_tramp);
+        return relo_cond(buf, pc, inst, type, addr, in_tramp);
+    case INST_ADR:
+        // the address itself is taken, no code runs from there
+        return relo_adr(buf, pc, inst, type, addr);
+    case INST_ADRP:
+        if (in_tramp) return -HOOK_BAD_RELO;
+        return relo_adr(buf, pc, inst, type, addr);
+    case INST_IGNORE:
+        return relo_ignore(buf, inst);
+    default:
+        if (in_tramp && type != INST_PRFM_LIT) return -HOOK_BAD_RELO;
+        if (in_tramp && buf) addr = relo_in_tramp(hook, addr);
+        return relo_ldr(buf, pc, inst, type, addr, in_tramp);
+    }
 }
 
-static __noinline hook_err_t relo_ignore(hook_t *hook, uint64_t inst_addr, uint32_t inst, inst_type_t type)
+static uint64_t relo_in_tramp(hook_t *hook, uint64_t addr)
 {
-    uint32_t *buf = hook->relo_insts + hook->relo_insts_num;
-    buf[0] = inst;
-    buf[1] = ARM64_NOP;
-    return HOOK_NO_ERR;
+    if (!is_in_tramp(hook, addr)) return addr;
+    uint32_t addr_inst_index = (addr - hook->origin_addr) / 4;
+    uint64_t fix_addr = hook->relo_addr;
+    for (int i = 0; i < addr_inst_index; i++) {
+        int32_t len = relo_inst(hook, hook->origin_addr + i * 4, hook->origin_insts[i], fix_addr, 0);
+        if (len < 0) break;
+        fix_addr += len * 4;
+    }
+    return fix_addr;
 }
 
 static uint32_t can_b_rel(uint64_t src_addr, uint64_t dst_addr)
@@ -339,52 +478,47 @@ int32_t branch_from_to(uint32_t *tramp_buf, uint64_t src_addr, uint64_t dst_addr
 #endif
 }
 
+// entries in transit.S, each passes the chain of the stub to its body below
+uint64_t _transit0();
+uint64_t _transit4();
+uint64_t _transit8();
+uint64_t _transit12();
+uint64_t _transit_ret();
+uint64_t _transit_one();
+
 // transit0
 typedef uint64_t (*transit0_func_t)();
 
-uint64_t __attribute__((section(".transit0.text"))) __attribute__((__noinline__)) _transit0()
+uint64_t __attribute__((section(".transit0.text"))) __attribute__((__noinline__)) _transit0_body(void *chain)
 {
-    uint64_t this_va;
-    asm volatile("adr %0, ." : "=r"(this_va));
-    uint32_t *vptr = (uint32_t *)this_va;
-    while (*--vptr != ARM64_NOP) {
-    };
-    vptr--;
-    hook_chain_t *hook_chain = local_container_of((uint64_t)vptr, hook_chain_t, transit);
+    hook_chain_t *hook_chain = (hook_chain_t *)chain;
     hook_fargs0_t fargs;
     fargs.skip_origin = 0;
     fargs.chain = hook_chain;
-    for (int32_t i = 0; i < hook_chain->chain_items_max; i++) {
-        if (hook_chain->states[i] != CHAIN_ITEM_STATE_READY) continue;
-        hook_chain0_callback func = hook_chain->befores[i];
-        if (func) func(&fargs, hook_chain->udata[i]);
-    }
+    hook_chain_enter(hook_chain);
+    fargs.inflight_idx = __inflight_idx;
+    hook_chain_stats_begin(hook_chain);
+    hook_chain_call_befores(hook_chain, hook_chain0_callback, &fargs);
+    hook_chain_stats_befores_done();
     if (!fargs.skip_origin) {
         transit0_func_t origin_func = (transit0_func_t)hook_chain->hook.relo_addr;
         fargs.ret = origin_func();
     }
-    for (int32_t i = hook_chain->chain_items_max - 1; i >= 0; i--) {
-        if (hook_chain->states[i] != CHAIN_ITEM_STATE_READY) continue;
-        hook_chain0_callback func = hook_chain->afters[i];
-        if (func) func(&fargs, hook_chain->udata[i]);
-    }
+    hook_chain_stats_origin_done();
+    hook_chain_call_afters(hook_chain, hook_chain0_callback, &fargs);
+    hook_chain_call_rets(hook_chain, fargs.ret, 0, 0, 0, 0);
+    hook_chain_stats_end(&fargs);
+    hook_chain_exit(hook_chain);
     return fargs.ret;
 }
-extern void _transit0_end();
 
 // transit4
 typedef uint64_t (*transit4_func_t)(uint64_t, uint64_t, uint64_t, uint64_t);
 
 uint64_t __attribute__((section(".transit4.text"))) __attribute__((__noinline__))
-_transit4(uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3)
-{
-    uint64_t this_va;
-    asm volatile("adr %0, ." : "=r"(this_va));
-    uint32_t *vptr = (uint32_t *)this_va;
-    while (*--vptr != ARM64_NOP) {
-    };
-    vptr--;
-    hook_chain_t *hook_chain = local_container_of((uint64_t)vptr, hook_chain_t, transit);
+_transit4_body(uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3, void *chain)
+{
+    hook_chain_t *hook_chain = (hook_chain_t *)chain;
     hook_fargs4_t fargs;
     fargs.skip_origin = 0;
     fargs.arg0 = arg0;
@@ -392,39 +526,32 @@ _transit4(uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3)
     fargs.arg2 = arg2;
     fargs.arg3 = arg3;
     fargs.chain = hook_chain;
-    for (int32_t i = 0; i < hook_chain->chain_items_max; i++) {
-        if (hook_chain->states[i] != CHAIN_ITEM_STATE_READY) continue;
-        hook_chain4_callback func = hook_chain->befores[i];
-        if (func) func(&fargs, hook_chain->udata[i]);
-    }
+    hook_chain_enter(hook_chain);
+    fargs.inflight_idx = __inflight_idx;
+    hook_chain_stats_begin(hook_chain);
+    hook_chain_call_befores(hook_chain, hook_chain4_callback, &fargs);
+    hook_chain_stats_befores_done();
     if (!fargs.skip_origin) {
         transit4_func_t origin_func = (transit4_func_t)hook_chain->hook.relo_addr;
         fargs.ret = origin_func(fargs.arg0, fargs.arg1, fargs.arg2, fargs.arg3);
     }
-    for (int32_t i = hook_chain->chain_items_max - 1; i >= 0; i--) {
-        if (hook_chain->states[i] != CHAIN_ITEM_STATE_READY) continue;
-        hook_chain4_callback func = hook_chain->afters[i];
-        if (func) func(&fargs, hook_chain->udata[i]);
-    }
+    hook_chain_stats_origin_done();
+    hook_chain_call_afters(hook_chain, hook_chain4_callback, &fargs);
+    hook_chain_call_rets(hook_chain, fargs.ret, fargs.arg0, fargs.arg1, fargs.arg2, fargs.arg3);
+    hook_chain_stats_end(&fargs);
+    hook_chain_exit(hook_chain);
     return fargs.ret;
 }
 
-extern void _transit4_end();
 
 // transit8:
 typedef uint64_t (*transit8_func_t)(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t);
 
 uint64_t __attribute__((section(".transit8.text"))) __attribute__((__noinline__))
-_transit8(uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5, uint64_t arg6,
-          uint64_t arg7)
-{
-    uint64_t this_va;
-    asm volatile("adr %0, ." : "=r"(this_va));
-    uint32_t *vptr = (uint32_t *)this_va;
-    while (*--vptr != ARM64_NOP) {
-    };
-    vptr--;
-    hook_chain_t *hook_chain = local_container_of((uint64_t)vptr, hook_chain_t, transit);
+_transit8_body(uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5, uint64_t arg6,
+               uint64_t arg7, void *chain)
+{
+    hook_chain_t *hook_chain = (hook_chain_t *)chain;
     hook_fargs8_t fargs;
     fargs.skip_origin = 0;
     fargs.arg0 = arg0;
@@ -436,41 +563,34 @@ _transit8(uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t a
     fargs.arg6 = arg6;
     fargs.arg7 = arg7;
     fargs.chain = hook_chain;
-    for (int32_t i = 0; i < hook_chain->chain_items_max; i++) {
-        if (hook_chain->states[i] != CHAIN_ITEM_STATE_READY) continue;
-        hook_chain8_callback func = hook_chain->befores[i];
-        if (func) func(&fargs, hook_chain->udata[i]);
-    }
+    hook_chain_enter(hook_chain);
+    fargs.inflight_idx = __inflight_idx;
+    hook_chain_stats_begin(hook_chain);
+    hook_chain_call_befores(hook_chain, hook_chain8_callback, &fargs);
+    hook_chain_stats_befores_done();
     if (!fargs.skip_origin) {
         transit8_func_t origin_func = (transit8_func_t)hook_chain->hook.relo_addr;
         fargs.ret =
             origin_func(fargs.arg0, fargs.arg1, fargs.arg2, fargs.arg3, fargs.arg4, fargs.arg5, fargs.arg6, fargs.arg7);
     }
-    for (int32_t i = hook_chain->chain_items_max - 1; i >= 0; i--) {
-        if (hook_chain->states[i] != CHAIN_ITEM_STATE_READY) continue;
-        hook_chain8_callback func = hook_chain->afters[i];
-        if (func) func(&fargs, hook_chain->udata[i]);
-    }
+    hook_chain_stats_origin_done();
+    hook_chain_call_afters(hook_chain, hook_chain8_callback, &fargs);
+    hook_chain_call_rets(hook_chain, fargs.ret, fargs.arg0, fargs.arg1, fargs.arg2, fargs.arg3);
+    hook_chain_stats_end(&fargs);
+    hook_chain_exit(hook_chain);
     return fargs.ret;
 }
 
-extern void _transit8_end();
 
 // transit12:
 typedef uint64_t (*transit12_func_t)(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t,
                                      uint64_t, uint64_t, uint64_t, uint64_t);
 
 uint64_t __attribute__((section(".transit12.text"))) __attribute__((__noinline__))
-_transit12(uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5, uint64_t arg6,
-           uint64_t arg7, uint64_t arg8, uint64_t arg9, uint64_t arg10, uint64_t arg11)
-{
-    uint64_t this_va;
-    asm volatile("adr %0, ." : "=r"(this_va));
-    uint32_t *vptr = (uint32_t *)this_va;
-    while (*--vptr != ARM64_NOP) {
-    };
-    vptr--;
-    hook_chain_t *hook_chain = local_container_of((uint64_t)vptr, hook_chain_t, transit);
+_transit12_body(uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5, uint64_t arg6,
+                uint64_t arg7, uint64_t arg8, uint64_t arg9, uint64_t arg10, uint64_t arg11, void *chain)
+{
+    hook_chain_t *hook_chain = (hook_chain_t *)chain;
     hook_fargs12_t fargs;
     fargs.skip_origin = 0;
     fargs.arg0 = arg0;
@@ -486,76 +606,90 @@ _transit12(uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t
     fargs.arg10 = arg10;
     fargs.arg11 = arg11;
     fargs.chain = hook_chain;
-    for (int32_t i = 0; i < hook_chain->chain_items_max; i++) {
-        if (hook_chain->states[i] != CHAIN_ITEM_STATE_READY) continue;
-        hook_chain12_callback func = hook_chain->befores[i];
-        if (func) func(&fargs, hook_chain->udata[i]);
-    }
+    hook_chain_enter(hook_chain);
+    fargs.inflight_idx = __inflight_idx;
+    hook_chain_stats_begin(hook_chain);
+    hook_chain_call_befores(hook_chain, hook_chain12_callback, &fargs);
+    hook_chain_stats_befores_done();
     if (!fargs.skip_origin) {
         transit12_func_t origin_func = (transit12_func_t)hook_chain->hook.relo_addr;
         fargs.ret = origin_func(fargs.arg0, fargs.arg1, fargs.arg2, fargs.arg3, fargs.arg4, fargs.arg5, fargs.arg6,
                                 fargs.arg7, fargs.arg8, fargs.arg9, fargs.arg10, fargs.arg11);
     }
-    for (int32_t i = hook_chain->chain_items_max - 1; i >= 0; i--) {
-        if (hook_chain->states[i] != CHAIN_ITEM_STATE_READY) continue;
-        hook_chain12_callback func = hook_chain->afters[i];
-        if (func) func(&fargs, hook_chain->udata[i]);
-    }
+    hook_chain_stats_origin_done();
+    hook_chain_call_afters(hook_chain, hook_chain12_callback, &fargs);
+    hook_chain_call_rets(hook_chain, fargs.ret, fargs.arg0, fargs.arg1, fargs.arg2, fargs.arg3);
+    hook_chain_stats_end(&fargs);
+    hook_chain_exit(hook_chain);
     return fargs.ret;
 }
 
-extern void _transit12_end();
 
-static __noinline hook_err_t relocate_inst(hook_t *hook, uint64_t inst_addr, uint32_t inst)
+// transit_ret: passes every argument register through, so any function with up to 8 arguments
+typedef uint64_t (*transit_ret_func_t)(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t);
+
+uint64_t __attribute__((section(".transit_ret.text"))) __attribute__((__noinline__))
+_transit_ret_body(uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5,
+                  uint64_t arg6, uint64_t arg7, void *chain)
 {
-    hook_err_t rc = HOOK_NO_ERR;
-    inst_type_t it = INST_IGNORE;
-    int len = 1;
+    hook_chain_t *hook_chain = (hook_chain_t *)chain;
+    hook_chain_enter(hook_chain);
+    transit_ret_func_t origin_func = (transit_ret_func_t)hook_chain->hook.relo_addr;
+    uint64_t ret = origin_func(arg0, arg1, arg2, arg3, arg4, arg5, arg6, arg7);
+    hook_chain_call_rets(hook_chain, ret, arg0, arg1, arg2, arg3);
+    hook_chain_exit(hook_chain);
+    return ret;
+}
 
-    for (int j = 0; j < sizeof(relo_len) / sizeof(relo_len[0]); j++) {
-        if ((inst & masks[j]) == types[j]) {
-            it = types[j];
-            len = relo_len[j];
-            break;
-        }
-    }
 
-    switch (it) {
-    case INST_B:
-    case INST_BC:
-    case INST_BL:
-        rc = relo_b(hook, inst_addr, inst, it);
-        break;
-    case INST_ADR:
-    case INST_ADRP:
-        rc = relo_adr(hook, inst_addr, inst, it);
-        break;
-    case INST_LDR_32:
-    case INST_LDR_64:
-    case INST_LDRSW_LIT:
-    case INST_PRFM_LIT:
-    case INST_LDR_SIMD_32:
-    case INST_LDR_SIMD_64:
-    case INST_LDR_SIMD_128:
-        rc = relo_ldr(hook, inst_addr, inst, it);
-        break;
-    case INST_CBZ:
-    case INST_CBNZ:
-        rc = relo_cb(hook, inst_addr, inst, it);
-        break;
-    case INST_TBZ:
-    case INST_TBNZ:
-        rc = relo_tb(hook, inst_addr, inst, it);
-        break;
-    case INST_IGNORE:
-    default:
-        rc = relo_ignore(hook, inst_addr, inst, it);
-        break;
+// transit_one: one before and after pair read without walking the slots, any function with up to 8 arguments
+uint64_t __attribute__((section(".transit_one.text"))) __attribute__((__noinline__))
+_transit_one_body(uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5,
+                  uint64_t arg6, uint64_t arg7, void *chain)
+{
+    hook_chain_t *hook_chain = (hook_chain_t *)chain;
+    hook_fargs8_t fargs;
+    fargs.skip_origin = 0;
+    fargs.arg0 = arg0;
+    fargs.arg1 = arg1;
+    fargs.arg2 = arg2;
+    fargs.arg3 = arg3;
+    fargs.arg4 = arg4;
+    fargs.arg5 = arg5;
+    fargs.arg6 = arg6;
+    fargs.arg7 = arg7;
+    fargs.chain = hook_chain;
+    hook_chain_enter(hook_chain);
+    fargs.inflight_idx = __inflight_idx;
+    hook_chain_stats_begin(hook_chain);
+    hook_chain8_callback before = 0, after = 0;
+    void *udata = 0;
+    int ready = hook_chain_read_one(hook_chain, before, after, udata);
+    if (ready && before) before(&fargs, udata);
+    hook_chain_stats_befores_done();
+    if (!fargs.skip_origin) {
+        transit8_func_t origin_func = (transit8_func_t)hook_chain->hook.relo_addr;
+        fargs.ret =
+            origin_func(fargs.arg0, fargs.arg1, fargs.arg2, fargs.arg3, fargs.arg4, fargs.arg5, fargs.arg6, fargs.arg7);
     }
+    hook_chain_stats_origin_done();
+    if (ready && after) after(&fargs, udata);
+    hook_chain_stats_end(&fargs);
+    hook_chain_exit(hook_chain);
+    return fargs.ret;
+}
 
+// sized first, a relocation that does not fit in relo_insts is not written
+static __noinline hook_err_t relocate_inst(hook_t *hook, uint64_t inst_addr, uint32_t inst)
+{
+    uint64_t pc = hook->relo_addr + hook->relo_insts_num * 4;
+    int32_t len = relo_inst(hook, inst_addr, inst, pc, 0);
+    if (len < 0) return len;
+    if (hook->relo_insts_num + len > RELOCATE_INST_NUM) return -HOOK_BAD_RELO;
+    len = relo_inst(hook, inst_addr, inst, pc, hook->relo_insts + hook->relo_insts_num);
+    if (len < 0) return len;
     hook->relo_insts_num += len;
-
-    return rc;
+    return HOOK_NO_ERR;
 }
 
 hook_err_t hook_prepare(hook_t *hook)
@@ -582,6 +716,7 @@ hook_err_t hook_prepare(hook_t *hook)
     for (int i = 0; i < sizeof(hook->relo_insts) / sizeof(hook->relo_insts[0]); i++) {
         hook->relo_insts[i] = ARM64_NOP;
     }
+    hook->relo_insts_num = 0;
 
     for (int i = 0; i < hook->tramp_insts_num; i++) {
         uint64_t inst_addr = hook->origin_addr + i * 4;
@@ -595,52 +730,192 @@ hook_err_t hook_prepare(hook_t *hook)
     // jump back
     uint64_t back_src_addr = hook->relo_addr + hook->relo_insts_num * 4;
     uint64_t back_dst_addr = hook->origin_addr + hook->tramp_insts_num * 4;
+    if (hook->relo_insts_num + relo_branch(0, back_src_addr, back_dst_addr, 0) > RELOCATE_INST_NUM) {
+        return -HOOK_BAD_RELO;
+    }
     uint32_t *buf = hook->relo_insts + hook->relo_insts_num;
-    hook->relo_insts_num += branch_from_to(buf, back_src_addr, back_dst_addr);
+    hook->relo_insts_num += relo_branch(buf, back_src_addr, back_dst_addr, 0);
+    flush_icache_range(hook->relo_addr, hook->relo_addr + hook->relo_insts_num * 4);
     return HOOK_NO_ERR;
 }
 KP_EXPORT_SYMBOL(hook_prepare);
 
-// todo:
-void hook_install(hook_t *hook)
+/*
+ * Writers of hook text, hook memory and callback slots are serialized by one lock, taken again by the same task.
+ * The holder may sleep, e.g. in stop_machine or hook_drain, so waiters sleep too instead of spinning.
+ * Tasks are told apart by their kernel stack, writers never run on an interrupt stack.
+ */
+static kp_lock_t hook_lock_val = { 0 };
+static uint64_t hook_lock_owner = 0;
+static int32_t hook_lock_nest = 0;
+
+static uint64_t hook_lock_self()
 {
-    uint64_t va = hook->origin_addr;
-    uint64_t *entry = pgtable_entry_kernel(va);
-    uint64_t ori_prot = *entry;
-    modify_entry_kernel(va, entry, (ori_prot | PTE_DBM) & ~PTE_RDONLY);
-    // todo: cpu_stop_machine
-    // todo: can use aarch64_insn_patch_text_nosync, aarch64_insn_patch_text directly?
-    for (int32_t i = 0; i < hook->tramp_insts_num; i++) {
-        *((uint32_t *)hook->origin_addr + i) = hook->tramp_insts[i];
+    uint64_t size = thread_size > 0 ? thread_size : THREAD_SIZE;
+    return current_stack_pointer & ~(size - 1);
+}
+
+// fails with -HOOK_ATOMIC instead of sleeping when the caller can not
+hook_err_t hook_lock()
+{
+    hook_err_t err = hook_may_sleep();
+    if (err) return err;
+    uint64_t self = hook_lock_self();
+    if (*(volatile uint64_t *)&hook_lock_owner == self) {
+        hook_lock_nest++;
+        return HOOK_NO_ERR;
     }
-    flush_icache_all();
-    modify_entry_kernel(va, entry, ori_prot);
+    while (!kp_trylock(&hook_lock_val)) {
+        hook_relax();
+    }
+    hook_lock_owner = self;
+    hook_lock_nest = 1;
+    return HOOK_NO_ERR;
+}
+
+void hook_unlock()
+{
+    if (--hook_lock_nest) return;
+    *(volatile uint64_t *)&hook_lock_owner = 0;
+    kp_unlock(&hook_lock_val);
+}
+
+// owned by the holder of the hook lock from hook_batch_begin to the outermost hook_batch_commit
+static void *batch_addrs[HOOK_BATCH_NUM * TRAMPOLINE_MAX_NUM];
+static uint32_t batch_insts[HOOK_BATCH_NUM * TRAMPOLINE_MAX_NUM];
+static hook_t *batch_hooks[HOOK_BATCH_NUM];
+static int8_t batch_installs[HOOK_BATCH_NUM];
+static int32_t batch_insts_num = 0;
+static int32_t batch_items_num = 0;
+static int32_t batch_depth = 0;
+static hook_err_t batch_err = HOOK_NO_ERR;
+
+static hook_err_t hook_patch_text(uint64_t addr, uint32_t *insts, int32_t insts_num)
+{
+    void *addrs[TRAMPOLINE_MAX_NUM];
+    for (int32_t i = 0; i < insts_num; i++) {
+        addrs[i] = (uint32_t *)addr + i;
+    }
+    int rc = kp_insn_patch_text(addrs, insts, insts_num);
+    if (!rc) return HOOK_NO_ERR;
+    logkw("Hook patch text: %llx, rc: %d\n", addr, rc);
+    return rc == -EBUSY ? -HOOK_BUSY : -HOOK_BAD_ADDRESS;
+}
+
+static hook_err_t hook_patch_one(hook_t *hook, int install)
+{
+    uint32_t *insts = install ? hook->tramp_insts : hook->origin_insts;
+    return hook_patch_text(hook->origin_addr, insts, hook->tramp_insts_num);
 }
-KP_EXPORT_SYMBOL(hook_install);
 
-void hook_uninstall(hook_t *hook)
+/*
+ * When the whole batch fails, items are patched one by one so a single busy hook fails alone.
+ * Queued uninstalls are already retired by their callers, those that failed are taken back into use,
+ * as their text still branches into them.
+ */
+static hook_err_t hook_batch_flush()
 {
-    uint64_t va = hook->origin_addr;
-    uint64_t *entry = pgtable_entry_kernel(va);
-    uint64_t ori_prot = *entry;
-    modify_entry_kernel(va, entry, (ori_prot | PTE_DBM) & ~PTE_RDONLY);
-    flush_tlb_kernel_page(va);
+    if (!batch_items_num) return HOOK_NO_ERR;
+    hook_err_t err = HOOK_NO_ERR;
+    int rc = kp_insn_patch_text(batch_addrs, batch_insts, batch_insts_num);
+    logkv("Hook batch flush: %d items, %d insts, rc: %d\n", batch_items_num, batch_insts_num, rc);
+    for (int32_t i = 0; rc && i < batch_items_num; i++) {
+        hook_err_t one = hook_patch_one(batch_hooks[i], batch_installs[i]);
+        if (!one) continue;
+        if (!batch_installs[i]) hook_mem_unretire(batch_hooks[i]);
+        logkw("Hook batch: %llx %s failed, err: %d\n", batch_hooks[i]->func_addr,
+              batch_installs[i] ? "install" : "uninstall", one);
+        if (!err) err = one;
+    }
+    batch_items_num = 0;
+    batch_insts_num = 0;
+    return err;
+}
+
+static void hook_batch_add(hook_t *hook, int install)
+{
+    if (batch_items_num >= HOOK_BATCH_NUM) {
+        hook_err_t err = hook_batch_flush();
+        if (!batch_err) batch_err = err;
+    }
+    uint32_t *insts = install ? hook->tramp_insts : hook->origin_insts;
     for (int32_t i = 0; i < hook->tramp_insts_num; i++) {
-        *((uint32_t *)hook->origin_addr + i) = hook->origin_insts[i];
+        batch_addrs[batch_insts_num] = (uint32_t *)hook->origin_addr + i;
+        batch_insts[batch_insts_num++] = insts[i];
+    }
+    batch_hooks[batch_items_num] = hook;
+    batch_installs[batch_items_num++] = install;
+}
+
+hook_err_t hook_batch_begin()
+{
+    hook_err_t err = hook_lock();
+    if (err) return err;
+    batch_depth++;
+    return HOOK_NO_ERR;
+}
+KP_EXPORT_SYMBOL(hook_batch_begin);
+
+hook_err_t hook_batch_commit()
+{
+    // a begin that failed took neither the lock nor a depth
+    if (batch_depth <= 0 || hook_lock_owner != hook_lock_self()) return HOOK_NO_ERR;
+    hook_err_t err = HOOK_NO_ERR;
+    if (!--batch_depth) {
+        err = hook_batch_flush();
+        if (batch_err) err = batch_err;
+        batch_err = HOOK_NO_ERR;
+    }
+    hook_unlock();
+    return err;
+}
+KP_EXPORT_SYMBOL(hook_batch_commit);
+
+// only meaningful to the holder of the hook lock, i.e. inside hook callbacks of the batch owner
+int32_t hook_batch_depth()
+{
+    return batch_depth;
+}
+KP_EXPORT_SYMBOL(hook_batch_depth);
+
+// queued inside a batch, where errors are returned by hook_batch_commit
+static hook_err_t hook_install_locked(hook_t *hook, int install)
+{
+    if (batch_depth) {
+        hook_batch_add(hook, install);
+        return HOOK_NO_ERR;
     }
-    flush_icache_all();
-    modify_entry_kernel(va, entry, ori_prot);
+    return hook_patch_one(hook, install);
+}
+
+hook_err_t hook_install(hook_t *hook)
+{
+    hook_err_t err = hook_lock();
+    if (err) return err;
+    err = hook_install_locked(hook, 1);
+    hook_unlock();
+    return err;
+}
+KP_EXPORT_SYMBOL(hook_install);
+
+hook_err_t hook_uninstall(hook_t *hook)
+{
+    hook_err_t err = hook_lock();
+    if (err) return err;
+    err = hook_install_locked(hook, 0);
+    hook_unlock();
+    return err;
 }
 KP_EXPORT_SYMBOL(hook_uninstall);
 
-hook_err_t hook(void *func, void *replace, void **backup)
+static hook_err_t __hook(void *func, void *replace, void **backup)
 {
     hook_err_t err = HOOK_NO_ERR;
     if (!func || !replace || !backup) {
         return -HOOK_BAD_ADDRESS;
     }
     uint64_t origin_addr = branch_func_addr((uintptr_t)func);
-    hook_t *hook = (hook_t *)hook_mem_zalloc(origin_addr, INLINE);
+    hook_t *hook = (hook_t *)hook_mem_zalloc_drain(origin_addr, INLINE);
     if (!hook) return -HOOK_NO_MEM;
     hook->func_addr = (uint64_t)func;
     hook->origin_addr = origin_addr;
@@ -650,8 +925,8 @@ hook_err_t hook(void *func, void *replace, void **backup)
     logkv("Hook func: %llx, origin: %llx, replace: %llx, relocate: %llx, chain: %llx\n", hook->func_addr,
           hook->origin_addr, hook->replace_addr, hook->relo_addr, hook);
     err = hook_prepare(hook);
+    if (!err) err = hook_install(hook);
     if (err) goto out;
-    hook_install(hook);
     logkv("Hook func: %llx succsseed\n", hook->func_addr);
     return HOOK_NO_ERR;
 out:
@@ -659,156 +934,352 @@ out:
     logkv("Hook func: %llx failed, err: %d\n", hook->func_addr, err);
     return err;
 }
+
+hook_err_t hook(void *func, void *replace, void **backup)
+{
+    hook_err_t err = hook_lock();
+    if (err) return err;
+    err = __hook(func, replace, backup);
+    hook_unlock();
+    return err;
+}
 KP_EXPORT_SYMBOL(hook);
 
-void unhook(void *func)
+static hook_err_t __unhook(void *func)
 {
     uint64_t origin = branch_func_addr((uint64_t)func);
     hook_t *hook = hook_get_mem_from_origin(origin);
-    if (!hook) return;
-    hook_uninstall(hook);
-    hook_mem_free(hook);
+    if (!hook) return HOOK_NO_ERR;
+    hook_err_t err = hook_uninstall(hook);
+    if (err) {
+        logkw("Unhook func: %llx failed, err: %d\n", func, err);
+        return err;
+    }
+    hook_mem_retire(hook);
     logkv("Unhook func: %llx\n", func);
+    return HOOK_NO_ERR;
+}
+
+hook_err_t unhook(void *func)
+{
+    hook_err_t err = hook_lock();
+    if (err) return err;
+    err = __unhook(func);
+    hook_unlock();
+    return err;
 }
 KP_EXPORT_SYMBOL(unhook);
 
-static hook_err_t hook_chain_prepare(uint32_t *transit, int32_t argno)
+static uint64_t hook_chain_transit(int32_t argno)
 {
-    uint64_t transit_start, transit_end;
     switch (argno) {
     case 0:
-        transit_start = (uint64_t)_transit0;
-        transit_end = (uint64_t)_transit0_end;
-        break;
+        return (uint64_t)_transit0;
     case 1:
     case 2:
     case 3:
     case 4:
-        transit_start = (uint64_t)_transit4;
-        transit_end = (uint64_t)_transit4_end;
-        break;
+        return (uint64_t)_transit4;
     case 5:
     case 6:
     case 7:
     case 8:
-        transit_start = (uint64_t)_transit8;
-        transit_end = (uint64_t)_transit8_end;
-        break;
+        return (uint64_t)_transit8;
     default:
-        transit_start = (uint64_t)_transit12;
-        transit_end = (uint64_t)_transit12_end;
-        break;
+        return (uint64_t)_transit12;
     }
+}
 
-    int32_t transit_num = (transit_end - transit_start) / 4;
-    // todo:assert
-    if (transit_num >= TRANSIT_INST_NUM) return -HOOK_TRANSIT_NO_MEM;
-
-    transit[0] = ARM64_BTI_JC;
-    transit[1] = ARM64_NOP;
-    for (int i = 0; i < transit_num; i++) {
-        transit[i + 2] = ((uint32_t *)transit_start)[i];
+static int hook_chain_has_rets(hook_chain_t *chain)
+{
+    for (int32_t i = 0; i < HOOK_RET_NUM; i++) {
+        if (chain->ret_callbacks[i]) return 1;
     }
-    return HOOK_NO_ERR;
+    return 0;
 }
 
-hook_err_t hook_chain_add(hook_chain_t *chain, void *before, void *after, void *udata)
+// copies the only callback for _transit_one, callers may still be inside from an earlier single callback
+static void hook_chain_set_one(hook_chain_t *chain, void *before, void *after, void *udata)
 {
-    for (int i = 0; i < HOOK_CHAIN_NUM; i++) {
-        if ((before && chain->befores[i] == before) || (after && chain->afters[i] == after)) return -HOOK_DUPLICATED;
-
-        // todo: atomic or lock
-        if (chain->states[i] == CHAIN_ITEM_STATE_EMPTY) {
-            chain->states[i] = CHAIN_ITEM_STATE_BUSY;
-            dsb(ish);
-            chain->udata[i] = udata;
-            chain->befores[i] = before;
-            chain->afters[i] = after;
-            if (i + 1 > chain->chain_items_max) {
-                chain->chain_items_max = i + 1;
-            }
-            dsb(ish);
-            chain->states[i] = CHAIN_ITEM_STATE_READY;
-            logkv("Wrap chain add: %llx, %llx, %llx successed\n", chain->hook.func_addr, before, after);
-            return HOOK_NO_ERR;
+    if (chain->one_before == before && chain->one_after == after && chain->one_udata == udata) return;
+    *(volatile uint32_t *)&chain->one_seq = chain->one_seq + 1;
+    smp_wmb();
+    chain->one_before = before;
+    chain->one_after = after;
+    chain->one_udata = udata;
+    smp_store_release(&chain->one_seq, chain->one_seq + 1);
+}
+
+/*
+ * The minimal _transit_ret while there are return callbacks only, _transit_one while there is a single callback
+ * and no return callback, the full transit otherwise.
+ */
+static uint64_t hook_chain_target(hook_chain_t *chain)
+{
+    hook_chain_slots_t slots = hook_chain_slots(chain, HOOK_CHAIN_NUM);
+    int32_t count = hook_chain_slots_count(slots);
+    int rets = hook_chain_has_rets(chain);
+    if (chain->argno <= RET_TRANSIT_ARGNO_MAX && rets && !count) return (uint64_t)_transit_ret;
+    if (chain->argno <= ONE_TRANSIT_ARGNO_MAX && !rets && count == 1) {
+        void *before, *after, *udata;
+        if (hook_chain_slots_first(slots, &before, &after, &udata)) {
+            hook_chain_set_one(chain, before, after, udata);
+            return (uint64_t)_transit_one;
         }
     }
-    logkv("Wrap chain add: %llx, %llx, %llx failed\n", chain->hook.func_addr, before, after);
-    return -HOOK_CHAIN_FULL;
+    return hook_chain_transit(chain->argno);
+}
+
+// the trampoline keeps branching to the stub, only the transit in its literal changes
+static void hook_chain_retarget(hook_chain_t *chain)
+{
+    uint64_t target = hook_chain_target(chain);
+    if (hook_stub_target(chain->transit) == target) return;
+    hook_stub_set_target(chain->transit, target);
+    logkv("Wrap func: %llx, retarget: %llx\n", chain->hook.func_addr, target);
+}
+
+static hook_err_t __hook_chain_add_priority(hook_chain_t *chain, void *before, void *after, void *udata,
+                                            int32_t priority)
+{
+    hook_err_t err = hook_chain_slots_add(hook_chain_slots(chain, HOOK_CHAIN_NUM), before, after, udata, priority);
+    if (!err) hook_chain_retarget(chain);
+    logkv("Wrap chain add: %llx, %llx, %llx, priority: %d %s\n", chain->hook.func_addr, before, after, priority,
+          err ? "failed" : "successed");
+    return err;
+}
+
+hook_err_t hook_chain_add_priority(hook_chain_t *chain, void *before, void *after, void *udata, int32_t priority)
+{
+    hook_err_t err = hook_lock();
+    if (err) return err;
+    err = __hook_chain_add_priority(chain, before, after, udata, priority);
+    hook_unlock();
+    return err;
+}
+KP_EXPORT_SYMBOL(hook_chain_add_priority);
+
+hook_err_t hook_chain_add(hook_chain_t *chain, void *before, void *after, void *udata)
+{
+    return hook_chain_add_priority(chain, before, after, udata, HOOK_PRIORITY_DEFAULT);
 }
 KP_EXPORT_SYMBOL(hook_chain_add);
 
-void hook_chain_remove(hook_chain_t *chain, void *before, void *after)
-{
-    for (int i = 0; i < HOOK_CHAIN_NUM; i++) {
-        if (chain->states[i] == CHAIN_ITEM_STATE_READY)
-            if ((before && chain->befores[i] == before) || (after && chain->afters[i] == after)) {
-                chain->states[i] = CHAIN_ITEM_STATE_BUSY;
-                dsb(ish);
-                chain->udata[i] = 0;
-                chain->befores[i] = 0;
-                chain->afters[i] = 0;
-                dsb(ish);
-                chain->states[i] = CHAIN_ITEM_STATE_EMPTY;
-                break;
-            }
-    }
+static hook_err_t __hook_chain_remove(hook_chain_t *chain, void *before, void *after)
+{
+    hook_chain_slots_remove(hook_chain_slots(chain, HOOK_CHAIN_NUM), before, after);
+    // calls that entered _transit_one before the retarget must not load the removed pair either
+    if (chain->one_before == before && chain->one_after == after) hook_chain_set_one(chain, 0, 0, 0);
+    chain->inflight_dirty = 1;
+    hook_chain_retarget(chain);
     logkv("Wrap chain remove: %llx, %llx, %llx\n", chain->hook.func_addr, before, after);
+    return HOOK_NO_ERR;
+}
+
+hook_err_t hook_chain_remove(hook_chain_t *chain, void *before, void *after)
+{
+    hook_err_t err = hook_lock();
+    if (err) return err;
+    err = __hook_chain_remove(chain, before, after);
+    hook_unlock();
+    return err;
 }
 KP_EXPORT_SYMBOL(hook_chain_remove);
 
-// todo: lock
-hook_err_t hook_wrap(void *func, int32_t argno, void *before, void *after, void *udata)
+static hook_chain_t *hook_chain_create(uint64_t faddr, uint64_t origin, int32_t argno, hook_err_t *err)
 {
-    if (is_bad_address(func)) return -HOOK_BAD_ADDRESS;
-    uint64_t faddr = (uint64_t)func;
-    uint64_t origin = branch_func_addr(faddr);
-    if (is_bad_address(func)) return -HOOK_BAD_ADDRESS;
-    hook_chain_t *chain = (hook_chain_t *)hook_get_mem_from_origin(origin);
-    if (chain) return hook_chain_add(chain, before, after, udata);
-    chain = (hook_chain_t *)hook_mem_zalloc(origin, INLINE_CHAIN);
-    if (!chain) return -HOOK_NO_MEM;
+    hook_chain_t *chain = (hook_chain_t *)hook_mem_zalloc_drain(origin, INLINE_CHAIN);
+    if (!chain) {
+        *err = -HOOK_NO_MEM;
+        return 0;
+    }
     chain->chain_items_max = 0;
+    chain->argno = argno;
     hook_t *hook = &chain->hook;
     hook->func_addr = faddr;
     hook->origin_addr = origin;
-    hook->replace_addr = (uint64_t)chain->transit;
     hook->relo_addr = (uint64_t)hook->relo_insts;
+    hook->replace_addr = (uint64_t)chain->transit;
+    hook_stub_init(chain->transit, chain, hook_chain_transit(argno));
+    hook_chain_slots_init(hook_chain_slots(chain, HOOK_CHAIN_NUM));
+    return chain;
+}
+
+// callbacks of a new chain are set before, so the stub targets the right transit at once
+static hook_err_t hook_chain_create_install(hook_chain_t *chain)
+{
+    hook_t *hook = &chain->hook;
+    hook_stub_set_target(chain->transit, hook_chain_target(chain));
     logkv("Wrap func: %llx, origin: %llx, replace: %llx, relocate: %llx, chain: %llx\n", hook->func_addr,
           hook->origin_addr, hook->replace_addr, hook->relo_addr, chain);
     hook_err_t err = hook_prepare(hook);
-    if (err) goto err;
-    err = hook_chain_prepare(chain->transit, argno);
-    if (err) goto err;
-    err = hook_chain_add(chain, before, after, udata);
-    if (err) goto err;
-    hook_chain_install(chain);
+    if (!err) err = hook_chain_install(chain);
+    if (err) return err;
     logkv("Wrap func: %llx succsseed\n", hook->func_addr);
     return HOOK_NO_ERR;
-err:
+}
+
+/*
+ * Uninstall once no callback of any kind is left, calls may still be inside, freed by hook_drain.
+ * Returns 1 when released, 0 while callbacks are left, or an error with the chain kept installed.
+ */
+static int hook_chain_release(hook_chain_t *chain)
+{
+    if (hook_chain_has_rets(chain)) return 0;
+    if (!hook_chain_slots_empty(hook_chain_slots(chain, HOOK_CHAIN_NUM))) return 0;
+    hook_err_t err = hook_chain_uninstall(chain);
+    if (err) return err;
+    hook_mem_retire(chain);
+    return 1;
+}
+
+static hook_err_t __hook_wrap_priority(void *func, int32_t argno, void *before, void *after, void *udata,
+                                       int32_t priority)
+{
+    if (is_bad_address(func)) return -HOOK_BAD_ADDRESS;
+    uint64_t faddr = (uint64_t)func;
+    uint64_t origin = branch_func_addr(faddr);
+    if (is_bad_address(func)) return -HOOK_BAD_ADDRESS;
+    hook_chain_t *chain = (hook_chain_t *)hook_get_mem_from_origin(origin);
+    if (chain) return hook_chain_add_priority(chain, before, after, udata, priority);
+    hook_err_t err = HOOK_NO_ERR;
+    chain = hook_chain_create(faddr, origin, argno, &err);
+    if (!chain) goto out;
+    err = hook_chain_slots_add(hook_chain_slots(chain, HOOK_CHAIN_NUM), before, after, udata, priority);
+    if (!err) err = hook_chain_create_install(chain);
+    if (!err) return HOOK_NO_ERR;
+    hook_chain_slots_free(hook_chain_slots(chain, HOOK_CHAIN_NUM));
     hook_mem_free(chain);
-    logkv("Wrap func: %llx failed, err: %d\n", hook->func_addr, err);
+out:
+    logkv("Wrap func: %llx failed, err: %d\n", faddr, err);
+    return err;
+}
+
+hook_err_t hook_wrap_priority(void *func, int32_t argno, void *before, void *after, void *udata, int32_t priority)
+{
+    hook_err_t err = hook_lock();
+    if (err) return err;
+    err = __hook_wrap_priority(func, argno, before, after, udata, priority);
+    hook_unlock();
     return err;
 }
+KP_EXPORT_SYMBOL(hook_wrap_priority);
+
+hook_err_t hook_wrap(void *func, int32_t argno, void *before, void *after, void *udata)
+{
+    return hook_wrap_priority(func, argno, before, after, udata, HOOK_PRIORITY_DEFAULT);
+}
 KP_EXPORT_SYMBOL(hook_wrap);
 
-void hook_unwrap_remove(void *func, void *before, void *after, int remove)
+static hook_err_t __hook_unwrap_remove(void *func, void *before, void *after, int remove)
 {
-    if (is_bad_address(func)) return;
+    if (is_bad_address(func)) return -HOOK_BAD_ADDRESS;
     uint64_t faddr = (uint64_t)func;
     uint64_t origin = branch_func_addr(faddr);
-    if (is_bad_address(func)) return;
+    if (is_bad_address(func)) return -HOOK_BAD_ADDRESS;
     hook_chain_t *chain = (hook_chain_t *)hook_get_mem_from_origin(origin);
-    if (!chain) return;
-    hook_chain_remove(chain, before, after);
-    if (!remove) return;
-    // todo:
-    for (int i = 0; i < HOOK_CHAIN_NUM; i++) {
-        if (chain->states[i] != CHAIN_ITEM_STATE_EMPTY) return;
-    }
-    hook_chain_uninstall(chain);
-    // todo: unsafe
-    hook_mem_free(chain);
-    logkv("Unwrap func: %llx\n", func);
+    if (!chain) return HOOK_NO_ERR;
+    hook_err_t err = hook_chain_remove(chain, before, after);
+    if (!remove) return err;
+    int released = hook_chain_release(chain);
+    if (released < 0) return released;
+    if (released) logkv("Unwrap func: %llx\n", func);
+    return released ? HOOK_NO_ERR : err;
+}
+
+hook_err_t hook_unwrap_remove(void *func, void *before, void *after, int remove)
+{
+    hook_err_t err = hook_lock();
+    if (err) return err;
+    err = __hook_unwrap_remove(func, before, after, remove);
+    hook_unlock();
+    return err;
 }
 KP_EXPORT_SYMBOL(hook_unwrap_remove);
+
+static hook_err_t __hook_wrap_ret(void *func, int32_t argno, hook_ret_callback callback, void *udata)
+{
+    if (is_bad_address(func) || !callback) return -HOOK_BAD_ADDRESS;
+    uint64_t faddr = (uint64_t)func;
+    uint64_t origin = branch_func_addr(faddr);
+    hook_err_t err = HOOK_NO_ERR;
+    hook_chain_t *chain = (hook_chain_t *)hook_get_mem_from_origin(origin);
+    int created = !chain;
+    if (created) {
+        chain = hook_chain_create(faddr, origin, argno, &err);
+        if (!chain) goto out;
+    }
+
+    int32_t slot = -1;
+    for (int32_t i = 0; i < HOOK_RET_NUM; i++) {
+        if (chain->ret_callbacks[i] == callback) {
+            err = -HOOK_DUPLICATED;
+            goto fail;
+        }
+        if (slot < 0 && !chain->ret_callbacks[i]) slot = i;
+    }
+    if (slot < 0) {
+        err = -HOOK_CHAIN_FULL;
+        goto fail;
+    }
+    chain->ret_udata[slot] = udata;
+    smp_store_release(&chain->ret_callbacks[slot], callback);
+
+    if (created) {
+        err = hook_chain_create_install(chain);
+    } else {
+        hook_chain_retarget(chain);
+    }
+    if (!err) {
+        logkv("Wrap ret: %llx, %llx\n", faddr, callback);
+        return HOOK_NO_ERR;
+    }
+    chain->ret_callbacks[slot] = 0;
+    chain->inflight_dirty = 1;
+fail:
+    if (created) {
+        hook_chain_slots_free(hook_chain_slots(chain, HOOK_CHAIN_NUM));
+        hook_mem_free(chain);
+    }
+out:
+    logkv("Wrap ret: %llx failed, err: %d\n", faddr, err);
+    return err;
+}
+
+hook_err_t hook_wrap_ret(void *func, int32_t argno, hook_ret_callback callback, void *udata)
+{
+    hook_err_t err = hook_lock();
+    if (err) return err;
+    err = __hook_wrap_ret(func, argno, callback, udata);
+    hook_unlock();
+    return err;
+}
+KP_EXPORT_SYMBOL(hook_wrap_ret);
+
+static hook_err_t __hook_unwrap_ret(void *func, hook_ret_callback callback)
+{
+    if (is_bad_address(func)) return -HOOK_BAD_ADDRESS;
+    uint64_t origin = branch_func_addr((uint64_t)func);
+    hook_chain_t *chain = (hook_chain_t *)hook_get_mem_from_origin(origin);
+    if (!chain) return HOOK_NO_ERR;
+    for (int32_t i = 0; i < HOOK_RET_NUM; i++) {
+        // udata is kept, a caller may have loaded the callback already
+        if (chain->ret_callbacks[i] == callback) chain->ret_callbacks[i] = 0;
+    }
+    chain->inflight_dirty = 1;
+    int released = hook_chain_release(chain);
+    hook_err_t err = released < 0 ? released : HOOK_NO_ERR;
+    if (!released) hook_chain_retarget(chain);
+    logkv("Unwrap ret: %llx, %llx, err: %d\n", func, callback, err);
+    return err;
+}
+
+hook_err_t hook_unwrap_ret(void *func, hook_ret_callback callback)
+{
+    hook_err_t err = hook_lock();
+    if (err) return err;
+    err = __hook_unwrap_ret(func, callback);
+    hook_unlock();
+    return err;
+}
+KP_EXPORT_SYMBOL(hook_unwrap_ret);
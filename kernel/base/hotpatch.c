@@ -1,10 +1,18 @@
 /* SPDX-License-Identifier: GPL-2.0-or-later */
-/* 
+/*
  * Copyright (C) 2023 bmax121. All Rights Reserved.
  */
 
 #include <hotpatch.h>
 
+#include <ktypes.h>
+#include <cache.h>
+#include <pgtable.h>
+#include <barrier.h>
+#include <ksyms.h>
+#include <log.h>
+#include <symbol.h>
+#include <asm/cmpxchg.h>
 #include <linux/stop_machine.h>
 #include <linux/init_task.h>
 #include <linux/sched.h>
@@ -13,78 +21,287 @@
 #include <uapi/asm-generic/errno.h>
 
 #define MAX_STACK_TRACE_DEPTH 64
-// static unsigned long stack_entries[MAX_STACK_TRACE_DEPTH];
-// static struct stack_trace trace = { 0 };
+#define HOTPATCH_MAX_PAGES 0x40
+#define HOTPATCH_BUSY_RETRY 3
+// stack walks inside stop_machine, every cpu waits for all of them
+#define HOTPATCH_VERIFY_MAX_TASKS 0x4000
+
+static unsigned long stack_entries[MAX_STACK_TRACE_DEPTH];
+static struct stack_trace trace = { 0 };
+
+static uint64_t patch_pages[HOTPATCH_MAX_PAGES];
+static uint64_t *patch_entries[HOTPATCH_MAX_PAGES];
+static uint64_t patch_prots[HOTPATCH_MAX_PAGES];
+
+static int hotpatch_ready = 0;
+
+// arch/arm64/kernel/patching.c, writes through fixmap and flushes the written range only
+static int kfunc_def(aarch64_insn_patch_text_nosync)(void *addr, uint32_t insn) = 0;
+
+static void patch_pages_writable(int32_t pages_num)
+{
+    dsb(ishst);
+    for (int32_t i = 0; i < pages_num; i++) {
+        uint64_t *entry = pgtable_entry_kernel(patch_pages[i]);
+        uint64_t ori_prot = *entry;
+        uint64_t prot = (ori_prot | PTE_DBM) & ~PTE_RDONLY;
+        patch_entries[i] = entry;
+        patch_prots[i] = ori_prot;
+        if (pte_valid_cont(ori_prot)) {
+            modify_entry_kernel(patch_pages[i], entry, prot);
+        } else {
+            *entry = prot;
+            flush_tlb_kernel_page_nosync(patch_pages[i]);
+        }
+    }
+    dsb(ish);
+    isb();
+}
+
+static void patch_pages_restore(int32_t pages_num)
+{
+    // restore in reverse order, pages sharing a contiguous range were saved already writable
+    dsb(ishst);
+    for (int32_t i = pages_num - 1; i >= 0; i--) {
+        if (pte_valid_cont(patch_prots[i])) {
+            modify_entry_kernel(patch_pages[i], patch_entries[i], patch_prots[i]);
+        } else {
+            *patch_entries[i] = patch_prots[i];
+            flush_tlb_kernel_page_nosync(patch_pages[i]);
+        }
+    }
+    dsb(ish);
+    isb();
+}
+
+static void patch_sync_icache(void *addrs[], int cnt)
+{
+    uint64_t dline = dcache_line_size();
+    uint64_t iline = icache_line_size();
+    uint64_t last = -1;
+
+    if (ctr_idc()) {
+        dsb(ishst);
+    } else {
+        for (int i = 0; i < cnt; i++) {
+            uint64_t va = (uint64_t)addrs[i] & ~(dline - 1);
+            if (va == last) continue;
+            dccvau(va);
+            last = va;
+        }
+        dsb(ish);
+    }
+
+    if (ctr_dic()) {
+        isb();
+        return;
+    }
 
-// static int backtrace_address_verify(unsigned long address, bool replace)
-// {
-//     return 0;
-// }
+    last = -1;
+    for (int i = 0; i < cnt; i++) {
+        uint64_t va = (uint64_t)addrs[i] & ~(iline - 1);
+        if (va == last) continue;
+        icivau(va);
+        last = va;
+    }
+    dsb(ish);
+    isb();
+}
+
+static void patch_text_chunk(void *addrs[], uint32_t insns[], int cnt, int32_t pages_num)
+{
+    patch_pages_writable(pages_num);
+    for (int i = 0; i < cnt; i++) {
+        *(uint32_t *)addrs[i] = insns[i];
+    }
+    patch_pages_restore(pages_num);
+    patch_sync_icache(addrs, cnt);
+}
+
+int kp_insn_patch_text_nosync(void *addrs[], uint32_t insns[], int cnt)
+{
+    if (cnt <= 0) return -EINVAL;
+    for (int i = 0; i < cnt; i++) {
+        if ((uint64_t)addrs[i] & 0x3) return -EINVAL;
+    }
+
+    uint64_t page_mask = ~((uint64_t)page_size - 1);
+    int32_t pages_num = 0;
+    int start = 0;
+
+    // one pte flip per page, chunked when the addresses span more pages than we can track
+    for (int i = 0; i < cnt; i++) {
+        uint64_t page = (uint64_t)addrs[i] & page_mask;
+        int32_t j = 0;
+        for (; j < pages_num; j++) {
+            if (patch_pages[j] == page) break;
+        }
+        if (j < pages_num) continue;
+        if (pages_num >= HOTPATCH_MAX_PAGES) {
+            patch_text_chunk(addrs + start, insns + start, i - start, pages_num);
+            start = i;
+            pages_num = 0;
+        }
+        patch_pages[pages_num++] = page;
+    }
+    patch_text_chunk(addrs + start, insns + start, cnt - start, pages_num);
+    return 0;
+}
+
+static int patch_text_write(void *addrs[], uint32_t insns[], int cnt)
+{
+    if (!kf_aarch64_insn_patch_text_nosync) return kp_insn_patch_text_nosync(addrs, insns, cnt);
+
+    // kernel image text goes through the kernel's own writer, everything else through ours
+    int start = 0;
+    int rc = 0;
+    for (int i = 0; i <= cnt && !rc; i++) {
+        if (i < cnt && !is_kimg_range((uint64_t)addrs[i])) continue;
+        if (i > start) rc = kp_insn_patch_text_nosync(addrs + start, insns + start, i - start);
+        if (i < cnt && !rc) rc = kf_aarch64_insn_patch_text_nosync(addrs[i], insns[i]);
+        start = i + 1;
+    }
+    return rc;
+}
+
+static int addr_in_patch(void *addrs[], int cnt, uint64_t addr)
+{
+    for (int i = 0; i < cnt; i++) {
+        if ((uint64_t)addrs[i] == addr) return 1;
+    }
+    return 0;
+}
+
+// a task can only return into the middle of a run of at least two adjacent instructions
+static int patch_has_run(void *addrs[], int cnt)
+{
+    for (int i = 0; i < cnt; i++) {
+        if (addr_in_patch(addrs, cnt, (uint64_t)addrs[i] + 4)) return 1;
+    }
+    return 0;
+}
+
+static int task_active_in_patch(struct task_struct *task, void *addrs[], int cnt)
+{
+    trace.max_entries = MAX_STACK_TRACE_DEPTH;
+    trace.entries = &stack_entries[0];
+    trace.nr_entries = 0;
+    trace.skip = 0;
+    save_stack_trace_tsk(task, &trace);
+
+    for (int i = 0; i < trace.nr_entries; i++) {
+        uint64_t ra = trace.entries[i];
+        if (ra == ULONG_MAX) break;
+        if (!addr_in_patch(addrs, cnt, ra) || !addr_in_patch(addrs, cnt, ra - 4)) continue;
+        logkw("hotpatch: %.20s is active at %llx\n", get_task_comm(task), ra);
+        for (int j = 0; j < trace.nr_entries && trace.entries[j] != ULONG_MAX; j++) {
+            logkw("  [<%llx>]\n", trace.entries[j]);
+        }
+        return 1;
+    }
+    return 0;
+}
 
 /*
  * https://github.com/dynup/kpatch/blob/922cd458091915b0dad8c1892d7a609addd4afd7/kmod/core/core.c#L274C20-L274C20
- * Verify activeness safety, i.e. that none of the to-be-patched functions are on the stack of any task.
+ * Verify activeness safety, i.e. that no task would return into the middle of a to-be-patched instruction run.
+ * Runs with every other cpu stopped, so the task lists can not change. Patches without such a run are not checked,
+ * runs are refused when the threads can not be walked, or when there are more than HOTPATCH_VERIFY_MAX_TASKS.
  */
-int patch_verify_safety()
+static int patch_verify_safety(void *addrs[], int cnt)
 {
-    // if (task_struct_offset.tasks_offset < 0) {
-    //     return -1;
-    // }
-    int ret = 0;
-
-    // trace.max_entries = sizeof(stack_entries) / sizeof(stack_entries[0]);
-    // trace.entries = &stack_entries[0];
-
-    // struct task_struct *g, *t;
-
-    // do_each_thread(p)
-    // {
-    //         trace.nr_entries = 0;
-    //         save_stack_trace_tsk(t, &trace);
-
-    //         if (trace.nr_entries >= trace.max_entries) {
-    //             logke("more than %u trace entries!\n", trace.max_entries);
-    //             ret = -EBUSY;
-    //             goto out;
-    //         }
-
-    //         for (int i = 0; i < trace.nr_entries; i++) {
-    //             if (trace.entries[i] == ULONG_MAX)
-    //                 break;
-    //             ret = backtrace_address_verify(trace.entries[i], 0);
-    //             if (ret)
-    //                 goto out;
-    //         }
-    // }
-
-    // out:
-    //     if (ret) {
-    //         // pid_t pid =
-    //         logke("Comm: %.20s\n", get_task_comm(t));
-    //         for (int i = 0; i < trace.nr_entries; i++) {
-    //             if (trace.entries[i] == ULONG_MAX)
-    //                 break;
-    //             logke("  [<%pK>] %pB\n", (void *)trace.entries[i], (void *)trace.entries[i]);
-    //         }
-    //     }
-
-    return ret;
+    if (!patch_has_run(addrs, cnt)) return 0;
+    if (task_struct_offset.tasks_offset < 0 || task_struct_offset.thread_node_offset < 0 ||
+        task_struct_offset.signal_offset < 0 || !kf_save_stack_trace_tsk || !init_task) {
+        logkw("hotpatch: can not walk the threads to verify a run of %d instructions\n", cnt);
+        return -ENOSYS;
+    }
+
+    int walked = 0;
+    struct task_struct *leader = init_task;
+    do {
+        struct list_head *head = get_task_thread_head_p(leader);
+        for (struct list_head *node = head->next; node != head; node = node->next) {
+            struct task_struct *task = (struct task_struct *)((uintptr_t)node - task_struct_offset.thread_node_offset);
+            if (++walked > HOTPATCH_VERIFY_MAX_TASKS) {
+                logkw("hotpatch: more than %d threads to verify\n", HOTPATCH_VERIFY_MAX_TASKS);
+                return -E2BIG;
+            }
+            if (task_active_in_patch(task, addrs, cnt)) return -EBUSY;
+        }
+
+        struct list_head *next = get_task_tasks_p(leader)->next;
+        leader = (struct task_struct *)((uintptr_t)next - task_struct_offset.tasks_offset);
+    } while (leader != init_task);
+
+    return 0;
 }
 
-// static int check_all_task(void *data)
-// {
-//     hook_t *hook = (hook_t *)data;
-//     logkd("check_all_task data: %llx\n", hook);
-//     return 0;
-// }
+struct kp_insn_patch
+{
+    void **addrs;
+    uint32_t *insns;
+    int cnt;
+    int ret;
+    int done;
+    int master;
+};
 
-int hot_patch_text()
+static int kp_insn_patch_text_cb(void *arg)
 {
-    // int rc = stop_machine(check_all_task, &data, 0);
-    // logkd("stop_machine rc: %d\n", rc);
+    struct kp_insn_patch *pp = (struct kp_insn_patch *)arg;
+
+    /* The first CPU becomes master, the others wait with interrupts off until the text is written */
+    if (!cmpxchg(&pp->master, 0, 1)) {
+        int ret = patch_verify_safety(pp->addrs, pp->cnt);
+        if (!ret) ret = patch_text_write(pp->addrs, pp->insns, pp->cnt);
+        pp->ret = ret;
+        smp_store_release(&pp->done, 1);
+        return ret;
+    }
+    while (!smp_load_acquire(&pp->done)) {
+        asm volatile("yield" ::: "memory");
+    }
+    isb();
     return 0;
 }
 
-int kp_insn_patch_text(void *addrs[], uint32_t insn[], int cnt)
+static int stop_machine_usable()
+{
+    if (!hotpatch_ready || !kf_stop_machine) return 0;
+    if (kv_stop_machine_initialized) return *kv_stop_machine_initialized;
+    return 1;
+}
+
+int kp_insn_patch_text(void *addrs[], uint32_t insns[], int cnt)
 {
-}
\ No newline at end of file
+    if (cnt <= 0) return -EINVAL;
+
+    // secondary cpus are not up yet, or stop_machine is unavailable
+    if (!stop_machine_usable()) return kp_insn_patch_text_nosync(addrs, insns, cnt);
+
+    int rc = 0;
+    for (int i = 0; i < HOTPATCH_BUSY_RETRY; i++) {
+        struct kp_insn_patch patch = {
+            .addrs = addrs,
+            .insns = insns,
+            .cnt = cnt,
+            .ret = 0,
+            .done = 0,
+            .master = 0,
+        };
+        // every online cpu enters the callback, those waiting for the master resync their pipelines after
+        rc = stop_machine(kp_insn_patch_text_cb, &patch, online_cpus_mask());
+        if (rc != -EBUSY) break;
+    }
+    if (rc) logkw("kp_insn_patch_text %llx, cnt: %d, rc: %d\n", addrs[0], cnt, rc);
+    return rc;
+}
+KP_EXPORT_SYMBOL(kp_insn_patch_text);
+
+void hotpatch_init()
+{
+    kfunc_lookup_name(aarch64_insn_patch_text_nosync);
+    hotpatch_ready = 1;
+    logkd("hotpatch aarch64_insn_patch_text_nosync: %llx\n", kf_aarch64_insn_patch_text_nosync);
+}
@@ -0,0 +1,107 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2024 bmax121. All Rights Reserved.
+ */
+
+#ifndef _KP_KPLOCK_H_
+#define _KP_KPLOCK_H_
+
+#include <stdint.h>
+#include <compiler.h>
+
+/*
+ * Locks of our own, usable before any kernel symbol is resolved and independent of the spinlock_t layout.
+ * Taken with interrupts masked they can be used from any context, but must be held briefly.
+ */
+typedef struct
+{
+    uint32_t val;
+} kp_lock_t;
+
+static __always_inline void kp_lock(kp_lock_t *lock)
+{
+    uint32_t tmp;
+    asm volatile("   sevl\n"
+                 "1: wfe\n"
+                 "2: ldaxr %w0, %1\n"
+                 "   cbnz %w0, 1b\n"
+                 "   stxr %w0, %w2, %1\n"
+                 "   cbnz %w0, 2b"
+                 : "=&r"(tmp), "+Q"(lock->val)
+                 : "r"(1)
+                 : "memory");
+}
+
+// returns 1 when taken, never waits
+static __always_inline int kp_trylock(kp_lock_t *lock)
+{
+    uint32_t tmp, fail;
+    asm volatile("1: ldaxr %w0, %2\n"
+                 "   cbnz %w0, 2f\n"
+                 "   stxr %w1, %w3, %2\n"
+                 "   cbnz %w1, 1b\n"
+                 "   b 3f\n"
+                 "2: clrex\n"
+                 "3:"
+                 : "=&r"(tmp), "=&r"(fail), "+Q"(lock->val)
+                 : "r"(1)
+                 : "memory");
+    return !tmp;
+}
+
+// the release store clears the exclusive monitor of waiters, which wakes them from wfe
+static __always_inline void kp_unlock(kp_lock_t *lock)
+{
+    asm volatile("stlr wzr, %0" : "=Q"(lock->val) : : "memory");
+}
+
+#ifdef KP_HOST_TEST
+// test/ runs in user space, where daif can not be touched and every access would trap into the shim
+static __always_inline uint64_t kp_lock_irqsave(kp_lock_t *lock)
+{
+    kp_lock(lock);
+    return 0;
+}
+
+static __always_inline void kp_unlock_irqrestore(kp_lock_t *lock, uint64_t flags)
+{
+    kp_unlock(lock);
+}
+#else
+static __always_inline uint64_t kp_lock_irqsave(kp_lock_t *lock)
+{
+    uint64_t flags;
+    asm volatile("mrs %0, daif\n"
+                 "msr daifset, #3"
+                 : "=r"(flags)
+                 :
+                 : "memory");
+    kp_lock(lock);
+    return flags;
+}
+
+static __always_inline void kp_unlock_irqrestore(kp_lock_t *lock, uint64_t flags)
+{
+    kp_unlock(lock);
+    asm volatile("msr daif, %0" : : "r"(flags) : "memory");
+}
+#endif
+
+// cpus are hashed from MPIDR affinity into @num slots, num must be a power of 2
+static __always_inline int32_t kp_cpu_slot(int32_t num)
+{
+#ifdef KP_HOST_TEST
+    // threads stand in for cpus in test/, told apart by their tls blocks, which sit on their own stacks
+    uint64_t tls;
+    asm volatile("mrs %0, tpidr_el0" : "=r"(tls));
+    return (((tls >> 12) * 0x9e3779b97f4a7c15ull) >> 32) & (num - 1);
+#else
+    uint64_t mpidr;
+    asm volatile("mrs %0, mpidr_el1" : "=r"(mpidr));
+    uint64_t aff0 = mpidr & 0xff;
+    uint64_t aff1 = (mpidr >> 8) & 0xff;
+    return (aff0 ^ (aff1 << 2) ^ (aff1 >> 2)) & (num - 1);
+#endif
+}
+
+#endif
@@ -0,0 +1,440 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2024 bmax121. All Rights Reserved.
+ */
+
+#include <kpmalloc.h>
+
+#include <stdint.h>
+#include <log.h>
+#include <pgtable.h>
+#include <ksyms.h>
+#include <symbol.h>
+#include <linux/vmalloc.h>
+#include <uapi/asm-generic/errno.h>
+#include "kplock.h"
+
+#define KP_POOL_RW 0
+#define KP_POOL_ROX 1
+#define KP_POOL_NUM 2
+
+// blocks of 64 to 512 bytes are cached, one class per power of 2
+#define KP_MAG_CLASS_MIN_SHIFT 6
+#define KP_MAG_CLASS_NUM 4
+#define KP_MAG_SIZE 16
+// cpus are hashed into magazine slots, must be a power of 2
+#define KP_MAG_CPU_NUM 8
+
+/*
+ * kp_rw_mem grows from vmalloc in kp_pool_reserve, never in the allocation path.
+ * Growing stops at the high watermark, and starts ahead of need when less than the low watermark is free.
+ * Grown memory is given back once it is entirely free and more than a growth step would be left free.
+ * kp_rox_mem never grows, vmalloc memory may be out of branch range of kpimg for module text.
+ * Executable regions for hooks are taken from vmalloc on their own and count against the same watermark.
+ */
+#define KP_POOL_GROW_NUM 0x20
+#define KP_POOL_GROW_SIZE (1 << 20)
+#define KP_POOL_HIGH_WATERMARK (32 << 20)
+#define KP_POOL_LOW_WATERMARK (256 << 10)
+
+typedef struct
+{
+    kp_lock_t lock;
+    int32_t num;
+    void *objs[KP_MAG_SIZE];
+} kp_mag_t;
+
+typedef struct
+{
+    void *mem;
+    size_t size;
+} kp_grown_t;
+
+typedef struct
+{
+    kp_lock_t lock;
+    size_t grown_size;
+    kp_grown_t grown[KP_POOL_GROW_NUM];
+    kp_mag_t mags[KP_MAG_CPU_NUM][KP_MAG_CLASS_NUM];
+} kp_pool_t;
+
+static kp_pool_t kp_pools[KP_POOL_NUM];
+
+// the tlsf handles are set at runtime, statically initialized pointers would not be relocated
+static inline tlsf_t pool_tlsf(int32_t pool)
+{
+    return pool == KP_POOL_ROX ? kp_rox_mem : kp_rw_mem;
+}
+
+static inline int pool_can_grow()
+{
+    return (kf_vmalloc || kf_vmalloc_noprof) && kf_vfree;
+}
+
+static inline int32_t mag_class_size(int32_t class)
+{
+    return 1 << (KP_MAG_CLASS_MIN_SHIFT + class);
+}
+
+// the class a request is served from, -1 if not cached
+static int32_t mag_alloc_class(size_t bytes)
+{
+    for (int32_t class = 0; class < KP_MAG_CLASS_NUM; class++) {
+        if (bytes <= mag_class_size(class)) return class;
+    }
+    return -1;
+}
+
+// the largest class a block is big enough for, blocks in class c are in [size(c), 2 * size(c))
+static int32_t mag_free_class(size_t block_size)
+{
+    for (int32_t class = KP_MAG_CLASS_NUM - 1; class >= 0; class--) {
+        if (block_size >= 2 * mag_class_size(class)) return -1;
+        if (block_size >= mag_class_size(class)) return class;
+    }
+    return -1;
+}
+
+static void *pool_tlsf_alloc(int32_t pool, size_t align, size_t bytes)
+{
+    return align ? tlsf_memalign(pool_tlsf(pool), align, bytes) : tlsf_malloc(pool_tlsf(pool), bytes);
+}
+
+// a racy read, only used to decide whether to grow or shrink
+static size_t pool_free_bytes(int32_t pool)
+{
+    size_t total, used;
+    tlsf_usage(pool_tlsf(pool), &total, &used);
+    return total > used ? total - used : 0;
+}
+
+static void pool_exec(uint64_t start, uint64_t size, int exec)
+{
+    for (uint64_t i = start; i < start + size; i += page_size) {
+        uint64_t *pte = pgtable_entry_kernel(i);
+        if (exec) {
+            *pte = (*pte | PTE_SHARED) & ~PTE_PXN & ~PTE_GP;
+        } else {
+            *pte |= PTE_PXN;
+        }
+    }
+    flush_tlb_kernel_range(start, start + size);
+}
+
+// may sleep, called without any lock held
+static int pool_grow(int32_t pool, size_t need)
+{
+    kp_pool_t *p = &kp_pools[pool];
+    size_t size = (need + tlsf_pool_overhead() + tlsf_alloc_overhead() + page_size - 1) & ~(page_size - 1);
+    if (size < KP_POOL_GROW_SIZE) size = KP_POOL_GROW_SIZE;
+    if (p->grown_size + size > KP_POOL_HIGH_WATERMARK) return -ENOMEM;
+
+    void *mem = vmalloc(size);
+    if (!mem) return -ENOMEM;
+
+    int rc = -ENOMEM;
+    uint64_t flags = kp_lock_irqsave(&p->lock);
+    for (int32_t i = 0; i < KP_POOL_GROW_NUM; i++) {
+        if (p->grown[i].mem) continue;
+        if (p->grown_size + size > KP_POOL_HIGH_WATERMARK) break;
+        if (!tlsf_add_pool(pool_tlsf(pool), mem, size)) break;
+        p->grown[i].mem = mem;
+        p->grown[i].size = size;
+        p->grown_size += size;
+        rc = 0;
+        break;
+    }
+    kp_unlock_irqrestore(&p->lock, flags);
+
+    if (rc) {
+        vfree(mem);
+        return rc;
+    }
+    logkv("kp pool %d grown: %llx, %llx\n", pool, mem, size);
+    return 0;
+}
+
+static void pool_used_walker(void *ptr, size_t size, int used, void *user)
+{
+    *(int *)user |= used;
+}
+
+// may sleep, called without any lock held
+static void pool_shrink(int32_t pool)
+{
+    kp_pool_t *p = &kp_pools[pool];
+    kp_grown_t grown = { 0 };
+
+    uint64_t flags = kp_lock_irqsave(&p->lock);
+    for (int32_t i = 0; i < KP_POOL_GROW_NUM; i++) {
+        if (!p->grown[i].mem) continue;
+        if (pool_free_bytes(pool) < p->grown[i].size + KP_POOL_GROW_SIZE) continue;
+        int used = 0;
+        tlsf_walk_pool(p->grown[i].mem, pool_used_walker, &used);
+        if (used) continue;
+        tlsf_remove_pool(pool_tlsf(pool), p->grown[i].mem);
+        grown = p->grown[i];
+        p->grown[i].mem = 0;
+        p->grown_size -= grown.size;
+        break;
+    }
+    kp_unlock_irqrestore(&p->lock, flags);
+
+    if (!grown.mem) return;
+    vfree(grown.mem);
+    logkv("kp pool %d shrunk: %llx, %llx\n", pool, grown.mem, grown.size);
+}
+
+static void *pool_alloc(int32_t pool, size_t align, size_t bytes)
+{
+    kp_pool_t *p = &kp_pools[pool];
+    int32_t class = bytes && !align ? mag_alloc_class(bytes) : -1;
+    kp_mag_t *mag = 0;
+    void *ptr = 0;
+    uint64_t flags;
+
+    if (class < 0) {
+        flags = kp_lock_irqsave(&p->lock);
+        ptr = pool_tlsf_alloc(pool, align, bytes);
+        kp_unlock_irqrestore(&p->lock, flags);
+        return ptr;
+    }
+
+    mag = &p->mags[kp_cpu_slot(KP_MAG_CPU_NUM)][class];
+    flags = kp_lock_irqsave(&mag->lock);
+    if (!mag->num) {
+        // refill half, so a following free does not flush right away
+        kp_lock(&p->lock);
+        while (mag->num < KP_MAG_SIZE / 2) {
+            void *obj = pool_tlsf_alloc(pool, 0, mag_class_size(class));
+            if (!obj) break;
+            mag->objs[mag->num++] = obj;
+        }
+        kp_unlock(&p->lock);
+    }
+    if (mag->num) ptr = mag->objs[--mag->num];
+    kp_unlock_irqrestore(&mag->lock, flags);
+    return ptr;
+}
+
+static void pool_free_uncached(int32_t pool, void *ptr)
+{
+    kp_pool_t *p = &kp_pools[pool];
+    uint64_t flags = kp_lock_irqsave(&p->lock);
+    tlsf_free(pool_tlsf(pool), ptr);
+    kp_unlock_irqrestore(&p->lock, flags);
+}
+
+static void pool_free(int32_t pool, void *ptr)
+{
+    if (!ptr) return;
+    kp_pool_t *p = &kp_pools[pool];
+    uint64_t flags;
+    // the size of a block in use is only changed by whoever owns it
+    int32_t class = mag_free_class(tlsf_block_size(ptr));
+
+    if (class < 0) {
+        pool_free_uncached(pool, ptr);
+        return;
+    }
+
+    kp_mag_t *mag = &p->mags[kp_cpu_slot(KP_MAG_CPU_NUM)][class];
+    flags = kp_lock_irqsave(&mag->lock);
+    if (mag->num == KP_MAG_SIZE) {
+        kp_lock(&p->lock);
+        while (mag->num > KP_MAG_SIZE / 2) {
+            tlsf_free(pool_tlsf(pool), mag->objs[--mag->num]);
+        }
+        kp_unlock(&p->lock);
+    }
+    mag->objs[mag->num++] = ptr;
+    kp_unlock_irqrestore(&mag->lock, flags);
+}
+
+static void *pool_realloc(int32_t pool, void *ptr, size_t size)
+{
+    if (!ptr) return pool_alloc(pool, 0, size);
+    if (!size) {
+        pool_free(pool, ptr);
+        return 0;
+    }
+    kp_pool_t *p = &kp_pools[pool];
+    uint64_t flags = kp_lock_irqsave(&p->lock);
+    void *ret = tlsf_realloc(pool_tlsf(pool), ptr, size);
+    kp_unlock_irqrestore(&p->lock, flags);
+    return ret;
+}
+
+void kp_malloc_init(void *rw, size_t rw_size, void *rox, size_t rox_size)
+{
+    kp_rw_mem = tlsf_create_with_pool(rw, rw_size);
+    kp_rox_mem = tlsf_malloc(kp_rw_mem, tlsf_size());
+    tlsf_create(kp_rox_mem);
+    tlsf_add_pool(kp_rox_mem, rox, rox_size);
+}
+
+// may sleep, see kpmalloc.h
+int kp_pool_reserve(size_t bytes)
+{
+    if (!pool_can_grow()) return -ENOSYS;
+    kp_pool_t *p = &kp_pools[KP_POOL_RW];
+    if (p->grown_size) pool_shrink(KP_POOL_RW);
+
+    tlsf_stat_t stat;
+    uint64_t flags = kp_lock_irqsave(&p->lock);
+    tlsf_stat(pool_tlsf(KP_POOL_RW), &stat);
+    kp_unlock_irqrestore(&p->lock, flags);
+
+    size_t free = stat.total > stat.used ? stat.total - stat.used : 0;
+    if (stat.largest_free >= bytes && free >= bytes + KP_POOL_LOW_WATERMARK) return 0;
+    return pool_grow(KP_POOL_RW, bytes);
+}
+KP_EXPORT_SYMBOL(kp_pool_reserve);
+
+// may sleep, see kpmalloc.h
+void *kp_exec_region_alloc(size_t size)
+{
+    kp_pool_t *p = &kp_pools[KP_POOL_ROX];
+    size = (size + page_size - 1) & ~(page_size - 1);
+    if (!pool_can_grow() || p->grown_size + size > KP_POOL_HIGH_WATERMARK) return 0;
+
+    void *mem = vmalloc(size);
+    if (!mem) return 0;
+    pool_exec((uint64_t)mem, size, 1);
+
+    int rc = -ENOMEM;
+    uint64_t flags = kp_lock_irqsave(&p->lock);
+    for (int32_t i = 0; i < KP_POOL_GROW_NUM; i++) {
+        if (p->grown[i].mem) continue;
+        if (p->grown_size + size > KP_POOL_HIGH_WATERMARK) break;
+        p->grown[i].mem = mem;
+        p->grown[i].size = size;
+        p->grown_size += size;
+        rc = 0;
+        break;
+    }
+    kp_unlock_irqrestore(&p->lock, flags);
+
+    if (rc) {
+        pool_exec((uint64_t)mem, size, 0);
+        vfree(mem);
+        return 0;
+    }
+    logkv("kp exec region: %llx, %llx\n", mem, size);
+    return mem;
+}
+
+// may sleep, see kpmalloc.h
+void kp_exec_region_free(void *mem)
+{
+    kp_pool_t *p = &kp_pools[KP_POOL_ROX];
+    kp_grown_t grown = { 0 };
+
+    uint64_t flags = kp_lock_irqsave(&p->lock);
+    for (int32_t i = 0; i < KP_POOL_GROW_NUM; i++) {
+        if (p->grown[i].mem != mem) continue;
+        grown = p->grown[i];
+        p->grown[i].mem = 0;
+        p->grown_size -= grown.size;
+        break;
+    }
+    kp_unlock_irqrestore(&p->lock, flags);
+
+    if (!grown.mem) return;
+    pool_exec((uint64_t)grown.mem, grown.size, 0);
+    vfree(grown.mem);
+}
+
+void kp_pool_stat(int exec, kp_pool_stat_t *stat)
+{
+    int32_t pool = exec ? KP_POOL_ROX : KP_POOL_RW;
+    kp_pool_t *p = &kp_pools[pool];
+
+    uint64_t flags = kp_lock_irqsave(&p->lock);
+    tlsf_stat(pool_tlsf(pool), &stat->tlsf);
+    stat->grown = p->grown_size;
+    kp_unlock_irqrestore(&p->lock, flags);
+
+    // cached blocks are used in tlsf, but still free to callers
+    stat->cached = 0;
+    for (int32_t cpu = 0; cpu < KP_MAG_CPU_NUM; cpu++) {
+        for (int32_t class = 0; class < KP_MAG_CLASS_NUM; class++) {
+            kp_mag_t *mag = &p->mags[cpu][class];
+            flags = kp_lock_irqsave(&mag->lock);
+            for (int32_t i = 0; i < mag->num; i++) {
+                stat->cached += tlsf_block_size(mag->objs[i]);
+            }
+            kp_unlock_irqrestore(&mag->lock, flags);
+        }
+    }
+}
+KP_EXPORT_SYMBOL(kp_pool_stat);
+
+void kp_pool_reset_peak(int exec)
+{
+    int32_t pool = exec ? KP_POOL_ROX : KP_POOL_RW;
+    kp_pool_t *p = &kp_pools[pool];
+    uint64_t flags = kp_lock_irqsave(&p->lock);
+    tlsf_reset_peak(pool_tlsf(pool));
+    kp_unlock_irqrestore(&p->lock, flags);
+}
+
+int is_kp_pool_exec_area(unsigned long addr)
+{
+    kp_grown_t *grown = kp_pools[KP_POOL_ROX].grown;
+    for (int32_t i = 0; i < KP_POOL_GROW_NUM; i++) {
+        uint64_t start = (uint64_t)grown[i].mem;
+        if (start && addr >= start && addr < start + grown[i].size) return 1;
+    }
+    return 0;
+}
+
+void *kp_malloc_exec(size_t bytes)
+{
+    return pool_alloc(KP_POOL_ROX, 0, bytes);
+}
+
+void *kp_memalign_exec(size_t align, size_t bytes)
+{
+    return pool_alloc(KP_POOL_ROX, align, bytes);
+}
+
+void *kp_realloc_exec(void *ptr, size_t size)
+{
+    return pool_realloc(KP_POOL_ROX, ptr, size);
+}
+
+void kp_free_exec(void *ptr)
+{
+    pool_free(KP_POOL_ROX, ptr);
+}
+
+void *kp_malloc(size_t bytes)
+{
+    return pool_alloc(KP_POOL_RW, 0, bytes);
+}
+KP_EXPORT_SYMBOL(kp_malloc);
+
+void *kp_memalign(size_t align, size_t bytes)
+{
+    return pool_alloc(KP_POOL_RW, align, bytes);
+}
+KP_EXPORT_SYMBOL(kp_memalign);
+
+void *kp_realloc(void *ptr, size_t size)
+{
+    return pool_realloc(KP_POOL_RW, ptr, size);
+}
+KP_EXPORT_SYMBOL(kp_realloc);
+
+void kp_free(void *ptr)
+{
+    pool_free(KP_POOL_RW, ptr);
+}
+KP_EXPORT_SYMBOL(kp_free);
+
+void kp_free_uncached(void *ptr)
+{
+    if (ptr) pool_free_uncached(KP_POOL_RW, ptr);
+}
+KP_EXPORT_SYMBOL(kp_free_uncached);
@@ -0,0 +1,274 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2024 bmax121. All Rights Reserved.
+ */
+
+#include <kpslab.h>
+
+#include <stdint.h>
+#include <log.h>
+#include <symbol.h>
+#include <baselib.h>
+#include <kpmalloc.h>
+#include "kplock.h"
+
+// cpus are hashed into freelist slots, must be a power of 2
+#define KP_SLAB_CPU_NUM 8
+#define KP_SLAB_CPU_MAX 32
+#define KP_SLAB_BATCH (KP_SLAB_CPU_MAX / 2)
+
+// chunks are aligned to their size, so the chunk of an object is found by masking its address
+#define KP_SLAB_CHUNK_SIZE 0x4000
+#define KP_SLAB_CHUNK_OBJS_MIN 8
+// entirely free chunks kept for reuse, more are given back to kp_rw_mem
+#define KP_SLAB_EMPTY_KEEP 1
+
+typedef struct kp_slab_chunk
+{
+    struct kp_slab_chunk *next;
+    struct kp_slab_chunk *prev;
+    void *free;
+    int32_t used;
+    int32_t num;
+} kp_slab_chunk_t;
+
+typedef struct
+{
+    kp_lock_t lock;
+    int32_t num;
+    void *head;
+} __attribute__((aligned(64))) kp_slab_cpu_t;
+
+struct kp_slab
+{
+    kp_lock_t lock;
+    uint32_t size;
+    // of the first object in a chunk
+    uint32_t offset;
+    int32_t per_chunk;
+    size_t chunk_size;
+    // chunks with free objects, full chunks are not linked
+    kp_slab_chunk_t *partial;
+    int32_t chunks;
+    int32_t empty;
+    // objects out of their chunks, including those in per cpu lists
+    int32_t used;
+    kp_slab_cpu_t cpus[KP_SLAB_CPU_NUM];
+};
+
+static void chunk_link(kp_slab_t *slab, kp_slab_chunk_t *chunk)
+{
+    chunk->prev = 0;
+    chunk->next = slab->partial;
+    if (slab->partial) slab->partial->prev = chunk;
+    slab->partial = chunk;
+}
+
+static void chunk_unlink(kp_slab_t *slab, kp_slab_chunk_t *chunk)
+{
+    if (chunk->prev) {
+        chunk->prev->next = chunk->next;
+    } else {
+        slab->partial = chunk->next;
+    }
+    if (chunk->next) chunk->next->prev = chunk->prev;
+    chunk->next = 0;
+    chunk->prev = 0;
+}
+
+static inline kp_slab_chunk_t *obj_chunk(kp_slab_t *slab, void *obj)
+{
+    return (kp_slab_chunk_t *)((uintptr_t)obj & ~(slab->chunk_size - 1));
+}
+
+// slab lock held
+static void slab_refill(kp_slab_t *slab, kp_slab_cpu_t *cpu)
+{
+    while (cpu->num < KP_SLAB_BATCH && slab->partial) {
+        kp_slab_chunk_t *chunk = slab->partial;
+        if (!chunk->used) slab->empty--;
+        while (cpu->num < KP_SLAB_BATCH && chunk->free) {
+            void *obj = chunk->free;
+            chunk->free = *(void **)obj;
+            *(void **)obj = cpu->head;
+            cpu->head = obj;
+            cpu->num++;
+            chunk->used++;
+            slab->used++;
+        }
+        if (!chunk->free) chunk_unlink(slab, chunk);
+    }
+}
+
+// slab lock held, returns the chunks to give back once no lock is held
+static kp_slab_chunk_t *slab_flush(kp_slab_t *slab, kp_slab_cpu_t *cpu, int32_t keep)
+{
+    kp_slab_chunk_t *release = 0;
+    while (cpu->num > keep) {
+        void *obj = cpu->head;
+        cpu->head = *(void **)obj;
+        cpu->num--;
+
+        kp_slab_chunk_t *chunk = obj_chunk(slab, obj);
+        if (!chunk->free) chunk_link(slab, chunk);
+        *(void **)obj = chunk->free;
+        chunk->free = obj;
+        chunk->used--;
+        slab->used--;
+
+        if (chunk->used) continue;
+        if (slab->empty < KP_SLAB_EMPTY_KEEP) {
+            slab->empty++;
+            continue;
+        }
+        chunk_unlink(slab, chunk);
+        slab->chunks--;
+        chunk->next = release;
+        release = chunk;
+    }
+    return release;
+}
+
+static void chunks_release(kp_slab_chunk_t *chunk)
+{
+    while (chunk) {
+        kp_slab_chunk_t *next = chunk->next;
+        kp_free(chunk);
+        chunk = next;
+    }
+}
+
+// no lock may be held while a chunk is taken from kp_rw_mem
+static int slab_grow(kp_slab_t *slab)
+{
+    kp_slab_chunk_t *chunk = (kp_slab_chunk_t *)kp_memalign(slab->chunk_size, slab->chunk_size);
+    if (!chunk) return 0;
+    chunk->free = 0;
+    chunk->used = 0;
+    chunk->num = slab->per_chunk;
+    // lower addresses are handed out first
+    for (int32_t i = slab->per_chunk - 1; i >= 0; i--) {
+        void *obj = (void *)((uintptr_t)chunk + slab->offset + (uintptr_t)i * slab->size);
+        *(void **)obj = chunk->free;
+        chunk->free = obj;
+    }
+
+    uint64_t flags = kp_lock_irqsave(&slab->lock);
+    chunk_link(slab, chunk);
+    slab->chunks++;
+    slab->empty++;
+    kp_unlock_irqrestore(&slab->lock, flags);
+    return 1;
+}
+
+kp_slab_t *kp_slab_create(size_t size, size_t align)
+{
+    if (align < sizeof(void *)) align = sizeof(void *);
+    if (align & (align - 1)) return 0;
+    if (size < sizeof(void *)) size = sizeof(void *);
+    size = (size + align - 1) & ~(align - 1);
+
+    size_t offset = (sizeof(kp_slab_chunk_t) + align - 1) & ~(align - 1);
+    size_t chunk_size = KP_SLAB_CHUNK_SIZE;
+    while (chunk_size < offset || (chunk_size - offset) / size < KP_SLAB_CHUNK_OBJS_MIN) {
+        chunk_size <<= 1;
+    }
+
+    kp_slab_t *slab = (kp_slab_t *)kp_memalign(64, sizeof(kp_slab_t));
+    if (!slab) return 0;
+    lib_memset(slab, 0, sizeof(kp_slab_t));
+    slab->size = size;
+    slab->offset = offset;
+    slab->per_chunk = (chunk_size - offset) / size;
+    slab->chunk_size = chunk_size;
+    logkv("kp slab: %llx, size: %llx, chunk: %llx, per chunk: %d\n", slab, size, chunk_size, slab->per_chunk);
+    return slab;
+}
+KP_EXPORT_SYMBOL(kp_slab_create);
+
+// every object must have been freed
+void kp_slab_destroy(kp_slab_t *slab)
+{
+    if (!slab) return;
+    for (int32_t i = 0; i < KP_SLAB_CPU_NUM; i++) {
+        kp_slab_cpu_t *cpu = &slab->cpus[i];
+        uint64_t flags = kp_lock_irqsave(&cpu->lock);
+        kp_lock(&slab->lock);
+        kp_slab_chunk_t *release = slab_flush(slab, cpu, 0);
+        kp_unlock(&slab->lock);
+        kp_unlock_irqrestore(&cpu->lock, flags);
+        chunks_release(release);
+    }
+    if (slab->used) logkw("kp slab: %llx destroyed with %d objects in use\n", slab, slab->used);
+
+    // chunks still in use are leaked rather than freed under their users
+    kp_slab_chunk_t *chunk = slab->partial;
+    while (chunk) {
+        kp_slab_chunk_t *next = chunk->next;
+        if (!chunk->used) kp_free(chunk);
+        chunk = next;
+    }
+    kp_free(slab);
+}
+KP_EXPORT_SYMBOL(kp_slab_destroy);
+
+void *kp_slab_alloc(kp_slab_t *slab)
+{
+    if (!slab) return 0;
+    for (int32_t retry = 0; retry < 2; retry++) {
+        kp_slab_cpu_t *cpu = &slab->cpus[kp_cpu_slot(KP_SLAB_CPU_NUM)];
+        uint64_t flags = kp_lock_irqsave(&cpu->lock);
+        if (!cpu->head) {
+            kp_lock(&slab->lock);
+            slab_refill(slab, cpu);
+            kp_unlock(&slab->lock);
+        }
+        void *obj = cpu->head;
+        if (obj) {
+            cpu->head = *(void **)obj;
+            cpu->num--;
+        }
+        kp_unlock_irqrestore(&cpu->lock, flags);
+
+        if (obj) return obj;
+        if (!slab_grow(slab)) break;
+    }
+    return 0;
+}
+KP_EXPORT_SYMBOL(kp_slab_alloc);
+
+void kp_slab_free(kp_slab_t *slab, void *obj)
+{
+    if (!obj) return;
+    kp_slab_chunk_t *release = 0;
+    kp_slab_cpu_t *cpu = &slab->cpus[kp_cpu_slot(KP_SLAB_CPU_NUM)];
+    uint64_t flags = kp_lock_irqsave(&cpu->lock);
+    *(void **)obj = cpu->head;
+    cpu->head = obj;
+    cpu->num++;
+    if (cpu->num > KP_SLAB_CPU_MAX) {
+        kp_lock(&slab->lock);
+        release = slab_flush(slab, cpu, KP_SLAB_BATCH);
+        kp_unlock(&slab->lock);
+    }
+    kp_unlock_irqrestore(&cpu->lock, flags);
+    chunks_release(release);
+}
+KP_EXPORT_SYMBOL(kp_slab_free);
+
+void kp_slab_stat(kp_slab_t *slab, kp_slab_stat_t *stat)
+{
+    int32_t cached = 0;
+    for (int32_t i = 0; i < KP_SLAB_CPU_NUM; i++) {
+        cached += *(volatile int32_t *)&slab->cpus[i].num;
+    }
+    uint64_t flags = kp_lock_irqsave(&slab->lock);
+    stat->obj_size = slab->size;
+    stat->chunk_size = slab->chunk_size;
+    stat->chunks = slab->chunks;
+    stat->objs = slab->chunks * slab->per_chunk;
+    stat->used = slab->used - cached;
+    kp_unlock_irqrestore(&slab->lock, flags);
+    stat->cached = cached;
+}
+KP_EXPORT_SYMBOL(kp_slab_stat);
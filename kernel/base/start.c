@@ -18,7 +18,9 @@
 #include "start.h"
 #include "hook.h"
 #include "tlsf.h"
+#include "kpmalloc.h"
 #include "hmem.h"
+#include "hchain.h"
 #include "setup.h"
 
 #define bits(n, high, low) (((n) << (63u - (high))) >> (63u - (high) + (low)))
@@ -174,11 +176,10 @@ uint64_t *pgtable_entry(uint64_t pgd, uint64_t va)
 }
 KP_EXPORT_SYMBOL(pgtable_entry);
 
-void modify_entry_kernel(uint64_t va, uint64_t *entry, uint64_t value)
+void modify_entry_kernel_nosync(uint64_t va, uint64_t *entry, uint64_t value)
 {
     if (!pte_valid_cont(*entry) && !pte_valid_cont(value)) {
         *entry = value;
-        flush_tlb_kernel_page(va);
         return;
     }
 
@@ -189,6 +190,18 @@ void modify_entry_kernel(uint64_t va, uint64_t *entry, uint64_t value)
         *p = (*p & table_pa_mask) | prot;
 
     *entry = value;
+}
+KP_EXPORT_SYMBOL(modify_entry_kernel_nosync);
+
+void modify_entry_kernel(uint64_t va, uint64_t *entry, uint64_t value)
+{
+    // a contiguous run is flushed as a whole, before or after the change
+    int cont = pte_valid_cont(*entry) || pte_valid_cont(value);
+    modify_entry_kernel_nosync(va, entry, value);
+    if (!cont) {
+        flush_tlb_kernel_page(va);
+        return;
+    }
     va &= CONT_PTE_MASK;
     flush_tlb_kernel_range(va, va + CONT_PTES * page_size);
 }
@@ -199,8 +212,8 @@ static void prot_myself()
     log_boot("Kernel stext prot: %llx\n", *kpte);
 
     _kp_region_start = (uint64_t)_kp_text_start;
-    _kp_region_end = (uint64_t)_kp_end + align_ceil(start_preset.extra_size, page_size) + HOOK_ALLOC_SIZE +
-                     MEMORY_ROX_SIZE + MEMORY_RW_SIZE;
+    _kp_region_end = (uint64_t)_kp_end + align_ceil(start_preset.extra_size, page_size) +
+                     start_preset.hook_alloc_size + MEMORY_ROX_SIZE + MEMORY_RW_SIZE;
     log_boot("Region: %llx, %llx\n", _kp_region_start, _kp_region_end);
 
     uint64_t *kppte = pgtable_entry_kernel(_kp_region_start);
@@ -253,7 +266,7 @@ static void prot_myself()
 
     // rwx for hook
     _kp_hook_start = (uint64_t)align_extra_end;
-    _kp_hook_end = _kp_hook_start + HOOK_ALLOC_SIZE;
+    _kp_hook_end = _kp_hook_start + start_preset.hook_alloc_size;
     log_boot("Hook: %llx, %llx\n", _kp_hook_start, _kp_hook_end);
 
     for (uint64_t i = _kp_hook_start; i < _kp_hook_end; i += page_size) {
@@ -261,7 +274,7 @@ static void prot_myself()
         *pte = (*pte | PTE_DBM | PTE_SHARED) & ~PTE_PXN & ~PTE_RDONLY & ~PTE_GP;
     }
     flush_tlb_kernel_range(_kp_hook_start, _kp_hook_end);
-    hook_mem_add(_kp_hook_start, HOOK_ALLOC_SIZE);
+    hook_mem_add(_kp_hook_start, start_preset.hook_alloc_size);
 
     // rw memory
     _kp_rw_start = _kp_hook_end;
@@ -276,17 +289,14 @@ static void prot_myself()
         }
     }
     flush_tlb_kernel_range(_kp_rw_start, _kp_rw_end);
-    kp_rw_mem = tlsf_create_with_pool((void *)_kp_rw_start, MEMORY_RW_SIZE);
 
     // rox memory
-    kp_rox_mem = tlsf_malloc(kp_rw_mem, tlsf_size());
-    tlsf_create(kp_rox_mem);
-
     _kp_rox_start = _kp_rw_end;
     _kp_rox_end = _kp_rox_start + MEMORY_ROX_SIZE;
     log_boot("ROX: %llx, %llx\n", _kp_rox_start, _kp_rox_end);
 
-    tlsf_add_pool(kp_rox_mem, (void *)_kp_rox_start, MEMORY_ROX_SIZE);
+    kp_malloc_init((void *)_kp_rw_start, MEMORY_RW_SIZE, (void *)_kp_rox_start, MEMORY_ROX_SIZE);
+    hook_chain_init();
 
     for (uint64_t i = _kp_rox_start; i < _kp_rox_end; i += page_size) {
         uint64_t *pte = pgtable_entry_kernel(i);
@@ -331,7 +341,7 @@ static void restore_map()
         *pte = orig;
         flush_tlb_kernel_page(i);
     }
-    flush_icache_all();
+    flush_icache_range(start, end);
 }
 
 #define log_reg(regname)                                                   \
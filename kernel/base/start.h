@@ -18,6 +18,7 @@ typedef struct
     int64_t kernel_size;
     int64_t start_offset;
     int64_t extra_size;
+    int64_t hook_alloc_size;
     uint64_t kernel_pa;
     int64_t map_offset;
     int64_t map_backup_len;
@@ -31,7 +32,8 @@ typedef struct
 #define start_kernel_size_offset (start_kallsyms_lookup_name_offset_offset + 8)
 #define start_start_offset_offset (start_kernel_size_offset + 8)
 #define start_extra_size_offset (start_start_offset_offset + 8)
-#define start_kernel_pa_offset (start_extra_size_offset + 8)
+#define start_hook_alloc_size_offset (start_extra_size_offset + 8)
+#define start_kernel_pa_offset (start_hook_alloc_size_offset + 8)
 #define start_map_offset_offset (start_kernel_pa_offset + 8)
 #define start_map_backup_len_offset (start_map_offset_offset + 8)
 #define start_map_backup_offset (start_map_backup_len_offset + 8)
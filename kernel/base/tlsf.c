@@ -361,6 +361,11 @@ typedef struct control_t
 
     /* Head of free lists. */
     block_header_t *blocks[FL_INDEX_COUNT][SL_INDEX_COUNT];
+
+    /* Bytes in pools and in used blocks, headers excluded. */
+    size_t total;
+    size_t used;
+    size_t peak;
 } control_t;
 
 /* A type used for casting when doing pointer arithmetic. */
@@ -770,6 +775,8 @@ static void *block_prepare_used(control_t *control, block_header_t *block, size_
         tlsf_assert(size && "size must be non-zero");
         block_trim_free(control, block, size);
         block_mark_as_used(block);
+        control->used += block_size(block);
+        if (control->used > control->peak) control->peak = control->used;
         p = block_to_ptr(block);
     }
     return p;
@@ -783,6 +790,10 @@ static void control_construct(control_t *control)
     control->block_null.next_free = &control->block_null;
     control->block_null.prev_free = &control->block_null;
 
+    control->total = 0;
+    control->used = 0;
+    control->peak = 0;
+
     control->fl_bitmap = 0;
     for (i = 0; i < FL_INDEX_COUNT; ++i) {
         control->sl_bitmap[i] = 0;
@@ -899,6 +910,51 @@ size_t tlsf_block_size(void *ptr)
     return size;
 }
 
+void tlsf_usage(tlsf_t tlsf, size_t *total, size_t *used)
+{
+    control_t *control = tlsf_cast(control_t *, tlsf);
+    *total = control->total;
+    *used = control->used;
+}
+
+/*
+** Counters are kept as blocks change hands, the free lists are only
+** walked here.
+*/
+void tlsf_stat(tlsf_t tlsf, tlsf_stat_t *stat)
+{
+    control_t *control = tlsf_cast(control_t *, tlsf);
+    int fl, sl;
+
+    stat->total = control->total;
+    stat->used = control->used;
+    stat->peak = control->peak;
+    stat->free_blocks = 0;
+    stat->largest_free = 0;
+    for (fl = 0; fl < TLSF_STAT_FL_NUM; ++fl) {
+        stat->fl_free[fl] = 0;
+    }
+
+    for (fl = 0; fl < FL_INDEX_COUNT; ++fl) {
+        if (!(control->fl_bitmap & (1U << fl))) continue;
+        for (sl = 0; sl < SL_INDEX_COUNT; ++sl) {
+            block_header_t *block = control->blocks[fl][sl];
+            for (; block != &control->block_null; block = block->next_free) {
+                const size_t size = block_size(block);
+                if (fl < TLSF_STAT_FL_NUM) stat->fl_free[fl]++;
+                stat->free_blocks++;
+                if (size > stat->largest_free) stat->largest_free = size;
+            }
+        }
+    }
+}
+
+void tlsf_reset_peak(tlsf_t tlsf)
+{
+    control_t *control = tlsf_cast(control_t *, tlsf);
+    control->peak = control->used;
+}
+
 int tlsf_check_pool(pool_t pool)
 {
     /* Check that the blocks are physically correct. */
@@ -981,6 +1037,7 @@ pool_t tlsf_add_pool(tlsf_t tlsf, void *mem, size_t bytes)
     block_set_free(block);
     block_set_prev_used(block);
     block_insert(tlsf_cast(control_t *, tlsf), block);
+    tlsf_cast(control_t *, tlsf)->total += pool_bytes;
 
     /* Split the block to create a zero-size sentinel block. */
     next = block_link_next(block);
@@ -1004,6 +1061,7 @@ void tlsf_remove_pool(tlsf_t tlsf, pool_t pool)
 
     mapping_insert(block_size(block), &fl, &sl);
     remove_free_block(control, block, fl, sl);
+    control->total -= block_size(block);
 }
 
 /*
@@ -1139,6 +1197,7 @@ void tlsf_free(tlsf_t tlsf, void *ptr)
         control_t *control = tlsf_cast(control_t *, tlsf);
         block_header_t *block = block_from_ptr(ptr);
         tlsf_assert(!block_is_free(block) && "block already marked as free");
+        control->used -= block_size(block);
         block_mark_as_free(block);
         block = block_merge_prev(control, block);
         block = block_merge_next(control, block);
@@ -1211,6 +1270,8 @@ void *tlsf_realloc(tlsf_t tlsf, void *ptr, size_t size)
 
             /* Trim the resulting block and return the original pointer. */
             block_trim_used(control, block, adjust);
+            control->used += block_size(block) - cursize;
+            if (control->used > control->peak) control->peak = control->used;
             p = ptr;
         }
     }
@@ -102,6 +102,43 @@ static inline void iciallu(void)
 {
     asm volatile("ic iallu" : : : "memory");
 }
+/* data cache clean by VA to PoU */
+static inline void dccvau(uint64_t va)
+{
+    asm volatile("dc cvau, %0" : : "r"(va) : "memory");
+}
+/* instruction cache invalidate by VA to PoU */
+static inline void icivau(uint64_t va)
+{
+    asm volatile("ic ivau, %0" : : "r"(va) : "memory");
+}
+/* read cache type register (CTR_EL0) */
+static inline uint64_t read_ctr(void)
+{
+    uint64_t ctr;
+    asm volatile("mrs %0, ctr_el0" : "=r"(ctr));
+    return ctr;
+}
+/* minimum D-cache line size in bytes, CTR_EL0.DminLine */
+static inline uint64_t dcache_line_size(void)
+{
+    return 4ul << ((read_ctr() >> 16) & 0xf);
+}
+/* minimum I-cache line size in bytes, CTR_EL0.IminLine */
+static inline uint64_t icache_line_size(void)
+{
+    return 4ul << (read_ctr() & 0xf);
+}
+/* CTR_EL0.IDC, D-cache clean to PoU not required for I/D coherence */
+static inline int ctr_idc(void)
+{
+    return (read_ctr() >> 28) & 1;
+}
+/* CTR_EL0.DIC, I-cache invalidation to PoU not required for I/D coherence */
+static inline int ctr_dic(void)
+{
+    return (read_ctr() >> 29) & 1;
+}
 
 void flush_cache_all(void);
 void flush_icache_range(unsigned long start, unsigned long end);
@@ -20,6 +20,8 @@ typedef enum
     HOOK_BAD_RELO = 4092,
     HOOK_TRANSIT_NO_MEM = 4091,
     HOOK_CHAIN_FULL = 4090,
+    HOOK_BUSY = 4089,
+    HOOK_ATOMIC = 4088, // called with irqs masked once booted, where the hook api may sleep
 } hook_err_t;
 
 enum hook_type
@@ -39,14 +41,37 @@ typedef int8_t chain_item_state;
 #define local_offsetof(TYPE, MEMBER) ((size_t) & ((TYPE *)0)->MEMBER)
 #define local_container_of(ptr, type, member) ({ (type *)((char *)(ptr) - local_offsetof(type, member)); })
 
-#define HOOK_MEM_REGION_NUM 4
+// the preset region and those chained on demand
+#define HOOK_MEM_REGION_NUM 8
 #define TRAMPOLINE_MAX_NUM 6
 #define RELOCATE_INST_NUM (4 * 8 + 8 - 4)
 
-#define HOOK_CHAIN_NUM 0x10
-#define TRANSIT_INST_NUM 0x60
+// callbacks stored inline with the chain, more go to hook_chain_ext_t blocks
+#define HOOK_CHAIN_NUM 0x4
 
-#define FP_HOOK_CHAIN_NUM 0x20
+// per chain entry stub, transits are shared
+#define HOOK_STUB_INST_NUM 0x8
+
+#define FP_HOOK_CHAIN_NUM 0x4
+
+// return-only callbacks of an inline chain, and the most arguments of the minimal transit running them
+#define HOOK_RET_NUM 0x4
+#define RET_TRANSIT_ARGNO_MAX 8
+
+// the minimal transit entered while an inline chain has a single before and after pair and nothing else
+#define ONE_TRANSIT_ARGNO_MAX 8
+
+#define HOOK_CHAIN_EXT_NUM 0x10
+
+// callbacks with higher priority run their before earlier and their after later
+#define HOOK_PRIORITY_DEFAULT 0
+
+#define HOOK_INFLIGHT_NUM 0x8
+
+#define HOOK_STATS_CPU_NUM 0x10
+#define HOOK_STATS_HIST_NUM 0x10
+
+#define HOOK_BATCH_NUM 0x40
 
 #define ARM64_NOP 0xd503201f
 #define ARM64_BTI_C 0xd503245f
@@ -74,6 +99,10 @@ struct _hook_chain;
 
 #define HOOK_LOCAL_DATA_NUM 8
 
+// values a before sets skip_origin to, HOOK_SKIP_CHAIN also skips the callbacks ordered after it
+#define HOOK_SKIP_ORIGIN 1
+#define HOOK_SKIP_CHAIN 2
+
 typedef struct
 {
     union
@@ -97,6 +126,7 @@ typedef struct
 {
     void *chain;
     int skip_origin;
+    int inflight_idx; // counter the call is in while it runs the chain, for hook_drain_from
     hook_local_t local;
     uint64_t ret;
     union
@@ -112,6 +142,7 @@ typedef struct
 {
     void *chain;
     int skip_origin;
+    int inflight_idx; // counter the call is in while it runs the chain, for hook_drain_from
     hook_local_t local;
     uint64_t ret;
     union
@@ -135,6 +166,7 @@ typedef struct
 {
     void *chain;
     int skip_origin;
+    int inflight_idx; // counter the call is in while it runs the chain, for hook_drain_from
     hook_local_t local;
     uint64_t ret;
     union
@@ -162,6 +194,7 @@ typedef struct
 {
     void *chain;
     int skip_origin;
+    int inflight_idx; // counter the call is in while it runs the chain, for hook_drain_from
     hook_local_t local;
     uint64_t ret;
     union
@@ -203,16 +236,86 @@ typedef void (*hook_chain10_callback)(hook_fargs10_t *fargs, void *udata);
 typedef void (*hook_chain11_callback)(hook_fargs11_t *fargs, void *udata);
 typedef void (*hook_chain12_callback)(hook_fargs12_t *fargs, void *udata);
 
+typedef void (*hook_ret_callback)(uint64_t ret, uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3,
+                                  void *udata);
+
+// padded to a cache line, cpus hashed to the same slot share it
+typedef struct __attribute__((aligned(64)))
+{
+    uint64_t calls;
+    uint64_t skips;
+    uint64_t before_ticks;
+    uint64_t origin_ticks;
+    uint64_t after_ticks;
+    // hist[i] counts calls taking [2^(i-1), 2^i) cntvct ticks in total, the last one everything above
+    uint64_t hist[HOOK_STATS_HIST_NUM];
+} hook_stats_cpu_t;
+
+typedef struct _hook_chain_stats
+{
+    // called by transits while stats are enabled
+    void (*record)(struct _hook_chain_stats *stats, uint64_t t0, uint64_t t1, uint64_t t2, uint64_t t3,
+                   int skip_origin);
+    // cpus are hashed into the slots, counters are only ever added to atomically
+    hook_stats_cpu_t cpus[HOOK_STATS_CPU_NUM];
+    // sums at the last reset, subtracted when read
+    hook_stats_cpu_t base;
+} hook_chain_stats_t;
+
+// per-cpu slot of in-flight calls, one cache line each, calls entering with inflight_idx count in count[inflight_idx]
+typedef struct
+{
+    int64_t count[2];
+    int64_t _pad[6];
+} hook_inflight_t;
+
+typedef struct _hook_chain_ext
+{
+    struct _hook_chain_ext *next;
+    struct _hook_chain_ext *prev;
+    int32_t chain_items_max;
+    chain_item_state states[HOOK_CHAIN_EXT_NUM];
+    uint32_t seqs[HOOK_CHAIN_EXT_NUM];
+    int32_t priorities[HOOK_CHAIN_EXT_NUM];
+    void *udata[HOOK_CHAIN_EXT_NUM];
+    void *befores[HOOK_CHAIN_EXT_NUM];
+    void *afters[HOOK_CHAIN_EXT_NUM];
+} hook_chain_ext_t __attribute__((aligned(8)));
+
 typedef struct _hook_chain
 {
     // must be the first element
     hook_t hook;
     int32_t chain_items_max;
     chain_item_state states[HOOK_CHAIN_NUM];
+    // odd while a slot is being written, transits skip a slot whose count moved while reading it
+    uint32_t seqs[HOOK_CHAIN_NUM];
+    // callbacks are kept sorted by priority, descending, in insertion order among equals
+    int32_t priorities[HOOK_CHAIN_NUM];
     void *udata[HOOK_CHAIN_NUM];
     void *befores[HOOK_CHAIN_NUM];
     void *afters[HOOK_CHAIN_NUM];
-    uint32_t transit[TRANSIT_INST_NUM];
+    // overflow blocks, befores run forward from ext, afters run backward from ext_last
+    hook_chain_ext_t *ext;
+    hook_chain_ext_t *ext_last;
+    // null when stats are disabled, stats_mem keeps the counters across disable and enable
+    hook_chain_stats_t *stats;
+    hook_chain_stats_t *stats_mem;
+    // callers still inside the transit or a callback, hook_drain waits for them before memory is reused
+    int32_t inflight_idx;
+    int32_t inflight_dirty;
+    hook_inflight_t inflight[HOOK_INFLIGHT_NUM];
+    int32_t argno;
+    // a callback is set after its udata, so a non-null callback is ready
+    hook_ret_callback ret_callbacks[HOOK_RET_NUM];
+    void *ret_udata[HOOK_RET_NUM];
+    // the trampoline branches here, its literal selects the full, the return-only or the single callback transit
+    uint32_t transit[HOOK_STUB_INST_NUM] __attribute__((aligned(8)));
+    // copy of the only callback for the single callback transit, read like a slot, odd one_seq while written
+    uint32_t one_seq;
+    void *one_before;
+    void *one_after;
+    void *one_udata;
 } hook_chain_t __attribute__((aligned(8)));
 
 typedef struct
@@ -227,15 +330,29 @@ typedef struct _fphook_chain
     fp_hook_t hook;
     int32_t chain_items_max;
     chain_item_state states[FP_HOOK_CHAIN_NUM];
+    uint32_t seqs[FP_HOOK_CHAIN_NUM];
+    int32_t priorities[FP_HOOK_CHAIN_NUM];
     void *udata[FP_HOOK_CHAIN_NUM];
     void *befores[FP_HOOK_CHAIN_NUM];
     void *afters[FP_HOOK_CHAIN_NUM];
-    uint32_t transit[TRANSIT_INST_NUM];
+    hook_chain_ext_t *ext;
+    hook_chain_ext_t *ext_last;
+    hook_chain_stats_t *stats;
+    hook_chain_stats_t *stats_mem;
+    int32_t inflight_idx;
+    int32_t inflight_dirty;
+    hook_inflight_t inflight[HOOK_INFLIGHT_NUM];
+    uint32_t transit[HOOK_STUB_INST_NUM] __attribute__((aligned(8)));
 } fp_hook_chain_t __attribute__((aligned(8)));
 
 static inline int is_bad_address(void *addr)
 {
+#ifdef KP_HOST_TEST
+    // test/ runs the hook engine in user space
+    return !addr;
+#else
     return ((uint64_t)addr & 0x8000000000000000) != 0x8000000000000000;
+#endif
 }
 
 int32_t branch_from_to(uint32_t *tramp_buf, uint64_t src_addr, uint64_t dst_addr);
@@ -243,9 +360,114 @@ int32_t branch_relative(uint32_t *buf, uint64_t src_addr, uint64_t dst_addr);
 int32_t branch_absolute(uint32_t *buf, uint64_t addr);
 int32_t ret_absolute(uint32_t *buf, uint64_t addr);
 
+/*
+ * Once the kernel is booted the calls below, except the branch helpers and hook_prepare, may sleep, on the hook
+ * lock, in hook_drain or in stop_machine, so they must be made from process context. A caller with irqs masked
+ * gets -HOOK_ATOMIC without anything being changed, calls without a result just return. A caller that only
+ * disabled preemption, e.g. by holding a spinlock, can not be told apart and must not make them.
+ */
+
 hook_err_t hook_prepare(hook_t *hook);
-void hook_install(hook_t *hook);
-void hook_uninstall(hook_t *hook);
+
+/**
+ * @brief Patch the trampoline of @param hook in, or the saved origin instructions back.
+ * Inside a batch the text is only queued and errors are returned by hook_batch_commit.
+ * 
+ * @return hook_err_t -HOOK_BUSY if a task was running the instructions to be patched, the text is unchanged then
+ */
+hook_err_t hook_install(hook_t *hook);
+hook_err_t hook_uninstall(hook_t *hook);
+
+/**
+ * @brief Start collecting hook_install and hook_uninstall calls instead of patching text one by one.
+ * Calls can be nested, text is patched when the outermost hook_batch_commit is called.
+ * The batch belongs to the calling task, it holds the hook lock until then and hook calls of others wait.
+ * 
+ * @note Hooks added in a batch are not active until the batch is committed.
+ * Must be called from sleepable context, and committed by the same task.
+ * 
+ * @see hook_batch_commit
+ * @return hook_err_t -HOOK_ATOMIC if called with irqs masked, no batch is started then
+ */
+hook_err_t hook_batch_begin();
+
+/**
+ * @brief Patch all pending hooks with a single kp_insn_patch_text call, 
+ * one pte flip per page, one tlb sync and one ranged i-cache maintenance pass over the touched lines.
+ * If that fails, the hooks are patched one by one, uninstalls that still fail are kept in use.
+ * 
+ * @return hook_err_t the first error of the batch
+ */
+hook_err_t hook_batch_commit();
+
+int32_t hook_batch_depth();
+
+/**
+ * @brief Wait until no caller can still be running code that was unhooked.
+ * Unhooked hook memory is retired instead of freed, this waits for the calls still inside retired transits
+ * and for the calls into chains that had callbacks removed, then frees the retired memory. Preemptible kernels
+ * without rcu tasks keep it retired, as a call preempted before it is counted can not be waited for.
+ * Must be called from sleepable context, e.g. before freeing the text of a module that removed its hooks.
+ * 
+ * @return hook_err_t -HOOK_BUSY if some calls did not leave within the timeout, nothing retired is freed then
+ */
+hook_err_t hook_drain();
+
+/**
+ * @brief hook_drain from a before or after callback, e.g. of a syscall that unloads a module.
+ * The calling call itself is not waited for, though its chain may have had callbacks removed.
+ * 
+ * @param fargs the fargs the callback got, 0 is the same as hook_drain
+ * @return hook_err_t -HOOK_BUSY also if the chain of the calling call is retired, it can not be freed under it
+ */
+hook_err_t hook_drain_from(void *fargs);
+
+/**
+ * @brief Enable or disable per-cpu call counters and latency histograms on every hook chain,
+ * including chains created later. Disabled chains cost a load and a branch per call.
+ * 
+ * @param enable 
+ */
+void hook_stats_enable(int enable);
+
+int hook_stats_enabled();
+
+/**
+ * @brief Start the counters of every hook chain over, calls still being recorded are not lost or torn.
+ * 
+ */
+void hook_stats_reset();
+
+typedef int (*hook_stats_cb)(enum hook_type type, uint64_t addr, int32_t callbacks, const hook_stats_cpu_t *sum,
+                             void *udata);
+
+/**
+ * @brief Call @param cb for each hook chain with its counters summed across cpus,
+ * iteration stops when @param cb returns non-zero.
+ * 
+ * @param cb 
+ * @param udata 
+ * @return int number of chains visited
+ */
+int hook_stats_for_each(hook_stats_cb cb, void *udata);
+
+typedef struct
+{
+    int32_t regions;
+    int32_t slot_size;
+    int32_t slots;
+    int32_t used;
+    int32_t retired;
+    int32_t peak;
+} hook_mem_stat_t;
+
+/**
+ * @brief Usage of hook memory, slots are counted across every region.
+ * Retired slots are unhooked but not yet freed by hook_drain.
+ * 
+ * @param stat 
+ */
+void hook_mem_stat(hook_mem_stat_t *stat);
 
 /**
  * @brief Inline-hook function which address is @param func with function @param replace, 
@@ -267,8 +489,9 @@ hook_err_t hook(void *func, void *replace, void **backup);
  * @brief unhook of hooked function
  * 
  * @param func 
+ * @return hook_err_t the hook is kept on error
  */
-void unhook(void *func);
+hook_err_t unhook(void *func);
 
 /**
  * @brief 
@@ -280,19 +503,38 @@ void unhook(void *func);
  * @return hook_err_t 
  */
 hook_err_t hook_chain_add(hook_chain_t *chain, void *before, void *after, void *udata);
+
+/**
+ * @brief Add callbacks to @param chain ordered by @param priority.
+ * Befores run from the highest priority to the lowest, afters in the reverse order,
+ * callbacks with equal priority run in the order they were added.
+ * 
+ * @param chain 
+ * @param before 
+ * @param after 
+ * @param udata 
+ * @param priority 
+ * @return hook_err_t 
+ */
+hook_err_t hook_chain_add_priority(hook_chain_t *chain, void *before, void *after, void *udata, int32_t priority);
+
 /**
  * @brief 
  * 
  * @param chain 
  * @param before 
  * @param after 
+ * @return hook_err_t
  */
-void hook_chain_remove(hook_chain_t *chain, void *before, void *after);
+hook_err_t hook_chain_remove(hook_chain_t *chain, void *before, void *after);
 
 /**
  * @brief Wrap a function with before and after function. 
  * The same function can do hook and unhook multiple times 
  * 
+ * @note While a function with up to ONE_TRANSIT_ARGNO_MAX arguments has a single before and after pair,
+ * calls go through a transit calling them directly, the stub switches back once another is added.
+ * 
  * @see hook_chain0_callback
  * @see hook_fargs0_t
  * 
@@ -306,6 +548,24 @@ void hook_chain_remove(hook_chain_t *chain, void *before, void *after);
  */
 hook_err_t hook_wrap(void *func, int32_t argno, void *before, void *after, void *udata);
 
+/**
+ * @brief Same as hook_wrap, with callbacks ordered by @param priority.
+ * A before setting skip_origin to HOOK_SKIP_CHAIN cuts the chain there: 
+ * befores and afters of lower ordered callbacks are not called for this call.
+ * Any other non-zero skip_origin skips the origin only, every callback still runs.
+ * 
+ * @see hook_chain_add_priority
+ * 
+ * @param func 
+ * @param argno 
+ * @param before 
+ * @param after 
+ * @param udata 
+ * @param priority 
+ * @return hook_err_t 
+ */
+hook_err_t hook_wrap_priority(void *func, int32_t argno, void *before, void *after, void *udata, int32_t priority);
+
 /**
  * @brief 
  * 
@@ -313,10 +573,36 @@ hook_err_t hook_wrap(void *func, int32_t argno, void *before, void *after, void
  * @param before 
  * @param after 
  * @param remove 
+ * @return hook_err_t the callbacks are removed even on error, the chain is then kept installed
+ */
+hook_err_t hook_unwrap_remove(void *func, void *before, void *after, int remove);
+
+/**
+ * @brief Call @param callback with the return value and the first four arguments each time @param func returns.
+ * Without befores and afters on the same function, calls go through a minimal transit that only saves
+ * the arguments, calls the origin and then the return callbacks, no hook_fargs is built.
+ * Can be mixed with hook_wrap on the same function, the full transit then calls them after the afters.
+ * 
+ * @note Functions with more than RET_TRANSIT_ARGNO_MAX arguments always use the full transit.
+ * 
+ * @param func 
+ * @param argno The number of method arguments
+ * @param callback 
+ * @param udata 
+ * @return hook_err_t 
  */
-void hook_unwrap_remove(void *func, void *before, void *after, int remove);
+hook_err_t hook_wrap_ret(void *func, int32_t argno, hook_ret_callback callback, void *udata);
 
-static inline void hook_unwrap(void *func, void *before, void *after)
+/**
+ * @brief 
+ * 
+ * @param func 
+ * @param callback 
+ * @return hook_err_t the callback is removed even on error, the chain is then kept installed
+ */
+hook_err_t hook_unwrap_ret(void *func, hook_ret_callback callback);
+
+static inline hook_err_t hook_unwrap(void *func, void *before, void *after)
 {
     return hook_unwrap_remove(func, before, after, 1);
 }
@@ -360,6 +646,22 @@ void fp_unhook(uintptr_t fp_addr, void *backup);
  */
 hook_err_t fp_hook_wrap(uintptr_t fp_addr, int32_t argno, void *before, void *after, void *udata);
 
+/**
+ * @brief Same as fp_hook_wrap, with callbacks ordered by @param priority.
+ * 
+ * @see hook_wrap_priority
+ * 
+ * @param fp_addr 
+ * @param argno 
+ * @param before 
+ * @param after 
+ * @param udata 
+ * @param priority 
+ * @return hook_err_t 
+ */
+hook_err_t fp_hook_wrap_priority(uintptr_t fp_addr, int32_t argno, void *before, void *after, void *udata,
+                                 int32_t priority);
+
 /**
  * @brief 
  * 
@@ -369,6 +671,35 @@ hook_err_t fp_hook_wrap(uintptr_t fp_addr, int32_t argno, void *before, void *af
  */
 void fp_hook_unwrap(uintptr_t fp_addr, void *before, void *after);
 
+/**
+ * @brief Wrap several function pointers of one table, e.g. a file_operations, with the same callbacks.
+ * Pointers are swapped together, each page holding them is made writable once for all of them.
+ * 
+ * @param table 
+ * @param indexes index of each function pointer in @param table
+ * @param n 
+ * @param argno 
+ * @param before 
+ * @param after 
+ * @param udata 
+ * @param results optional, @param n entries, the result of each index
+ * @return int32_t number of pointers wrapped
+ */
+int32_t fp_hook_table(void **table, const uint32_t *indexes, int32_t n, int32_t argno, void *before, void *after,
+                      void *udata, hook_err_t *results);
+
+/**
+ * @brief Unwrap the function pointers wrapped by fp_hook_table,
+ * pointers left without callbacks are restored together.
+ * 
+ * @param table 
+ * @param indexes 
+ * @param n 
+ * @param before 
+ * @param after 
+ */
+void fp_unhook_table(void **table, const uint32_t *indexes, int32_t n, void *before, void *after);
+
 /**
  * 
  */
@@ -379,14 +710,14 @@ static inline void *fp_get_origin_func(void *hook_args)
     return (void *)chain->hook.origin_fp;
 }
 
-static inline void hook_chain_install(hook_chain_t *chain)
+static inline hook_err_t hook_chain_install(hook_chain_t *chain)
 {
-    hook_install(&chain->hook);
+    return hook_install(&chain->hook);
 }
 
-static inline void hook_chain_uninstall(hook_chain_t *chain)
+static inline hook_err_t hook_chain_uninstall(hook_chain_t *chain)
 {
-    hook_uninstall(&chain->hook);
+    return hook_uninstall(&chain->hook);
 }
 
 static inline hook_err_t hook_wrap0(void *func, hook_chain0_callback before, hook_chain0_callback after, void *udata)
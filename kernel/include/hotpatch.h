@@ -8,6 +8,28 @@
 
 #include <stdint.h>
 
+void hotpatch_init();
+
+/**
+ * @brief Write instructions without stopping other cpus, one instruction per address.
+ * Only safe while the patched text can not be executing elsewhere.
+ * 
+ * @param addrs 
+ * @param insn 
+ * @param cnt 
+ * @return int 0 or -EINVAL
+ */
+int kp_insn_patch_text_nosync(void *addrs[], uint32_t insn[], int cnt);
+
+/**
+ * @brief Write instructions under stop_machine once it is usable, one instruction per address.
+ * Fails with -EBUSY if a task would return into the middle of the patched text.
+ * 
+ * @param addrs 
+ * @param insn 
+ * @param cnt 
+ * @return int 
+ */
 int kp_insn_patch_text(void *addrs[], uint32_t insn[], int cnt);
 
 #endif
\ No newline at end of file
@@ -6,44 +6,50 @@
 extern tlsf_t kp_rw_mem;
 extern tlsf_t kp_rox_mem;
 
-static inline void *kp_malloc_exec(size_t bytes)
-{
-    return tlsf_malloc(kp_rox_mem, bytes);
-}
-
-static inline void *kp_memalign_exec(size_t align, size_t bytes)
-{
-    return tlsf_memalign(kp_rox_mem, align, bytes);
-}
-
-static inline void *kp_realloc_exec(void *ptr, size_t size)
-{
-    return tlsf_realloc(kp_rox_mem, ptr, size);
-}
-
-static inline void kp_free_exec(void *ptr)
-{
-    tlsf_free(kp_rox_mem, ptr);
-}
-
-static inline void *kp_malloc(size_t bytes)
-{
-    return tlsf_malloc(kp_rw_mem, bytes);
-}
-
-static inline void *kp_memalign(size_t align, size_t bytes)
-{
-    return tlsf_memalign(kp_rw_mem, align, bytes);
-}
-
-static inline void *kp_realloc(void *ptr, size_t size)
-{
-    return tlsf_realloc(kp_rw_mem, ptr, size);
-}
-
-static inline void kp_free(void *ptr)
-{
-    tlsf_free(kp_rw_mem, ptr);
-}
-
-#endif
\ No newline at end of file
+/*
+ * Both pools are safe to use from any cpu and context, allocations and frees never sleep.
+ * Small blocks are cached per cpu and only reach tlsf, under its lock, in batches.
+ */
+void kp_malloc_init(void *rw, size_t rw_size, void *rox, size_t rox_size);
+int is_kp_pool_exec_area(unsigned long addr);
+
+typedef struct
+{
+    tlsf_stat_t tlsf;
+    // bytes held in per cpu caches, counted as used by tlsf
+    size_t cached;
+    // bytes added from vmalloc, for the exec pool those of kp_exec_region_alloc
+    size_t grown;
+} kp_pool_stat_t;
+
+void kp_pool_stat(int exec, kp_pool_stat_t *stat);
+void kp_pool_reset_peak(int exec);
+
+/*
+ * May sleep, only call it from process context, e.g. a supercall or module loading.
+ * Grows kp_rw_mem from vmalloc until a block of bytes and the low watermark are free,
+ * and gives back grown memory that has become entirely free since.
+ */
+int kp_pool_reserve(size_t bytes);
+
+/*
+ * May sleep. Executable memory from vmalloc, which may be out of branch range of kpimg and the kernel,
+ * only for code that branches absolutely, like hook regions. kp_rox_mem itself never grows.
+ */
+void *kp_exec_region_alloc(size_t size);
+void kp_exec_region_free(void *mem);
+
+void *kp_malloc_exec(size_t bytes);
+void *kp_memalign_exec(size_t align, size_t bytes);
+void *kp_realloc_exec(void *ptr, size_t size);
+void kp_free_exec(void *ptr);
+
+void *kp_malloc(size_t bytes);
+void *kp_memalign(size_t align, size_t bytes);
+void *kp_realloc(void *ptr, size_t size);
+void kp_free(void *ptr);
+
+// straight back to the pool, skipping the per cpu magazines, as kp_memalign with an alignment does on allocation
+void kp_free_uncached(void *ptr);
+
+#endif
@@ -0,0 +1,36 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2024 bmax121. All Rights Reserved.
+ */
+
+#ifndef _KP_KPSLAB_H_
+#define _KP_KPSLAB_H_
+
+#include <ktypes.h>
+
+/*
+ * Caches of same-size objects, carved in chunks from kp_rw_mem.
+ * Freed objects are kept per cpu and only go back to their chunk, under the cache lock, in batches.
+ * Like kp_malloc, safe from any context and never sleeps.
+ */
+typedef struct kp_slab kp_slab_t;
+
+typedef struct
+{
+    size_t obj_size;
+    size_t chunk_size;
+    int32_t chunks;
+    int32_t objs;
+    // handed out and not freed yet
+    int32_t used;
+    // freed but still held in per cpu lists
+    int32_t cached;
+} kp_slab_stat_t;
+
+kp_slab_t *kp_slab_create(size_t size, size_t align);
+void kp_slab_destroy(kp_slab_t *slab);
+void *kp_slab_alloc(kp_slab_t *slab);
+void kp_slab_free(kp_slab_t *slab, void *obj);
+void kp_slab_stat(kp_slab_t *slab, kp_slab_stat_t *stat);
+
+#endif
@@ -164,6 +164,13 @@ static inline void flush_tlb_kernel_page(uint64_t addr)
     isb();
 }
 
+// caller must issue dsb(ishst) before and dsb(ish); isb() after a run of these
+static inline void flush_tlb_kernel_page_nosync(uint64_t addr)
+{
+    addr = tlbi_vaddr(addr, 0);
+    tlbi_1(vaale1is, addr);
+}
+
 static inline int is_kimg_range(uint64_t addr)
 {
     return addr >= kernel_va && addr < (kernel_va + kernel_size);
@@ -178,4 +185,7 @@ static inline uint64_t *pgtable_entry_kernel(uint64_t va)
 
 void modify_entry_kernel(uint64_t va, uint64_t *entry, uint64_t value);
 
+// without the tlb flush, the caller flushes the contiguous range holding va once it is done with all entries
+void modify_entry_kernel_nosync(uint64_t va, uint64_t *entry, uint64_t value);
+
 #endif
\ No newline at end of file
@@ -18,6 +18,7 @@
 #define COMPILE_TIME_LEN 0x18
 #define MAP_MAX_SIZE 0xa00
 #define HOOK_ALLOC_SIZE (1 << 20)
+#define HOOK_ALLOC_ALIGN 0x10000
 #define MEMORY_ROX_SIZE (4 << 20)
 #define MEMORY_RW_SIZE (2 << 20)
 #define MAP_ALIGN 0x10
@@ -233,7 +234,8 @@ typedef struct _setup_preset_t
     int64_t printk_offset;
     map_symbol_t map_symbol;
     uint8_t header_backup[HDR_BACKUP_SIZE];
-    uint8_t __[SETUP_PRESERVE_LEN];
+    int64_t hook_alloc_size; // must aligned HOOK_ALLOC_ALIGN, 0 for HOOK_ALLOC_SIZE
+    uint8_t __[SETUP_PRESERVE_LEN - 8];
     patch_config_t patch_config;
     char additional[ADDITIONAL_LEN];
 } setup_preset_t;
@@ -253,6 +255,7 @@ typedef struct _setup_preset_t
 #define setup_printk_offset_offset (setup_paging_init_offset_offset + 8)
 #define setup_map_symbol_offset (setup_printk_offset_offset + 8)
 #define setup_header_backup_offset (setup_map_symbol_offset + MAP_SYMBOL_SIZE)
+#define setup_hook_alloc_size_offset (setup_header_backup_offset + HDR_BACKUP_SIZE)
 #define setup_patch_config_offset (setup_header_backup_offset + HDR_BACKUP_SIZE + SETUP_PRESERVE_LEN)
 #define setup_end (setup_patch_config_offset + PATCH_CONFIG_LEN)
 #endif
@@ -70,6 +70,27 @@ void tlsf_free(tlsf_t tlsf, void *ptr);
 /* Returns internal block size, not original request size */
 size_t tlsf_block_size(void *ptr);
 
+/*
+** Usage counters, kept up to date by every allocation and free.
+** Free blocks of first-level class 0 are smaller than 256 bytes,
+** those of class i >= 1 are in [1 << (i + 7), 1 << (i + 8)).
+*/
+#define TLSF_STAT_FL_NUM 32
+
+typedef struct tlsf_stat_t
+{
+    size_t total;
+    size_t used;
+    size_t peak;
+    size_t free_blocks;
+    size_t largest_free;
+    size_t fl_free[TLSF_STAT_FL_NUM];
+} tlsf_stat_t;
+
+void tlsf_usage(tlsf_t tlsf, size_t *total, size_t *used);
+void tlsf_stat(tlsf_t tlsf, tlsf_stat_t *stat);
+void tlsf_reset_peak(tlsf_t tlsf);
+
 /* Overheads/limits of internal structures. */
 size_t tlsf_size(void);
 size_t tlsf_align_size(void);
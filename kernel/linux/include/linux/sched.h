@@ -59,6 +59,10 @@ struct task_struct_offset
     int16_t tasks_offset;
     int16_t mm_offset;
     int16_t active_mm_offset;
+    int16_t signal_offset;
+    int16_t thread_node_offset;
+    // in signal_struct, the head of the thread_node list of the group
+    int16_t signal_thread_head_offset;
 };
 
 extern struct task_struct_offset task_struct_offset;
@@ -69,6 +73,17 @@ static inline struct list_head *get_task_tasks_p(struct task_struct *task)
     return head;
 }
 
+static inline struct list_head *get_task_thread_node_p(struct task_struct *task)
+{
+    return (struct list_head *)(((uintptr_t)task) + task_struct_offset.thread_node_offset);
+}
+
+static inline struct list_head *get_task_thread_head_p(struct task_struct *task)
+{
+    uintptr_t signal = *(uintptr_t *)(((uintptr_t)task) + task_struct_offset.signal_offset);
+    return (struct list_head *)(signal + task_struct_offset.signal_thread_head_offset);
+}
+
 static inline const char *get_task_comm(struct task_struct *task)
 {
     return (const char *)(((uintptr_t)task) + task_struct_offset.comm_offset);
@@ -84,7 +99,7 @@ static inline struct task_struct *next_task(struct task_struct *task)
 {
     struct list_head *head = get_task_tasks_p(task);
     struct list_head *next = head->next;
-    struct task_struct *next_task = (struct task_struct *)(next - task_struct_offset.tasks_offset);
+    struct task_struct *next_task = (struct task_struct *)((uintptr_t)next - task_struct_offset.tasks_offset);
     return next_task;
 }
 
@@ -10,6 +10,15 @@ struct cpumask;
 
 extern bool kvar_def(stop_machine_initialized);
 extern const struct cpumask *kvar_def(cpu_online_mask);
+extern struct cpumask kvar_def(__cpu_online_mask);
+
+// the mask itself is __cpu_online_mask since 4.5, cpu_online_mask was a pointer to it before
+static inline const struct cpumask *online_cpus_mask()
+{
+    if (kvar(__cpu_online_mask)) return kvar(__cpu_online_mask);
+    if (kvar(cpu_online_mask)) return kvar_val(cpu_online_mask);
+    return 0;
+}
 
 /**
  * stop_machine: freeze the machine on all CPUs and run this function
@@ -27,8 +27,10 @@ int su_add_allow_uid(uid_t uid, uid_t to_uid, const char *scontext)
 }
 KP_EXPORT_SYMBOL(su_add_allow_uid);
 
+// the bitmap only rules uids out, a set bit only says an entry exists, its profile decides
 int is_su_allow_uid(uid_t uid)
 {
+    if (!test_kstorage_uid(su_kstorage_gid, uid)) return 0;
     int rc = 0;
 
     rcu_read_lock();
@@ -37,7 +39,11 @@ int is_su_allow_uid(uid_t uid)
         goto out;
 
     struct su_profile *profile = (struct su_profile *)ks->data;
-    rc = (profile->uid == uid);
+    unsigned int seq;
+    do {
+        seq = kstorage_read_begin(ks);
+        rc = (profile->uid == uid);
+    } while (kstorage_read_retry(ks, seq));
 
 out:
     rcu_read_unlock();
@@ -57,8 +63,11 @@ int set_ap_mod_exclude(uid_t uid, int exclude)
 }
 KP_EXPORT_SYMBOL(set_ap_mod_exclude);
 
+// a uid not excluded is removed rather than written with 0, but an entry written with 0 still reads as 0
 int get_ap_mod_exclude(uid_t uid)
 {
+    if (!test_kstorage_uid(exclude_kstorage_gid, uid)) return 0;
+
     int exclude = 0;
     int rc = read_kstorage(exclude_kstorage_gid, uid, &exclude, 0, sizeof(exclude), false);
     if (rc < 0) return 0;
@@ -74,6 +83,10 @@ int kpextension_init()
     exclude_kstorage_gid = try_alloc_kstroage_group();
     if (exclude_kstorage_gid != KSTORAGE_EXCLUDE_LIST_GROUP) return -ENOMEM;
 
+    // without the index the checks still work through lookups
+    enable_kstorage_uid_index(su_kstorage_gid);
+    enable_kstorage_uid_index(exclude_kstorage_gid);
+
     su_add_allow_uid(0, 0, all_allow_sctx);
 
     return 0;
@@ -15,101 +15,591 @@
 #include <linux/errno.h>
 #include <linux/vmalloc.h>
 #include <kputils.h>
+#include <kpslab.h>
 
-#define KSTRORAGE_MAX_GROUP_NUM 4
+#define KSTRORAGE_MAX_GROUP_NUM 64
 
-// static atomic64_t used_max_group = ATOMIC_INIT(0);
-static int used_max_group = -1;
-static struct list_head kstorage_groups[KSTRORAGE_MAX_GROUP_NUM];
-static spinlock_t kstorage_glocks[KSTRORAGE_MAX_GROUP_NUM];
-static int group_sizes[KSTRORAGE_MAX_GROUP_NUM] = { 0 };
-static spinlock_t used_max_group_lock;
+// a table is resized once its load leaves [1/8, 2], to a size with a load of at most 1
+#define KSTORAGE_HASH_MIN_SHIFT 4
+#define KSTORAGE_HASH_MAX_SHIFT 20
+#define KSTORAGE_HASH_GROW_LOAD 2
+#define KSTORAGE_HASH_SHRINK_LOAD 8
+
+// uids below 1 << 24 cover the app ranges of the first users, leaves of 4096 uids are allocated on first use
+#define KSTORAGE_UID_INDEX_SHIFT 24
+#define KSTORAGE_UID_LEAF_SHIFT 12
+#define KSTORAGE_UID_LEAF_NUM (1 << (KSTORAGE_UID_INDEX_SHIFT - KSTORAGE_UID_LEAF_SHIFT))
+#define KSTORAGE_UID_LEAF_SIZE ((1 << KSTORAGE_UID_LEAF_SHIFT) / 8)
+
+struct kstorage_group;
+
+// a bit per id of the entries of a group, leaves are never freed before the group
+struct kstorage_uid_index
+{
+    // an entry was linked without its leaf, e.g. by a write racing the enable, tests fall back to lookups
+    int partial;
+    unsigned long *leaves[KSTORAGE_UID_LEAF_NUM];
+};
+
+struct kstorage_table
+{
+    struct rcu_head rcu;
+    struct kstorage_group *group;
+    // which hnode of an entry links it into this table
+    int idx;
+    int shift;
+    struct hlist_head buckets[0];
+};
+
+/*
+ * Entries are linked in the group list for walks and, with hash lookup, in the current table for lookups by id.
+ * A resize links every entry into a new table through its other hnode and publishes it,
+ * the old table is freed after a grace period and until then no resize may reuse its hnode.
+ * 
+ * Readers find the group under rcu, writers may sleep and hold a reference instead.
+ * A removed group is freed with all its entries once it has no writers and a grace period passed.
+ */
+struct kstorage_group
+{
+    struct list_head list;
+    struct kstorage_table *table;
+    struct kstorage_uid_index *uid_index;
+    spinlock_t lock;
+    int size;
+    int retiring;
+    int users;
+    int dead;
+    int min_shift;
+    struct kstorage_group_conf conf;
+    char name[KSTORAGE_GROUP_NAME_LEN];
+    struct rcu_head rcu;
+};
+
+static struct kstorage_group *kstorage_groups[KSTRORAGE_MAX_GROUP_NUM] = { 0 };
+static spinlock_t kstorage_groups_lock;
+static kp_slab_t *kstorage_slab = 0;
+
+static bool kstorage_small(int len)
+{
+    return kstorage_slab && len <= KSTORAGE_SMALL_SIZE;
+}
+
+static struct kstorage *kstorage_alloc(int len)
+{
+    struct kstorage *ks = 0;
+    if (kstorage_small(len)) {
+        ks = (struct kstorage *)kp_slab_alloc(kstorage_slab);
+    } else {
+        ks = (struct kstorage *)vmalloc(sizeof(struct kstorage) + len);
+    }
+    if (ks) {
+        ks->seq = 0;
+        ks->dlen = len;
+    }
+    return ks;
+}
+
+// dlen is never changed after allocation, it tells where the entry came from
+static void kstorage_free(struct kstorage *ks)
+{
+    if (kstorage_small(ks->dlen)) {
+        kp_slab_free(kstorage_slab, ks);
+    } else {
+        kvfree(ks);
+    }
+}
 
 static void reclaim_callback(struct rcu_head *rcu)
 {
     struct kstorage *ks = container_of(rcu, struct kstorage, rcu);
-    kvfree(ks);
+    kstorage_free(ks);
 }
 
-int try_alloc_kstroage_group()
+static inline uint32_t kstorage_hash(long did, int shift)
+{
+    return (uint32_t)(((uint64_t)did * 0x9e3779b97f4a7c15ull) >> (64 - shift));
+}
+
+static struct kstorage_table *table_alloc(struct kstorage_group *group, int shift, int idx)
 {
-    spin_lock(&used_max_group_lock);
-    if (used_max_group + 1 >= KSTRORAGE_MAX_GROUP_NUM) {
-        spin_unlock(&used_max_group_lock);
-        return -1;
+    size_t size = sizeof(struct kstorage_table) + sizeof(struct hlist_head) * (1 << shift);
+    struct kstorage_table *table = (struct kstorage_table *)vmalloc(size);
+    if (!table) return 0;
+    memset(table, 0, size);
+    table->group = group;
+    table->idx = idx;
+    table->shift = shift;
+    return table;
+}
+
+static void table_reclaim_callback(struct rcu_head *rcu)
+{
+    struct kstorage_table *table = container_of(rcu, struct kstorage_table, rcu);
+    WRITE_ONCE(table->group->retiring, 0);
+    kvfree(table);
+}
+
+// within rcu read lock or the group lock
+static struct kstorage *table_find(struct kstorage_table *table, long did)
+{
+    struct hlist_head *head = &table->buckets[kstorage_hash(did, table->shift)];
+    struct hlist_node *node = rcu_dereference_raw(hlist_first_rcu(head));
+    for (; node; node = rcu_dereference_raw(hlist_next_rcu(node))) {
+        struct kstorage *pos = container_of(node - table->idx, struct kstorage, hnode[0]);
+        if (pos->did == did) return pos;
     }
-    used_max_group++;
-    spin_unlock(&used_max_group_lock);
-    return used_max_group;
+    return 0;
 }
 
-int kstorage_group_size(int gid)
+static int table_fit_shift(int size, int min_shift)
 {
-    if (gid < 0 || gid >= KSTRORAGE_MAX_GROUP_NUM) return -ENOENT;
-    return group_sizes[gid];
+    int shift = min_shift;
+    while (shift < KSTORAGE_HASH_MAX_SHIFT && (1 << shift) < size) {
+        shift++;
+    }
+    return shift;
 }
 
-int write_kstorage(int gid, long did, void *data, int offset, int len, bool data_is_user)
+static int table_want_shift(int size, int shift, int min_shift)
 {
-    int rc = -ENOENT;
-    if (gid < 0 || gid >= KSTRORAGE_MAX_GROUP_NUM) return rc;
+    int buckets = 1 << shift;
+    if (size > buckets * KSTORAGE_HASH_GROW_LOAD || size * KSTORAGE_HASH_SHRINK_LOAD < buckets) {
+        return table_fit_shift(size, min_shift);
+    }
+    return shift;
+}
+
+// may sleep, a resize that can not happen now, e.g. while the last old table is retiring, is left to a later write
+// adding makes room ahead for that many more entries
+static void kstorage_resize(struct kstorage_group *group, int adding)
+{
+    if (!group->table) return;
+
+    spin_lock(&group->lock);
+    struct kstorage_table *table = group->table;
+    int shift = table_want_shift(group->size + adding, table->shift, group->min_shift);
+    int idx = !table->idx;
+    int skip = shift == table->shift || group->retiring;
+    spin_unlock(&group->lock);
+    if (skip) return;
+
+    struct kstorage_table *new = table_alloc(group, shift, idx);
+    if (!new) return;
+
+    spin_lock(&group->lock);
+    table = group->table;
+    if (table->idx == idx || group->retiring) {
+        spin_unlock(&group->lock);
+        kvfree(new);
+        return;
+    }
+    struct kstorage *pos = 0;
+    list_for_each_entry(pos, &group->list, list)
+    {
+        hlist_add_head_rcu(&pos->hnode[new->idx], &new->buckets[kstorage_hash(pos->did, shift)]);
+    }
+    rcu_assign_pointer(group->table, new);
+    group->retiring = 1;
+    spin_unlock(&group->lock);
 
-    struct list_head *head = &kstorage_groups[gid];
-    spinlock_t *lock = &kstorage_glocks[gid];
-    struct kstorage *pos = 0, *old = 0;
+    call_rcu(&table->rcu, table_reclaim_callback);
+}
 
-    rcu_read_lock();
+static bool uid_indexed(long did)
+{
+    return did >= 0 && did < (1l << KSTORAGE_UID_INDEX_SHIFT);
+}
+
+static inline unsigned long *uid_word(unsigned long *leaf, long did)
+{
+    return &leaf[(did & ((1 << KSTORAGE_UID_LEAF_SHIFT) - 1)) / BITS_PER_LONG];
+}
+
+// may sleep, the leaf of an id must exist before an entry with that id is linked
+static int uid_index_reserve(struct kstorage_group *group, long did)
+{
+    struct kstorage_uid_index *index = rcu_dereference_raw(group->uid_index);
+    if (!index || !uid_indexed(did)) return 0;
+    unsigned long **slot = &index->leaves[did >> KSTORAGE_UID_LEAF_SHIFT];
+    if (READ_ONCE(*slot)) return 0;
+
+    unsigned long *leaf = (unsigned long *)vmalloc(KSTORAGE_UID_LEAF_SIZE);
+    if (!leaf) return -ENOMEM;
+    memset(leaf, 0, KSTORAGE_UID_LEAF_SIZE);
+    spin_lock(&group->lock);
+    if (!*slot) {
+        rcu_assign_pointer(*slot, leaf);
+        leaf = 0;
+    }
+    spin_unlock(&group->lock);
+    if (leaf) kvfree(leaf);
+    return 0;
+}
+
+// group lock held
+static void uid_index_set(struct kstorage_group *group, long did, bool set)
+{
+    struct kstorage_uid_index *index = group->uid_index;
+    if (!index || !uid_indexed(did)) return;
+    unsigned long *leaf = index->leaves[did >> KSTORAGE_UID_LEAF_SHIFT];
+    if (!leaf) {
+        if (set) WRITE_ONCE(index->partial, 1);
+        return;
+    }
+    unsigned long *word = uid_word(leaf, did);
+    unsigned long mask = 1ul << (did % BITS_PER_LONG);
+    WRITE_ONCE(*word, set ? *word | mask : *word & ~mask);
+}
+
+static void uid_index_free(struct kstorage_uid_index *index)
+{
+    for (int i = 0; i < KSTORAGE_UID_LEAF_NUM; i++) {
+        if (index->leaves[i]) kvfree(index->leaves[i]);
+    }
+    kvfree(index);
+}
 
-    list_for_each_entry(pos, head, list)
+// within rcu read lock
+static struct kstorage *group_find(struct kstorage_group *group, long did)
+{
+    struct kstorage_table *table = rcu_dereference_raw(group->table);
+    if (table) return table_find(table, did);
+
+    struct kstorage *pos = 0;
+    list_for_each_entry_rcu(pos, &group->list, list)
+    {
+        if (pos->did == did) return pos;
+    }
+    return 0;
+}
+
+// group lock held
+static void group_link(struct kstorage_group *group, struct kstorage *new, struct kstorage *old)
+{
+    struct kstorage_table *table = group->table;
+    if (old) { // update
+        list_replace_rcu(&old->list, &new->list);
+        if (table) hlist_replace_rcu(&old->hnode[table->idx], &new->hnode[table->idx]);
+    } else { // add new one
+        list_add_rcu(&new->list, &group->list);
+        if (table) hlist_add_head_rcu(&new->hnode[table->idx], &table->buckets[kstorage_hash(new->did, table->shift)]);
+        uid_index_set(group, new->did, true);
+        group->size++;
+    }
+}
+
+// group lock held
+static void group_unlink(struct kstorage_group *group, struct kstorage *pos)
+{
+    struct kstorage_table *table = group->table;
+    list_del_rcu(&pos->list);
+    if (table) hlist_del_rcu(&pos->hnode[table->idx]);
+    uid_index_set(group, pos->did, false);
+    group->size--;
+}
+
+static void group_reclaim_callback(struct rcu_head *rcu)
+{
+    struct kstorage_group *group = container_of(rcu, struct kstorage_group, rcu);
+    // the last old table still points at the group
+    if (READ_ONCE(group->retiring)) {
+        call_rcu(&group->rcu, group_reclaim_callback);
+        return;
+    }
+    struct kstorage *pos = 0, *n = 0;
+    list_for_each_entry_safe(pos, n, &group->list, list)
     {
-        if (pos->did == did) {
-            old = pos;
+        kstorage_free(pos);
+    }
+    if (group->table) kvfree(group->table);
+    if (group->uid_index) uid_index_free(group->uid_index);
+    kvfree(group);
+}
+
+static struct kstorage_group *group_get(int gid)
+{
+    if (gid < 0 || gid >= KSTRORAGE_MAX_GROUP_NUM) return 0;
+    rcu_read_lock();
+    struct kstorage_group *group = rcu_dereference_raw(kstorage_groups[gid]);
+    if (group) {
+        spin_lock(&group->lock);
+        bool dead = group->dead;
+        if (!dead) group->users++;
+        spin_unlock(&group->lock);
+        if (dead) group = 0;
+    }
+    rcu_read_unlock();
+    return group;
+}
+
+static void group_put(struct kstorage_group *group)
+{
+    spin_lock(&group->lock);
+    bool last = !--group->users && group->dead;
+    spin_unlock(&group->lock);
+    if (last) call_rcu(&group->rcu, group_reclaim_callback);
+}
+
+static int find_group_locked(const char *name)
+{
+    for (int i = 0; i < KSTRORAGE_MAX_GROUP_NUM; i++) {
+        if (kstorage_groups[i] && !strcmp(kstorage_groups[i]->name, name)) return i;
+    }
+    return -ENOENT;
+}
+
+int alloc_kstorage_group(const char *name, const struct kstorage_group_conf *conf)
+{
+    struct kstorage_group_conf def = { 0, KSTORAGE_LOOKUP_HASH, 0 };
+    if (!conf) conf = &def;
+    if (!name) name = "";
+    if (strlen(name) >= KSTORAGE_GROUP_NAME_LEN) return -ENAMETOOLONG;
+    if (conf->expected_size < 0 || conf->max_dlen < 0) return -EINVAL;
+    if (conf->lookup != KSTORAGE_LOOKUP_HASH && conf->lookup != KSTORAGE_LOOKUP_LIST) return -EINVAL;
+
+    struct kstorage_group *group = (struct kstorage_group *)vmalloc(sizeof(struct kstorage_group));
+    if (!group) return -ENOMEM;
+    memset(group, 0, sizeof(struct kstorage_group));
+    INIT_LIST_HEAD(&group->list);
+    spin_lock_init(&group->lock);
+    group->conf = *conf;
+    strcpy(group->name, name);
+    if (conf->lookup == KSTORAGE_LOOKUP_HASH) {
+        group->min_shift = table_fit_shift(conf->expected_size, KSTORAGE_HASH_MIN_SHIFT);
+        group->table = table_alloc(group, group->min_shift, 0);
+        if (!group->table) {
+            kvfree(group);
+            return -ENOMEM;
+        }
+    }
+
+    // the lowest free id, so the su and exclude groups allocated first get theirs
+    int gid = -ENOSPC;
+    spin_lock(&kstorage_groups_lock);
+    if (name[0] && find_group_locked(name) >= 0) {
+        gid = -EEXIST;
+    } else {
+        for (int i = 0; i < KSTRORAGE_MAX_GROUP_NUM; i++) {
+            if (kstorage_groups[i]) continue;
+            rcu_assign_pointer(kstorage_groups[i], group);
+            gid = i;
             break;
         }
     }
+    spin_unlock(&kstorage_groups_lock);
 
-    struct kstorage *new = (struct kstorage *)vmalloc(sizeof(struct kstorage) + len);   
-    if (!new) {
-        rcu_read_unlock();
+    if (gid < 0) {
+        if (group->table) kvfree(group->table);
+        kvfree(group);
+    }
+    logkfd("name: %s, gid: %d, expected: %d, lookup: %d, max_dlen: %d\n", name, gid, conf->expected_size,
+           conf->lookup, conf->max_dlen);
+    return gid;
+}
+KP_EXPORT_SYMBOL(alloc_kstorage_group);
+
+int find_kstorage_group(const char *name)
+{
+    if (!name || !name[0]) return -ENOENT;
+    spin_lock(&kstorage_groups_lock);
+    int gid = find_group_locked(name);
+    spin_unlock(&kstorage_groups_lock);
+    return gid;
+}
+KP_EXPORT_SYMBOL(find_kstorage_group);
+
+int remove_kstorage_group(int gid)
+{
+    if (gid < 0 || gid >= KSTRORAGE_MAX_GROUP_NUM) return -ENOENT;
+
+    spin_lock(&kstorage_groups_lock);
+    struct kstorage_group *group = kstorage_groups[gid];
+    if (group) rcu_assign_pointer(kstorage_groups[gid], 0);
+    spin_unlock(&kstorage_groups_lock);
+    if (!group) return -ENOENT;
+
+    // the id may be reused right away, readers still holding the group see it until the grace period ends
+    spin_lock(&group->lock);
+    logkfd("gid: %d, name: %s, size: %d\n", gid, group->name, group->size);
+    group->dead = 1;
+    bool last = !group->users;
+    spin_unlock(&group->lock);
+    if (last) call_rcu(&group->rcu, group_reclaim_callback);
+    return 0;
+}
+KP_EXPORT_SYMBOL(remove_kstorage_group);
+
+int try_alloc_kstroage_group()
+{
+    int gid = alloc_kstorage_group(0, 0);
+    return gid < 0 ? -1 : gid;
+}
+KP_EXPORT_SYMBOL(try_alloc_kstroage_group);
+
+int kstorage_group_size(int gid)
+{
+    if (gid < 0 || gid >= KSTRORAGE_MAX_GROUP_NUM) return -ENOENT;
+    rcu_read_lock();
+    struct kstorage_group *group = rcu_dereference_raw(kstorage_groups[gid]);
+    int size = group ? group->size : -ENOENT;
+    rcu_read_unlock();
+    return size;
+}
+KP_EXPORT_SYMBOL(kstorage_group_size);
+
+int enable_kstorage_uid_index(int gid)
+{
+    struct kstorage_group *group = group_get(gid);
+    if (!group) return -ENOENT;
+
+    struct kstorage_uid_index *index = (struct kstorage_uid_index *)vmalloc(sizeof(struct kstorage_uid_index));
+    if (!index) {
+        group_put(group);
         return -ENOMEM;
     }
-    new->gid = gid;
-    new->did = did;
-    new->dlen = 0;
-    if (data_is_user) {
-        void *drc = memdup_user(data + offset, len);
-        if (IS_ERR(drc)) {
-            rcu_read_unlock();
-            return PTR_ERR(drc);
-        }
-        memcpy(new->data, drc, len);
-        kvfree(drc);
+    memset(index, 0, sizeof(struct kstorage_uid_index));
+
+    // existing entries are not indexed
+    int rc = 0;
+    spin_lock(&group->lock);
+    if (group->uid_index) {
+        rc = -EEXIST;
+    } else if (group->size) {
+        rc = -EBUSY;
     } else {
-        memcpy(new->data, data + offset, len);
+        rcu_assign_pointer(group->uid_index, index);
+        index = 0;
     }
-    new->dlen = len;
+    spin_unlock(&group->lock);
 
-    spin_lock(lock);
-    if (old) { // update
-        list_replace_rcu(&old->list, &new->list);
-    } else { // add new one
-        list_add_rcu(&new->list, head);
-        group_sizes[gid]++;
-    }
-    spin_unlock(lock);
+    if (index) kvfree(index);
+    group_put(group);
+    logkfd("gid: %d, rc: %d\n", gid, rc);
+    return rc;
+}
+KP_EXPORT_SYMBOL(enable_kstorage_uid_index);
 
+int test_kstorage_uid(int gid, long did)
+{
+    if (gid < 0 || gid >= KSTRORAGE_MAX_GROUP_NUM) return -ENOENT;
+    if (!uid_indexed(did)) return -ERANGE;
+
+    int rc = -ENOENT;
+    rcu_read_lock();
+    struct kstorage_group *group = rcu_dereference_raw(kstorage_groups[gid]);
+    if (group) {
+        struct kstorage_uid_index *index = rcu_dereference_raw(group->uid_index);
+        rc = -ERANGE;
+        if (index && !READ_ONCE(index->partial)) {
+            unsigned long *leaf = rcu_dereference_raw(index->leaves[did >> KSTORAGE_UID_LEAF_SHIFT]);
+            unsigned long word = leaf ? READ_ONCE(*uid_word(leaf, did)) : 0;
+            rc = (word >> (did % BITS_PER_LONG)) & 1;
+        }
+    }
     rcu_read_unlock();
+    return rc;
+}
+KP_EXPORT_SYMBOL(test_kstorage_uid);
+
+// a write at offset 0 replaces the data, a write at an offset keeps the data around it
+static int write_size(int dlen, int offset, int len)
+{
+    if (!offset) return len;
+    return dlen > offset + len ? dlen : offset + len;
+}
 
-    if (old) {
-        bool async = true;
-        if (async) {
-            call_rcu(&old->rcu, reclaim_callback);
+// small entries written without changing their size are updated in place, returns -EAGAIN otherwise
+static int write_inplace(struct kstorage_group *group, long did, const void *src, int offset, int len)
+{
+    spin_lock(&group->lock);
+    struct kstorage *pos = group_find(group, did);
+    if (!pos || !kstorage_small(pos->dlen) || write_size(pos->dlen, offset, len) != pos->dlen) {
+        spin_unlock(&group->lock);
+        return -EAGAIN;
+    }
+    WRITE_ONCE(pos->seq, pos->seq + 1);
+    smp_wmb();
+    memcpy(pos->data + offset, src, len);
+    smp_wmb();
+    WRITE_ONCE(pos->seq, pos->seq + 1);
+    spin_unlock(&group->lock);
+    return 0;
+}
+
+static int write_cow(struct kstorage_group *group, int gid, long did, const void *src, int offset, int len)
+{
+    for (;;) {
+        spin_lock(&group->lock);
+        struct kstorage *old = group_find(group, did);
+        int old_len = old ? old->dlen : 0;
+        spin_unlock(&group->lock);
+
+        int size = write_size(old_len, offset, len);
+        if (group->conf.max_dlen && size > group->conf.max_dlen) return -E2BIG;
+        struct kstorage *new = kstorage_alloc(size);
+        if (!new) return -ENOMEM;
+        new->gid = gid;
+        new->did = did;
+        if (!old && uid_index_reserve(group, did)) {
+            kstorage_free(new);
+            return -ENOMEM;
+        }
+
+        spin_lock(&group->lock);
+        old = group_find(group, did);
+        // replaced meanwhile by another size, its data must be kept
+        if ((old ? old->dlen : 0) != old_len) {
+            spin_unlock(&group->lock);
+            kstorage_free(new);
+            continue;
+        }
+        memset(new->data, 0, size);
+        if (old && offset) memcpy(new->data, old->data, old_len);
+        memcpy(new->data + offset, src, len);
+        group_link(group, new, old);
+        spin_unlock(&group->lock);
+
+        if (old) {
+            bool async = true;
+            if (async) {
+                call_rcu(&old->rcu, reclaim_callback);
+            } else {
+                synchronize_rcu();
+                kstorage_free(old);
+            }
         } else {
-            synchronize_rcu();
-            kvfree(old);
+            kstorage_resize(group, 0);
         }
+        return 0;
     }
-    return 0;
+}
+
+int write_kstorage(int gid, long did, void *data, int offset, int len, bool data_is_user)
+{
+    if (offset < 0 || len < 0) return -EINVAL;
+
+    struct kstorage_group *group = group_get(gid);
+    if (!group) return -ENOENT;
+
+    int rc = 0;
+    const void *src = data;
+    void *dup = 0;
+    if (data_is_user) {
+        dup = memdup_user(data, len);
+        if (IS_ERR(dup)) {
+            rc = PTR_ERR(dup);
+            goto out;
+        }
+        src = dup;
+    }
+
+    rc = write_inplace(group, did, src, offset, len);
+    if (rc == -EAGAIN) rc = write_cow(group, gid, did, src, offset, len);
+
+    if (dup) kvfree(dup);
+out:
+    group_put(group);
+    return rc;
 }
 KP_EXPORT_SYMBOL(write_kstorage);
 
@@ -117,15 +607,11 @@ const struct kstorage *get_kstorage(int gid, long did)
 {
     if (gid < 0 || gid >= KSTRORAGE_MAX_GROUP_NUM) return ERR_PTR(-ENOENT);
 
-    struct list_head *head = &kstorage_groups[gid];
-    struct kstorage *pos = 0;
+    struct kstorage_group *group = rcu_dereference_raw(kstorage_groups[gid]);
+    if (!group) return ERR_PTR(-ENOENT);
 
-    list_for_each_entry(pos, head, list)
-    {
-        if (pos->did == did) {
-            return pos;
-        }
-    }
+    struct kstorage *pos = group_find(group, did);
+    if (pos) return pos;
 
     return ERR_PTR(-ENOENT);
 }
@@ -137,14 +623,18 @@ int on_each_kstorage_elem(int gid, on_kstorage_cb cb, void *udata)
 
     int rc = 0;
 
-    struct list_head *head = &kstorage_groups[gid];
-    struct kstorage *pos = 0;
-
     rcu_read_lock();
 
-    list_for_each_entry(pos, head, list)
+    struct kstorage_group *group = rcu_dereference_raw(kstorage_groups[gid]);
+    if (!group) {
+        rcu_read_unlock();
+        return -ENOENT;
+    }
+
+    struct kstorage *pos = 0;
+    list_for_each_entry_rcu(pos, &group->list, list)
     {
-        int rc = cb(pos, udata);
+        rc = cb(pos, udata);
         if (rc) break;
     }
 
@@ -157,6 +647,7 @@ KP_EXPORT_SYMBOL(on_each_kstorage_elem);
 int read_kstorage(int gid, long did, void *data, int offset, int len, bool data_is_user)
 {
     int rc = 0;
+    char buf[KSTORAGE_SMALL_SIZE];
     rcu_read_lock();
 
     const struct kstorage *pos = get_kstorage(gid, did);
@@ -166,16 +657,32 @@ int read_kstorage(int gid, long did, void *data, int offset, int len, bool data_
         return PTR_ERR(pos);
     }
 
+    if (offset < 0 || len < 0 || offset > pos->dlen) {
+        rcu_read_unlock();
+        return -EINVAL;
+    }
+
     int min_len = pos->dlen - offset > len ? len : pos->dlen - offset;
+    const char *src = pos->data + offset;
+
+    // small entries may be written in place, take a consistent copy
+    if (kstorage_small(pos->dlen)) {
+        unsigned int seq;
+        do {
+            seq = kstorage_read_begin(pos);
+            memcpy(buf, pos->data + offset, min_len);
+        } while (kstorage_read_retry(pos, seq));
+        src = buf;
+    }
 
     if (data_is_user) {
-        int cplen = compat_copy_to_user(data, pos->data + offset, min_len);
+        int cplen = compat_copy_to_user(data, src, min_len);
         if (cplen <= 0) {
             logkfe("compat_copy_to_user error: %d", cplen);
             rc = cplen;
         }
     } else {
-        memcpy(data, pos->data + offset, min_len);
+        memcpy(data, src, min_len);
     }
 
     rcu_read_unlock();
@@ -189,12 +696,16 @@ int list_kstorage_ids(int gid, long *ids, int idslen, bool data_is_user)
 
     int cnt = 0;
 
-    struct list_head *head = &kstorage_groups[gid];
-    struct kstorage *pos = 0;
-
     rcu_read_lock();
 
-    list_for_each_entry(pos, head, list)
+    struct kstorage_group *group = rcu_dereference_raw(kstorage_groups[gid]);
+    if (!group) {
+        rcu_read_unlock();
+        return -ENOENT;
+    }
+
+    struct kstorage *pos = 0;
+    list_for_each_entry_rcu(pos, &group->list, list)
     {
         if (cnt >= idslen) break;
 
@@ -218,47 +729,190 @@ KP_EXPORT_SYMBOL(list_kstorage_ids);
 
 int remove_kstorage(int gid, long did)
 {
-    int rc = -ENOENT;
-    if (gid < 0 || gid >= KSTRORAGE_MAX_GROUP_NUM) return rc;
+    struct kstorage_group *group = group_get(gid);
+    if (!group) return -ENOENT;
+
+    spin_lock(&group->lock);
+    struct kstorage *pos = group_find(group, did);
+    if (!pos) {
+        spin_unlock(&group->lock);
+        group_put(group);
+        return 0;
+    }
+    group_unlink(group, pos);
+    spin_unlock(&group->lock);
 
-    struct list_head *head = &kstorage_groups[gid];
-    spinlock_t *lock = &kstorage_glocks[gid];
-    struct kstorage *pos = 0;
+    bool async = true;
+    if (async) {
+        call_rcu(&pos->rcu, reclaim_callback);
+    } else {
+        synchronize_rcu();
+        kstorage_free(pos);
+    }
+    kstorage_resize(group, 0);
+    group_put(group);
+    return 0;
+}
+KP_EXPORT_SYMBOL(remove_kstorage);
 
-    spin_lock(lock);
+// writes replacing the data and removes, consecutive ones of a group are applied under one lock
+static bool batch_lockable(const struct kstorage_batch_item *item)
+{
+    return item->op == KSTORAGE_BATCH_REMOVE || (item->op == KSTORAGE_BATCH_WRITE && !item->offset);
+}
 
-    list_for_each_entry(pos, head, list)
-    {
-        if (pos->did == did) {
-            list_del_rcu(&pos->list);
-            spin_unlock(lock);
+static long batch_one(struct kstorage_batch_item *item, bool data_is_user)
+{
+    switch (item->op) {
+    case KSTORAGE_BATCH_READ:
+        return read_kstorage(item->gid, item->did, (void *)item->ptr, item->offset, item->len, data_is_user);
+    case KSTORAGE_BATCH_WRITE:
+        return write_kstorage(item->gid, item->did, (void *)item->ptr, item->offset, item->len, data_is_user);
+    case KSTORAGE_BATCH_REMOVE:
+        return remove_kstorage(item->gid, item->did);
+    }
+    return -EINVAL;
+}
 
-            group_sizes[gid]--;
+// may sleep, the data of a write is copied into a new entry before the lock is taken
+static struct kstorage *batch_prepare(struct kstorage_group *group, struct kstorage_batch_item *item,
+                                      bool data_is_user)
+{
+    if (item->op != KSTORAGE_BATCH_WRITE) return 0;
+    int len = item->len;
+    if (len < 0) {
+        item->status = -EINVAL;
+        return 0;
+    }
+    if (group->conf.max_dlen && len > group->conf.max_dlen) {
+        item->status = -E2BIG;
+        return 0;
+    }
+    struct kstorage *new = kstorage_alloc(len);
+    if (!new) {
+        item->status = -ENOMEM;
+        return 0;
+    }
+    new->gid = item->gid;
+    new->did = item->did;
+    if (uid_index_reserve(group, item->did)) {
+        item->status = -ENOMEM;
+        kstorage_free(new);
+        return 0;
+    }
+    if (!data_is_user) {
+        memcpy(new->data, (void *)item->ptr, len);
+        return new;
+    }
+    void *dup = memdup_user((void *)item->ptr, len);
+    if (IS_ERR(dup)) {
+        item->status = PTR_ERR(dup);
+        kstorage_free(new);
+        return 0;
+    }
+    memcpy(new->data, dup, len);
+    kvfree(dup);
+    return new;
+}
 
-            bool async = true;
-            if (async) {
-                call_rcu(&pos->rcu, reclaim_callback);
-            } else {
-                synchronize_rcu();
-                kvfree(pos);
-            }
-            return 0;
+/*
+ * Group lock held. A prepared entry used is cleared from *new, what is left there was never published.
+ * A replaced or removed entry is left in *old for call_rcu.
+ */
+static void batch_apply(struct kstorage_group *group, struct kstorage_batch_item *item, struct kstorage **new,
+                        struct kstorage **old)
+{
+    struct kstorage *pos = group_find(group, item->did);
+    if (item->op == KSTORAGE_BATCH_REMOVE) {
+        if (pos) group_unlink(group, pos);
+        *old = pos;
+        return;
+    }
+    if (pos && kstorage_small(pos->dlen) && pos->dlen == (*new)->dlen) {
+        WRITE_ONCE(pos->seq, pos->seq + 1);
+        smp_wmb();
+        memcpy(pos->data, (*new)->data, pos->dlen);
+        smp_wmb();
+        WRITE_ONCE(pos->seq, pos->seq + 1);
+        return;
+    }
+    group_link(group, *new, pos);
+    *new = 0;
+    *old = pos;
+}
+
+static void batch_run(int gid, struct kstorage_batch_item *items, int num, struct kstorage **news,
+                      struct kstorage **olds, bool data_is_user)
+{
+    struct kstorage_group *group = group_get(gid);
+    if (!group) {
+        for (int i = 0; i < num; i++) {
+            items[i].status = -ENOENT;
         }
+        return;
     }
 
-    spin_unlock(lock);
+    int writes = 0;
+    for (int i = 0; i < num; i++) {
+        items[i].status = 0;
+        olds[i] = 0;
+        news[i] = batch_prepare(group, &items[i], data_is_user);
+        if (news[i]) writes++;
+    }
+    // grow once up front rather than inserting the whole run into a small table
+    kstorage_resize(group, writes);
 
-    return 0;
+    spin_lock(&group->lock);
+    for (int i = 0; i < num; i++) {
+        if (items[i].status) continue;
+        batch_apply(group, &items[i], &news[i], &olds[i]);
+    }
+    spin_unlock(&group->lock);
+
+    for (int i = 0; i < num; i++) {
+        if (news[i]) kstorage_free(news[i]);
+        if (olds[i]) call_rcu(&olds[i]->rcu, reclaim_callback);
+    }
+    kstorage_resize(group, 0);
+    group_put(group);
 }
-KP_EXPORT_SYMBOL(remove_kstorage);
 
-int kstorage_init()
+int batch_kstorage(struct kstorage_batch_item *items, int num, bool data_is_user)
 {
-    for (int i = 0; i < KSTRORAGE_MAX_GROUP_NUM; i++) {
-        INIT_LIST_HEAD(&kstorage_groups[i]);
-        spin_lock_init(&kstorage_glocks[i]);
+    if (num < 0 || num > KSTORAGE_BATCH_MAX) return -EINVAL;
+    if (!num) return 0;
+
+    struct kstorage **ents = (struct kstorage **)vmalloc(sizeof(struct kstorage *) * num * 2);
+    if (!ents) return -ENOMEM;
+
+    for (int i = 0; i < num;) {
+        struct kstorage_batch_item *item = &items[i];
+        if (!batch_lockable(item)) {
+            item->status = batch_one(item, data_is_user);
+            i++;
+            continue;
+        }
+        int end = i + 1;
+        while (end < num && items[end].gid == item->gid && batch_lockable(&items[end])) {
+            end++;
+        }
+        batch_run(item->gid, item, end - i, ents, ents + num, data_is_user);
+        i = end;
     }
-    spin_lock_init(&used_max_group_lock);
+    kvfree(ents);
 
+    int failed = 0;
+    for (int i = 0; i < num; i++) {
+        if (items[i].status < 0) failed++;
+    }
+    logkfd("num: %d, failed: %d\n", num, failed);
+    return failed;
+}
+KP_EXPORT_SYMBOL(batch_kstorage);
+
+int kstorage_init()
+{
+    spin_lock_init(&kstorage_groups_lock);
+    kstorage_slab = kp_slab_create(sizeof(struct kstorage) + KSTORAGE_SMALL_SIZE, 8);
     return 0;
 }
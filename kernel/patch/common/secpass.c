@@ -7,6 +7,7 @@
 #include <hook.h>
 #include <kallsyms.h>
 #include <common.h>
+#include <kpmalloc.h>
 #include <uapi/asm-generic/errno.h>
 
 #include <predata.h>
@@ -15,7 +16,8 @@ struct pt_regs;
 
 static inline bool should_cfi_pass(unsigned long target)
 {
-    return is_kp_text_area(target) || is_kp_hook_area(target) || is_kpm_rox_area(target);
+    return is_kp_text_area(target) || is_kp_hook_area(target) || is_kpm_rox_area(target) ||
+           is_kp_pool_exec_area(target);
 }
 
 enum bug_trap_type
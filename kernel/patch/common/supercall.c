@@ -16,6 +16,7 @@
 #include <linux/cred.h>
 #include <asm/current.h>
 #include <linux/string.h>
+#include <linux/kernel.h>
 #include <linux/pid.h>
 #include <linux/sched.h>
 #include <linux/security.h>
@@ -32,6 +33,7 @@
 #include <kpextension.h>
 #include <kstorage.h>
 #include <rehook.h>
+#include <kpmalloc.h>
 
 #include <linux/umh.h>
 
@@ -84,12 +86,12 @@ static long call_kpm_control(const char __user *arg1, const char *__user arg2, v
     return module_control0(name, arglen <= 0 ? 0 : args, out_msg, outlen);
 }
 
-static long call_kpm_unload(const char *__user arg1, void *__user reserved)
+static long call_kpm_unload(const char *__user arg1, void *__user reserved, void *fargs)
 {
     char name[KPM_NAME_LEN];
     long len = compat_strncpy_from_user(name, arg1, sizeof(name));
     if (len <= 0) return -EINVAL;
-    return unload_module(name, reserved);
+    return unload_module(name, reserved, fargs);
 }
 
 static long call_kpm_nums()
@@ -121,6 +123,132 @@ static long call_kpm_info(const char *__user uname, char *__user out_info, int o
     return sz;
 }
 
+struct hook_stats_ctx
+{
+    struct hook_stat __user *out;
+    int num;
+    int idx;
+};
+
+static int hook_stats_copy(enum hook_type type, uint64_t addr, int32_t callbacks, const hook_stats_cpu_t *sum,
+                           void *udata)
+{
+    struct hook_stats_ctx *ctx = (struct hook_stats_ctx *)udata;
+    if (ctx->idx >= ctx->num) return 0;
+
+    struct hook_stat stat;
+    memset(&stat, 0, sizeof(stat));
+    snprintf(stat.name, sizeof(stat.name), "%pS", (void *)addr);
+    stat.addr = addr;
+    stat.type = type;
+    stat.callbacks = callbacks;
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(stat.freq));
+    stat.calls = sum->calls;
+    stat.skips = sum->skips;
+    stat.before_ticks = sum->before_ticks;
+    stat.origin_ticks = sum->origin_ticks;
+    stat.after_ticks = sum->after_ticks;
+    for (int i = 0; i < HOOK_STAT_HIST_NUM && i < HOOK_STATS_HIST_NUM; i++) {
+        stat.hist[i] = sum->hist[i];
+    }
+    if (compat_copy_to_user(ctx->out + ctx->idx, &stat, sizeof(stat)) != sizeof(stat)) return -EFAULT;
+    ctx->idx++;
+    return 0;
+}
+
+static long call_hook_stats_ctl(int op)
+{
+    switch (op) {
+    case HOOK_STATS_DISABLE:
+    case HOOK_STATS_ENABLE:
+        hook_stats_enable(op == HOOK_STATS_ENABLE);
+        return 0;
+    case HOOK_STATS_RESET:
+        hook_stats_reset();
+        return 0;
+    case HOOK_STATS_STATUS:
+        return hook_stats_enabled();
+    }
+    return -EINVAL;
+}
+
+// returns the number of hook chains, at most num of them are copied
+static long call_hook_stats(struct hook_stat __user *out, int num)
+{
+    if (num < 0 || (num && !out)) return -EINVAL;
+    struct hook_stats_ctx ctx = { out, num, 0 };
+    return hook_stats_for_each(hook_stats_copy, &ctx);
+}
+
+static void mem_pool_stat_copy(struct mem_pool_stat *out, int exec)
+{
+    kp_pool_stat_t stat;
+    kp_pool_stat(exec, &stat);
+    out->total = stat.tlsf.total;
+    out->used = stat.tlsf.used;
+    out->peak = stat.tlsf.peak;
+    out->cached = stat.cached;
+    out->grown = stat.grown;
+    out->free_blocks = stat.tlsf.free_blocks;
+    out->largest_free = stat.tlsf.largest_free;
+    for (int i = 0; i < MEM_STAT_FL_NUM && i < TLSF_STAT_FL_NUM; i++) {
+        out->fl_free[i] = stat.tlsf.fl_free[i];
+    }
+}
+
+// returns the size of struct mem_stats, at most len bytes of it are copied
+static long call_mem_stats(int op, struct mem_stats __user *out, int len)
+{
+    if (op == MEM_STATS_RESET_PEAK) {
+        kp_pool_reset_peak(0);
+        kp_pool_reset_peak(1);
+        return 0;
+    }
+    if (op != MEM_STATS_READ || len < 0 || (len && !out)) return -EINVAL;
+
+    struct mem_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    mem_pool_stat_copy(&stats.rw, 0);
+    mem_pool_stat_copy(&stats.rox, 1);
+
+    hook_mem_stat_t hook;
+    hook_mem_stat(&hook);
+    stats.hook.regions = hook.regions;
+    stats.hook.slot_size = hook.slot_size;
+    stats.hook.slots = hook.slots;
+    stats.hook.used = hook.used;
+    stats.hook.retired = hook.retired;
+    stats.hook.peak = hook.peak;
+
+    int sz = len < sizeof(stats) ? len : sizeof(stats);
+    if (sz && compat_copy_to_user(out, &stats, sz) != sz) return -EFAULT;
+    return sizeof(stats);
+}
+
+static long call_kstorage_alloc_group(const char __user *uname, const struct kstorage_group_conf __user *uconf)
+{
+    char name[KSTORAGE_GROUP_NAME_LEN] = { 0 };
+    if (uname) {
+        long len = compat_strncpy_from_user(name, uname, sizeof(name));
+        if (len < 0) return -EINVAL;
+        if (len >= sizeof(name)) return -ENAMETOOLONG;
+    }
+    if (!uconf) return alloc_kstorage_group(name, 0);
+
+    struct kstorage_group_conf *conf = memdup_user(uconf, sizeof(struct kstorage_group_conf));
+    if (IS_ERR(conf)) return PTR_ERR(conf);
+    long rc = alloc_kstorage_group(name, conf);
+    kvfree(conf);
+    return rc;
+}
+
+static long call_kstorage_remove_group(int gid)
+{
+    // the su and exclude lists are owned by KernelPatch
+    if (gid == KSTORAGE_SU_LIST_GROUP || gid == KSTORAGE_EXCLUDE_LIST_GROUP) return -EPERM;
+    return remove_kstorage_group(gid);
+}
+
 static long call_kstorage_read(int gid, long did, void *out_data, int offset, int dlen)
 {
     return read_kstorage(gid, did, out_data, offset, dlen, true);
@@ -141,7 +269,19 @@ static long call_kstorage_remove(int gid, long did)
     return remove_kstorage(gid, did);
 }
 
-static long supercall(long cmd, long arg1, long arg2, long arg3, long arg4)
+static long call_kstorage_batch(struct kstorage_batch_item __user *uitems, int num)
+{
+    if (num <= 0 || num > KSTORAGE_BATCH_MAX) return -EINVAL;
+    int size = num * sizeof(struct kstorage_batch_item);
+    struct kstorage_batch_item *items = memdup_user(uitems, size);
+    if (IS_ERR(items)) return PTR_ERR(items);
+    long rc = batch_kstorage(items, num, true);
+    if (rc >= 0 && compat_copy_to_user(uitems, items, size) != size) rc = -EFAULT;
+    kvfree(items);
+    return rc;
+}
+
+static long supercall(long cmd, long arg1, long arg2, long arg3, long arg4, void *fargs)
 {
     switch (cmd) {
     case SUPERCALL_HELLO:
@@ -167,6 +307,12 @@ static long supercall(long cmd, long arg1, long arg2, long arg3, long arg4)
         return call_list_kstorage_ids((int)arg1, (long *)arg2, (int)arg3);
     case SUPERCALL_KSTORAGE_REMOVE:
         return call_kstorage_remove((int)arg1, (long)arg2);
+    case SUPERCALL_KSTORAGE_ALLOC_GROUP:
+        return call_kstorage_alloc_group((const char __user *)arg1, (const struct kstorage_group_conf __user *)arg2);
+    case SUPERCALL_KSTORAGE_REMOVE_GROUP:
+        return call_kstorage_remove_group((int)arg1);
+    case SUPERCALL_KSTORAGE_BATCH:
+        return call_kstorage_batch((struct kstorage_batch_item __user *)arg1, (int)arg2);
     default:
         break;
     }
@@ -191,13 +337,19 @@ static long supercall(long cmd, long arg1, long arg2, long arg3, long arg4)
         }
     case SUPERCALL_REHOOK_STATUS:
         return rehook_status();
+    case SUPERCALL_HOOK_STATS_CTL:
+        return call_hook_stats_ctl((int)arg1);
+    case SUPERCALL_HOOK_STATS:
+        return call_hook_stats((struct hook_stat __user *)arg1, (int)arg2);
+    case SUPERCALL_MEM_STATS:
+        return call_mem_stats((int)arg1, (struct mem_stats __user *)arg2, (int)arg3);
     }
 
     switch (cmd) {
     case SUPERCALL_KPM_LOAD:
         return call_kpm_load((const char *__user)arg1, (const char *__user)arg2, (void *__user)arg3);
     case SUPERCALL_KPM_UNLOAD:
-        return call_kpm_unload((const char *__user)arg1, (void *__user)arg2);
+        return call_kpm_unload((const char *__user)arg1, (void *__user)arg2, fargs);
     case SUPERCALL_KPM_CONTROL:
         return call_kpm_control((const char *__user)arg1, (const char *__user)arg2, (char *__user)arg3, (int)arg4);
     case SUPERCALL_KPM_NUMS:
@@ -234,8 +386,12 @@ void supercall_before(hook_fargs6_t *args, void *udata)
     long a3 = (long)syscall_argn(args, 4);
     long a4 = (long)syscall_argn(args, 5);
 
+    // a syscall may sleep, kp_rw_mem only grows here and when modules are loaded
+    kp_pool_reserve(0);
+
     args->skip_origin = 1;
-    args->ret = supercall(cmd, a1, a2, a3, a4);
+    // unloading drains from inside this hook, the call itself is not waited for
+    args->ret = supercall(cmd, a1, a2, a3, a4, args);
 }
 
 int supercall_install()
@@ -0,0 +1,137 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/* 
+ * Copyright (C) 2024 bmax121. All Rights Reserved.
+ */
+
+#include "symhook.h"
+
+#include <ksyms.h>
+#include <hook.h>
+#include <log.h>
+#include <symbol.h>
+#include <kallsyms.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+#include <uapi/asm-generic/errno.h>
+
+static int glob_match(const char *pattern, const char *str)
+{
+    const char *star = 0;
+    const char *retry = 0;
+    while (*str) {
+        if (*pattern == '*') {
+            star = pattern++;
+            retry = str;
+        } else if (*pattern == '?' || *pattern == *str) {
+            pattern++;
+            str++;
+        } else if (star) {
+            pattern = star + 1;
+            str = ++retry;
+        } else {
+            return 0;
+        }
+    }
+    while (*pattern == '*')
+        pattern++;
+    return !*pattern;
+}
+
+struct symbols_glob_ctx
+{
+    const char *pattern;
+    int match_dot;
+    uintptr_t stext;
+    uintptr_t etext;
+    uintptr_t *addrs;
+    int32_t num;
+    int32_t max;
+    int32_t dropped;
+};
+
+static int symbols_glob_cb(void *data, const char *name, struct module *module, unsigned long addr)
+{
+    struct symbols_glob_ctx *ctx = (struct symbols_glob_ctx *)data;
+    if (module) return 0;
+    // data symbols share the namespace, only hook text
+    if (addr < ctx->stext || addr >= ctx->etext) return 0;
+    if (!ctx->match_dot && strchr(name, '.')) return 0;
+    if (!glob_match(ctx->pattern, name)) return 0;
+    for (int32_t i = 0; i < ctx->num; i++) {
+        if (ctx->addrs[i] == addr) return 0;
+    }
+    if (ctx->num >= ctx->max) {
+        ctx->dropped++;
+        return 0;
+    }
+    ctx->addrs[ctx->num++] = addr;
+    return 0;
+}
+
+int32_t symbols_glob(const char *pattern, uintptr_t *addrs, int32_t max)
+{
+    if (!pattern || !*pattern || !addrs || max <= 0) return -EINVAL;
+    if (!kallsyms_on_each_symbol) return -ENOSYS;
+
+    struct symbols_glob_ctx ctx = {
+        .pattern = pattern,
+        .match_dot = !!strchr(pattern, '.'),
+        .stext = kallsyms_lookup_name("_stext"),
+        .etext = kallsyms_lookup_name("_etext"),
+        .addrs = addrs,
+        .num = 0,
+        .max = max,
+        .dropped = 0,
+    };
+    if (!ctx.stext || ctx.etext <= ctx.stext) return -ENOENT;
+
+    kallsyms_on_each_symbol(symbols_glob_cb, &ctx);
+    if (ctx.dropped) logkw("symbols glob %s: %d more than %d dropped\n", pattern, ctx.dropped, max);
+    return ctx.num;
+}
+KP_EXPORT_SYMBOL(symbols_glob);
+
+int32_t hook_symbols_glob(const char *pattern, int32_t argno, void *before, void *after, void *udata,
+                          symhook_report_f report, void *report_udata)
+{
+    uintptr_t *addrs = vmalloc(SYMHOOK_MAX_NUM * sizeof(uintptr_t));
+    if (!addrs) return -ENOMEM;
+    int32_t num = symbols_glob(pattern, addrs, SYMHOOK_MAX_NUM);
+    if (num < 0) {
+        vfree(addrs);
+        return num;
+    }
+
+    int32_t hooked = 0;
+    hook_batch_begin();
+    for (int32_t i = 0; i < num; i++) {
+        hook_err_t err = hook_wrap((void *)addrs[i], argno, before, after, udata);
+        if (report) report(addrs[i], err, report_udata);
+        if (!err) hooked++;
+    }
+    hook_err_t err = hook_batch_commit();
+    if (err) logkw("hook symbols glob %s: commit err: %d\n", pattern, err);
+    logkv("hook symbols glob %s: %d matched, %d hooked\n", pattern, num, hooked);
+
+    vfree(addrs);
+    return hooked;
+}
+KP_EXPORT_SYMBOL(hook_symbols_glob);
+
+int32_t unhook_symbols_glob(const char *pattern, void *before, void *after)
+{
+    uintptr_t *addrs = vmalloc(SYMHOOK_MAX_NUM * sizeof(uintptr_t));
+    if (!addrs) return -ENOMEM;
+    int32_t num = symbols_glob(pattern, addrs, SYMHOOK_MAX_NUM);
+    if (num > 0) {
+        hook_batch_begin();
+        for (int32_t i = 0; i < num; i++) {
+            hook_unwrap((void *)addrs[i], before, after);
+        }
+        hook_err_t err = hook_batch_commit();
+        if (err) logkw("unhook symbols glob %s: commit err: %d\n", pattern, err);
+    }
+    vfree(addrs);
+    return num;
+}
+KP_EXPORT_SYMBOL(unhook_symbols_glob);
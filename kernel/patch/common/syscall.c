@@ -345,6 +345,132 @@ void unhook_compat_syscalln(int nr, void *before, void *after)
 }
 KP_EXPORT_SYMBOL(unhook_compat_syscalln);
 
+#define SYSCALL_NAME_RANK_NONE 0xff
+
+struct syscall_resolve_ctx
+{
+    int is_compat;
+    uint8_t ranks[SYSCALL_SET_NR_MAX];
+};
+
+/*
+ * Ranked like the lookup order of syscalln_name_addr, prefix first, then suffix,
+ * so a single walk ends up with the same address as the per-name lookups.
+ */
+static int syscall_resolve_cb(void *data, const char *name, struct module *module, unsigned long addr)
+{
+    struct syscall_resolve_ctx *ctx = (struct syscall_resolve_ctx *)data;
+    if (module) return 0;
+
+    int rank = 0;
+    if (!strncmp(name, "__arm64_", 8)) {
+        name += 8;
+    } else {
+        rank = 3;
+    }
+    if (strncmp(name, "sys_", 4) && strncmp(name, "compat_sys_", 11)) return 0;
+
+    int len = strlen(name);
+    if (len > 7 && !strcmp(name + len - 7, ".cfi_jt")) {
+        len -= 7;
+    } else if (len > 4 && !strcmp(name + len - 4, ".cfi")) {
+        len -= 4;
+        rank += 1;
+    } else {
+        rank += 2;
+    }
+
+    for (int nr = 0; nr < SYSCALL_SET_NR_MAX; nr++) {
+        if (rank >= ctx->ranks[nr]) continue;
+        const char *tname = ctx->is_compat ? compat_syscall_name_table[nr].name : syscall_name_table[nr].name;
+        if (strncmp(tname, name, len) || tname[len]) continue;
+        ctx->ranks[nr] = rank;
+        if (!ctx->is_compat) {
+            syscall_name_table[nr].addr = addr;
+        } else {
+            compat_syscall_name_table[nr].addr = addr;
+        }
+    }
+    return 0;
+}
+
+void syscall_set_resolve(const syscall_set_t *set, int is_compat)
+{
+    struct syscall_resolve_ctx ctx;
+    ctx.is_compat = is_compat;
+    int num = 0;
+    for (int nr = 0; nr < SYSCALL_SET_NR_MAX; nr++) {
+        ctx.ranks[nr] = 0;
+        if (!syscall_set_has(set, nr)) continue;
+        if (!is_compat) {
+            if (!syscall_name_table[nr].name || syscall_name_table[nr].addr) continue;
+        } else {
+            if (!compat_syscall_name_table[nr].name || compat_syscall_name_table[nr].addr) continue;
+        }
+        ctx.ranks[nr] = SYSCALL_NAME_RANK_NONE;
+        num++;
+    }
+    if (!num) return;
+
+    if (!kallsyms_on_each_symbol) {
+        for (int nr = 0; nr < SYSCALL_SET_NR_MAX; nr++) {
+            if (ctx.ranks[nr]) syscalln_name_addr(nr, is_compat);
+        }
+        return;
+    }
+    kallsyms_on_each_symbol(syscall_resolve_cb, &ctx);
+    logkv("syscall set resolve: %d, compat: %d\n", num, is_compat);
+}
+KP_EXPORT_SYMBOL(syscall_set_resolve);
+
+int wrap_syscall_set(const syscall_set_t *set, int narg, int is_compat, void *before, void *after, void *udata,
+                     hook_err_t *results)
+{
+    uintptr_t *table = is_compat ? compat_sys_call_table : sys_call_table;
+    if (!table) syscall_set_resolve(set, is_compat);
+
+    int hooked = 0;
+    hook_batch_begin();
+    for (int nr = 0; nr < SYSCALL_SET_NR_MAX; nr++) {
+        if (!syscall_set_has(set, nr)) continue;
+        hook_err_t err;
+        if (table) {
+            err = fp_wrap_syscalln(nr, narg, is_compat, before, after, udata);
+        } else {
+            err = inline_wrap_syscalln(nr, narg, is_compat, before, after, udata);
+        }
+        if (results) results[nr] = err;
+        if (err) {
+            logkw("hook syscall set nr: %d, compat: %d, err: %d\n", nr, is_compat, err);
+            continue;
+        }
+        hooked++;
+    }
+    hook_err_t err = hook_batch_commit();
+    if (err) logkw("hook syscall set compat: %d, commit err: %d\n", is_compat, err);
+    return hooked;
+}
+KP_EXPORT_SYMBOL(wrap_syscall_set);
+
+void unwrap_syscall_set(const syscall_set_t *set, int is_compat, void *before, void *after)
+{
+    uintptr_t *table = is_compat ? compat_sys_call_table : sys_call_table;
+    if (!table) syscall_set_resolve(set, is_compat);
+
+    hook_batch_begin();
+    for (int nr = 0; nr < SYSCALL_SET_NR_MAX; nr++) {
+        if (!syscall_set_has(set, nr)) continue;
+        if (table) {
+            fp_unwrap_syscalln(nr, is_compat, before, after);
+        } else {
+            inline_unwrap_syscalln(nr, is_compat, before, after);
+        }
+    }
+    hook_err_t err = hook_batch_commit();
+    if (err) logkw("unhook syscall set compat: %d, commit err: %d\n", is_compat, err);
+}
+KP_EXPORT_SYMBOL(unwrap_syscall_set);
+
 void syscall_init()
 {
     for (int i = 0; i < sizeof(syscall_name_table) / sizeof(syscall_name_table[0]); i++) {
@@ -9,22 +9,61 @@
 #include <ktypes.h>
 #include <uapi/scdefs.h>
 #include <stdbool.h>
+#include <barrier.h>
 
 struct kstorage
 {
     struct list_head list;
     struct rcu_head rcu;
+    // links in the hash tables of the group, a resize moves entries to the other one
+    struct hlist_node hnode[2];
 
     int gid;
+    // odd while data is written in place
+    unsigned int seq;
     long did;
     int dlen;
     char data[0];
 };
 
+// data of up to this size is written in place when the size does not change, larger data is copied on write
+#define KSTORAGE_SMALL_SIZE 256
+
+// direct readers of small data retry like a seqcount
+static inline unsigned int kstorage_read_begin(const struct kstorage *ks)
+{
+    unsigned int seq;
+    while ((seq = smp_load_acquire(&ks->seq)) & 1) {
+        asm volatile("yield" ::: "memory");
+    }
+    return seq;
+}
+
+static inline bool kstorage_read_retry(const struct kstorage *ks, unsigned int seq)
+{
+    smp_rmb();
+    return *(volatile unsigned int *)&ks->seq != seq;
+}
+
 int try_alloc_kstroage_group();
 
+/// the name may be empty, otherwise it must be unique, returns the group id
+int alloc_kstorage_group(const char *name, const struct kstorage_group_conf *conf);
+
+int find_kstorage_group(const char *name);
+
+/// the id can be allocated again right away, the entries are freed after a grace period
+int remove_kstorage_group(int gid);
+
 int kstorage_group_size(int gid);
 
+/// keeps a bitmap of the ids below 1 << 24 of an empty group, so membership is tested without a lookup
+int enable_kstorage_uid_index(int gid);
+
+/// returns 1 or 0 whether an entry with the id exists, -ERANGE if the id is not indexed, call a lookup then
+int test_kstorage_uid(int gid, long did);
+
+/// writes len bytes of data at offset into the entry, at offset 0 they replace its data
 int write_kstorage(int gid, long did, void *data, int offset, int len, bool data_is_user);
 
 /// must within rcu read lock
@@ -39,4 +78,7 @@ int list_kstorage_ids(int gid, long *ids, int idslen, bool data_is_user);
 
 int remove_kstorage(int gid, long did);
 
+/// runs the items in order and sets their status, returns the number of failed items
+int batch_kstorage(struct kstorage_batch_item *items, int num, bool data_is_user);
+
 #endif
\ No newline at end of file
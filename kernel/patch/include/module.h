@@ -46,7 +46,9 @@ struct module
     unsigned int text_size;
     unsigned int ro_size;
 
+    // text from kp_rox_mem, ro and rw data from kp_rw_mem
     void *start;
+    void *data;
 
     struct list_head list;
 };
@@ -55,7 +57,8 @@ long load_module(const void *data, int len, const char *args, const char *event,
 long load_module_path(const char *path, const char *args, void *__user reserved);
 long module_control0(const char *name, const char *ctl_args, char *__user out_msg, int outlen);
 long module_control1(const char *name, void *a1, void *a2, void *a3);
-long unload_module(const char *name, void *__user reserved);
+// fargs of the hook callback it is called from, 0 outside of any, see hook_drain_from
+long unload_module(const char *name, void *__user reserved, void *fargs);
 struct module *find_module(const char *name);
 
 int get_module_nums();
@@ -0,0 +1,61 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/* 
+ * Copyright (C) 2024 bmax121. All Rights Reserved.
+ */
+
+#ifndef _KP_SYMHOOK_H_
+#define _KP_SYMHOOK_H_
+
+#include <ktypes.h>
+#include <hook.h>
+
+#define SYMHOOK_MAX_NUM 0x200
+
+/**
+ * @brief Called for each symbol matched by hook_symbols_glob.
+ * 
+ * @param addr address of the symbol, print with %ps for its name
+ * @param err result of hooking it
+ * @param udata 
+ */
+typedef void (*symhook_report_f)(uintptr_t addr, hook_err_t err, void *udata);
+
+/**
+ * @brief Match @pattern against the names of the kernel text symbols, supports '*' and '?'.
+ * Symbols with a '.' suffix, like .cfi_jt, only match when @pattern contains a '.',
+ * addresses with several names are counted once, module symbols are not matched.
+ * 
+ * @param pattern 
+ * @param addrs 
+ * @param max 
+ * @return int32_t number of addresses, at most @max
+ */
+int32_t symbols_glob(const char *pattern, uintptr_t *addrs, int32_t max);
+
+/**
+ * @brief Hook every kernel function matching @pattern, e.g. "vfs_*", with the same callbacks.
+ * Symbols are resolved in one kallsyms walk and installed in one batch.
+ * 
+ * @param pattern 
+ * @param argno 
+ * @param before 
+ * @param after 
+ * @param udata 
+ * @param report optional, called with the result of each matched function
+ * @param report_udata 
+ * @return int32_t number of functions hooked, or negative error
+ */
+int32_t hook_symbols_glob(const char *pattern, int32_t argno, void *before, void *after, void *udata,
+                          symhook_report_f report, void *report_udata);
+
+/**
+ * @brief 
+ * 
+ * @param pattern 
+ * @param before 
+ * @param after 
+ * @return int32_t number of functions matched, or negative error
+ */
+int32_t unhook_symbols_glob(const char *pattern, void *before, void *after);
+
+#endif
@@ -169,4 +169,78 @@ hook_err_t hook_compat_syscalln(int nr, int narg, void *before, void *after, voi
 
 void unhook_compat_syscalln(int nr, void *before, void *after);
 
+#define SYSCALL_SET_NR_MAX 460
+
+typedef struct
+{
+    uint64_t bits[(SYSCALL_SET_NR_MAX + 63) / 64];
+} syscall_set_t;
+
+static inline void syscall_set_add(syscall_set_t *set, int nr)
+{
+    if (nr >= 0 && nr < SYSCALL_SET_NR_MAX) set->bits[nr / 64] |= 1ull << (nr % 64);
+}
+
+static inline int syscall_set_has(const syscall_set_t *set, int nr)
+{
+    return (set->bits[nr / 64] >> (nr % 64)) & 1;
+}
+
+/**
+ * @brief Resolve the addresses of every syscall in @set that is not cached yet with one kallsyms walk,
+ * instead of several kallsyms_lookup_name calls per syscall.
+ * 
+ * @param set 
+ * @param is_compat 
+ */
+void syscall_set_resolve(const syscall_set_t *set, int is_compat);
+
+/**
+ * @brief Hook every syscall in @set with the same callbacks.
+ * Names are resolved in one pass and inline hooks are installed in one batch.
+ * 
+ * @param set 
+ * @param narg 
+ * @param is_compat 
+ * @param before 
+ * @param after 
+ * @param udata 
+ * @param results optional, SYSCALL_SET_NR_MAX entries, result of each syscall in @set is stored at its nr
+ * @return int number of syscalls hooked
+ */
+int wrap_syscall_set(const syscall_set_t *set, int narg, int is_compat, void *before, void *after, void *udata,
+                     hook_err_t *results);
+
+/**
+ * @brief 
+ * 
+ * @param set 
+ * @param is_compat 
+ * @param before 
+ * @param after 
+ */
+void unwrap_syscall_set(const syscall_set_t *set, int is_compat, void *before, void *after);
+
+static inline int hook_syscall_set(const syscall_set_t *set, int narg, void *before, void *after, void *udata,
+                                   hook_err_t *results)
+{
+    return wrap_syscall_set(set, narg, 0, before, after, udata, results);
+}
+
+static inline void unhook_syscall_set(const syscall_set_t *set, void *before, void *after)
+{
+    unwrap_syscall_set(set, 0, before, after);
+}
+
+static inline int hook_compat_syscall_set(const syscall_set_t *set, int narg, void *before, void *after, void *udata,
+                                          hook_err_t *results)
+{
+    return wrap_syscall_set(set, narg, 1, before, after, udata, results);
+}
+
+static inline void unhook_compat_syscall_set(const syscall_set_t *set, void *before, void *after)
+{
+    unwrap_syscall_set(set, 1, before, after);
+}
+
 #endif
\ No newline at end of file
@@ -44,12 +44,113 @@ struct kernel_storage
 #define KSTORAGE_UNUSED_GROUP_2 2
 #define KSTORAGE_UNUSED_GROUP_3 3
 
+#define KSTORAGE_GROUP_NAME_LEN 32
+
+#define KSTORAGE_LOOKUP_HASH 0
+#define KSTORAGE_LOOKUP_LIST 1
+
+struct kstorage_group_conf
+{
+    // entries the group is expected to hold, sizes its hash table up front
+    int expected_size;
+    // KSTORAGE_LOOKUP_HASH, or KSTORAGE_LOOKUP_LIST for groups of a few entries
+    int lookup;
+    // longest data an entry may hold, 0 for no limit
+    int max_dlen;
+};
+
+#define SUPERCALL_KSTORAGE_BATCH 0x1046
+
+#define KSTORAGE_BATCH_READ 0
+#define KSTORAGE_BATCH_WRITE 1
+#define KSTORAGE_BATCH_REMOVE 2
+
+#define KSTORAGE_BATCH_MAX 4096
+
+// one operation of a batch, ptr is the data to write or the buffer to read into, status is filled in.
+// fixed width, so 32-bit callers share the layout
+struct kstorage_batch_item
+{
+    int op;
+    int gid;
+    int64_t did;
+    int offset;
+    int len;
+    uint64_t ptr;
+    int64_t status;
+};
+
 #define SUPERCALL_BOOTLOG 0x10fd
 #define SUPERCALL_PANIC 0x10fe
 
 #define SUPERCALL_REHOOK_SYSCALL 0x1100
 #define SUPERCALL_REHOOK_STATUS 0x1101
 
+#define SUPERCALL_HOOK_STATS_CTL 0x1110
+#define SUPERCALL_HOOK_STATS 0x1111
+
+#define HOOK_STATS_DISABLE 0
+#define HOOK_STATS_ENABLE 1
+#define HOOK_STATS_RESET 2
+#define HOOK_STATS_STATUS 3
+
+#define HOOK_STAT_NAME_LEN 0x60
+#define HOOK_STAT_HIST_NUM 0x10
+
+// one hook chain, summed across cpus, times are in cntvct ticks of freq Hz
+struct hook_stat
+{
+    char name[HOOK_STAT_NAME_LEN];
+    unsigned long long addr;
+    int type;
+    int callbacks;
+    unsigned long long freq;
+    unsigned long long calls;
+    unsigned long long skips;
+    unsigned long long before_ticks;
+    unsigned long long origin_ticks;
+    unsigned long long after_ticks;
+    unsigned long long hist[HOOK_STAT_HIST_NUM];
+};
+
+#define SUPERCALL_MEM_STATS 0x1112
+
+#define MEM_STATS_READ 0
+#define MEM_STATS_RESET_PEAK 1
+
+#define MEM_STAT_FL_NUM 0x20
+
+// a kp memory pool, sizes in bytes, free blocks of class 0 are below 256, those of class i in [2^(i+7), 2^(i+8))
+struct mem_pool_stat
+{
+    unsigned long long total;
+    unsigned long long used;
+    unsigned long long peak;
+    unsigned long long cached;
+    unsigned long long grown;
+    unsigned long long free_blocks;
+    unsigned long long largest_free;
+    unsigned long long fl_free[MEM_STAT_FL_NUM];
+};
+
+// hook memory, in slots of slot_size bytes, retired slots are unhooked and wait for hook_drain
+struct hook_mem_stats
+{
+    int regions;
+    int slot_size;
+    int slots;
+    int used;
+    int retired;
+    int peak;
+};
+
+struct mem_stats
+{
+    struct mem_pool_stat rw;
+    struct mem_pool_stat rox;
+    struct hook_mem_stats hook;
+};
+
 #define SUPERCALL_SCONTEXT_LEN 0x60
 
 struct su_profile
@@ -259,12 +259,14 @@ void _linux_kernel_pid_sym_match(const char *name, unsigned long addr)
 
 bool kvar_def(stop_machine_initialized) = 0;
 const struct cpumask *kvar_def(cpu_online_mask) = 0;
+struct cpumask kvar_def(__cpu_online_mask) = 0;
 int kfunc_def(stop_machine)(int (*fn)(void *), void *data, const struct cpumask *cpus) = 0;
 
 static void _linux_kernel_stop_machine_sym_match(const char *name, unsigned long addr)
 {
-    // kvar_match(stop_machine_initialized, name, addr);
-    // kvar_match(cpu_online_mask, name, addr);
+    kvar_match(stop_machine_initialized, name, addr);
+    kvar_match(cpu_online_mask, name, addr);
+    kvar_match(__cpu_online_mask, name, addr);
     kfunc_match(stop_machine, name, addr);
 }
 
@@ -31,6 +31,9 @@
 #define THREAD_INFO_MAX_SIZE 0x90
 #define CRED_MAX_SIZE 0x100
 #define MM_STRUCT_MAX_SIZE 0xb0
+#define SIGNAL_STRUCT_MAX_SIZE 0x400
+// prio of pushable_tasks in init_task, the plist_node behind tasks
+#define TASK_MAX_PRIO 140
 
 struct mm_struct_offset mm_struct_offset = {
     .mmap_base_offset = -1,
@@ -75,6 +78,9 @@ struct task_struct_offset task_struct_offset = {
     .tasks_offset = -1,
     .mm_offset = -1,
     .active_mm_offset = -1,
+    .signal_offset = -1,
+    .thread_node_offset = -1,
+    .signal_thread_head_offset = -1,
 };
 KP_EXPORT_SYMBOL(task_struct_offset);
 
@@ -455,6 +461,39 @@ int resolve_task_offset()
     }
     log_boot("    active_mm offset: %x\n", task_struct_offset.active_mm_offset);
 
+    // tasks, a list head followed by pushable_tasks, a plist_node init_task is never queued with
+    uintptr_t task_end = (uintptr_t)init_task + TASK_STRUCT_MAX_SIZE;
+    for (uintptr_t i = (uintptr_t)init_task; i + 7 * sizeof(uintptr_t) <= task_end; i += sizeof(uintptr_t)) {
+        uintptr_t *p = (uintptr_t *)i;
+        if (*(int *)&p[2] != TASK_MAX_PRIO) continue;
+        if (p[3] != (uintptr_t)&p[3] || p[4] != p[3] || p[5] != (uintptr_t)&p[5] || p[6] != p[5]) continue;
+        // empty until the first fork
+        if (p[0] != i && ((int64_t)p[0] >= 0 || *(uintptr_t *)(p[0] + sizeof(uintptr_t)) != i)) continue;
+        task_struct_offset.tasks_offset = i - (uintptr_t)init_task;
+        break;
+    }
+    log_boot("    tasks offset: %x\n", task_struct_offset.tasks_offset);
+
+    // signal, and thread_node, linked with the thread_head of init_signals, init_task is alone in its group
+    uintptr_t init_signals = kallsyms_lookup_name("init_signals");
+    if (init_signals) {
+        for (uintptr_t i = (uintptr_t)init_task; i + 2 * sizeof(uintptr_t) <= task_end; i += sizeof(uintptr_t)) {
+            uintptr_t *p = (uintptr_t *)i;
+            if (p[0] == init_signals && task_struct_offset.signal_offset < 0) {
+                task_struct_offset.signal_offset = i - (uintptr_t)init_task;
+            }
+            if (task_struct_offset.thread_node_offset >= 0) continue;
+            if (p[0] <= init_signals || p[0] >= init_signals + SIGNAL_STRUCT_MAX_SIZE || p[1] != p[0]) continue;
+            uintptr_t *head = (uintptr_t *)p[0];
+            if (head[0] != i || head[1] != i) continue;
+            task_struct_offset.thread_node_offset = i - (uintptr_t)init_task;
+            task_struct_offset.signal_thread_head_offset = p[0] - init_signals;
+        }
+    }
+    log_boot("    signal offset: %x\n", task_struct_offset.signal_offset);
+    log_boot("    thread_node offset: %x, thread_head offset: %x\n", task_struct_offset.thread_node_offset,
+             task_struct_offset.signal_thread_head_offset);
+
     revert_current(backup);
     vfree(task);
     return 0;
@@ -6,6 +6,7 @@
 #include <uapi/asm-generic/errno.h>
 #include <pgtable.h>
 #include <kpmalloc.h>
+#include <kpslab.h>
 #include <linux/err.h>
 #include <linux/string.h>
 #include <symbol.h>
@@ -15,6 +16,7 @@
 #include <linux/fs.h>
 #include <uapi/linux/fs.h>
 #include <hotpatch.h>
+#include <hook.h>
 #include <linux/list.h>
 #include <linux/kernel.h>
 #include <linux/spinlock.h>
@@ -124,7 +126,7 @@ static void layout_sections(struct module *mod, struct load_info *info)
     for (int i = 0; i < info->hdr->e_shnum; i++)
         info->sechdrs[i].sh_entsize = ~0UL;
 
-    // todo: tslf alloc all rwx and not page aligned
+    // text, ro and rw data each start on a page, move_module puts text and data in separate blocks
     for (int m = 0; m < sizeof(masks) / sizeof(masks[0]); ++m) {
         for (int i = 0; i < info->hdr->e_shnum; ++i) {
             Elf_Shdr *s = &info->sechdrs[i];
@@ -267,15 +269,59 @@ static int rewrite_section_headers(struct load_info *info)
     return 0;
 }
 
+// offsets below text_size are in the text block, the rest in the data block
+static void *module_addr(struct module *mod, unsigned long offset)
+{
+    if (offset < mod->text_size) return mod->start + offset;
+    return mod->data + offset - mod->text_size;
+}
+
+// pages of a contiguous range share it with other allocations and are left as they are
+static void module_prot(void *start, unsigned int size, bool ro)
+{
+    if (!start || !size) return;
+    for (uint64_t va = (uint64_t)start; va < (uint64_t)start + size; va += page_size) {
+        uint64_t *entry = pgtable_entry_kernel(va);
+        if (!entry || pte_valid_cont(*entry)) continue;
+        if (ro) {
+            *entry = (*entry | PTE_RDONLY) & ~PTE_DBM;
+        } else {
+            *entry = (*entry | PTE_DBM) & ~PTE_RDONLY;
+        }
+    }
+    flush_tlb_kernel_range((uint64_t)start, (uint64_t)start + size);
+}
+
+// after relocation, text and ro data become read-only, rw data is never executable as it comes from kp_rw_mem
+static void module_protect(struct module *mod, bool ro)
+{
+    module_prot(mod->start, mod->text_size, ro);
+    module_prot(mod->data, mod->ro_size - mod->text_size, ro);
+}
+
+static void module_free_mem(struct module *mod)
+{
+    module_protect(mod, false);
+    if (mod->start) kp_free_exec(mod->start);
+    if (mod->data) kp_free(mod->data);
+    mod->start = 0;
+    mod->data = 0;
+}
+
 static int move_module(struct module *mod, struct load_info *info)
 {
-    // todo:
-    logki("alloc module size: %llx\n", mod->size);
-    mod->start = kp_malloc_exec(mod->size);
-    if (!mod->start) {
+    mod->size = align(mod->size);
+    logki("alloc module text size: %llx, data size: %llx\n", mod->text_size, mod->size - mod->text_size);
+    // modules are loaded from kernel_init or a supercall, both may sleep
+    kp_pool_reserve(mod->size - mod->text_size + page_size);
+    mod->start = kp_memalign_exec(page_size, mod->text_size);
+    mod->data = kp_memalign(page_size, mod->size - mod->text_size);
+    if (!mod->start || !mod->data) {
+        module_free_mem(mod);
         return -ENOMEM;
     }
-    memset(mod->start, 0, mod->size);
+    memset(mod->start, 0, mod->text_size);
+    memset(mod->data, 0, mod->size - mod->text_size);
 
     /* Transfer each section which specifies SHF_ALLOC */
     logkd("final section addresses:\n");
@@ -285,7 +331,7 @@ static int move_module(struct module *mod, struct load_info *info)
         Elf_Shdr *shdr = &info->sechdrs[i];
         if (!(shdr->sh_flags & SHF_ALLOC)) continue;
 
-        dest = mod->start + shdr->sh_entsize;
+        dest = module_addr(mod, shdr->sh_entsize);
         const char *sname = info->secstrings + shdr->sh_name;
 
         logkd("    %s %llx %llx\n", sname, dest, shdr->sh_size);
@@ -394,6 +440,22 @@ static int elf_header_check(struct load_info *info)
 
 struct module modules = { 0 };
 static spinlock_t module_lock;
+static kp_slab_t *module_slab = 0;
+
+// unloaded modules whose memory was kept because hooks were busy, freed by the next unload that drains
+static struct list_head busy_modules;
+
+static void free_busy_modules()
+{
+    struct module *pos, *n;
+    list_for_each_entry_safe(pos, n, &busy_modules, list)
+    {
+        list_del(&pos->list);
+        logkfi("name: %s, module memory freed\n", pos->info.name);
+        module_free_mem(pos);
+        kp_slab_free(module_slab, pos);
+    }
+}
 
 long load_module(const void *data, int len, const char *args, const char *event, void *__user reserved)
 {
@@ -410,7 +472,7 @@ long load_module(const void *data, int len, const char *args, const char *event,
         goto out;
     }
 
-    struct module *mod = (struct module *)vmalloc(sizeof(struct module));
+    struct module *mod = (struct module *)kp_slab_alloc(module_slab);
     if (!mod) return -ENOMEM;
     memset(mod, 0, sizeof(struct module));
 
@@ -430,7 +492,8 @@ long load_module(const void *data, int len, const char *args, const char *event,
     if ((rc = simplify_symbols(mod, info))) goto free;
     if ((rc = apply_relocations(mod, info))) goto free;
 
-    flush_icache_all();
+    flush_icache_range((uintptr_t)mod->start, (uintptr_t)mod->start + mod->text_size);
+    module_protect(mod, true);
 
     rc = (*mod->init)(mod->args, event, reserved);
 
@@ -445,15 +508,15 @@ long load_module(const void *data, int len, const char *args, const char *event,
 
 free:
     if (mod->args) kvfree(mod->args);
-    kp_free_exec(mod->start);
+    module_free_mem(mod);
 free1:
-    kvfree(mod);
+    kp_slab_free(module_slab, mod);
 out:
     return rc;
 }
 
 // todo: lock
-long unload_module(const char *name, void *__user reserved)
+long unload_module(const char *name, void *__user reserved, void *fargs)
 {
     if (!name) return -EINVAL;
     logkfe("name: %s\n", name);
@@ -467,15 +530,27 @@ long unload_module(const char *name, void *__user reserved)
         goto out;
     }
     list_del(&mod->list);
+    rcu_read_unlock();
+
+    // exit may sleep, e.g. in stop_machine when it unhooks
     rc = (*mod->exit)(reserved);
 
     if (mod->args) kvfree(mod->args);
     if (mod->ctl_args) kvfree(mod->ctl_args);
 
-    kp_free_exec(mod->start);
-    kvfree(mod);
+    // other cpus may still be inside callbacks in the module text
+    hook_err_t err = hook_drain_from(fargs);
+    if (err) {
+        logkfw("name: %s, hooks busy: %d, module memory is kept until a later drain\n", name, err);
+        list_add_tail(&mod->list, &busy_modules);
+    } else {
+        module_free_mem(mod);
+        kp_slab_free(module_slab, mod);
+        free_busy_modules();
+    }
 
     logkfi("name: %s, rc: %d\n", name, rc);
+    return rc;
 
 out:
     rcu_read_unlock();
@@ -661,5 +736,7 @@ int get_module_info(const char *name, char *out_info, int size)
 void module_init()
 {
     INIT_LIST_HEAD(&modules.list);
+    INIT_LIST_HEAD(&busy_modules);
     spin_lock_init(&module_lock);
+    module_slab = kp_slab_create(sizeof(struct module), 8);
 }
\ No newline at end of file
@@ -52,6 +52,8 @@ void syscall_init();
 int kstorage_init();
 int kpextension_init();
 int rehook_init();
+void hotpatch_init();
+void hook_drain_init();
 
 static void before_rest_init(hook_fargs4_t *args, void *udata)
 {
@@ -109,6 +111,9 @@ static void before_kernel_init(hook_fargs4_t *args, void *udata)
 static void after_kernel_init(hook_fargs4_t *args, void *udata)
 {
     log_boot("event: %s\n", EXTRA_EVENT_POST_KERNEL_INIT);
+    hotpatch_init();
+    log_boot("hotpatch_init done\n");
+    hook_drain_init();
 }
 
 int patch()
@@ -118,7 +123,9 @@ int patch()
     module_init();
     syscall_init();
 
-    hook_err_t rc = 0;
+    hook_err_t rc = 0, crc = 0;
+
+    hook_batch_begin();
 
     unsigned long panic_addr = patch_config->panic;
     logkd("panic addr: %llx\n", panic_addr);
@@ -126,7 +133,7 @@ int patch()
         rc = hook_wrap12((void *)panic_addr, before_panic, 0, 0);
         log_boot("hook panic rc: %d\n", rc);
     }
-    if (rc) return rc;
+    if (rc) goto out;
 
     // rest_init or cgroup_init
     unsigned long init_addr = patch_config->rest_init;
@@ -135,7 +142,7 @@ int patch()
         rc = hook_wrap4((void *)init_addr, before_rest_init, 0, (void *)init_addr);
         log_boot("hook rest_init rc: %d\n", rc);
     }
-    if (rc) return rc;
+    if (rc) goto out;
 
     // kernel_init
     unsigned long kernel_init_addr = patch_config->kernel_init;
@@ -144,5 +151,8 @@ int patch()
         log_boot("hook kernel_init rc: %d\n", rc);
     }
 
-    return rc;
+out:
+    crc = hook_batch_commit();
+    log_boot("hook commit rc: %d\n", crc);
+    return rc ? rc : crc;
 }
@@ -0,0 +1,13 @@
+set(CMAKE_SYSTEM_NAME Linux)
+set(CMAKE_SYSTEM_PROCESSOR aarch64)
+
+set(CROSS_COMPILE aarch64-linux-gnu- CACHE STRING "cross toolchain prefix")
+set(CMAKE_C_COMPILER ${CROSS_COMPILE}gcc)
+set(CMAKE_ASM_COMPILER ${CROSS_COMPILE}gcc)
+
+# the binary is static, -cpu max has pac and bti
+set(CMAKE_CROSSCOMPILING_EMULATOR qemu-aarch64 -cpu max)
+
+set(CMAKE_FIND_ROOT_PATH_MODE_PROGRAM NEVER)
+set(CMAKE_FIND_ROOT_PATH_MODE_LIBRARY ONLY)
+set(CMAKE_FIND_ROOT_PATH_MODE_INCLUDE ONLY)
@@ -0,0 +1,278 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2024 bmax121. All Rights Reserved.
+ */
+
+#include <kpmalloc.h>
+#include <kpslab.h>
+#include <baselib.h>
+#include <log.h>
+#include <linux/vmalloc.h>
+#include "bench.h"
+
+/*
+ * Alloc and free of a batch of objects from a kp_slab against vmalloc and vfree, which is what kstorage and module
+ * headers used before, then how many of the slab's objects are in use after freeing every other one and
+ * allocating half of them again. vmalloc is mmap in the shim.
+ *
+ * Then threads allocate and free batches, first through kp_malloc and kp_free, which are served from the per cpu
+ * magazines for sizes up to 512, then through kp_memalign and kp_free_uncached, which take the pool lock for every
+ * allocation and every free. Every block is stamped and checked before it is freed, and each thread also frees one
+ * block per batch that its neighbour allocated. Reports both throughputs and the pool usage after.
+ */
+
+#define SLAB_COUNT 1024
+#define MALLOC_WORKERS 4
+#define MALLOC_BATCH 32
+#define MALLOC_MS 200
+// kp_memalign with a non-zero alignment never goes through the magazines
+#define MALLOC_LOCKED_ALIGN 16
+
+static const int slab_sizes[] = { 32, 128, 512 };
+static const int malloc_sizes[] = { 64, 256 };
+
+static void *objs[SLAB_COUNT];
+
+// returns the ticks of SLAB_COUNT allocations in *alloc and of SLAB_COUNT frees
+static uint64_t bench_slab(kp_slab_t *slab, uint64_t *alloc)
+{
+    uint64_t t0 = bench_now();
+    for (int i = 0; i < SLAB_COUNT; i++) {
+        objs[i] = kp_slab_alloc(slab);
+    }
+    uint64_t t1 = bench_now();
+    for (int i = 0; i < SLAB_COUNT; i++) {
+        if (objs[i]) kp_slab_free(slab, objs[i]);
+    }
+    *alloc = t1 - t0;
+    return bench_now() - t1;
+}
+
+static uint64_t bench_vmalloc(int size, uint64_t *alloc)
+{
+    uint64_t t0 = bench_now();
+    for (int i = 0; i < SLAB_COUNT; i++) {
+        objs[i] = vmalloc(size);
+    }
+    uint64_t t1 = bench_now();
+    for (int i = 0; i < SLAB_COUNT; i++) {
+        if (objs[i]) vfree(objs[i]);
+    }
+    *alloc = t1 - t0;
+    return bench_now() - t1;
+}
+
+static int slab_bench(int size)
+{
+    kp_slab_t *slab = kp_slab_create(size, 8);
+    if (!slab) {
+        printk("slab %d: create failed\n", size);
+        return 1;
+    }
+
+    // the first round grows the slab, time the second one
+    uint64_t slab_alloc, vm_alloc;
+    bench_slab(slab, &slab_alloc);
+    uint64_t slab_free = bench_slab(slab, &slab_alloc);
+    uint64_t vm_free = bench_vmalloc(size, &vm_alloc);
+
+    // churn, then see how much of the slab is live
+    int live = 0, failed = 0;
+    for (int i = 0; i < SLAB_COUNT; i++) {
+        objs[i] = kp_slab_alloc(slab);
+        if (!objs[i]) failed++;
+    }
+    for (int i = 0; i < SLAB_COUNT; i += 2) {
+        if (objs[i]) kp_slab_free(slab, objs[i]);
+        objs[i] = 0;
+    }
+    for (int i = 0; i < SLAB_COUNT; i += 4) {
+        objs[i] = kp_slab_alloc(slab);
+        if (!objs[i]) failed++;
+    }
+    for (int i = 0; i < SLAB_COUNT; i++) {
+        if (objs[i]) live++;
+    }
+    kp_slab_stat_t stat;
+    kp_slab_stat(slab, &stat);
+    for (int i = 0; i < SLAB_COUNT; i++) {
+        if (objs[i]) kp_slab_free(slab, objs[i]);
+    }
+    kp_slab_destroy(slab);
+
+    uint64_t used = stat.objs ? (uint64_t)stat.used * 1000 / stat.objs : 0;
+    printk("slab %4d  alloc: %lluns, free: %lluns, vmalloc: %lluns, vfree: %lluns, live: %d, chunks: %d, objs: %d, "
+           "cached: %d, used: %llu.%llu%%, failed: %d\n",
+           size, bench_ns(slab_alloc, SLAB_COUNT), bench_ns(slab_free, SLAB_COUNT), bench_ns(vm_alloc, SLAB_COUNT),
+           bench_ns(vm_free, SLAB_COUNT), live, stat.chunks, stat.objs, stat.cached, used / 10, used % 10, failed);
+    return failed;
+}
+
+struct bench_worker
+{
+    void *thread;
+    int id;
+    int locked;
+    size_t size;
+    uint64_t ops;
+    uint64_t fails;
+    uint64_t corrupt;
+    void *blocks[MALLOC_BATCH];
+};
+
+static struct bench_worker workers[MALLOC_WORKERS];
+// one block in flight from each worker to the next one
+static void *handoff[MALLOC_WORKERS];
+static volatile int bench_stop = 0;
+
+static void *xchg_ptr(void **ptr, void *val)
+{
+    void *old;
+    uint32_t fail;
+    asm volatile("1: ldaxr %0, %2\n"
+                 "   stlxr %w1, %3, %2\n"
+                 "   cbnz %w1, 1b"
+                 : "=&r"(old), "=&r"(fail), "+Q"(*ptr)
+                 : "r"(val)
+                 : "memory");
+    return old;
+}
+
+static void stamp(void *block, size_t size, uint64_t val)
+{
+    uint64_t *words = (uint64_t *)block;
+    words[0] = val;
+    words[size / sizeof(uint64_t) - 1] = ~val;
+}
+
+static int stamp_ok(void *block, size_t size)
+{
+    uint64_t *words = (uint64_t *)block;
+    return words[size / sizeof(uint64_t) - 1] == ~words[0];
+}
+
+static void bench_free(int locked, void *block)
+{
+    if (locked) {
+        kp_free_uncached(block);
+    } else {
+        kp_free(block);
+    }
+}
+
+static void bench_batch(struct bench_worker *w)
+{
+    int num = 0;
+    for (int i = 0; i < MALLOC_BATCH; i++) {
+        void *block = w->locked ? kp_memalign(MALLOC_LOCKED_ALIGN, w->size) : kp_malloc(w->size);
+        if (!block) {
+            w->fails++;
+            continue;
+        }
+        stamp(block, w->size, ((uint64_t)w->id << 32) | (w->ops + i));
+        w->blocks[num++] = block;
+    }
+
+    // pass the last one on, and free what the previous worker passed
+    if (num) {
+        void *prev = xchg_ptr(&handoff[w->id], w->blocks[--num]);
+        if (prev) {
+            if (!stamp_ok(prev, w->size)) w->corrupt++;
+            bench_free(w->locked, prev);
+        }
+    }
+    void *in = xchg_ptr(&handoff[(w->id + MALLOC_WORKERS - 1) % MALLOC_WORKERS], 0);
+    if (in) {
+        if (!stamp_ok(in, w->size)) w->corrupt++;
+        bench_free(w->locked, in);
+    }
+
+    while (num) {
+        void *block = w->blocks[--num];
+        if (!stamp_ok(block, w->size)) w->corrupt++;
+        bench_free(w->locked, block);
+    }
+    w->ops += MALLOC_BATCH;
+}
+
+static int bench_worker_fn(void *data)
+{
+    struct bench_worker *w = (struct bench_worker *)data;
+    while (!bench_stop) {
+        bench_batch(w);
+    }
+    return 0;
+}
+
+// total batch ops of all workers, -1 if not all workers could be started
+static int64_t bench_phase(int locked, size_t size, uint64_t *fails, uint64_t *corrupt)
+{
+    lib_memset(workers, 0, sizeof(workers));
+    lib_memset(handoff, 0, sizeof(handoff));
+    bench_stop = 0;
+
+    int started = 0;
+    for (int i = 0; i < MALLOC_WORKERS; i++) {
+        struct bench_worker *w = &workers[i];
+        w->id = i;
+        w->locked = locked;
+        w->size = size;
+        w->thread = host_thread_start(bench_worker_fn, w);
+        if (!w->thread) break;
+        started++;
+    }
+    if (started == MALLOC_WORKERS) host_msleep(MALLOC_MS);
+    bench_stop = 1;
+    for (int i = 0; i < started; i++) {
+        host_thread_join(workers[i].thread);
+    }
+
+    int64_t ops = 0;
+    for (int i = 0; i < started; i++) {
+        ops += workers[i].ops;
+        *fails += workers[i].fails;
+        *corrupt += workers[i].corrupt;
+        if (handoff[i]) {
+            if (!stamp_ok(handoff[i], size)) (*corrupt)++;
+            bench_free(locked, handoff[i]);
+            handoff[i] = 0;
+        }
+    }
+    return started == MALLOC_WORKERS ? ops : -1;
+}
+
+static int malloc_bench(size_t size)
+{
+    uint64_t fails = 0, corrupt = 0;
+    int64_t mag = bench_phase(0, size, &fails, &corrupt);
+    int64_t locked = mag < 0 ? -1 : bench_phase(1, size, &fails, &corrupt);
+    if (mag < 0 || locked < 0) {
+        printk("malloc %4d: threads failed\n", (int)size);
+        return 1;
+    }
+
+    kp_pool_stat_t stat;
+    kp_pool_stat(0, &stat);
+    uint64_t ratio = locked ? mag * 100 / locked : 0;
+    printk("malloc %4d  magazine: %llu ops/ms, locked: %llu ops/ms, ratio: %llu.%02llu, fails: %llu, corrupt: %llu, "
+           "used: %llu, cached: %llu\n",
+           (int)size, mag / MALLOC_MS, locked / MALLOC_MS, ratio / 100, ratio % 100, fails, corrupt, stat.tlsf.used,
+           stat.cached);
+    return corrupt ? 1 : 0;
+}
+
+int alloc_bench_run()
+{
+    int failures = 0;
+    if (!bench_freq()) {
+        printk("bench: no cntfrq\n");
+        return 1;
+    }
+    for (int i = 0; i < sizeof(slab_sizes) / sizeof(slab_sizes[0]); i++) {
+        failures += slab_bench(slab_sizes[i]);
+    }
+    for (int i = 0; i < sizeof(malloc_sizes) / sizeof(malloc_sizes[0]); i++) {
+        failures += malloc_bench(malloc_sizes[i]);
+    }
+    return failures;
+}
@@ -0,0 +1,42 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2024 bmax121. All Rights Reserved.
+ */
+
+#ifndef _KP_TEST_BENCH_H_
+#define _KP_TEST_BENCH_H_
+
+#include <stdint.h>
+
+// timer reads shared by the benches of test/, and what they take from the shim
+
+static inline uint64_t bench_now()
+{
+    uint64_t val;
+    asm volatile("isb; mrs %0, cntvct_el0" : "=r"(val) : : "memory");
+    return val;
+}
+
+static inline uint64_t bench_freq()
+{
+    uint64_t val;
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(val));
+    return val;
+}
+
+static inline uint64_t bench_ns(uint64_t ticks, uint64_t count)
+{
+    if (!count) return 0;
+    return ticks * 1000000000ull / bench_freq() / count;
+}
+
+// threads of the shim stand in for the kthreads of the benches on a device, they are not bound to cpus
+void *host_thread_start(int (*fn)(void *data), void *data);
+void host_thread_join(void *thread);
+void host_msleep(unsigned int ms);
+
+// all return the number of failures
+int alloc_bench_run();
+int kstorage_bench_run();
+
+#endif
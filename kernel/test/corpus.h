@@ -0,0 +1,41 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2024 bmax121. All Rights Reserved.
+ */
+
+#ifndef _KP_TEST_CORPUS_H_
+#define _KP_TEST_CORPUS_H_
+
+#include <stdint.h>
+
+typedef uint64_t (*corpus_fn_t)(uint64_t a, uint64_t b);
+
+uint64_t corpus_pac(uint64_t a, uint64_t b);
+uint64_t corpus_bti(uint64_t a, uint64_t b);
+uint64_t corpus_adrp(uint64_t a, uint64_t b);
+uint64_t corpus_adr(uint64_t a, uint64_t b);
+uint64_t corpus_ldr_lit(uint64_t a, uint64_t b);
+uint64_t corpus_prfm(uint64_t a, uint64_t b);
+uint64_t corpus_cbz(uint64_t a, uint64_t b);
+uint64_t corpus_cbz_in(uint64_t a, uint64_t b);
+uint64_t corpus_tbz(uint64_t a, uint64_t b);
+uint64_t corpus_bcond(uint64_t a, uint64_t b);
+uint64_t corpus_b(uint64_t a, uint64_t b);
+uint64_t corpus_bl(uint64_t a, uint64_t b);
+uint64_t corpus_scs(uint64_t a, uint64_t b);
+uint64_t corpus_lit_in_tramp(uint64_t a, uint64_t b);
+
+uint64_t corpus_scs_call(corpus_fn_t fn, uint64_t a, uint64_t b);
+
+uint64_t corpus_bench_direct(uint64_t a, uint64_t b);
+uint64_t corpus_bench_one(uint64_t a, uint64_t b);
+uint64_t corpus_bench_full(uint64_t a, uint64_t b);
+uint64_t corpus_bench_ret(uint64_t a, uint64_t b);
+uint64_t corpus_bench_replace(uint64_t a, uint64_t b);
+uint64_t corpus_bench_fp(uint64_t a, uint64_t b);
+
+// both return the number of failures
+int hook_test_run();
+int hook_bench_run();
+
+#endif
@@ -0,0 +1,107 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2024 bmax121. All Rights Reserved.
+ */
+
+#include <hook.h>
+#include <log.h>
+#include "corpus.h"
+#include "bench.h"
+
+/*
+ * Per-call cost of each transit kind, with empty callbacks, against a direct call of the same function.
+ * Under qemu the numbers only compare the kinds with each other, run it on a device for absolute ones.
+ */
+
+#define BENCH_ITERS 1000000
+
+static void bench_before(hook_fargs2_t *fargs, void *udata)
+{
+}
+
+static void bench_after(hook_fargs2_t *fargs, void *udata)
+{
+}
+
+static void bench_before2(hook_fargs2_t *fargs, void *udata)
+{
+}
+
+static void bench_ret(uint64_t ret, uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3, void *udata)
+{
+}
+
+static corpus_fn_t replace_backup = 0;
+
+static uint64_t bench_replace(uint64_t a, uint64_t b)
+{
+    return replace_backup(a, b);
+}
+
+static corpus_fn_t bench_fp = corpus_bench_fp;
+
+// ticks for BENCH_ITERS calls, called through a volatile pointer so the loop is not folded
+static uint64_t bench_loop(corpus_fn_t fn)
+{
+    corpus_fn_t volatile call = fn;
+    uint64_t acc = 0;
+    uint64_t t0 = bench_now();
+    for (uint64_t i = 0; i < BENCH_ITERS; i++) {
+        acc = call(i, acc);
+    }
+    uint64_t t1 = bench_now();
+    asm volatile("" : : "r"(acc));
+    return t1 - t0;
+}
+
+// in hundredths of a nanosecond
+static uint64_t bench_cns(uint64_t ticks, uint64_t freq)
+{
+    return ticks * 1000000000ull / freq * 100 / BENCH_ITERS;
+}
+
+static void bench_report(const char *name, uint64_t ticks, uint64_t base, uint64_t freq)
+{
+    uint64_t cns = bench_cns(ticks, freq);
+    uint64_t over = ticks > base ? bench_cns(ticks - base, freq) : 0;
+    printk("%-8s %6llu.%02llu ns/call, +%llu.%02llu ns\n", name, cns / 100, cns % 100, over / 100, over % 100);
+}
+
+int hook_bench_run()
+{
+    int failures = 0;
+    uint64_t freq = bench_freq();
+    if (!freq) {
+        printk("bench: no cntfrq\n");
+        return 1;
+    }
+
+    if (hook_wrap2(corpus_bench_one, bench_before, bench_after, 0)) failures++;
+    if (hook_wrap2(corpus_bench_full, bench_before, bench_after, 0)) failures++;
+    if (hook_wrap2(corpus_bench_full, bench_before2, 0, 0)) failures++;
+    if (hook_wrap_ret(corpus_bench_ret, 2, bench_ret, 0)) failures++;
+    if (hook(corpus_bench_replace, bench_replace, (void **)&replace_backup)) failures++;
+    if (fp_hook_wrap2((uintptr_t)&bench_fp, bench_before, bench_after, 0)) failures++;
+    if (failures) {
+        printk("bench: %d hooks failed\n", failures);
+        return failures;
+    }
+
+    // warm up, then the direct call is the base of every kind
+    bench_loop(corpus_bench_direct);
+    uint64_t base = bench_loop(corpus_bench_direct);
+    bench_report("direct", base, base, freq);
+    bench_report("one", bench_loop(corpus_bench_one), base, freq);
+    bench_report("full", bench_loop(corpus_bench_full), base, freq);
+    bench_report("ret", bench_loop(corpus_bench_ret), base, freq);
+    bench_report("replace", bench_loop(corpus_bench_replace), base, freq);
+    bench_report("fp", bench_loop(bench_fp), base, freq);
+
+    hook_unwrap(corpus_bench_one, bench_before, bench_after);
+    hook_unwrap(corpus_bench_full, bench_before, bench_after);
+    hook_unwrap(corpus_bench_full, bench_before2, 0);
+    hook_unwrap_ret(corpus_bench_ret, bench_ret);
+    unhook(corpus_bench_replace);
+    fp_hook_unwrap((uintptr_t)&bench_fp, bench_before, bench_after);
+    return hook_drain() ? 1 : 0;
+}
@@ -0,0 +1,358 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2024 bmax121. All Rights Reserved.
+ */
+
+#include <hook.h>
+#include <log.h>
+#include <baselib.h>
+#include "corpus.h"
+
+/*
+ * Each prologue of the corpus is called unhooked, then through every transit kind and a replace hook,
+ * then unhooked again, and must return the same for every input and leave its text as it was.
+ */
+
+struct corpus_case
+{
+    const char *name;
+    corpus_fn_t fn;
+    int scs;
+};
+
+static const struct corpus_case cases[] = {
+    { "pac", corpus_pac, 0 },     { "bti", corpus_bti, 0 },       { "adrp", corpus_adrp, 0 },
+    { "adr", corpus_adr, 0 },     { "ldr_lit", corpus_ldr_lit, 0 }, { "prfm", corpus_prfm, 0 },
+    { "cbz", corpus_cbz, 0 },     { "cbz_in", corpus_cbz_in, 0 }, { "tbz", corpus_tbz, 0 },
+    { "bcond", corpus_bcond, 0 }, { "b", corpus_b, 0 },           { "bl", corpus_bl, 0 },
+    { "scs", corpus_scs, 1 },
+};
+
+#define CASES_NUM (sizeof(cases) / sizeof(cases[0]))
+
+static const uint64_t inputs[][2] = {
+    { 0, 0 }, { 1, 2 }, { 7, 1 }, { 8, 3 }, { 42, 0 }, { 3, 9 }, { 0x123456789, 5 }, { ~0ull, 1 },
+};
+
+#define INPUTS_NUM (sizeof(inputs) / sizeof(inputs[0]))
+
+#define TEXT_WORDS 8
+
+static int failures = 0;
+
+#define check(cond, fmt, ...)                                                            \
+    do {                                                                                 \
+        if (!(cond)) {                                                                   \
+            failures++;                                                                  \
+            printk("FAIL %s:%d: " fmt "\n", __func__, __LINE__, ##__VA_ARGS__);          \
+        }                                                                                \
+    } while (0)
+
+struct counter
+{
+    int befores;
+    int afters;
+    int rets;
+    uint64_t last_ret;
+};
+
+static uint64_t corpus_call(const struct corpus_case *c, uint64_t a, uint64_t b)
+{
+    if (c->scs) return corpus_scs_call(c->fn, a, b);
+    return c->fn(a, b);
+}
+
+static void count_before(hook_fargs2_t *fargs, void *udata)
+{
+    ((struct counter *)udata)->befores++;
+}
+
+static void count_after(hook_fargs2_t *fargs, void *udata)
+{
+    struct counter *cnt = (struct counter *)udata;
+    cnt->afters++;
+    cnt->last_ret = fargs->ret;
+}
+
+static void count_before2(hook_fargs2_t *fargs, void *udata)
+{
+    ((struct counter *)udata)->befores++;
+}
+
+static void count_ret(uint64_t ret, uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3, void *udata)
+{
+    struct counter *cnt = (struct counter *)udata;
+    cnt->rets++;
+    cnt->last_ret = ret;
+}
+
+static corpus_fn_t replace_backup = 0;
+static int replace_calls = 0;
+
+static uint64_t replace_fn(uint64_t a, uint64_t b)
+{
+    replace_calls++;
+    return replace_backup(a, b);
+}
+
+static void check_same(const struct corpus_case *c, const uint64_t *expected, const char *how)
+{
+    for (int i = 0; i < INPUTS_NUM; i++) {
+        uint64_t got = corpus_call(c, inputs[i][0], inputs[i][1]);
+        check(got == expected[i], "%s %s: input %d, got %llx, expected %llx", c->name, how, i, got, expected[i]);
+    }
+}
+
+static void test_case(const struct corpus_case *c)
+{
+    uint64_t expected[INPUTS_NUM];
+    uint32_t text[TEXT_WORDS];
+    for (int i = 0; i < TEXT_WORDS; i++) {
+        text[i] = ((uint32_t *)c->fn)[i];
+    }
+    for (int i = 0; i < INPUTS_NUM; i++) {
+        expected[i] = corpus_call(c, inputs[i][0], inputs[i][1]);
+    }
+
+    // a single pair goes through _transit_one
+    struct counter one = { 0 };
+    hook_err_t err = hook_wrap2(c->fn, count_before, count_after, &one);
+    check(!err, "%s wrap: %d", c->name, err);
+    check_same(c, expected, "one");
+    check(one.befores == INPUTS_NUM && one.afters == INPUTS_NUM, "%s one: %d, %d", c->name, one.befores,
+          one.afters);
+    check(one.last_ret == expected[INPUTS_NUM - 1], "%s one ret: %llx", c->name, one.last_ret);
+
+    // a second one switches to the full transit
+    struct counter full = { 0 };
+    err = hook_wrap2(c->fn, count_before2, 0, &full);
+    check(!err, "%s wrap second: %d", c->name, err);
+    check_same(c, expected, "full");
+    check(full.befores == INPUTS_NUM, "%s full: %d", c->name, full.befores);
+
+    // return callbacks joining the full transit
+    struct counter rets = { 0 };
+    err = hook_wrap_ret(c->fn, 2, count_ret, &rets);
+    check(!err, "%s wrap ret: %d", c->name, err);
+    check_same(c, expected, "full ret");
+    check(rets.rets == INPUTS_NUM, "%s full ret: %d", c->name, rets.rets);
+
+    hook_unwrap(c->fn, count_before, count_after);
+    hook_unwrap(c->fn, count_before2, 0);
+
+    // return callbacks only go through _transit_ret
+    rets.rets = 0;
+    check_same(c, expected, "ret");
+    check(rets.rets == INPUTS_NUM, "%s ret: %d", c->name, rets.rets);
+    check(rets.last_ret == expected[INPUTS_NUM - 1], "%s ret value: %llx", c->name, rets.last_ret);
+    err = hook_unwrap_ret(c->fn, count_ret);
+    check(!err, "%s unwrap ret: %d", c->name, err);
+    check_same(c, expected, "unwrapped");
+
+    replace_calls = 0;
+    err = hook(c->fn, replace_fn, (void **)&replace_backup);
+    check(!err, "%s hook: %d", c->name, err);
+    check_same(c, expected, "replace");
+    check(replace_calls == INPUTS_NUM, "%s replace: %d", c->name, replace_calls);
+    unhook(c->fn);
+
+    check(!hook_drain(), "%s drain", c->name);
+    check_same(c, expected, "unhooked");
+    for (int i = 0; i < TEXT_WORDS; i++) {
+        check(((uint32_t *)c->fn)[i] == text[i], "%s text %d: %x, expected %x", c->name, i, ((uint32_t *)c->fn)[i],
+              text[i]);
+    }
+}
+
+static void test_lit_in_tramp()
+{
+    uint32_t text[TEXT_WORDS];
+    for (int i = 0; i < TEXT_WORDS; i++) {
+        text[i] = ((uint32_t *)corpus_lit_in_tramp)[i];
+    }
+    struct counter cnt = { 0 };
+    hook_err_t err = hook_wrap2(corpus_lit_in_tramp, count_before, count_after, &cnt);
+    check(err == -HOOK_BAD_RELO, "wrap: %d", err);
+    for (int i = 0; i < TEXT_WORDS; i++) {
+        check(((uint32_t *)corpus_lit_in_tramp)[i] == text[i], "text %d changed", i);
+    }
+}
+
+static void skip_before(hook_fargs2_t *fargs, void *udata)
+{
+    fargs->skip_origin = HOOK_SKIP_ORIGIN;
+    fargs->ret = 1234;
+}
+
+static void test_skip_origin()
+{
+    struct counter cnt = { 0 };
+    hook_err_t err = hook_wrap2(corpus_bti, skip_before, 0, 0);
+    if (!err) err = hook_wrap2(corpus_bti, count_before, count_after, &cnt);
+    check(!err, "wrap: %d", err);
+    check(corpus_bti(1, 2) == 1234, "origin called");
+    check(cnt.afters == 1 && cnt.last_ret == 1234, "afters: %d, %llx", cnt.afters, cnt.last_ret);
+    hook_unwrap(corpus_bti, skip_before, 0);
+    hook_unwrap(corpus_bti, count_before, count_after);
+}
+
+// more callbacks than fit inline, ordered by priority, equal priorities in insertion order
+#define ORDER_NUM 6
+
+static int order_log[ORDER_NUM * 2];
+static int order_log_num = 0;
+
+#define ORDER_CB(n)                                                      \
+    static void order_before_##n(hook_fargs2_t *fargs, void *udata)      \
+    {                                                                    \
+        if (order_log_num < ORDER_NUM * 2) order_log[order_log_num++] = n; \
+    }                                                                    \
+    static void order_after_##n(hook_fargs2_t *fargs, void *udata)       \
+    {                                                                    \
+        if (order_log_num < ORDER_NUM * 2) order_log[order_log_num++] = n; \
+    }
+
+ORDER_CB(0)
+ORDER_CB(1)
+ORDER_CB(2)
+ORDER_CB(3)
+ORDER_CB(4)
+ORDER_CB(5)
+
+static void test_priority()
+{
+    void *befores[ORDER_NUM] = { order_before_0, order_before_1, order_before_2,
+                                 order_before_3, order_before_4, order_before_5 };
+    void *afters[ORDER_NUM] = { order_after_0, order_after_1, order_after_2,
+                                order_after_3, order_after_4, order_after_5 };
+    const int32_t priorities[ORDER_NUM] = { 0, 5, -3, 5, 10, 1 };
+    const int expected[ORDER_NUM] = { 4, 1, 3, 5, 0, 2 };
+
+    for (int i = 0; i < ORDER_NUM; i++) {
+        hook_err_t err = hook_wrap_priority(corpus_adrp, 2, befores[i], afters[i], 0, priorities[i]);
+        check(!err, "wrap %d: %d", i, err);
+    }
+    uint64_t ret = corpus_adrp(1, 2);
+    check(ret == 0x1122334455667788 + 3, "ret: %llx", ret);
+    check(order_log_num == ORDER_NUM * 2, "calls: %d", order_log_num);
+    for (int i = 0; i < ORDER_NUM; i++) {
+        check(order_log[i] == expected[i], "before %d: %d, expected %d", i, order_log[i], expected[i]);
+        check(order_log[ORDER_NUM + i] == expected[ORDER_NUM - 1 - i], "after %d: %d, expected %d", i,
+              order_log[ORDER_NUM + i], expected[ORDER_NUM - 1 - i]);
+    }
+    for (int i = 0; i < ORDER_NUM; i++) {
+        hook_unwrap(corpus_adrp, befores[i], afters[i]);
+    }
+}
+
+static corpus_fn_t fp_single = corpus_bti;
+static corpus_fn_t fp_table[3] = { corpus_bti, corpus_adrp, corpus_bl };
+
+static void test_fp()
+{
+    struct counter cnt = { 0 };
+    uint64_t expected = corpus_bti(3, 4);
+    hook_err_t err = fp_hook_wrap2((uintptr_t)&fp_single, count_before, count_after, &cnt);
+    check(!err, "wrap: %d", err);
+    check(fp_single != corpus_bti, "pointer not replaced");
+    check(fp_single(3, 4) == expected, "ret");
+    check(cnt.befores == 1 && cnt.afters == 1, "calls: %d, %d", cnt.befores, cnt.afters);
+    fp_hook_unwrap((uintptr_t)&fp_single, count_before, count_after);
+    check(fp_single == corpus_bti, "pointer not restored");
+
+    const uint32_t indexes[] = { 0, 2 };
+    hook_err_t results[2];
+    cnt.befores = 0;
+    int32_t wrapped =
+        fp_hook_table((void **)fp_table, indexes, 2, 2, count_before, count_after, &cnt, results);
+    check(wrapped == 2 && !results[0] && !results[1], "table: %d, %d, %d", wrapped, results[0], results[1]);
+    check(fp_table[1] == corpus_adrp, "unlisted index replaced");
+    check(fp_table[0](5, 6) == corpus_bti(5, 6) && fp_table[2](5, 6) == corpus_bl(5, 6), "table ret");
+    check(cnt.befores == 2, "table calls: %d", cnt.befores);
+    fp_unhook_table((void **)fp_table, indexes, 2, count_before, count_after);
+    check(fp_table[0] == corpus_bti && fp_table[2] == corpus_bl, "table not restored");
+}
+
+static void test_branch()
+{
+    uint32_t buf[4];
+    int32_t n = branch_relative(buf, 0x10000, 0x20000);
+    check(n == 2 && buf[0] == (0x14000000 | (0x10000 >> 2)) && buf[1] == ARM64_NOP, "near: %d, %x", n, buf[0]);
+    n = branch_relative(buf, 0x20000, 0x10000);
+    check(n == 2 && buf[0] == (0x14000000 | ((-0x10000 >> 2) & 0x3ffffff)), "back: %d, %x", n, buf[0]);
+    n = branch_relative(buf, 0x10000, 0x10000 + (1ull << 30));
+    check(n == 0, "far: %d", n);
+    n = branch_absolute(buf, 0x123456789abcdef0);
+    check(n == 4 && buf[2] == 0x9abcdef0 && buf[3] == 0x12345678, "absolute: %d", n);
+}
+
+static uint64_t stats_calls = 0;
+
+static int stats_cb(enum hook_type type, uint64_t addr, int32_t callbacks, const hook_stats_cpu_t *sum, void *udata)
+{
+    if (addr == (uint64_t)corpus_tbz) stats_calls = sum->calls;
+    return 0;
+}
+
+static void test_stats()
+{
+    struct counter cnt = { 0 };
+    hook_stats_enable(1);
+    hook_err_t err = hook_wrap2(corpus_tbz, count_before, count_after, &cnt);
+    check(!err, "wrap: %d", err);
+    for (int i = 0; i < 10; i++) {
+        corpus_tbz(i, i);
+    }
+    hook_stats_for_each(stats_cb, 0);
+    check(stats_calls == 10, "calls: %llu", stats_calls);
+    hook_stats_reset();
+    corpus_tbz(1, 1);
+    hook_stats_for_each(stats_cb, 0);
+    check(stats_calls == 1, "calls after reset: %llu", stats_calls);
+    hook_unwrap(corpus_tbz, count_before, count_after);
+    hook_stats_enable(0);
+}
+
+// unloading a module that hooked the supercall drains from the supercall hook, as this callback does
+static hook_err_t drain_from_err = -HOOK_BUSY;
+
+static void drain_from_before(hook_fargs2_t *fargs, void *udata)
+{
+    hook_unwrap(corpus_bl, count_before, 0);
+    drain_from_err = hook_drain_from(fargs);
+}
+
+static void test_drain_from()
+{
+    struct counter cnt = { 0 };
+    uint64_t expected = corpus_bl(1, 2);
+    hook_err_t err = hook_wrap2(corpus_bl, drain_from_before, 0, 0);
+    if (!err) err = hook_wrap2(corpus_bl, count_before, 0, &cnt);
+    check(!err, "wrap: %d", err);
+    check(corpus_bl(1, 2) == expected, "ret");
+    // the call itself is still counted in the chain it drains, it must not wait for itself
+    check(drain_from_err == HOOK_NO_ERR, "drain from callback: %d", drain_from_err);
+    int befores = cnt.befores;
+    check(corpus_bl(1, 2) == expected, "ret after drain");
+    check(cnt.befores == befores, "removed callback called: %d", cnt.befores);
+    hook_unwrap(corpus_bl, drain_from_before, 0);
+}
+
+int hook_test_run()
+{
+    test_branch();
+    for (int i = 0; i < CASES_NUM; i++) {
+        int before = failures;
+        test_case(&cases[i]);
+        printk("corpus %s: %s\n", cases[i].name, failures == before ? "ok" : "failed");
+    }
+    test_lit_in_tramp();
+    test_skip_origin();
+    test_priority();
+    test_fp();
+    test_stats();
+    test_drain_from();
+    check(!hook_drain(), "final drain");
+    printk("hook test: %d failures\n", failures);
+    return failures;
+}
@@ -0,0 +1,90 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2024 bmax121. All Rights Reserved.
+ */
+
+#include <kstorage.h>
+#include <log.h>
+#include "bench.h"
+
+/*
+ * Fills a group with count entries keyed like uids, then times read_kstorage of present and absent ids,
+ * and, as the baseline of a list walk, finding one id with on_each_kstorage_elem.
+ * Nothing reads concurrently, the shim runs rcu callbacks right away.
+ */
+
+#define BENCH_DID_BASE 10000
+#define BENCH_LOOKUPS 100000
+#define BENCH_WALKS 100
+
+static const long bench_counts[] = { 1000, 10000 };
+
+static int walk_find_cb(struct kstorage *kstorage, void *udata)
+{
+    return kstorage->did == *(long *)udata;
+}
+
+static int kstorage_bench(long count)
+{
+    struct kstorage_group_conf conf = { 10000, KSTORAGE_LOOKUP_HASH, sizeof(long) };
+    int gid = alloc_kstorage_group("kstorage-bench", &conf);
+    if (gid < 0) {
+        printk("kstorage %ld: group failed: %d\n", count, gid);
+        return 1;
+    }
+
+    int failed = 0;
+    uint64_t t0 = bench_now();
+    for (long i = 0; i < count; i++) {
+        long val = i;
+        if (write_kstorage(gid, BENCH_DID_BASE + i, &val, 0, sizeof(val), false)) failed++;
+    }
+    uint64_t write_ticks = bench_now() - t0;
+
+    // a cheap lcg spreads the ids, so every bucket and list position is hit
+    uint64_t seed = 1;
+    t0 = bench_now();
+    for (long i = 0; i < BENCH_LOOKUPS; i++) {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        long val;
+        if (read_kstorage(gid, BENCH_DID_BASE + (seed >> 33) % count, &val, 0, sizeof(val), false)) failed++;
+    }
+    uint64_t hit_ticks = bench_now() - t0;
+
+    t0 = bench_now();
+    for (long i = 0; i < BENCH_LOOKUPS; i++) {
+        long val;
+        read_kstorage(gid, -1 - i, &val, 0, sizeof(val), false);
+    }
+    uint64_t miss_ticks = bench_now() - t0;
+
+    t0 = bench_now();
+    for (long i = 0; i < BENCH_WALKS; i++) {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        long did = BENCH_DID_BASE + (seed >> 33) % count;
+        on_each_kstorage_elem(gid, walk_find_cb, &did);
+    }
+    uint64_t walk_ticks = bench_now() - t0;
+
+    int size = kstorage_group_size(gid);
+    if (size != count) failed++;
+    remove_kstorage_group(gid);
+
+    printk("kstorage %5ld  write: %lluns, lookup hit: %lluns, miss: %lluns, list walk: %lluns, size: %d, failed: %d\n",
+           count, bench_ns(write_ticks, count), bench_ns(hit_ticks, BENCH_LOOKUPS), bench_ns(miss_ticks, BENCH_LOOKUPS),
+           bench_ns(walk_ticks, BENCH_WALKS), size, failed);
+    return failed;
+}
+
+int kstorage_bench_run()
+{
+    int failures = 0;
+    if (!bench_freq()) {
+        printk("bench: no cntfrq\n");
+        return 1;
+    }
+    for (int i = 0; i < sizeof(bench_counts) / sizeof(bench_counts[0]); i++) {
+        failures += kstorage_bench(bench_counts[i]);
+    }
+    return failures;
+}
@@ -0,0 +1,283 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2024 bmax121. All Rights Reserved.
+ */
+
+/*
+ * User space stand-ins for what the hook engine, the allocators and kstorage take from the kernel and from kpimg.
+ * Built against the C library, unlike the rest of test/, which is built like kpimg.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "corpus.h"
+#include "bench.h"
+
+// far from the text, so trampolines take their absolute form as they do in the kernel
+#define HOST_HOOK_MEM_HINT 0x1000000000ull
+#define HOST_HOOK_MEM_SIZE (1 << 20)
+
+// hook_lock tells tasks apart by their stack base, like kernel stacks the runner stack is aligned to its size
+#define HOST_STACK_SIZE (1 << 20)
+
+// what kpimg and the kernel give kp_rw_mem and kp_rox_mem at boot
+#define HOST_RW_POOL_SIZE (32 << 20)
+#define HOST_ROX_POOL_SIZE (4 << 20)
+
+int hook_mem_add(uint64_t start, int32_t size);
+void hook_chain_init();
+void kp_malloc_init(void *rw, size_t rw_size, void *rox, size_t rox_size);
+int kstorage_init();
+
+void *kp_rw_mem = 0;
+void *kp_rox_mem = 0;
+
+int64_t page_size = 4096;
+int64_t page_shift = 12;
+uint64_t pgd_va = 0;
+int thread_size = HOST_STACK_SIZE;
+unsigned long (*kallsyms_lookup_name)(const char *name) = 0;
+
+static void host_printk(const char *fmt, ...)
+{
+    va_list va;
+    va_start(va, fmt);
+    vprintf(fmt, va);
+    va_end(va);
+    fflush(stdout);
+}
+
+void (*printk)(const char *fmt, ...) = host_printk;
+
+void log_boot(const char *fmt, ...)
+{
+    va_list va;
+    va_start(va, fmt);
+    vprintf(fmt, va);
+    va_end(va);
+}
+
+void *lib_memset(void *dst, int c, size_t n)
+{
+    return memset(dst, c, n);
+}
+
+// one fake entry per page, enough for the function pointer hooks to save and restore a prot
+#define HOST_PTE_NUM 64
+#define HOST_PTE_VALID ((3ull << 0) | (1ull << 10) | (1ull << 7))
+
+static uint64_t host_ptes[HOST_PTE_NUM];
+
+uint64_t *pgtable_entry(uint64_t pgd, uint64_t va)
+{
+    uint64_t *entry = &host_ptes[(va / page_size) % HOST_PTE_NUM];
+    if (!*entry) *entry = HOST_PTE_VALID;
+    return entry;
+}
+
+void modify_entry_kernel(uint64_t va, uint64_t *entry, uint64_t value)
+{
+    *entry = value;
+}
+
+void modify_entry_kernel_nosync(uint64_t va, uint64_t *entry, uint64_t value)
+{
+    *entry = value;
+}
+
+int kp_insn_patch_text(void *addrs[], uint32_t insns[], int cnt)
+{
+    for (int i = 0; i < cnt; i++) {
+        uint64_t page = (uint64_t)addrs[i] & ~(page_size - 1);
+        if (mprotect((void *)page, page_size, PROT_READ | PROT_WRITE | PROT_EXEC)) return -1;
+        *(volatile uint32_t *)addrs[i] = insns[i];
+        __builtin___clear_cache((char *)addrs[i], (char *)addrs[i] + 4);
+    }
+    return 0;
+}
+
+// vmalloc memory is executable here, so the exec regions taken from it work without the kernel's page tables
+static void *host_vmalloc(unsigned long size)
+{
+    size_t total = page_size + ((size + page_size - 1) & ~(page_size - 1));
+    void *mem = mmap(0, total, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return 0;
+    *(size_t *)mem = total;
+    return (char *)mem + page_size;
+}
+
+static void host_vfree(const void *addr)
+{
+    void *mem = (char *)addr - page_size;
+    munmap(mem, *(size_t *)mem);
+}
+
+static void host_spin_lock(int *lock)
+{
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+    }
+}
+
+static void host_spin_unlock(int *lock)
+{
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+struct host_rcu_head
+{
+    struct host_rcu_head *next;
+    void (*func)(struct host_rcu_head *head);
+};
+
+// nothing reads concurrently with a writer in test/, so a grace period has always passed
+static void host_call_rcu(struct host_rcu_head *head, void (*func)(struct host_rcu_head *head))
+{
+    func(head);
+}
+
+void *(*kf_vmalloc)(unsigned long size) = host_vmalloc;
+void *(*kf_vmalloc_noprof)(unsigned long size) = 0;
+void (*kf_vfree)(const void *addr) = host_vfree;
+void (*kf_kvfree)(const void *addr) = host_vfree;
+void (*kf__raw_spin_lock)(int *lock) = host_spin_lock;
+void (*kf__raw_spin_unlock)(int *lock) = host_spin_unlock;
+void (*kf___rcu_read_lock)(void) = 0;
+void (*kf___rcu_read_unlock)(void) = 0;
+// hook_drain only waits for a grace period once booted
+void (*kf_synchronize_rcu)(void) = 0;
+void (*kf_call_rcu)(struct host_rcu_head *head, void (*func)(struct host_rcu_head *head)) = host_call_rcu;
+void *(*kf_memcpy)(void *dst, const void *src, size_t n) = memcpy;
+void *(*kf_memset)(void *dst, int c, size_t n) = memset;
+int (*kf_strcmp)(const char *a, const char *b) = strcmp;
+char *(*kf_strcpy)(char *dst, const char *src) = strcpy;
+size_t (*kf_strlen)(const char *s) = strlen;
+// there is no user space of user space, the benches never pass user buffers
+void *(*kf_memdup_user)(const void *src, size_t len) = 0;
+
+int compat_copy_to_user(void *to, const void *from, int n)
+{
+    memcpy(to, from, n);
+    return n;
+}
+
+struct host_thread
+{
+    pthread_t thread;
+    int (*fn)(void *data);
+    void *data;
+};
+
+static void *host_thread_fn(void *arg)
+{
+    struct host_thread *t = (struct host_thread *)arg;
+    return (void *)(intptr_t)t->fn(t->data);
+}
+
+void *host_thread_start(int (*fn)(void *data), void *data)
+{
+    struct host_thread *t = malloc(sizeof(*t));
+    if (!t) return 0;
+    t->fn = fn;
+    t->data = data;
+    if (pthread_create(&t->thread, 0, host_thread_fn, t)) {
+        free(t);
+        return 0;
+    }
+    return t;
+}
+
+void host_thread_join(void *thread)
+{
+    struct host_thread *t = (struct host_thread *)thread;
+    pthread_join(t->thread, 0);
+    free(t);
+}
+
+void host_msleep(unsigned int ms)
+{
+    usleep(ms * 1000);
+}
+
+/*
+ * tlbi, ic ialluis and the daif and el1 register accesses the engine uses are not allowed at el0.
+ * There is nothing to maintain in user space, so they are skipped and system register reads return 0.
+ */
+static void host_sigill(int sig, siginfo_t *info, void *ctx)
+{
+    ucontext_t *uc = (ucontext_t *)ctx;
+    uint32_t inst = *(uint32_t *)uc->uc_mcontext.pc;
+    if ((inst & 0xffc00000) != 0xd5000000) {
+        fprintf(stderr, "illegal instruction %08x at %llx\n", inst, (unsigned long long)uc->uc_mcontext.pc);
+        abort();
+    }
+    // mrs
+    if ((inst & 0xfff00000) == 0xd5300000 && (inst & 0x1f) != 31) uc->uc_mcontext.regs[inst & 0x1f] = 0;
+    uc->uc_mcontext.pc += 4;
+}
+
+static void *host_run(void *arg)
+{
+    const char *what = (const char *)arg;
+    intptr_t rc;
+    if (!strcmp(what, "bench")) {
+        rc = hook_bench_run();
+    } else if (!strcmp(what, "alloc-bench")) {
+        rc = alloc_bench_run();
+    } else if (!strcmp(what, "kstorage-bench")) {
+        rc = kstorage_bench_run();
+    } else {
+        rc = hook_test_run();
+    }
+    return (void *)rc;
+}
+
+int main(int argc, char **argv)
+{
+    const char *what = argc > 1 ? argv[1] : "test";
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = host_sigill;
+    sa.sa_flags = SA_SIGINFO;
+    sigaction(SIGILL, &sa, 0);
+
+    void *rw = mmap(0, HOST_RW_POOL_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    void *rox = mmap(0, HOST_ROX_POOL_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (rw == MAP_FAILED || rox == MAP_FAILED) {
+        fprintf(stderr, "no pool memory\n");
+        return 1;
+    }
+    kp_malloc_init(rw, HOST_RW_POOL_SIZE, rox, HOST_ROX_POOL_SIZE);
+    kstorage_init();
+
+    void *mem = mmap((void *)HOST_HOOK_MEM_HINT, HOST_HOOK_MEM_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED || hook_mem_add((uint64_t)mem, HOST_HOOK_MEM_SIZE)) {
+        fprintf(stderr, "no hook memory\n");
+        return 1;
+    }
+    hook_chain_init();
+
+    void *stack = mmap(0, HOST_STACK_SIZE * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (stack == MAP_FAILED) return 1;
+    stack = (void *)(((uint64_t)stack + HOST_STACK_SIZE - 1) & ~(uint64_t)(HOST_STACK_SIZE - 1));
+
+    pthread_attr_t attr;
+    pthread_t thread;
+    void *rc = 0;
+    pthread_attr_init(&attr);
+    pthread_attr_setstack(&attr, stack, HOST_STACK_SIZE);
+    if (pthread_create(&thread, &attr, host_run, (void *)what)) return 1;
+    pthread_join(thread, &rc);
+    return rc ? 1 : 0;
+}
@@ -0,0 +1,227 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2024 bmax121. All Rights Reserved.
+ */
+
+#include <compiler.h>
+#include <kpmodule.h>
+#include <hook.h>
+
+#define KPBENCH_NAME "hook-stress"
+#include <kpbench.h>
+
+KPM_NAME("kpm-hook-stress");
+KPM_VERSION("1.0.0");
+KPM_LICENSE("GPL v2");
+KPM_AUTHOR("bmax121");
+KPM_DESCRIPTION("KernelPatch Module concurrent hook add/remove stress");
+
+/*
+ * control0 args: "[duration_ms] [workers]", default "500 4".
+ * Workers are bound to distinct cpus. Even ones keep adding and removing their own before, after and return
+ * callbacks on stress_target, each with its own priority so the chain is built, spilled into ext blocks and
+ * torn down again all the time. Odd ones keep calling stress_target and check every result, the callbacks
+ * check the arguments and the return value they see. Reports add/remove cycles, calls and failures.
+ */
+
+#define STRESS_WORKERS_MAX 16
+#define STRESS_CHURNERS_MAX (STRESS_WORKERS_MAX / 2)
+
+// set in every argument a caller passes, a callback seeing it clear got another call's or a stale frame
+#define STRESS_MARK 0x100000ull
+
+struct stress_worker
+{
+    struct task_struct *task;
+    int id;
+    uint64_t ops;
+    uint64_t errors;
+    int last_err;
+};
+
+static struct stress_worker workers[STRESS_WORKERS_MAX];
+static int stress_running = 0;
+
+// callbacks run on the callers' cpus, only the first bad value is kept, counts are not exact
+static volatile uint64_t cb_hits = 0;
+static volatile uint64_t cb_errors = 0;
+static volatile uint64_t cb_bad = 0;
+
+int __noinline stress_target(int a)
+{
+    return a * 2 + 1;
+}
+
+static void stress_check_before(hook_fargs1_t *args)
+{
+    cb_hits++;
+    if (!(args->arg0 & STRESS_MARK)) {
+        cb_bad = args->arg0;
+        cb_errors++;
+    }
+}
+
+static void stress_check_after(hook_fargs1_t *args)
+{
+    if ((int)args->ret != (int)args->arg0 * 2 + 1) {
+        cb_bad = args->ret;
+        cb_errors++;
+    }
+}
+
+static void stress_check_ret(uint64_t ret, uint64_t arg0)
+{
+    if ((int)ret != (int)arg0 * 2 + 1) {
+        cb_bad = ret;
+        cb_errors++;
+    }
+}
+
+// every churner owns a distinct set, the chain tells callbacks apart by address
+#define STRESS_CB(n)                                                                                             \
+    static void stress_before_##n(hook_fargs1_t *args, void *udata)                                              \
+    {                                                                                                            \
+        stress_check_before(args);                                                                               \
+    }                                                                                                            \
+    static void stress_after_##n(hook_fargs1_t *args, void *udata)                                               \
+    {                                                                                                            \
+        stress_check_after(args);                                                                                \
+    }                                                                                                            \
+    static void stress_ret_##n(uint64_t ret, uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3,          \
+                               void *udata)                                                                      \
+    {                                                                                                            \
+        stress_check_ret(ret, arg0);                                                                             \
+    }
+
+STRESS_CB(0)
+STRESS_CB(1)
+STRESS_CB(2)
+STRESS_CB(3)
+STRESS_CB(4)
+STRESS_CB(5)
+STRESS_CB(6)
+STRESS_CB(7)
+
+static void *const stress_befores[STRESS_CHURNERS_MAX] = {
+    stress_before_0, stress_before_1, stress_before_2, stress_before_3,
+    stress_before_4, stress_before_5, stress_before_6, stress_before_7,
+};
+
+static void *const stress_afters[STRESS_CHURNERS_MAX] = {
+    stress_after_0, stress_after_1, stress_after_2, stress_after_3,
+    stress_after_4, stress_after_5, stress_after_6, stress_after_7,
+};
+
+static const hook_ret_callback stress_rets[STRESS_CHURNERS_MAX] = {
+    stress_ret_0, stress_ret_1, stress_ret_2, stress_ret_3, stress_ret_4, stress_ret_5, stress_ret_6, stress_ret_7,
+};
+
+static void stress_fail(struct stress_worker *w, int err)
+{
+    w->errors++;
+    w->last_err = err;
+}
+
+static void stress_churn(struct stress_worker *w)
+{
+    int k = w->id / 2;
+    void *func = (void *)stress_target;
+    // every other cycle also adds a return callback, so the callers keep crossing between transit kinds
+    hook_err_t err = hook_wrap_priority(func, 1, stress_befores[k], stress_afters[k], w, k % 3 - 1);
+    if (err) {
+        stress_fail(w, err);
+        return;
+    }
+    if (w->ops & 1) {
+        err = hook_wrap_ret(func, 1, stress_rets[k], w);
+        if (err) stress_fail(w, err);
+        hook_unwrap(func, stress_befores[k], stress_afters[k]);
+        if (!err) hook_unwrap_ret(func, stress_rets[k]);
+    } else {
+        hook_unwrap(func, stress_befores[k], stress_afters[k]);
+    }
+}
+
+static void stress_call(struct stress_worker *w)
+{
+    int (*volatile call)(int) = stress_target;
+    int x = (int)(STRESS_MARK | (w->ops & 0xfffff));
+    int ret = call(x);
+    if (ret != x * 2 + 1) stress_fail(w, ret);
+}
+
+// stays in the loop until kthread_stop, which waits for the thread to be out of module text
+static int stress_worker_fn(void *data)
+{
+    struct stress_worker *w = (struct stress_worker *)data;
+    while (!kthread_should_stop()) {
+        if (w->id & 1) {
+            stress_call(w);
+        } else {
+            stress_churn(w);
+        }
+        w->ops++;
+    }
+    return 0;
+}
+
+static long hook_stress_control0(const char *args, char *__user out_msg, int outlen)
+{
+    unsigned long long ms = 500;
+    unsigned long long num = 4;
+    if (kpbench_parse_args(args, &ms, &num) || !ms || num < 2 || num > STRESS_WORKERS_MAX) return -EINVAL;
+    if (stress_running) return -EBUSY;
+    stress_running = 1;
+
+    unsigned int cpus = *nr_cpu_ids ?: 1;
+    cb_hits = 0;
+    cb_errors = 0;
+    cb_bad = 0;
+    memset(workers, 0, sizeof(workers));
+
+    int started = 0;
+    for (int i = 0; i < num; i++) {
+        struct stress_worker *w = &workers[i];
+        w->id = i;
+        w->task = kpbench_thread(stress_worker_fn, w, i % cpus, "kp_hook_stress/%d", i);
+        if (!w->task) break;
+        started++;
+    }
+    for (int i = 0; i < started; i++) {
+        wake_up_process(workers[i].task);
+    }
+    if (started == num) msleep(ms);
+    for (int i = 0; i < started; i++) {
+        kthread_stop(workers[i].task);
+    }
+
+    // every churner removed what it added, what they retired goes now
+    hook_err_t drain = hook_drain();
+
+    uint64_t cycles = 0, calls = 0, errors = 0;
+    int last_err = 0;
+    for (int i = 0; i < started; i++) {
+        struct stress_worker *w = &workers[i];
+        if (w->id & 1) {
+            calls += w->ops;
+        } else {
+            cycles += w->ops;
+        }
+        errors += w->errors;
+        if (w->errors) last_err = w->last_err;
+    }
+    stress_running = 0;
+    if (started != num) return -ENOMEM;
+
+    char msg[192];
+    snprintf(msg, sizeof(msg),
+             "workers: %llu, cpus: %u, ms: %llu, cycles: %llu, calls: %llu, callbacks: %llu, errors: %llu, "
+             "last: %d, callback errors: %llu, bad: %llx, drain: %d\n",
+             num, cpus, ms, cycles, calls, cb_hits, errors, last_err, cb_errors, cb_bad, drain);
+    kpbench_report(msg, out_msg, outlen);
+    return errors || cb_errors || drain ? -EFAULT : 0;
+}
+
+KPM_INIT(kpbench_init);
+KPM_CTL0(hook_stress_control0);
+KPM_EXIT(kpbench_exit);
@@ -0,0 +1,176 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2024 bmax121. All Rights Reserved.
+ */
+
+#include <compiler.h>
+#include <kpmodule.h>
+#include <hook.h>
+
+#define KPBENCH_NAME "icache-bench"
+#include <kpbench.h>
+
+KPM_NAME("kpm-icache-bench");
+KPM_VERSION("1.0.0");
+KPM_LICENSE("GPL v2");
+KPM_AUTHOR("bmax121");
+KPM_DESCRIPTION("KernelPatch Module I-cache maintenance cost of hook/unhook");
+
+/*
+ * control0 args: "[duration_ms] [cpu]", default "200 1".
+ * A worker bound to cpu keeps running a cache-line spread workload. A driver bound to the next cpu measures
+ * its throughput first idle and then while hooking and unhooking bench_target in a loop, and reports the drop.
+ */
+
+#define WORK_FN_NUM 128
+
+// one function per cache line, so every line the worker touches can be evicted by I-cache maintenance
+#define WORK_FN(n)                                                  \
+    static int __noinline __aligned(64) work_##n(int x)             \
+    {                                                               \
+        return (x ^ n) * 3 + (x >> 1);                              \
+    }
+#define WORK_FN8(n) WORK_FN(n##0) WORK_FN(n##1) WORK_FN(n##2) WORK_FN(n##3) \
+    WORK_FN(n##4) WORK_FN(n##5) WORK_FN(n##6) WORK_FN(n##7)
+
+WORK_FN8(1)
+WORK_FN8(2)
+WORK_FN8(3)
+WORK_FN8(4)
+WORK_FN8(5)
+WORK_FN8(6)
+WORK_FN8(7)
+WORK_FN8(10)
+WORK_FN8(11)
+WORK_FN8(12)
+WORK_FN8(13)
+WORK_FN8(14)
+WORK_FN8(15)
+WORK_FN8(16)
+WORK_FN8(17)
+WORK_FN8(20)
+
+#define WORK_REF8(n) work_##n##0, work_##n##1, work_##n##2, work_##n##3, \
+    work_##n##4, work_##n##5, work_##n##6, work_##n##7
+
+static int (*const volatile work_fns[WORK_FN_NUM])(int) = {
+    WORK_REF8(1),  WORK_REF8(2),  WORK_REF8(3),  WORK_REF8(4),  WORK_REF8(5),  WORK_REF8(6),
+    WORK_REF8(7),  WORK_REF8(10), WORK_REF8(11), WORK_REF8(12), WORK_REF8(13), WORK_REF8(14),
+    WORK_REF8(15), WORK_REF8(16), WORK_REF8(17), WORK_REF8(20),
+};
+
+static volatile uint64_t worker_iters = 0;
+static volatile int worker_sink = 0;
+static int bench_running = 0;
+
+struct bench_result
+{
+    uint64_t ticks;
+    uint64_t base;
+    uint64_t churn;
+    uint64_t cycles;
+    int err;
+    volatile int done;
+};
+
+// stays in the loop until kthread_stop, which waits for the thread to be out of module text
+static int bench_worker(void *data)
+{
+    int x = 1;
+    while (!kthread_should_stop()) {
+        for (int i = 0; i < WORK_FN_NUM; i++) {
+            x = work_fns[i](x);
+        }
+        worker_iters++;
+    }
+    worker_sink = x;
+    return 0;
+}
+
+int __noinline bench_target(int a)
+{
+    return a + 1;
+}
+
+static void before_bench_target(hook_fargs1_t *args, void *udata)
+{
+}
+
+// a failed hook_wrap1 ends the phase early, its count is then not comparable and err is set
+static uint64_t bench_phase(uint64_t ticks, int churn, uint64_t *cycles, int *err)
+{
+    uint64_t start = read_cntvct();
+    uint64_t iters = worker_iters;
+    uint64_t n = 0;
+    while (read_cntvct() - start < ticks) {
+        if (!churn) continue;
+        hook_err_t rc = hook_wrap1((void *)bench_target, before_bench_target, 0, 0);
+        if (rc) {
+            *err = rc;
+            break;
+        }
+        hook_unwrap((void *)bench_target, before_bench_target, 0);
+        n++;
+    }
+    if (cycles) *cycles = n;
+    return worker_iters - iters;
+}
+
+// runs on another cpu than the worker, then waits for kthread_stop like the worker
+static int bench_driver(void *data)
+{
+    struct bench_result *r = (struct bench_result *)data;
+    bench_phase(r->ticks / 4, 0, 0, &r->err); // warm up
+    r->base = bench_phase(r->ticks, 0, 0, &r->err);
+    r->churn = bench_phase(r->ticks, 1, &r->cycles, &r->err);
+    r->done = 1;
+    while (!kthread_should_stop()) {
+        msleep(1);
+    }
+    return 0;
+}
+
+static long icache_bench_control0(const char *args, char *__user out_msg, int outlen)
+{
+    unsigned long long ms = 200;
+    unsigned long long cpu = 1;
+    if (kpbench_parse_args(args, &ms, &cpu) || !ms) return -EINVAL;
+    // the driver takes the next cpu, the caller may be anywhere
+    unsigned int cpus = *nr_cpu_ids;
+    if (cpus < 2 || cpu >= cpus) return -EINVAL;
+    if (bench_running) return -EBUSY;
+    bench_running = 1;
+
+    struct bench_result r = { 0 };
+    r.ticks = read_cntfrq() * ms / 1000;
+    worker_iters = 0;
+    struct task_struct *worker = kpbench_thread(bench_worker, 0, cpu, "kp_icache_bench", 0);
+    struct task_struct *driver = kpbench_thread(bench_driver, &r, (cpu + 1) % cpus, "kp_icache_drive", 0);
+    if (worker) wake_up_process(worker);
+    if (driver) wake_up_process(driver);
+    while (driver && !r.done) {
+        msleep(10);
+    }
+    if (driver) kthread_stop(driver);
+    if (worker) kthread_stop(worker);
+    bench_running = 0;
+    if (!worker || !driver) return -ENOMEM;
+
+    // a churn phase cut short by a failed hook is not compared with the full base phase
+    char msg[128];
+    uint64_t drop = r.base && r.churn < r.base ? (r.base - r.churn) * 1000 / r.base : 0;
+    if (r.err) {
+        snprintf(msg, sizeof(msg), "cpu: %llu, ms: %llu, hook_wrap1 failed: %d after %llu cycles\n", cpu, ms, r.err,
+                 r.cycles);
+    } else {
+        snprintf(msg, sizeof(msg),
+                 "cpu: %llu, ms: %llu, base: %llu, churn: %llu, drop: %llu.%llu%%, hook cycles: %llu\n", cpu, ms,
+                 r.base, r.churn, drop / 10, drop % 10, r.cycles);
+    }
+    kpbench_report(msg, out_msg, outlen);
+    return r.err ? -EFAULT : 0;
+}
+
+KPM_INIT(kpbench_init);
+KPM_CTL0(icache_bench_control0);
+KPM_EXIT(kpbench_exit);
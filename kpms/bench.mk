@@ -0,0 +1,32 @@
+# Shared by the bench KPMs, set BENCH to the name of the source and of the kpm before including it.
+
+ifndef TARGET_COMPILE
+    $(error TARGET_COMPILE not set)
+endif
+
+ifndef KP_DIR
+    KP_DIR = ../..
+endif
+
+
+CC = $(TARGET_COMPILE)gcc
+LD = $(TARGET_COMPILE)ld
+
+INCLUDE_DIRS := . include patch/include linux/include linux/arch/arm64/include linux/tools/arch/arm64/include
+
+INCLUDE_FLAGS := $(foreach dir,$(INCLUDE_DIRS),-I$(KP_DIR)/kernel/$(dir)) -I$(KP_DIR)/kpms/include
+
+objs := $(BENCH).o
+
+all: $(BENCH).kpm
+
+$(BENCH).kpm: ${objs}
+	${CC} -r -o $@ $^
+
+%.o: %.c
+	${CC} $(CFLAGS) $(INCLUDE_FLAGS) -c -O2 -o $@ $<
+
+.PHONY: clean
+clean:
+	rm -rf *.kpm
+	find . -name "*.o" | xargs rm -f
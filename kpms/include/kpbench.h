@@ -0,0 +1,120 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2024 bmax121. All Rights Reserved.
+ */
+
+#ifndef _KPM_KPBENCH_H_
+#define _KPM_KPBENCH_H_
+
+#include <log.h>
+#include <compiler.h>
+#include <kputils.h>
+#include <linux/printk.h>
+#include <linux/string.h>
+#include <linux/kernel.h>
+#include <uapi/asm-generic/errno.h>
+
+/*
+ * What the bench KPMs share: timer reads, control0 argument parsing, the kthread symbols their workers run on,
+ * and init, report and exit logging. Define KPBENCH_NAME, the name logged with every line, before including it.
+ */
+
+#ifndef KPBENCH_NAME
+#error "KPBENCH_NAME not defined"
+#endif
+
+struct task_struct;
+
+static struct task_struct *(*kthread_create_on_node)(int (*threadfn)(void *data), void *data, int node,
+                                                      const char namefmt[], ...) = 0;
+static void (*kthread_bind)(struct task_struct *k, unsigned int cpu) = 0;
+static int (*wake_up_process)(struct task_struct *p) = 0;
+static int (*kthread_should_stop)(void) = 0;
+static int (*kthread_stop)(struct task_struct *k) = 0;
+static void (*msleep)(unsigned int msecs) = 0;
+static unsigned int *nr_cpu_ids = 0;
+
+static inline uint64_t read_cntvct()
+{
+    uint64_t val;
+    asm volatile("isb; mrs %0, cntvct_el0" : "=r"(val) : : "memory");
+    return val;
+}
+
+static inline uint64_t read_cntfrq()
+{
+    uint64_t val;
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(val));
+    return val;
+}
+
+static inline uint64_t ticks_to_ns(uint64_t ticks, uint64_t count)
+{
+    if (!count) return 0;
+    return ticks * 1000000000ull / read_cntfrq() / count;
+}
+
+// space separated decimals into vals in order, those not given keep their defaults
+static inline long kpbench_parse(const char *args, unsigned long long *vals[], int num)
+{
+    char buf[48] = { 0 };
+    if (!args) return 0;
+    strncpy(buf, args, sizeof(buf) - 1);
+    char *pos = buf;
+    for (int i = 0; i < num && pos; i++) {
+        char *next = strchr(pos, ' ');
+        if (next) *next++ = '\0';
+        if (pos[0] && kstrtoull(pos, 10, vals[i])) return -EINVAL;
+        pos = next;
+    }
+    return 0;
+}
+
+#define kpbench_parse_args(args, ...)                                   \
+    kpbench_parse(args, (unsigned long long *[]){ __VA_ARGS__ },        \
+                  sizeof((unsigned long long *[]){ __VA_ARGS__ }) / sizeof(unsigned long long *))
+
+static inline long kpbench_init(const char *args, const char *event, void *__user reserved)
+{
+    kthread_create_on_node = (typeof(kthread_create_on_node))kallsyms_lookup_name("kthread_create_on_node");
+    kthread_bind = (typeof(kthread_bind))kallsyms_lookup_name("kthread_bind");
+    wake_up_process = (typeof(wake_up_process))kallsyms_lookup_name("wake_up_process");
+    kthread_should_stop = (typeof(kthread_should_stop))kallsyms_lookup_name("kthread_should_stop");
+    kthread_stop = (typeof(kthread_stop))kallsyms_lookup_name("kthread_stop");
+    msleep = (typeof(msleep))kallsyms_lookup_name("msleep");
+    nr_cpu_ids = (typeof(nr_cpu_ids))kallsyms_lookup_name("nr_cpu_ids");
+    pr_info("kpm %s init, kthread_create_on_node: %llx, kthread_stop: %llx, msleep: %llx, nr_cpu_ids: %llx\n",
+            KPBENCH_NAME, kthread_create_on_node, kthread_stop, msleep, nr_cpu_ids);
+    if (!kthread_create_on_node || !kthread_bind || !wake_up_process || !kthread_should_stop || !kthread_stop ||
+        !msleep || !nr_cpu_ids)
+        return -ENOENT;
+    return 0;
+}
+
+// a kthread bound to cpu and not woken yet, 0 if it could not be created, namefmt may take id
+static inline struct task_struct *kpbench_thread(int (*fn)(void *data), void *data, unsigned int cpu,
+                                                 const char *namefmt, int id)
+{
+    struct task_struct *task = kthread_create_on_node(fn, data, -1, namefmt, id);
+    if (!task || (unsigned long)task >= (unsigned long)-4095) return 0;
+    kthread_bind(task, cpu);
+    return task;
+}
+
+// logs msg and copies it out to the caller of control0
+static inline void kpbench_report(const char *msg, char *__user out_msg, int outlen)
+{
+    pr_info("kpm %s %s", KPBENCH_NAME, msg);
+    if (out_msg && outlen > 0) {
+        int len = strlen(msg) + 1;
+        compat_copy_to_user(out_msg, msg, len < outlen ? len : outlen);
+    }
+}
+
+static inline long kpbench_exit(void *__user reserved)
+{
+    pr_info("kpm %s exit\n", KPBENCH_NAME);
+    return 0;
+}
+
+#endif
@@ -52,6 +52,7 @@ void print_usage(char **argv)
         "  -k, --kpimg PATH                 KPatch-Next image path.\n"
         "  -o, --out PATH                   Patched image path.\n"
         "  -a  --addition KEY=VALUE         Add additional information.\n"
+        "  -H, --hook-alloc-size SIZE       Size of the initial hook memory region, aligned to 64K.\n"
 
         "  -K, --kpatch PATH                Embed kpatch executable binary into patches.\n"
 
@@ -85,6 +86,7 @@ int main(int argc, char *argv[])
                                  { "kpimg", required_argument, NULL, 'k' },
                                  { "out", required_argument, NULL, 'o' },
                                  { "addition", required_argument, NULL, 'a' },
+                                 { "hook-alloc-size", required_argument, NULL, 'H' },
 
                                  { "embed-extra-path", required_argument, NULL, 'M' },
                                  { "embeded-extra-name", required_argument, NULL, 'E' },
@@ -93,12 +95,14 @@ int main(int argc, char *argv[])
                                  { "extra-event", required_argument, NULL, 'V' },
                                  { "extra-args", required_argument, NULL, 'A' },
                                  { 0, 0, 0, 0 } };
-    char *optstr = "hvpurdfli:k:o:a:M:E:T:N:V:A:";
+    char *optstr = "hvpurdfli:k:o:a:H:M:E:T:N:V:A:";
 
     char *kimg_path = NULL;
     char *kpimg_path = NULL;
     char *out_path = NULL;
 
+    int64_t hook_alloc_size = 0;
+
     int additional_num = 0;
     const char *additional[16] = { 0 };
 
@@ -135,6 +139,9 @@ int main(int argc, char *argv[])
         case 'a':
             additional[additional_num++] = optarg;
             break;
+        case 'H':
+            hook_alloc_size = strtoll(optarg, NULL, 0);
+            break;
         case 'M':
             config = &extra_configs[extra_config_num++];
             config->is_path = true;
@@ -175,7 +182,7 @@ int main(int argc, char *argv[])
             fprintf(stdout, "%x\n", version);
     } else if (cmd == 'p') {
         ret = patch_update_img(kimg_path, kpimg_path, out_path, additional, extra_configs,
-                               extra_config_num);
+                               extra_config_num, hook_alloc_size);
     } else if (cmd == 'd') {
         ret = dump_kallsym(kimg_path);
     } else if (cmd == 'f') {
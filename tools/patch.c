@@ -364,12 +364,15 @@ static void disable_pi_map(char *img, int32_t imglen)
 
 }
 
-int patch_update_img(const char *kimg_path, const char *kpimg_path, const char *out_path, const char **additional, extra_config_t *extra_configs, int extra_config_num)
+int patch_update_img(const char *kimg_path, const char *kpimg_path, const char *out_path, const char **additional, extra_config_t *extra_configs, int extra_config_num, int64_t hook_alloc_size)
 {
     set_log_enable(true);
 
     if (!kpimg_path) tools_loge_exit("empty kpimg\n");
     if (!out_path) tools_loge_exit("empty out image path\n");
+    if (hook_alloc_size < 0 || hook_alloc_size % HOOK_ALLOC_ALIGN) {
+        tools_loge_exit("hook alloc size must be aligned to 0x%x\n", HOOK_ALLOC_ALIGN);
+    }
 
     patched_kimg_t pimg = { 0 };
     kernel_file_t kernel_file;
@@ -525,6 +528,8 @@ int patch_update_img(const char *kimg_path, const char *kpimg_path, const char *
     setup->setup_offset = align_kimg_len;
     setup->start_offset = start_offset;
     setup->extra_size = extra_size;
+    setup->hook_alloc_size = hook_alloc_size;
+    if (hook_alloc_size) tools_logi("hook alloc size: 0x%llx\n", (long long)hook_alloc_size);
 
     int map_start, map_max_size;
     select_map_area(&kallsym, kallsym_kimg, &map_start, &map_max_size);
@@ -557,6 +562,7 @@ int patch_update_img(const char *kimg_path, const char *kpimg_path, const char *
         setup->setup_offset = i64swp(setup->setup_offset);
         setup->start_offset = i64swp(setup->start_offset);
         setup->extra_size = i64swp(setup->extra_size);
+        setup->hook_alloc_size = i64swp(setup->hook_alloc_size);
         setup->map_offset = i64swp(setup->map_offset);
         setup->map_max_size = i64swp(setup->map_max_size);
         setup->kallsyms_lookup_name_offset = i64swp(setup->kallsyms_lookup_name_offset);
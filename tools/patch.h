@@ -68,7 +68,7 @@ preset_t *get_preset(const char *kimg, int kimg_len);
 uint32_t get_kpimg_version(const char *kpimg_path);
 int extra_str_type(const char *extra_str);
 const char *extra_type_str(extra_item_type extra_type);
-int patch_update_img(const char *kimg_path, const char *kpimg_path, const char *out_path, const char **additional, extra_config_t *extra_configs, int extra_config_num);
+int patch_update_img(const char *kimg_path, const char *kpimg_path, const char *out_path, const char **additional, extra_config_t *extra_configs, int extra_config_num, int64_t hook_alloc_size);
 int unpatch_img(const char *kimg_path, const char *out_path);
 int dump_kallsym(const char *kimg_path);
 int dump_ikconfig(const char *kimg_path);
@@ -0,0 +1,110 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2024 bmax121. All Rights Reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "supercall.h"
+
+extern const char program_name[];
+
+static void hooks_usage(int status)
+{
+    if (status != EXIT_SUCCESS)
+        fprintf(stderr, "Try `%s help' for more information.\n", program_name);
+    else {
+        printf("Usage: %s <stats|enable|disable|reset>\n\n", program_name);
+        printf("Hook statistics.\n\n"
+               "help                 Print this help message.\n"
+               "stats                Print calls, skips, average cost and latency histogram of each hook.\n"
+               "enable               Start collecting statistics.\n"
+               "disable              Stop collecting statistics, collected data is kept.\n"
+               "reset                Clear collected statistics.\n");
+    }
+    exit(status);
+}
+
+static unsigned long long ticks_to_ns(unsigned long long ticks, unsigned long long calls, unsigned long long freq)
+{
+    if (!calls || !freq) return 0;
+    return (unsigned long long)((double)ticks * 1000000000.0 / freq / calls);
+}
+
+static int hooks_stats()
+{
+    long enabled = sc_hook_stats_ctl(HOOK_STATS_STATUS);
+    if (enabled < 0) {
+        fprintf(stderr, "Error getting hook stats status: %ld\n", enabled);
+        return 1;
+    }
+
+    long num = sc_hook_stats(NULL, 0);
+    if (num < 0) {
+        fprintf(stderr, "Error getting hook stats: %ld\n", num);
+        return 1;
+    }
+    printf("Hook stats: %s, hooks: %ld\n", enabled ? "enabled" : "disabled", num);
+    if (!num) return 0;
+
+    // leave room for hooks installed between the two calls
+    int cap = num + 8;
+    struct hook_stat *stats = (struct hook_stat *)calloc(cap, sizeof(struct hook_stat));
+    if (!stats) return 1;
+    num = sc_hook_stats(stats, cap);
+    if (num < 0) {
+        fprintf(stderr, "Error getting hook stats: %ld\n", num);
+        free(stats);
+        return 1;
+    }
+    if (num > cap) num = cap;
+
+    printf("%-40s %4s %4s %12s %12s %10s %10s %10s\n", "symbol", "type", "cbs", "calls", "skips", "before_ns",
+           "origin_ns", "after_ns");
+    for (int i = 0; i < num; i++) {
+        struct hook_stat *s = &stats[i];
+        printf("%-40s %4d %4d %12llu %12llu %10llu %10llu %10llu\n", s->name, s->type, s->callbacks, s->calls, s->skips,
+               ticks_to_ns(s->before_ticks, s->calls, s->freq),
+               ticks_to_ns(s->origin_ticks, s->calls - s->skips, s->freq),
+               ticks_to_ns(s->after_ticks, s->calls, s->freq));
+        if (!s->calls) continue;
+        // bucket i counts calls that took [2^(i-1), 2^i) ticks
+        printf("  hist(ticks):");
+        for (int j = 0; j < HOOK_STAT_HIST_NUM; j++) {
+            if (!s->hist[j]) continue;
+            printf(" <%llu:%llu", 1ULL << j, s->hist[j]);
+        }
+        printf("\n");
+    }
+    free(stats);
+    return 0;
+}
+
+static int hooks_ctl(int op, const char *what)
+{
+    long rc = sc_hook_stats_ctl(op);
+    if (rc < 0) {
+        fprintf(stderr, "Error %s hook stats: %ld\n", what, rc);
+        return 1;
+    }
+    printf("Hook stats: %s\n", what);
+    return 0;
+}
+
+int kphooks_main(int argc, char **argv)
+{
+    if (argc < 1) hooks_usage(EXIT_FAILURE);
+
+    const char *scmd = argv[0];
+    if (!strcmp(scmd, "help")) hooks_usage(EXIT_SUCCESS);
+    if (!strcmp(scmd, "stats")) return hooks_stats();
+    if (!strcmp(scmd, "enable")) return hooks_ctl(HOOK_STATS_ENABLE, "enabled");
+    if (!strcmp(scmd, "disable")) return hooks_ctl(HOOK_STATS_DISABLE, "disabled");
+    if (!strcmp(scmd, "reset")) return hooks_ctl(HOOK_STATS_RESET, "reset");
+
+    fprintf(stderr, "Invalid argument: %s\n", scmd);
+    hooks_usage(EXIT_FAILURE);
+    return 1;
+}
@@ -0,0 +1,19 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2024 bmax121. All Rights Reserved.
+ */
+
+#ifndef _KPU_HOOKS_H
+#define _KPU_HOOKS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int kphooks_main(int argc, char **argv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
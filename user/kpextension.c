@@ -1,13 +1,30 @@
 #include "kpextension.h"
 
 #include <stdio.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <error.h>
 #include <string.h>
+#include <errno.h>
 #include "supercall.h"
 
 extern const char program_name[];
 
+static void import_usage(int status)
+{
+    if (status != EXIT_SUCCESS)
+        fprintf(stderr, "Try `%s exclude_import help' for more information.\n", program_name);
+    else {
+        printf("Usage: %s exclude_import <FILE|->\n\n", program_name);
+        printf(
+            "Import exclude list command.\n\n"
+            "help                 Print this help message.\n"
+            "<FILE|->             Read lines of '<UID> [0|1]' from FILE or stdin, 1 if omitted.\n"
+        );
+    }
+    exit(status);
+}
+
 static void set_usage(int status)
 {
     if (status != EXIT_SUCCESS)
@@ -108,3 +125,84 @@ int kpexclude_get_main(int argc, char **argv)
 
     return get_uid_exclude(uid);
 }
+
+static int exclude_value = 1;
+
+// pushes the items in one supercall, reports the failed ones
+static long import_flush(struct kstorage_batch_item *items, int num)
+{
+    if (!num) return 0;
+    long rc = sc_kstorage_batch(items, num);
+    if (rc < 0) return rc;
+    for (int i = 0; i < num; i++) {
+        if (items[i].status < 0)
+            fprintf(stderr, "UID %" PRId64 ": %" PRId64 "\n", items[i].did, items[i].status);
+    }
+    return rc;
+}
+
+long import_uid_exclude(FILE *fp)
+{
+    struct kstorage_batch_item *items = calloc(KSTORAGE_BATCH_MAX, sizeof(*items));
+    if (!items) return -ENOMEM;
+
+    char line[64];
+    int num = 0;
+    long total = 0, failed = 0, rc = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        long uid;
+        int exclude = 1;
+        int n = sscanf(line, "%ld %d", &uid, &exclude);
+        if (n < 1) continue;
+        if (exclude != 0 && exclude != 1) {
+            fprintf(stderr, "Invalid line: %s", line);
+            continue;
+        }
+
+        struct kstorage_batch_item *item = &items[num++];
+        memset(item, 0, sizeof(*item));
+        item->gid = KSTORAGE_EXCLUDE_LIST_GROUP;
+        item->did = uid;
+        if (exclude) {
+            item->op = KSTORAGE_BATCH_WRITE;
+            item->ptr = (uint64_t)(uintptr_t)&exclude_value;
+            item->len = sizeof(exclude_value);
+        } else {
+            item->op = KSTORAGE_BATCH_REMOVE;
+        }
+        total++;
+
+        if (num < KSTORAGE_BATCH_MAX) continue;
+        rc = import_flush(items, num);
+        num = 0;
+        if (rc < 0) break;
+        failed += rc;
+    }
+    if (rc >= 0) {
+        rc = import_flush(items, num);
+        if (rc >= 0) failed += rc;
+    }
+    free(items);
+    if (rc < 0) return rc;
+
+    printf("%ld UIDs imported, %ld failed\n", total - failed, failed);
+    return failed ? -EINVAL : 0;
+}
+
+int kpexclude_import_main(int argc, char **argv)
+{
+    if (argc != 1)
+        import_usage(EXIT_FAILURE);
+
+    if (!strcmp(argv[0], "help"))
+        import_usage(EXIT_SUCCESS);
+
+    FILE *fp = strcmp(argv[0], "-") ? fopen(argv[0], "r") : stdin;
+    if (!fp)
+        error(-errno, errno, "open %s", argv[0]);
+
+    long rc = import_uid_exclude(fp);
+    if (fp != stdin)
+        fclose(fp);
+    return rc;
+}
@@ -2,6 +2,7 @@
 #define _KPU_KPEXTENSION_H
 
 
+#include <stdio.h>
 #include <unistd.h>
 
 #ifdef __cplusplus
@@ -10,9 +11,11 @@ extern "C" {
 
 long set_uid_exclude(uid_t uid, int exclude);
 long get_uid_exclude(uid_t uid);
+long import_uid_exclude(FILE *fp);
 
 int kpexclude_set_main(int argc, char **argv);
 int kpexclude_get_main(int argc, char **argv);
+int kpexclude_import_main(int argc, char **argv);
 
 #ifdef __cplusplus
 }
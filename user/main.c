@@ -6,6 +6,7 @@
 #include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -18,6 +19,8 @@
 #include "kpm.h"
 #include "kpextension.h"
 #include "rehook.h"
+#include "hooks.h"
+#include "mem.h"
 
 char program_name[128] = { '\0' };
 
@@ -45,8 +48,11 @@ static void usage(int status)
                 "kpm                KPatch-Next Module manager.\n"
                 "exclude_set        Manage the exclude list.\n"
                 "exclude_get        Get exclude list status.\n"
+                "exclude_import     Import exclude list entries from a file.\n"
                 "rehook             Set rehook mode (0=off, 1=target, 2=minimal).\n"
                 "rehook_status      Check current rehook mode.\n"
+                "hooks              Hook statistics (stats, enable, disable, reset).\n"
+                "mem                Memory usage of KPatch-Next pools and hook memory (stats, reset).\n"
                 "\n",
                 SUPERCALL_HELLO_ECHO);
     }
@@ -75,8 +81,11 @@ int main(int argc, char **argv)
         { "kpm", 'k' },
         { "exclude_set", 'e' },
         { "exclude_get", 'g' },
+        { "exclude_import", 'i' },
         { "rehook", 'r' },
         { "rehook_status", 'q' },
+        { "hooks", 'H' },
+        { "mem", 'm' },
 
         { "bootlog", 'l' },
         { "panic", '.' },
@@ -114,12 +123,21 @@ int main(int argc, char **argv)
     case 'g':
         strcat(program_name, " exclude_get");
         return kpexclude_get_main(argc - 2, argv + 2);
+    case 'i':
+        strcat(program_name, " exclude_import");
+        return kpexclude_import_main(argc - 2, argv + 2);
     case 'r':
         strcat(program_name, " rehook");
         return kprehook_main(argc - 2, argv + 2);
     case 'q':
         strcat(program_name, " rehook_status");
         return kprehook_status_main(argc - 2, argv + 2);
+    case 'H':
+        strcat(program_name, " hooks");
+        return kphooks_main(argc - 2, argv + 2);
+    case 'm':
+        strcat(program_name, " mem");
+        return kpmem_main(argc - 2, argv + 2);
     case 'l':
         bootlog();
         break;
@@ -0,0 +1,85 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2024 bmax121. All Rights Reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "supercall.h"
+
+extern const char program_name[];
+
+static void mem_usage(int status)
+{
+    if (status != EXIT_SUCCESS)
+        fprintf(stderr, "Try `%s help' for more information.\n", program_name);
+    else {
+        printf("Usage: %s [stats|reset]\n\n", program_name);
+        printf("Memory usage of KPatch-Next pools and hook memory.\n\n"
+               "help                 Print this help message.\n"
+               "stats                Print usage, peak and free block distribution, the default.\n"
+               "reset                Restart peak usage of the rw and rox pools from their current usage.\n");
+    }
+    exit(status);
+}
+
+static void mem_pool_print(const char *name, struct mem_pool_stat *s)
+{
+    unsigned long long pct = s->total ? s->used * 100 / s->total : 0;
+    printf("%-4s total: %llu, used: %llu (%llu%%), peak: %llu, cached: %llu, grown: %llu\n", name, s->total, s->used,
+           pct, s->peak, s->cached, s->grown);
+    printf("     free blocks: %llu, largest free: %llu\n", s->free_blocks, s->largest_free);
+    if (!s->free_blocks) return;
+    // class 0 holds blocks below 256 bytes, class i those below 256 << i
+    printf("     free by size:");
+    for (int i = 0; i < MEM_STAT_FL_NUM; i++) {
+        if (!s->fl_free[i]) continue;
+        printf(" <%llu:%llu", 256ULL << i, s->fl_free[i]);
+    }
+    printf("\n");
+}
+
+static int mem_stats()
+{
+    struct mem_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    long rc = sc_mem_stats(MEM_STATS_READ, &stats, sizeof(stats));
+    if (rc < 0) {
+        fprintf(stderr, "Error getting memory stats: %ld\n", rc);
+        return 1;
+    }
+    mem_pool_print("rw", &stats.rw);
+    mem_pool_print("rox", &stats.rox);
+
+    struct hook_mem_stats *h = &stats.hook;
+    printf("hook regions: %d, slots: %d of %d bytes, used: %d, retired: %d, peak: %d\n", h->regions, h->slots,
+           h->slot_size, h->used, h->retired, h->peak);
+    return 0;
+}
+
+static int mem_reset()
+{
+    long rc = sc_mem_stats(MEM_STATS_RESET_PEAK, NULL, 0);
+    if (rc < 0) {
+        fprintf(stderr, "Error resetting memory stats: %ld\n", rc);
+        return 1;
+    }
+    printf("Memory stats: peak reset\n");
+    return 0;
+}
+
+int kpmem_main(int argc, char **argv)
+{
+    if (argc < 1) return mem_stats();
+
+    const char *scmd = argv[0];
+    if (!strcmp(scmd, "help")) mem_usage(EXIT_SUCCESS);
+    if (!strcmp(scmd, "stats")) return mem_stats();
+    if (!strcmp(scmd, "reset")) return mem_reset();
+
+    fprintf(stderr, "Invalid argument: %s\n", scmd);
+    mem_usage(EXIT_FAILURE);
+    return 1;
+}
@@ -10,6 +10,7 @@
 #include <sys/syscall.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <errno.h>
 
@@ -118,6 +119,22 @@ static inline long sc_kstorage_remove(int gid, long did)
     return syscall(__NR_supercall, NULL, ver_and_cmd(SUPERCALL_KSTORAGE_REMOVE), gid, did);
 }
 
+static inline long sc_kstorage_alloc_group(const char *name, const struct kstorage_group_conf *conf)
+{
+    return syscall(__NR_supercall, NULL, ver_and_cmd(SUPERCALL_KSTORAGE_ALLOC_GROUP), name, conf);
+}
+
+static inline long sc_kstorage_remove_group(int gid)
+{
+    return syscall(__NR_supercall, NULL, ver_and_cmd(SUPERCALL_KSTORAGE_REMOVE_GROUP), gid);
+}
+
+// returns the number of failed items, each item has its own status
+static inline long sc_kstorage_batch(struct kstorage_batch_item *items, int num)
+{
+    return syscall(__NR_supercall, NULL, ver_and_cmd(SUPERCALL_KSTORAGE_BATCH), items, num);
+}
+
 static inline long sc_set_ap_mod_exclude(uid_t uid, int exclude)
 {
     if(exclude) {
@@ -145,4 +162,19 @@ static inline int sc_rehook_status(void)
     return syscall(__NR_supercall, NULL, ver_and_cmd(SUPERCALL_REHOOK_STATUS));
 }
 
+static inline long sc_hook_stats_ctl(int op)
+{
+    return syscall(__NR_supercall, NULL, ver_and_cmd(SUPERCALL_HOOK_STATS_CTL), (long)op);
+}
+
+static inline long sc_hook_stats(struct hook_stat *out, int num)
+{
+    return syscall(__NR_supercall, NULL, ver_and_cmd(SUPERCALL_HOOK_STATS), out, (long)num);
+}
+
+static inline long sc_mem_stats(int op, struct mem_stats *out, int len)
+{
+    return syscall(__NR_supercall, NULL, ver_and_cmd(SUPERCALL_MEM_STATS), (long)op, out, (long)len);
+}
+
 #endif
\ No newline at end of file